@@ -0,0 +1,301 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Active localization
+ *
+ ** Description ***************************************************************
+ *
+ *  Rather than wander about and wait for the localizer to make up its mind,
+ *  pick moves that will help it to. Given the hypotheses we have, each of
+ *  a handful of moves (drive on, turn one way or the other, curve off) is
+ *  tried out from every hypothesis on the map: where would the robot end
+ *  up, and what would the laser see when it got there (raycast.h)? A move
+ *  after which the hypotheses would all expect to see much the same thing
+ *  is no use; one after which they would see very different things will
+ *  rule most of them out, whichever of them is right.
+ *
+ *  Formally, for each move we work out the expected entropy of the
+ *  hypothesis weights after it. Supposing hypothesis j is right, the scan
+ *  we'll see is the one predicted for j, and each hypothesis i is
+ *  reweighted by how well its own prediction matches that; the entropy of
+ *  the result, averaged over j by weight, is what we expect to be left
+ *  with. The move that takes away the most entropy per second is the one
+ *  we make. Moves that would put the robot into a wall on the likely
+ *  hypotheses are out.
+ *
+ *  The moves are scored in parallel on the work stealing pool in
+ *  workpool.h. A move is carried out blind, for its duration, unless
+ *  something gets in the way, and then the next one is chosen. With only
+ *  one hypothesis there is nothing to choose between, and the caller goes
+ *  back to wandering.
+ */
+
+#ifndef ACTIVELOC_H
+#define ACTIVELOC_H
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+#include "distmap.h"
+#include "hyptrack.h"
+#include "mcl.h"
+#include "planner.h"
+#include "raycast.h"
+#include "sensorframe.h"
+#include "workpool.h"
+
+/**
+ * A move: this speed and turn rate for this long.
+ *
+ **/
+
+struct ActiveMove
+{
+  double speed, turnrate;
+  double duration;              // Seconds
+  const char* name;
+};
+
+/**
+ * The moves, the map to try them out on, and the one we're making.
+ *
+ **/
+
+struct ActiveLocalizer
+{
+  const GridMap* map;
+  const DistMap* dist;          // For collisions
+  RayCaster    caster;
+  ScanGeometry beams;           // The laser, with fewer beams
+
+  std::vector<ActiveMove> moves;
+  int    max_hyps;              // Only the heaviest this many are used
+  double sigma;                 // Per beam noise when comparing scans
+  double clearance;             // Keep this far off walls, as well as radius
+  double overhead;              // Seconds added to each move's duration
+  double min_gain;              // Less than this isn't worth moving for
+  int    threads;
+
+  // What we're doing
+  int    current;               // Index into moves, or -1
+  double remaining;             // Seconds of it left
+  double last_stamp;
+  std::vector<double> gains;    // Of each move, last time we chose
+  int    decisions;
+};
+
+/**
+ * initActiveLocalizer()
+ *
+ **/
+
+inline void initActiveLocalizer(ActiveLocalizer& al, const GridMap& map,
+                                const DistMap& dist)
+{
+  static const ActiveMove moves[] = {
+    {  1.0,  0.0, 1.0, "forward 1m"   },
+    {  0.5,  0.0, 1.0, "forward 0.5m" },
+    {  0.0,  0.8, 1.0, "left 45"      },
+    {  0.0, -0.8, 1.0, "right 45"     },
+    {  0.0,  0.8, 2.0, "left 90"      },
+    {  0.0, -0.8, 2.0, "right 90"     },
+    {  0.5,  0.4, 2.0, "curve left"   },
+    {  0.5, -0.4, 2.0, "curve right"  },
+  };
+
+  al.map = &map;
+  al.dist = &dist;
+  initRayCaster(al.caster, map);
+  // Every tenth beam of the SICK is plenty to tell places apart
+  initScanGeometry(al.beams, 37, -M_PI / 2, M_PI / 36, 8.0);
+  al.moves.assign(moves, moves + sizeof(moves) / sizeof(moves[0]));
+  al.max_hyps = 8;
+  al.sigma = 0.3;
+  al.clearance = 0.1;
+  al.overhead = 0.5;
+  al.min_gain = 0.01;
+  al.threads = std::thread::hardware_concurrency();
+  if (al.threads < 1) al.threads = 1;
+  al.current = -1;
+  al.remaining = 0;
+  al.last_stamp = -1;
+  al.gains.assign(al.moves.size(), 0);
+  al.decisions = 0;
+} // End of initActiveLocalizer()
+
+/**
+ * predictMove()
+ *
+ * Where the robot would end up after the move from pose, following the arc
+ * in 50ms steps and stopping short of anything in the way, as Stage does.
+ * Sets blocked if it had to stop.
+ *
+ **/
+
+inline Pose2d predictMove(const ActiveLocalizer& al, Pose2d pose,
+                          const ActiveMove& move, bool* blocked)
+{
+  const double h = 0.05;
+  double radius = ROOMBA_RADIUS + al.clearance;
+
+  *blocked = false;
+  for (double t = 0; t < move.duration - 1e-9; t += h) {
+    Pose2d next = pose;
+    double a = pose.pa, w = move.turnrate, v = move.speed;
+    if (fabs(w) > 1e-9) {
+      next.px += v / w * (sin(a + w * h) - sin(a));
+      next.py -= v / w * (cos(a + w * h) - cos(a));
+    } else {
+      next.px += v * h * cos(a);
+      next.py += v * h * sin(a);
+    }
+    next.pa = normalizeAngle(a + w * h);
+    if (v != 0 && distAt(*al.dist, next.px, next.py) < radius) {
+      *blocked = true;
+      break;
+    }
+    pose = next;
+  }
+  return pose;
+} // End of predictMove()
+
+/**
+ * expectedGain()
+ *
+ * How much entropy the move is expected to take away from the n
+ * hypotheses, with weights p, in bits. Returns -1 if the move would run
+ * into something on most of them.
+ *
+ **/
+
+inline double expectedGain(const ActiveLocalizer& al, const MclHypoth* hyps,
+                           const double* p, int n, const ActiveMove& move)
+{
+  int beams = al.beams.count;
+  std::vector<float> scans(n * beams);
+  std::vector<char> blocked(n);
+  double blocked_weight = 0;
+
+  for (int i = 0; i < n; i++) {
+    bool b;
+    Pose2d end = predictMove(al, hyps[i].mean, move, &b);
+    blocked[i] = b;
+    if (b) blocked_weight += p[i];
+    castScan(al.caster, al.beams, end, &scans[i * beams]);
+  }
+  if (blocked_weight > 0.5) return -1;
+
+  double inv_2s2 = 1.0 / (2 * al.sigma * al.sigma);
+  std::vector<double> q(n);
+  double expected = 0;
+  for (int j = 0; j < n; j++) {
+    // Suppose j is right: reweight everything by how well it would have
+    // predicted what j predicts
+    const float* zj = &scans[j * beams];
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+      const float* zi = &scans[i * beams];
+      double d2 = 0;
+      for (int b = 0; b < beams; b++) d2 += (zi[b] - zj[b]) * (zi[b] - zj[b]);
+      double like = exp(-d2 * inv_2s2);
+      // The bumpers would tell us which of them hit something
+      if (blocked[i] != blocked[j]) like *= 0.01;
+      q[i] = p[i] * like;
+      sum += q[i];
+    }
+    // If every likelihood underflows, seeing it tells us nothing
+    if (sum <= 0) {
+      expected += p[j] * hypothesisEntropy(p, n);
+      continue;
+    }
+    for (int i = 0; i < n; i++) q[i] /= sum;
+    expected += p[j] * hypothesisEntropy(&q[0], n);
+  }
+  return hypothesisEntropy(p, n) - expected;
+} // End of expectedGain()
+
+/**
+ * chooseMove()
+ *
+ * Score every move against the hypotheses, in parallel, and return the
+ * best, or -1 if none of them is worth making.
+ *
+ **/
+
+inline int chooseMove(ActiveLocalizer& al, const std::vector<MclHypoth>& all)
+{
+  int n = all.size() < (size_t)al.max_hyps ? all.size() : al.max_hyps;
+  if (n < 2) return -1;
+
+  // The heaviest hypotheses. mcl.h sorts them already, but amcl gives
+  // them in no particular order.
+  std::vector<MclHypoth> hyps(all);
+  if (hyps.size() > (size_t)n)
+    std::partial_sort(hyps.begin(), hyps.begin() + n, hyps.end(),
+                      [](const MclHypoth& l, const MclHypoth& r) {
+                        return l.alpha > r.alpha;
+                      });
+  std::vector<double> p(n);
+  double total = 0;
+  for (int i = 0; i < n; i++) total += hyps[i].alpha;
+  if (total <= 0) return -1;
+  for (int i = 0; i < n; i++) p[i] = hyps[i].alpha / total;
+
+  runParallel(al.moves.size(), al.threads, [&](int m, int) {
+      al.gains[m] = expectedGain(al, &hyps[0], &p[0], n, al.moves[m]);
+    });
+
+  int best = -1;
+  double best_rate = 0;
+  for (size_t m = 0; m < al.moves.size(); m++) {
+    if (al.gains[m] < al.min_gain) continue;
+    double rate = al.gains[m] / (al.moves[m].duration + al.overhead);
+    if (rate > best_rate) {
+      best_rate = rate;
+      best = m;
+    }
+  }
+  al.decisions++;
+  return best;
+} // End of chooseMove()
+
+/**
+ * activeStep()
+ *
+ * One tick of active localization. Carries on with the move we're making,
+ * or chooses another, and sets speed and turnrate for it. Returns false,
+ * leaving them alone, if there's no move worth making or we had to give
+ * one up because something is in the way.
+ *
+ **/
+
+inline bool activeStep(ActiveLocalizer& al, const std::vector<MclHypoth>& hyps,
+                       const SensorFrame& frame, double* speed,
+                       double* turnrate)
+{
+  double dt = al.last_stamp < 0 ? 0 : frame.stamp - al.last_stamp;
+  al.last_stamp = frame.stamp;
+
+  if (al.current >= 0) {
+    al.remaining -= dt;
+    if (al.remaining <= 0) al.current = -1;
+  }
+  if (al.current < 0) {
+    al.current = chooseMove(al, hyps);
+    if (al.current < 0) return false;
+    al.remaining = al.moves[al.current].duration;
+  }
+
+  // We may not be where the best hypothesis thinks, so watch the laser too
+  const ActiveMove& move = al.moves[al.current];
+  if (move.speed > 0 && frame.ranges_count > 0
+      && (frame.min_left < 0.5 || frame.min_right < 0.5)) {
+    al.current = -1;
+    return false;
+  }
+  *speed = move.speed;
+  *turnrate = move.turnrate;
+  return true;
+} // End of activeStep()
+
+#endif
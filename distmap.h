@@ -0,0 +1,437 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Distance map cache
+ *
+ ** Description ***************************************************************
+ *
+ *  For every cell in a map, the distance in metres to the nearest obstacle.
+ *  With this the laser model only has to look up where each beam ends
+ *  rather than tracing the beam through the map (the "likelihood field"
+ *  model in amcl), and the planners get their obstacle clearance for free.
+ *
+ *  The distances are worked out with the exact Euclidean distance transform
+ *  of Felzenszwalb and Huttenlocher, which is linear in the number of cells,
+ *  and saved next to the bitmap (bitmaps/local.png gives bitmaps/local.dmap)
+ *  so later runs just map the file into memory. The file is:
+ *
+ *    DistMapHeader   (64 bytes, see below)
+ *    float[w * h]    distances, row major from the bottom of the map
+ *
+ *  A cache file is only used if its version matches DISTMAP_VERSION and it
+ *  was built from the same bitmap bytes stretched over the same size;
+ *  otherwise it is rebuilt.
+ */
+
+#ifndef DISTMAP_H
+#define DISTMAP_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include "gridmap.h"
+
+#define DISTMAP_VERSION 1
+
+/**
+ * What's at the front of a .dmap file.
+ *
+ **/
+
+struct DistMapHeader
+{
+  char     magic[4];          // "DMAP"
+  uint32_t version;
+  uint32_t width, height;     // Cells
+  double   scale;             // Metres per cell
+  double   origin_x, origin_y;
+  uint64_t source_hash;       // See bitmapHash()
+  char     pad[16];           // Keeps the distances 16 byte aligned
+};
+static_assert(sizeof(DistMapHeader) == 64, "DistMapHeader must be 64 bytes");
+
+/**
+ * A loaded distance map. "dist" either points into the mapped file or at
+ * "owned" if we built it ourselves and couldn't map it back in.
+ *
+ **/
+
+struct DistMap
+{
+  int    width, height;
+  double scale;
+  double origin_x, origin_y;
+  const float* dist;
+
+  void*  mapping;
+  size_t mapping_size;
+  std::vector<float> owned;
+};
+
+/**
+ * distAt()
+ *
+ * Distance to the nearest obstacle from a point in the world. The world
+ * beyond the edge of the map is all obstacle unless "outside" says
+ * otherwise; the laser model wants beams that end off the map to count as
+ * far from anything.
+ *
+ **/
+
+inline float distAt(const DistMap& dm, double x, double y, float outside = 0)
+{
+  int cx = (int)floor((x - dm.origin_x) / dm.scale);
+  int cy = (int)floor((y - dm.origin_y) / dm.scale);
+  if (cx < 0 || cy < 0 || cx >= dm.width || cy >= dm.height) return outside;
+  return dm.dist[cy * dm.width + cx];
+} // End of distAt()
+
+/**
+ * edt1d()
+ *
+ * Squared distance transform of one row or column: d[q] = min over p of
+ * (q - p)^2 + f[p], found from the lower envelope of the parabolas rooted
+ * at each p. v and z are scratch, of size n and n + 1. If "from" is given,
+ * the p each q's distance is to goes there.
+ *
+ **/
+
+inline void edt1d(const float* f, float* d, int n, int* v, float* z,
+                  int* from = NULL)
+{
+  const float inf = 1e20f;
+  int k = 0;
+
+  v[0] = 0;
+  z[0] = -inf;
+  z[1] = inf;
+  for (int q = 1; q < n; q++) {
+    float s = ((f[q] + (float)q * q) - (f[v[k]] + (float)v[k] * v[k]))
+      / (2.0f * (q - v[k]));
+    while (s <= z[k]) {
+      k--;
+      s = ((f[q] + (float)q * q) - (f[v[k]] + (float)v[k] * v[k]))
+        / (2.0f * (q - v[k]));
+    }
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = inf;
+  }
+
+  k = 0;
+  for (int q = 0; q < n; q++) {
+    while (z[k + 1] < q) k++;
+    float dq = (float)(q - v[k]);
+    d[q] = dq * dq + f[v[k]];
+    if (from != NULL) from[q] = v[k];
+  }
+} // End of edt1d()
+
+/**
+ * computeDistancesIn()
+ *
+ * Fill "out" with the distance in metres from each cell of the window x0
+ * to x1, y0 to y1 (inclusive) of the map to the nearest occupied cell in
+ * the window: columns first, then rows. "out" is row major over the
+ * window.
+ *
+ **/
+
+inline void computeDistancesIn(const GridMap& map, int x0, int y0,
+                               int x1, int y1, std::vector<float>& out)
+{
+  int w = x1 - x0 + 1, h = y1 - y0 + 1;
+  int n = std::max(w, h);
+  std::vector<float> f(n), d(n), z(n + 1);
+  std::vector<int>   v(n);
+
+  out.resize((size_t)w * h);
+  for (int cy = 0; cy < h; cy++) {
+    const unsigned char* src = &map.cells[(size_t)(y0 + cy) * map.width + x0];
+    float* dst = &out[(size_t)cy * w];
+    for (int cx = 0; cx < w; cx++) dst[cx] = src[cx] ? 0.0f : 1e20f;
+  }
+
+  for (int cx = 0; cx < w; cx++) {
+    for (int cy = 0; cy < h; cy++) f[cy] = out[(size_t)cy * w + cx];
+    edt1d(&f[0], &d[0], h, &v[0], &z[0]);
+    for (int cy = 0; cy < h; cy++) out[(size_t)cy * w + cx] = d[cy];
+  }
+  for (int cy = 0; cy < h; cy++) {
+    float* row = &out[(size_t)cy * w];
+    std::copy(row, row + w, f.begin());
+    edt1d(&f[0], row, w, &v[0], &z[0]);
+  }
+
+  for (size_t i = 0; i < out.size(); i++)
+    out[i] = sqrtf(out[i]) * map.scale;
+} // End of computeDistancesIn()
+
+/**
+ * computeDistances()
+ *
+ * The same, for the whole map.
+ *
+ **/
+
+inline void computeDistances(const GridMap& map, std::vector<float>& out)
+{
+  computeDistancesIn(map, 0, 0, map.width - 1, map.height - 1, out);
+} // End of computeDistances()
+
+/**
+ * bitmapHash()
+ *
+ * FNV-1a over the bytes of the bitmap and the size it is stretched over,
+ * so an edited bitmap or a changed world file both invalidate the cache.
+ * Returns 0 if the file can't be read.
+ *
+ **/
+
+inline uint64_t bitmapHash(const char* path, double size_x, double size_y)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  unsigned char buf[65536];
+  size_t got;
+
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) return 0;
+  while ((got = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    for (size_t i = 0; i < got; i++) {
+      hash ^= buf[i];
+      hash *= 1099511628211ULL;
+    }
+  }
+  fclose(fp);
+
+  double sizes[2] = { size_x, size_y };
+  const unsigned char* s = (const unsigned char*)sizes;
+  for (size_t i = 0; i < sizeof(sizes); i++) {
+    hash ^= s[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+} // End of bitmapHash()
+
+/**
+ * cachePath()
+ *
+ * Where the cached version of a bitmap lives: the same name with the
+ * extension swapped, e.g. bitmaps/local.png -> bitmaps/local.dmap.
+ *
+ **/
+
+inline std::string cachePath(const char* bitmap, const char* ext)
+{
+  std::string path(bitmap);
+  size_t dot = path.rfind('.');
+  size_t slash = path.rfind('/');
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+    path.erase(dot);
+  return path + ext;
+} // End of cachePath()
+
+/**
+ * freeDistMap()
+ *
+ **/
+
+inline void freeDistMap(DistMap& dm)
+{
+  if (dm.mapping != NULL) munmap(dm.mapping, dm.mapping_size);
+  dm.mapping = NULL;
+  dm.dist = NULL;
+  dm.owned.clear();
+} // End of freeDistMap()
+
+/**
+ * openDistMap()
+ *
+ * Map a .dmap file into memory. If "hash" is non-zero the file must have
+ * been built from a bitmap with that hash. Returns false if the file is
+ * missing, out of date or from a different version of this code.
+ *
+ **/
+
+inline bool openDistMap(DistMap& dm, const char* path, uint64_t hash)
+{
+  struct stat st;
+  DistMapHeader hdr;
+
+  dm.mapping = NULL;
+  dm.dist = NULL;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr)) {
+    close(fd);
+    return false;
+  }
+
+  void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  memcpy(&hdr, mem, sizeof(hdr));
+  size_t need = sizeof(hdr) + (size_t)hdr.width * hdr.height * sizeof(float);
+  if (memcmp(hdr.magic, "DMAP", 4) != 0 || hdr.version != DISTMAP_VERSION
+      || (hash != 0 && hdr.source_hash != hash)
+      || (size_t)st.st_size != need) {
+    munmap(mem, st.st_size);
+    return false;
+  }
+
+  dm.width    = hdr.width;
+  dm.height   = hdr.height;
+  dm.scale    = hdr.scale;
+  dm.origin_x = hdr.origin_x;
+  dm.origin_y = hdr.origin_y;
+  dm.mapping  = mem;
+  dm.mapping_size = st.st_size;
+  dm.dist     = (const float*)((const char*)mem + sizeof(hdr));
+  return true;
+} // End of openDistMap()
+
+/**
+ * writeDistMap()
+ *
+ * Save distances for "map" to path. Writes to a temporary file and renames
+ * it, so a reader never sees half a file.
+ *
+ **/
+
+inline bool writeDistMap(const char* path, const GridMap& map,
+                         const std::vector<float>& dist, uint64_t hash)
+{
+  DistMapHeader hdr;
+  std::string tmp = std::string(path) + ".tmp";
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, "DMAP", 4);
+  hdr.version     = DISTMAP_VERSION;
+  hdr.width       = map.width;
+  hdr.height      = map.height;
+  hdr.scale       = map.scale;
+  hdr.origin_x    = map.origin_x;
+  hdr.origin_y    = map.origin_y;
+  hdr.source_hash = hash;
+
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  if (fp == NULL) return false;
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+    && fwrite(&dist[0], sizeof(float), dist.size(), fp) == dist.size();
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), path) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+} // End of writeDistMap()
+
+/**
+ * loadDistMap()
+ *
+ * Get the distance map for a bitmap stretched over size_x by size_y
+ * metres, from the cache if it is up to date and otherwise by building it
+ * (and saving it for next time). If "map" is given it should already hold
+ * the loaded bitmap, which saves reading it again.
+ *
+ **/
+
+inline bool loadDistMap(DistMap& dm, const char* bitmap,
+                        double size_x, double size_y,
+                        const GridMap* map = NULL)
+{
+  uint64_t hash = bitmapHash(bitmap, size_x, size_y);
+  std::string path = cachePath(bitmap, ".dmap");
+
+  if (hash == 0) {
+    std::cerr << "Can't read map bitmap " << bitmap << std::endl;
+    return false;
+  }
+  if (openDistMap(dm, path.c_str(), hash)) return true;
+
+  GridMap loaded;
+  if (map == NULL) {
+    if (!loadGridMap(loaded, bitmap, size_x, size_y)) return false;
+    map = &loaded;
+  }
+
+  std::vector<float> dist;
+  computeDistances(*map, dist);
+  if (writeDistMap(path.c_str(), *map, dist, hash)
+      && openDistMap(dm, path.c_str(), hash)) return true;
+
+  // Read-only directory or some such: keep it in memory instead.
+  std::cerr << "Warning: can't cache distance map in " << path << std::endl;
+  dm.width    = map->width;
+  dm.height   = map->height;
+  dm.scale    = map->scale;
+  dm.origin_x = map->origin_x;
+  dm.origin_y = map->origin_y;
+  dm.owned.swap(dist);
+  dm.dist     = &dm.owned[0];
+  return true;
+} // End of loadDistMap()
+
+/**
+ * ownDistMap()
+ *
+ * Copy a mapped distance map into memory of its own, so that it can be
+ * changed (see updateDistances()) without changing the file.
+ *
+ **/
+
+inline void ownDistMap(DistMap& dm)
+{
+  if (dm.mapping == NULL) return;
+  dm.owned.assign(dm.dist, dm.dist + (size_t)dm.width * dm.height);
+  munmap(dm.mapping, dm.mapping_size);
+  dm.mapping = NULL;
+  dm.dist = &dm.owned[0];
+} // End of ownDistMap()
+
+/**
+ * updateDistances()
+ *
+ * Work the distances out again around cells x0 to x1, y0 to y1 of the map,
+ * which have changed, rather than for the whole map. Only distances up to
+ * "reach" metres are worked out again, from the cells within twice that of
+ * the change; anything further from the change than that can't have got
+ * any nearer to a wall. A cell that was within reach of a wall that has
+ * gone is left at "reach", so beyond that the distances are only known to
+ * be at least that far. The map must be owned (see ownDistMap()).
+ *
+ **/
+
+inline void updateDistances(DistMap& dm, const GridMap& map, int x0, int y0,
+                            int x1, int y1, double reach)
+{
+  int r = (int)ceil(reach / dm.scale);
+  // The cells to update, and the cells whose walls could be near them
+  int wx0 = std::max(0, x0 - r), wx1 = std::min(dm.width - 1, x1 + r);
+  int wy0 = std::max(0, y0 - r), wy1 = std::min(dm.height - 1, y1 + r);
+  int sx0 = std::max(0, wx0 - r), sx1 = std::min(dm.width - 1, wx1 + r);
+  int sy0 = std::max(0, wy0 - r), sy1 = std::min(dm.height - 1, wy1 + r);
+  if (wx0 > wx1 || wy0 > wy1 || dm.owned.empty()) return;
+
+  std::vector<float> local;
+  computeDistancesIn(map, sx0, sy0, sx1, sy1, local);
+  float far = reach;
+  float* dist = &dm.owned[0];
+  int sw = sx1 - sx0 + 1;
+  for (int cy = wy0; cy <= wy1; cy++) {
+    const float* src = &local[(size_t)(cy - sy0) * sw + (wx0 - sx0)];
+    float* dst = &dist[(size_t)cy * dm.width + wx0];
+    for (int i = 0; i <= wx1 - wx0; i++) {
+      if (src[i] < far) dst[i] = src[i];
+      else if (dst[i] < far) dst[i] = far;
+    }
+  }
+} // End of updateDistances()
+
+#endif
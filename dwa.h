@@ -0,0 +1,334 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Dynamic window local planner
+ *
+ ** Description ***************************************************************
+ *
+ *  Works out the speed and turn rate to drive towards a target point with,
+ *  rather than turning on the spot to face it and then driving with the
+ *  turn rate hard over one way or the other.
+ *
+ *  Each tick, a few hundred pairs of speed and turn rate are tried: those
+ *  the robot could reach from what it's doing now in one tick, given how
+ *  fast it can speed up and slow down (the dynamic window). Each is rolled
+ *  out for a second or two as the arc the robot would follow, and the arcs
+ *  are scored on
+ *
+ *    goal       how far from the target the arc ends up
+ *    heading    how far off facing the target it ends up
+ *    cost       the costmap (planner.h) along the way, so it keeps off
+ *               walls where it can
+ *    clearance  how close it comes to what the laser sees, which includes
+ *               anything that isn't on the map
+ *    speed      how slowly it goes
+ *
+ *  An arc that would run into a wall on the map, or into anything the
+ *  laser sees, is out. Given a Footprint and a BitGrid (footprint.h), the
+ *  walls are checked with the robot's shape, facing the way it would be,
+ *  rather than with the costmap's circle. The best of the rest is what we
+ *  do. Turning on the spot is always safe for a round robot, so if every
+ *  arc that goes anywhere is out the robot stops and turns towards the
+ *  target, and dwaStep() says so, so that the caller can look for another
+ *  way.
+ *
+ *  With a LaserScan (scan.h) it takes what the laser sees from the points
+ *  kept there, which leaves out the outliers and doesn't crowd the points
+ *  together close up, where they cost the most; otherwise every few beams.
+ *
+ *  The arcs are rolled out all at once, a step at a time, one float per
+ *  arc in each array, with the heading turned by a rotation worked out
+ *  once per arc rather than calling cos() and sin() every step, so the
+ *  loops over the arcs are plain arithmetic that the compiler vectorizes.
+ */
+
+#ifndef DWA_H
+#define DWA_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "footprint.h"
+#include "laserkernel.h"
+#include "planner.h"
+#include "scan.h"
+#include "sensorframe.h"
+
+// Arcs tried each tick: speeds by turn rates. A multiple of 8, and fixed,
+// so the loops over them vectorize without a scalar loop to finish off.
+#define DWA_SPEEDS     16
+#define DWA_TURNRATES  20
+#define DWA_ARCS       (DWA_SPEEDS * DWA_TURNRATES)
+
+/**
+ * The limits of the robot, the weights of the scores, and scratch space
+ * for the arcs, one entry per arc.
+ *
+ **/
+
+struct DwaPlanner
+{
+  const CostMap* costmap;
+  const Footprint* footprint;   // Check the walls with these, if set
+  BitGrid*       walls;
+  double max_speed, max_turnrate;
+  double accel, turn_accel;     // m/s^2 and rad/s^2
+  double horizon, step;         // Seconds to roll out for, and in
+  double radius;                // Of the robot
+  double clearance;             // Wanted beyond that, from the laser
+  int    laser_step;            // Use every this many beams
+
+  // Weights of the scores
+  double w_goal, w_heading, w_cost, w_clear, w_speed;
+
+  double last_stamp;
+  float v[DWA_ARCS], w[DWA_ARCS];    // Each arc's speed and turn rate
+  float x[DWA_ARCS], y[DWA_ARCS];    // Where it's got to
+  float c[DWA_ARCS], s[DWA_ARCS];    // ...and the way it's facing
+  float dc[DWA_ARCS], ds[DWA_ARCS];  // How that turns each step
+  float cost[DWA_ARCS];              // Summed along the arc
+  float clear[DWA_ARCS];             // Closest to the laser, squared
+  char  lethal[DWA_ARCS];            // Hits a wall on the map
+  std::vector<float> lx, ly;         // What the laser sees, in the map
+
+  // From the last tick
+  int    samples, rejected;
+  double best_score;
+};
+
+/**
+ * initDwaPlanner()
+ *
+ * The limits are about what the Roomba in Stage does with what
+ * local-roomba has always asked of it.
+ *
+ **/
+
+inline void initDwaPlanner(DwaPlanner& dwa, const CostMap& costmap)
+{
+  dwa.costmap = &costmap;
+  dwa.footprint = NULL;
+  dwa.walls = NULL;
+  dwa.max_speed = 1.0;
+  dwa.max_turnrate = 1.2;
+  dwa.accel = 2.0;
+  dwa.turn_accel = 4.0;
+  dwa.horizon = 1.5;
+  dwa.step = 0.1;
+  dwa.radius = costmap.radius;
+  dwa.clearance = 0.05;
+  dwa.laser_step = 4;
+  dwa.w_goal = 1.0;
+  dwa.w_heading = 0.3;
+  dwa.w_cost = 0.5;
+  dwa.w_clear = 0.3;
+  dwa.w_speed = 0.2;
+  dwa.last_stamp = -1;
+  dwa.samples = dwa.rejected = 0;
+  dwa.best_score = 0;
+} // End of initDwaPlanner()
+
+/**
+ * dwaLaserPoints()
+ *
+ * The ends of the laser beams close enough to matter, into the map from
+ * pose. Returns how many.
+ *
+ **/
+
+inline int dwaLaserPoints(DwaPlanner& dwa, const SensorFrame& frame,
+                          Pose2d pose)
+{
+  double reach = dwa.max_speed * dwa.horizon + dwa.radius + dwa.clearance;
+  double c = cos(pose.pa), s = sin(pose.pa);
+  float ends_x[FRAME_MAX_BEAMS], ends_y[FRAME_MAX_BEAMS];
+  beamEnds(frame.ranges, frame.bearings, frame.ranges_count, ends_x, ends_y);
+
+  dwa.lx.clear();
+  dwa.ly.clear();
+  for (int i = 0; i < frame.ranges_count; i += dwa.laser_step) {
+    double r = frame.ranges[i];
+    if (r < 0.02 || r > reach || r >= frame.max_range - 0.01) continue;
+    double bx = ends_x[i], by = ends_y[i];
+    dwa.lx.push_back(pose.px + c * bx - s * by);
+    dwa.ly.push_back(pose.py + s * bx + c * by);
+  }
+  return dwa.lx.size();
+} // End of dwaLaserPoints()
+
+/**
+ * dwaScanPoints()
+ *
+ * The same, from the points a LaserScan kept.
+ *
+ **/
+
+inline int dwaScanPoints(DwaPlanner& dwa, const LaserScan& scan, Pose2d pose)
+{
+  double reach = dwa.max_speed * dwa.horizon + dwa.radius + dwa.clearance;
+  double c = cos(pose.pa), s = sin(pose.pa);
+
+  dwa.lx.clear();
+  dwa.ly.clear();
+  for (int i = 0; i < scan.count; i++) {
+    if (scan.range[i] < 0.02 || scan.range[i] > reach) continue;
+    dwa.lx.push_back(pose.px + c * scan.x[i] - s * scan.y[i]);
+    dwa.ly.push_back(pose.py + s * scan.x[i] + c * scan.y[i]);
+  }
+  return dwa.lx.size();
+} // End of dwaScanPoints()
+
+/**
+ * dwaStep()
+ *
+ * One tick: the best speed and turn rate to head for the target with from
+ * pose. *speed and *turnrate come in as what the robot was last told to do
+ * and go out as what to tell it now. Returns false if every arc that moves
+ * would hit something, and it is turning on the spot instead. What the
+ * laser sees comes from the scan, if there is one, made from the frame.
+ *
+ **/
+
+inline bool dwaStep(DwaPlanner& dwa, const SensorFrame& frame, Pose2d pose,
+                    double targ_x, double targ_y, double* speed,
+                    double* turnrate, const LaserScan* scan = NULL)
+{
+  const CostMap& cm = *dwa.costmap;
+  double dt = dwa.last_stamp < 0 ? 0.1 : frame.stamp - dwa.last_stamp;
+  if (dt < 0.02 || dt > 0.5) dt = 0.1;
+  dwa.last_stamp = frame.stamp;
+
+  // The window: what we can get to from here in one tick. We don't
+  // drive backwards; the bumpers deal with that.
+  double v_lo = std::max(0.0, *speed - dwa.accel * dt);
+  double v_hi = std::min(dwa.max_speed, *speed + dwa.accel * dt);
+  if (v_hi < v_lo) v_hi = v_lo;
+  double w_lo = std::max(-dwa.max_turnrate, *turnrate - dwa.turn_accel * dt);
+  double w_hi = std::min(dwa.max_turnrate, *turnrate + dwa.turn_accel * dt);
+  if (w_hi < w_lo) w_lo = w_hi = std::max(-dwa.max_turnrate,
+                                          std::min(dwa.max_turnrate,
+                                                   *turnrate));
+
+  int n = 0;
+  float h = dwa.step;
+  for (int i = 0; i < DWA_SPEEDS; i++) {
+    double v = v_lo + (v_hi - v_lo) * i / (DWA_SPEEDS - 1);
+    for (int j = 0; j < DWA_TURNRATES; j++) {
+      double w = w_lo + (w_hi - w_lo) * j / (DWA_TURNRATES - 1);
+      dwa.v[n] = v;
+      dwa.w[n] = w;
+      dwa.dc[n] = cos(w * h);
+      dwa.ds[n] = sin(w * h);
+      n++;
+    }
+  }
+  const float px0 = pose.px, py0 = pose.py;
+  const float c0 = cos(pose.pa), s0 = sin(pose.pa);
+  for (int i = 0; i < DWA_ARCS; i++) {
+    dwa.x[i] = px0;
+    dwa.y[i] = py0;
+    dwa.c[i] = c0;
+    dwa.s[i] = s0;
+    dwa.cost[i] = 0;
+    dwa.clear[i] = 1e6f;
+    dwa.lethal[i] = 0;
+  }
+  int points = scan != NULL ? dwaScanPoints(dwa, *scan, pose)
+                            : dwaLaserPoints(dwa, frame, pose);
+
+  // If the map says we're in a wall already it is wrong by a cell or so,
+  // and only the laser can tell us what we'd hit
+  int cx0 = (int)floor((pose.px - cm.origin_x) / cm.scale);
+  int cy0 = (int)floor((pose.py - cm.origin_y) / cm.scale);
+  bool trust_map = costAt(cm, cx0, cy0) < COST_LETHAL;
+  bool shaped = dwa.footprint != NULL && dwa.walls != NULL;
+  if (shaped)
+    trust_map = !footprintHits(*dwa.footprint, *dwa.walls, pose.px, pose.py,
+                               pose.pa);
+
+  int steps = (int)ceil(dwa.horizon / dwa.step);
+  for (int k = 0; k < steps; k++) {
+    // Half a turn, the move, the other half: a good enough arc
+    for (int i = 0; i < DWA_ARCS; i++) {
+      float hc = 0.5f * (1.0f + dwa.dc[i]), hs = 0.5f * dwa.ds[i];
+      float mc = dwa.c[i] * hc - dwa.s[i] * hs;
+      float ms = dwa.s[i] * hc + dwa.c[i] * hs;
+      dwa.x[i] += dwa.v[i] * h * mc;
+      dwa.y[i] += dwa.v[i] * h * ms;
+      float nc = dwa.c[i] * dwa.dc[i] - dwa.s[i] * dwa.ds[i];
+      dwa.s[i] = dwa.s[i] * dwa.dc[i] + dwa.c[i] * dwa.ds[i];
+      dwa.c[i] = nc;
+    }
+    for (int p = 0; p < points; p++) {
+      const float px = dwa.lx[p], py = dwa.ly[p];
+      for (int i = 0; i < DWA_ARCS; i++) {
+        float ex = dwa.x[i] - px, ey = dwa.y[i] - py;
+        float d2 = ex * ex + ey * ey;
+        dwa.clear[i] = d2 < dwa.clear[i] ? d2 : dwa.clear[i];
+      }
+    }
+    // Looking up the costmap doesn't vectorize, but it's one per arc
+    for (int i = 0; i < DWA_ARCS; i++) {
+      int cost = costAt(cm, (int)floor((dwa.x[i] - cm.origin_x) / cm.scale),
+                        (int)floor((dwa.y[i] - cm.origin_y) / cm.scale));
+      bool hit = cost >= COST_LETHAL;
+      // Well clear of the walls (COST_FREE) the shape can't matter
+      if (shaped && trust_map && dwa.v[i] > 0 && !dwa.lethal[i]
+          && (cost > COST_FREE || cm.inflation <= 0))
+        hit = footprintHits(*dwa.footprint, *dwa.walls, dwa.x[i], dwa.y[i],
+                            pose.pa + dwa.w[i] * h * (k + 1));
+      if (hit && trust_map && dwa.v[i] > 0) dwa.lethal[i] = 1;
+      dwa.cost[i] += cost >= COST_LETHAL ? 253 : cost - COST_FREE;
+    }
+  }
+
+  // Score them. Already too close to something (the laser sees it, so
+  // the map was wrong) we may move so long as we don't get any closer.
+  double too_close = dwa.radius + dwa.clearance;
+  double margin = 0.5;          // Clearance past too_close that's worth having
+  double start = 1e6;
+  for (int p = 0; p < points; p++) {
+    double ex = pose.px - dwa.lx[p], ey = pose.py - dwa.ly[p];
+    start = std::min(start, sqrt(ex * ex + ey * ey));
+  }
+  double limit = std::min(too_close, start - 0.01);
+  int best = -1, moving = 0;
+  double best_score = 0;
+  dwa.rejected = 0;
+  for (int i = 0; i < DWA_ARCS; i++) {
+    double d = sqrt(dwa.clear[i]);
+    if (dwa.v[i] > 0 && (dwa.lethal[i] || d < limit)) {
+      dwa.rejected++;
+      continue;
+    }
+    if (dwa.v[i] > 0) moving++;
+    double dx = targ_x - dwa.x[i], dy = targ_y - dwa.y[i];
+    double heading = atan2(dwa.s[i], dwa.c[i]);
+    double off = fabs(normalizeAngle(atan2(dy, dx) - heading)) / M_PI;
+    double near = std::max(0.0, 1 - (d - too_close) / margin);
+    double score = dwa.w_goal * sqrt(dx * dx + dy * dy)
+                 + dwa.w_heading * off
+                 + dwa.w_cost * dwa.cost[i] / (253.0 * steps)
+                 + dwa.w_clear * std::min(1.0, near)
+                 + dwa.w_speed * (1 - dwa.v[i] / dwa.max_speed);
+    if (best < 0 || score < best_score) {
+      best = i;
+      best_score = score;
+    }
+  }
+  dwa.samples = DWA_ARCS;
+  dwa.best_score = best_score;
+
+  if (moving == 0) {
+    // Stop dead, whatever the window says, and turn for the target
+    double off = normalizeAngle(atan2(targ_y - pose.py, targ_x - pose.px)
+                                - pose.pa);
+    *speed = 0;
+    *turnrate = off < 0 ? -dwa.max_turnrate / 2 : dwa.max_turnrate / 2;
+    return false;
+  }
+  *speed = dwa.v[best];
+  *turnrate = dwa.w[best];
+  return true;
+} // End of dwaStep()
+
+#endif
@@ -0,0 +1,477 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Fleet
+ *
+ ** Description ***************************************************************
+ *
+ *  Runs the local-roomba controller (gotogoal.h) for a whole fleet of
+ *  robots in one process, rather than one process per robot:
+ *
+ *    ./fleet [-robots n] [-threads n] [-dwa] [-mission file | -roadmap]
+ *            [-time seconds] [-seed n] [-player [host]] [world]
+ *
+ *  Each robot is given somewhere to go and, when it gets there, somewhere
+ *  else, until the time is up: random places on the map, in the part of it
+ *  that's all joined up. With -mission they go by the roads of the
+ *  mission's graph instead, and with -roadmap by the roads roadmap.h finds
+ *  on the map. Each robot starts from a depot, one of the nodes well clear
+ *  of the walls, and goes from there to the mission's goals, or if it has
+ *  none (as a roadmap doesn't) to any of the nodes, and back, at random:
+ *  only those it can get to by the roads from its depot. -dwa has them
+ *  steer with the local planner in dwa.h. -roadmap means -dwa: the roads
+ *  go down the middle of narrow gaps too, and stopping to turn 0.5m short
+ *  of each bend, as the robots otherwise do, takes them into the walls.
+ *
+ *  The robots run in step. Each tick, every robot's controller runs once,
+ *  spread over the cores with the pool in workpool.h (as many threads as
+ *  there are cores, or the number given), whose threads are started once
+ *  and kept waiting between ticks. What the robots share, and none of them
+ *  changes, is loaded once: the map, the distance map, the roads and the
+ *  costmap. What each robot keeps from one tick to the next (its frame,
+ *  its path, its local planner) is in arrays, one entry per robot.
+ *  A* needs space for every cell of the map while it searches, but only
+ *  while it searches, so there is one planner for each thread, which plans
+ *  for whichever robot that thread is running. So the fleet's memory grows
+ *  by the size of the robots' own state, tens of kilobytes each, not by a
+ *  map's worth per robot.
+ *
+ *  By default the robots are in the headless simulator (sim.h), on
+ *  world4.world or the world given, for 10 simulated minutes or the time
+ *  given, as fast as it will go. They start at random places, and they
+ *  don't see or bump into each other, only the walls. With -player they
+ *  are the robots on the Player server (localhost unless given), with
+ *  position2d, bumper, localize (and for -dwa, laser) devices 0 to n-1,
+ *  all read in one go each tick, at 10Hz, for the time given.
+ *
+ *  At the end it prints how many goals the fleet reached, how many
+ *  collisions there were, how long the controllers took per robot per
+ *  tick and per fleet tick (latency.h), and how much memory the process
+ *  has in use, before the robots were added and at the end.
+ */
+
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <libplayerc++/playerc++.h>
+#include "gotogoal.h"
+#include "latency.h"
+#include "roadmap.h"
+#include "robotclient.h"
+#include "workpool.h"
+using namespace PlayerCc;
+
+/**
+ * What each robot has done.
+ *
+ **/
+
+struct RobotStats
+{
+  int  goals;                  // Reached
+  int  no_path;                // Given up on
+  int  collisions;
+  bool was_hit;
+};
+
+/**
+ * Function headers
+ *
+ **/
+
+double memoryUsed();
+void largestRegion(const CostMap& cm, std::vector<char>& in);
+Pose2d randomFree(const CostMap& cm, const std::vector<char>& region,
+                  std::mt19937& rng);
+int randomStop(const std::vector<int>& stops, int last, std::mt19937& rng);
+
+/**
+ * main()
+ *
+ **/
+
+int main(int argc, char *argv[])
+{
+  int n_robots = 100;
+  int n_threads = std::thread::hardware_concurrency();
+  bool use_dwa = false;
+  const char* mission_path = NULL;
+  bool use_roadmap = false;
+  double time_limit = 600;
+  unsigned seed = 1;
+  const char* host = NULL;     // Player server, with -player
+  const char* world_path = "world4.world";
+  SimWorld world;
+  GridMap grid;                // With -player; the simulator has its own
+  DistMap field;
+  MissionGraph mission;        // The roads, with -mission or -roadmap
+  const MissionGraph* roads = NULL;
+  LoopProfile profile;         // For the fleet's ticks
+  std::vector<LoopProfile> thread_prof;  // For each robot's, on each thread
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-robots") == 0 && i + 1 < argc)
+      n_robots = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+      n_threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-dwa") == 0) use_dwa = true;
+    else if (strcmp(argv[i], "-mission") == 0 && i + 1 < argc)
+      mission_path = argv[++i];
+    else if (strcmp(argv[i], "-roadmap") == 0) use_dwa = use_roadmap = true;
+    else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc)
+      time_limit = atof(argv[++i]);
+    else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+      seed = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-player") == 0) {
+      host = "localhost";
+      if (i + 1 < argc && argv[i + 1][0] != '-'
+          && strstr(argv[i + 1], ".world") == NULL) host = argv[++i];
+    }
+    else world_path = argv[i];
+  }
+  if (n_robots < 1) n_robots = 1;
+  if (n_threads < 1) n_threads = 1;
+  if (n_threads > n_robots) n_threads = n_robots;
+
+  // Everything the robots share
+  const DistMap* dist = &field;
+  if (host == NULL) {
+    if (!loadSimWorld(world, world_path)) return 1;
+    dist = &world.dist;
+  } else {
+    // Same map and size as world4.world
+    if (!loadGridMap(grid, "bitmaps/local.png", 16, 16)) return 1;
+    if (!loadDistMap(field, "bitmaps/local.png", 16, 16, &grid)) return 1;
+  }
+  if (mission_path != NULL && use_roadmap) {
+    std::cerr << "-roadmap is instead of -mission" << std::endl;
+    return 1;
+  }
+  if (mission_path != NULL) {
+    if (!loadMission(mission, mission_path)) return 1;
+    roads = &mission;
+  }
+  std::vector<Planner> planners(n_threads);
+  for (int t = 0; t < n_threads; t++) initPlanner(planners[t], *dist);
+  const CostMap& costmap = planners[0].costmap;
+  if (use_roadmap) {
+    RoadmapParams params;
+    initRoadmapParams(params);
+    bool loaded = host == NULL
+      ? loadRoadmap(mission, world.bitmap.c_str(), world.size_x,
+                    world.size_y, world.map, costmap, params)
+      : loadRoadmap(mission, "bitmaps/local.png", 16, 16, grid, costmap,
+                    params);
+    if (!loaded) return 1;
+    roads = &mission;
+  }
+  std::vector<char> region;    // Where there's room, and a way everywhere else
+  largestRegion(costmap, region);
+
+  // With roads, the depots, and for each the nodes a robot starting there
+  // can go to, the depot first. A roadmap can have roads shut off from the
+  // rest, inside walls, and a mission can have goals some depots can't
+  // get to, so only those the route table has a way to count.
+  std::vector<int> depots;
+  std::vector<std::vector<int> > stops;
+  for (int k = 0; roads != NULL && k < roads->node_count; k++) {
+    const GraphNode& n = roads->nodes[k];
+    int cx = (int)floor((n.x - costmap.origin_x) / costmap.scale);
+    int cy = (int)floor((n.y - costmap.origin_y) / costmap.scale);
+    if (costAt(costmap, cx, cy) != COST_FREE
+        || !region[cy * costmap.width + cx]) continue;
+    std::vector<int> to(1, k);
+    int count = roads->goal_count > 0 ? roads->goal_count : roads->node_count;
+    for (int j = 0; j < count; j++) {
+      int s = roads->goal_count > 0 ? roads->goals[j] : j;
+      if (s != k && routeCost(*roads, k, s) < GRAPH_UNREACHABLE)
+        to.push_back(s);
+    }
+    if (to.size() < 2) continue;
+    depots.push_back(k);
+    stops.push_back(to);
+  }
+  if (roads != NULL && depots.empty()) {
+    std::cerr << "No node clear of the walls has anywhere to go by the roads"
+              << std::endl;
+    return 1;
+  }
+
+  initProfile(profile);
+  int t_tick = addStage(profile, "fleet tick");
+  int t_robot = addStage(profile, "robot tick");
+  thread_prof.resize(n_threads);
+  for (int t = 0; t < n_threads; t++) {
+    initProfile(thread_prof[t]);
+    addStage(thread_prof[t], "robot tick");
+  }
+  double shared_mb = memoryUsed();
+
+  // ...and what each robot keeps to itself
+  std::vector<GoToGoal>    tasks(n_robots);
+  std::vector<DwaPlanner>  dwas(use_dwa ? n_robots : 0);
+  std::vector<SensorFrame> frames(n_robots);
+  std::vector<RobotStats>  stats(n_robots);
+  std::vector<std::mt19937> rngs(n_robots);
+  std::vector<int>         targets(roads != NULL ? n_robots : 0);
+  std::vector<Sim>         sims(host == NULL ? n_robots : 0);
+
+  for (int i = 0; i < n_robots; i++) {
+    std::seed_seq seq = { seed, (unsigned)i };
+    rngs[i].seed(seq);
+    memset(&stats[i], 0, sizeof(stats[i]));
+    Pose2d start = randomFree(costmap, region, rngs[i]);
+    Point2d goal;
+    if (roads != NULL) {
+      // Start on the roads, so there's always a way on to them
+      int d = i % depots.size();
+      const GraphNode& n = roads->nodes[depots[d]];
+      start.px = n.x;
+      start.py = n.y;
+      targets[i] = randomStop(stops[d], depots[d], rngs[i]);
+      goal.x = roads->nodes[targets[i]].x;
+      goal.y = roads->nodes[targets[i]].y;
+    } else {
+      Pose2d p = randomFree(costmap, region, rngs[i]);
+      goal.x = p.px;
+      goal.y = p.py;
+    }
+    initGoToGoal(tasks[i], planners[0], NULL, goal.x, goal.y);
+    tasks[i].quiet = true;
+    tasks[i].graph = roads;
+    if (use_dwa) {
+      initDwaPlanner(dwas[i], costmap);
+      tasks[i].dwa = &dwas[i];
+    }
+    if (host == NULL) {
+      initSim(sims[i], world, rngs[i]());
+      sims[i].pose = sims[i].odom = start;
+      sims[i].laser = use_dwa;
+    }
+  }
+
+  // Set up proxies, robot i's devices all at index i
+  PlayerClient* robot = NULL;
+  std::vector<Position2dProxy*> pp;
+  std::vector<BumperProxy*>     bp;
+  std::vector<LocalizeProxy*>   lp;
+  std::vector<LaserProxy*>      sp;
+  if (host != NULL) {
+    robot = new PlayerClient(host);
+    for (int i = 0; i < n_robots; i++) {
+      pp.push_back(new Position2dProxy(robot, i));
+      bp.push_back(new BumperProxy(robot, i));
+      lp.push_back(new LocalizeProxy(robot, i));
+      sp.push_back(use_dwa ? new LaserProxy(robot, i) : NULL);
+      pp[i]->SetMotorEnable(true);
+    }
+  }
+
+  // One robot's tick, given what it has just read
+  auto tickRobot = [&](int i, int t) {
+    ScopedTimer timer(thread_prof[t], 0);
+    GoToGoal& task = tasks[i];
+    RobotStats& st = stats[i];
+    const SensorFrame& frame = frames[i];
+
+    // Count each time we run into something, not each tick we're stuck
+    bool hit = frame.bumper[0] || frame.bumper[1] || frame.stall;
+    if (hit && !st.was_hit) st.collisions++;
+    st.was_hit = hit;
+
+    task.planner = &planners[t];
+    int status = goToGoalTick(task, frame);
+    if (status == GOAL_ARRIVED || status == GOAL_NO_PATH) {
+      if (status == GOAL_ARRIVED) st.goals++;
+      else st.no_path++;
+      if (roads != NULL) {
+        int k = randomStop(stops[i % depots.size()], targets[i], rngs[i]);
+        targets[i] = k;
+        setGoal(task, roads->nodes[k].x, roads->nodes[k].y);
+      } else {
+        Pose2d p = randomFree(costmap, region, rngs[i]);
+        setGoal(task, p.px, p.py);
+      }
+      task.speed = task.turnrate = 0;
+    }
+  };
+
+  WorkPool pool;
+  startWorkPool(pool, n_threads);
+
+  double start = clientNow();
+  double next = start;
+  int ticks = 0;
+  while (true) {
+    if (host == NULL && sims[0].time > time_limit) break;
+    if (host != NULL && clientNow() - start > time_limit) break;
+    while (host != NULL && clientNow() < next)
+      std::this_thread::sleep_for(std::chrono::milliseconds(IO_POLL_MS));
+    next += 0.1;
+    ScopedTimer timer(profile, t_tick);
+    if (host == NULL) {
+      // Each robot's simulator is its own, so they step on the threads too
+      runBatch(pool, n_robots, [&](int i, int t) {
+          if (ticks > 0) simStep(sims[i]);
+          simSense(sims[i], frames[i]);
+          tickRobot(i, t);
+          sims[i].speed = tasks[i].speed;
+          sims[i].turnrate = tasks[i].turnrate;
+        });
+    } else {
+      // The proxies aren't safe to share, so only this thread touches them
+      robot->Read();
+      for (int i = 0; i < n_robots; i++) {
+        readProxies(pp[i], bp[i], sp[i], lp[i], frames[i]);
+        frames[i].seq = ticks + 1;
+      }
+      runBatch(pool, n_robots, tickRobot);
+      for (int i = 0; i < n_robots; i++)
+        pp[i]->SetSpeed(tasks[i].speed, tasks[i].turnrate);
+    }
+    ticks++;
+  }
+  double took = clientNow() - start;
+  stopWorkPool(pool);
+  double fleet_mb = memoryUsed();
+
+  if (host != NULL) {
+    for (int i = 0; i < n_robots; i++) {
+      pp[i]->SetSpeed(0, 0);
+      delete pp[i];
+      delete bp[i];
+      delete lp[i];
+      delete sp[i];
+    }
+    delete robot;
+  }
+
+  int goals = 0, no_path = 0, collisions = 0, idle = 0;
+  for (int i = 0; i < n_robots; i++) {
+    goals += stats[i].goals;
+    no_path += stats[i].no_path;
+    collisions += stats[i].collisions;
+    if (stats[i].goals == 0) idle++;
+  }
+  for (int t = 0; t < n_threads; t++)
+    mergeHistogram(profile.hist[t_robot], thread_prof[t].hist[0]);
+
+  std::cout << n_robots << " robots, " << ticks << " ticks in " << took
+            << "s on " << n_threads << " threads" << std::endl;
+  std::cout << "Goals reached: " << goals << " (" << (double)goals / n_robots
+            << " per robot, " << idle << " robots reached none), "
+            << no_path << " given up" << std::endl;
+  std::cout << "Collisions: " << collisions << std::endl;
+  std::cout << "Memory: " << shared_mb << "MB before the robots, "
+            << fleet_mb << "MB with them, "
+            << (fleet_mb - shared_mb) * 1024 / n_robots << "KB per robot"
+            << std::endl;
+  printProfile(profile);
+
+  if (host != NULL) freeDistMap(field);
+  if (roads != NULL) freeMission(mission);
+  return 0;
+} // end of main()
+
+/**
+ * memoryUsed()
+ *
+ * The memory the process has in use, in megabytes.
+ *
+ **/
+
+double memoryUsed()
+{
+  long pages = 0, resident = 0;
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL) return 0;
+  if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(fp);
+  return resident * (sysconf(_SC_PAGESIZE) / 1048576.0);
+} // End of memoryUsed()
+
+/**
+ * largestRegion()
+ *
+ * Mark the cells of the biggest part of the map the robot can drive round
+ * without going through a wall, so that it can get from any of them to
+ * any other. Parts of the map shut off from the rest would only be goals
+ * that nobody can get to.
+ *
+ **/
+
+void largestRegion(const CostMap& cm, std::vector<char>& in)
+{
+  int n = cm.width * cm.height;
+  std::vector<int> label(n, -1), queue;
+  int best = -1, best_size = 0, labels = 0;
+
+  for (int s = 0; s < n; s++) {
+    if (label[s] >= 0 || cm.cost[s] >= COST_LETHAL) continue;
+    queue.assign(1, s);
+    label[s] = labels;
+    for (size_t q = 0; q < queue.size(); q++) {
+      int c = queue[q], cx = c % cm.width, cy = c / cm.width;
+      const int dx[4] = { 1, -1, 0, 0 }, dy[4] = { 0, 0, 1, -1 };
+      for (int k = 0; k < 4; k++) {
+        int nx = cx + dx[k], ny = cy + dy[k];
+        if (costAt(cm, nx, ny) >= COST_LETHAL) continue;
+        int m = ny * cm.width + nx;
+        if (label[m] >= 0) continue;
+        label[m] = labels;
+        queue.push_back(m);
+      }
+    }
+    if ((int)queue.size() > best_size) {
+      best = labels;
+      best_size = queue.size();
+    }
+    labels++;
+  }
+  in.assign(n, 0);
+  for (int c = 0; c < n; c++) in[c] = label[c] == best;
+} // End of largestRegion()
+
+/**
+ * randomFree()
+ *
+ * A pose anywhere in the region, well clear of the walls.
+ *
+ **/
+
+Pose2d randomFree(const CostMap& cm, const std::vector<char>& region,
+                  std::mt19937& rng)
+{
+  std::uniform_int_distribution<int> cell(0, cm.width * cm.height - 1);
+  std::uniform_real_distribution<double> ua(-M_PI, M_PI);
+  int c;
+  Pose2d pose;
+
+  // Clear of the walls, in the costmap, is where it's cheapest
+  do {
+    c = cell(rng);
+  } while (!region[c] || cm.cost[c] != COST_FREE);
+  pose.px = cm.origin_x + (c % cm.width + 0.5) * cm.scale;
+  pose.py = cm.origin_y + (c / cm.width + 0.5) * cm.scale;
+  pose.pa = ua(rng);
+  return pose;
+} // End of randomFree()
+
+/**
+ * randomStop()
+ *
+ * Any of the stops but the last one gone to: pick from all but the end of
+ * the list, and if that is the last one, take the end one instead.
+ *
+ **/
+
+int randomStop(const std::vector<int>& stops, int last, std::mt19937& rng)
+{
+  std::uniform_int_distribution<int> pick(0, stops.size() - 2);
+  int k = stops[pick(rng)];
+  return k == last ? stops.back() : k;
+} // End of randomStop()
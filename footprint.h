@@ -0,0 +1,250 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Footprint collision checker
+ *
+ ** Description ***************************************************************
+ *
+ *  Says whether the robot, put down at a pose, would overlap a wall, using
+ *  the shape of the robot rather than just a point and a radius.
+ *
+ *  The shape is the polygon in roomba.inc, which Stage scales to the
+ *  model's "size [0.33 0.33]". At startup it is turned, in
+ *  FOOTPRINT_HEADINGS steps, and each turn of it is drawn into a mask
+ *  with the robot in the middle of a cell: a cell is in the mask if its
+ *  middle is inside the polygon, which is how the costmap (planner.h)
+ *  decides a cell is too close to a wall. Each row of a mask is one 64
+ *  bit word, one bit per cell.
+ *
+ *  The walls are kept the same way, in a BitGrid: one bit per cell of
+ *  the GridMap, 64 cells to a word, with a border of wall all round it,
+ *  since the edge of the map is a wall. Checking a pose then takes the
+ *  mask for the nearest heading and, for each of its rows, the 64 bits of
+ *  the grid it lies over, shifted into line, and ANDs the two. A Roomba
+ *  on the 3.2cm cells of bitmaps/local.png is eleven rows, so a pose is
+ *  eleven pairs of word loads, shifts and ANDs, at most.
+ *
+ *  If the map changes (occmap.h), updateBitGrid() copies the cells that
+ *  changed over.
+ *
+ *  The Roomba is round, and roomba.inc's polygon is only a circle drawn
+ *  with 16 points, so its masks cover the same cells as the costmap's
+ *  circle: checking arcs with them rules out what the costmap does, only
+ *  more slowly. It is here for robots that aren't round, whose polygon
+ *  initFootprint() takes instead.
+ */
+
+#ifndef FOOTPRINT_H
+#define FOOTPRINT_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "gridmap.h"
+#include "planner.h"
+
+#define FOOTPRINT_HEADINGS 64   // Masks, 5.625 degrees apart
+#define FOOTPRINT_HALF     31   // Cells a mask reaches either side of centre
+#define FOOTPRINT_ROWS     (2 * FOOTPRINT_HALF + 1)
+#define BITGRID_PAD        64   // Cells of wall left and right of the map
+
+/**
+ * The footprint at one heading. Bit c of row r is the cell
+ * (c - FOOTPRINT_HALF, r - FOOTPRINT_HALF) from the robot's; only rows lo
+ * to hi have anything in them.
+ *
+ **/
+
+struct FootprintMask
+{
+  uint64_t rows[FOOTPRINT_ROWS];
+  int lo, hi;
+};
+
+struct Footprint
+{
+  std::vector<Point2d> polygon;  // In the robot's frame, metres
+  double scale;                  // Metres per cell, as the map
+  FootprintMask masks[FOOTPRINT_HEADINGS];
+};
+
+/**
+ * The walls, a bit per cell. Row cy of the map is row cy + FOOTPRINT_HALF
+ * here, and cell cx is bit cx + BITGRID_PAD of it, with wall all round.
+ *
+ **/
+
+struct BitGrid
+{
+  int    width, height;         // Of the map, in cells
+  double scale, origin_x, origin_y;
+  int    words;                 // In each row
+  std::vector<uint64_t> bits;
+};
+
+/**
+ * roombaFootprint()
+ *
+ * The polygon from roomba.inc, scaled as Stage scales it to fit the
+ * model's size.
+ *
+ **/
+
+inline std::vector<Point2d> roombaFootprint()
+{
+  static const double points[16][2] = {
+    { 0.225, 0.000 }, { 0.208, 0.086 }, { 0.159, 0.159 }, { 0.086, 0.208 },
+    { 0.000, 0.225 }, { -0.086, 0.208 }, { -0.159, 0.159 },
+    { -0.208, 0.086 }, { -0.225, 0.000 }, { -0.208, -0.086 },
+    { -0.159, -0.159 }, { -0.086, -0.208 }, { -0.000, -0.225 },
+    { 0.086, -0.208 }, { 0.159, -0.159 }, { 0.208, -0.086 }
+  };
+  std::vector<Point2d> polygon(16);
+  for (int i = 0; i < 16; i++) {
+    polygon[i].x = points[i][0] * ROOMBA_RADIUS / 0.225;
+    polygon[i].y = points[i][1] * ROOMBA_RADIUS / 0.225;
+  }
+  return polygon;
+} // End of roombaFootprint()
+
+/**
+ * insidePolygon()
+ *
+ * Whether (x, y) is inside the polygon, by counting the edges a line out
+ * from it to the right crosses.
+ *
+ **/
+
+inline bool insidePolygon(const std::vector<Point2d>& polygon, double x,
+                          double y)
+{
+  bool inside = false;
+  for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+    const Point2d& a = polygon[i];
+    const Point2d& b = polygon[j];
+    if ((a.y > y) != (b.y > y)
+        && x < a.x + (y - a.y) * (b.x - a.x) / (b.y - a.y))
+      inside = !inside;
+  }
+  return inside;
+} // End of insidePolygon()
+
+/**
+ * initFootprint()
+ *
+ * Draw the masks for a polygon on cells "scale" metres across. Returns
+ * false if it is too big for them.
+ *
+ **/
+
+inline bool initFootprint(Footprint& fp, double scale,
+                          const std::vector<Point2d>& polygon
+                            = roombaFootprint())
+{
+  fp.polygon = polygon;
+  fp.scale = scale;
+  bool fits = true;
+
+  for (int k = 0; k < FOOTPRINT_HEADINGS; k++) {
+    FootprintMask& m = fp.masks[k];
+    double a = 2 * M_PI * k / FOOTPRINT_HEADINGS;
+    double c = cos(a), s = sin(a);
+    m.lo = FOOTPRINT_ROWS;
+    m.hi = -1;
+    for (int r = 0; r < FOOTPRINT_ROWS; r++) {
+      m.rows[r] = 0;
+      for (int b = 0; b < FOOTPRINT_ROWS; b++) {
+        // The middle of the cell, turned back into the robot's frame
+        double wx = (b - FOOTPRINT_HALF) * scale;
+        double wy = (r - FOOTPRINT_HALF) * scale;
+        if (!insidePolygon(polygon, c * wx + s * wy, -s * wx + c * wy))
+          continue;
+        m.rows[r] |= (uint64_t)1 << b;
+        m.lo = std::min(m.lo, r);
+        m.hi = std::max(m.hi, r);
+        if (r == 0 || r == FOOTPRINT_ROWS - 1
+            || b == 0 || b == FOOTPRINT_ROWS - 1) fits = false;
+      }
+    }
+  }
+  return fits;
+} // End of initFootprint()
+
+/**
+ * updateBitGrid()
+ *
+ * Copy cells x0 to x1, y0 to y1 of the map over.
+ *
+ **/
+
+inline void updateBitGrid(BitGrid& bg, const GridMap& map, int x0, int y0,
+                          int x1, int y1)
+{
+  x0 = std::max(0, x0);
+  y0 = std::max(0, y0);
+  x1 = std::min(bg.width - 1, x1);
+  y1 = std::min(bg.height - 1, y1);
+  for (int cy = y0; cy <= y1; cy++) {
+    uint64_t* row = &bg.bits[(size_t)(cy + FOOTPRINT_HALF) * bg.words];
+    for (int cx = x0; cx <= x1; cx++) {
+      int b = cx + BITGRID_PAD;
+      uint64_t bit = (uint64_t)1 << (b & 63);
+      if (map.cells[cy * map.width + cx]) row[b >> 6] |= bit;
+      else row[b >> 6] &= ~bit;
+    }
+  }
+} // End of updateBitGrid()
+
+/**
+ * buildBitGrid()
+ *
+ **/
+
+inline void buildBitGrid(BitGrid& bg, const GridMap& map)
+{
+  bg.width = map.width;
+  bg.height = map.height;
+  bg.scale = map.scale;
+  bg.origin_x = map.origin_x;
+  bg.origin_y = map.origin_y;
+  // The pad both sides, and a word over for footprintHits() to read
+  bg.words = (map.width + 2 * BITGRID_PAD + 63) / 64 + 1;
+  bg.bits.assign((size_t)(map.height + 2 * FOOTPRINT_HALF) * bg.words,
+                 ~(uint64_t)0);
+  updateBitGrid(bg, map, 0, 0, map.width - 1, map.height - 1);
+} // End of buildBitGrid()
+
+/**
+ * footprintHits()
+ *
+ * Whether the robot at (x, y), facing a, overlaps a wall. The footprint
+ * is the one for the nearest heading, centred on the cell (x, y) is in.
+ *
+ **/
+
+inline bool footprintHits(const Footprint& fp, const BitGrid& bg, double x,
+                          double y, double a)
+{
+  int cx = (int)floor((x - bg.origin_x) / bg.scale);
+  int cy = (int)floor((y - bg.origin_y) / bg.scale);
+  if (cx < 0 || cy < 0 || cx >= bg.width || cy >= bg.height) return true;
+
+  int k = (int)floor(a * (FOOTPRINT_HEADINGS / (2 * M_PI)) + 0.5)
+          % FOOTPRINT_HEADINGS;
+  if (k < 0) k += FOOTPRINT_HEADINGS;
+  const FootprintMask& m = fp.masks[k];
+
+  // Bit 0 of the mask lies over this bit of the grid's rows
+  int b = cx + BITGRID_PAD - FOOTPRINT_HALF;
+  int s = b & 63;
+  const uint64_t* row = &bg.bits[(size_t)(cy + m.lo) * bg.words + (b >> 6)];
+  for (int r = m.lo; r <= m.hi; r++, row += bg.words) {
+    // The 64 bits from bit s on; shifting by 1 then 63 - s, so that
+    // s = 0 doesn't shift by 64
+    uint64_t under = (row[0] >> s) | ((row[1] << 1) << (63 - s));
+    if (under & m.rows[r]) return true;
+  }
+  return false;
+} // End of footprintHits()
+
+#endif
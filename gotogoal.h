@@ -0,0 +1,571 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Go to goal
+ *
+ ** Description ***************************************************************
+ *
+ *  The decision making of local-roomba, taken out of its main() so that
+ *  other programs (the Monte Carlo runner, say) can run it against any
+ *  number of robots. Each call to goToGoalTick() is one time round the old
+ *  control loop: it takes what the robot just read and says what speed and
+ *  turn rate to send.
+ *
+ *  The robot plans a path to the goal with A* (planner.h), then turns on
+ *  the spot to face each waypoint and drives to it. If it bumps into
+ *  something it backs off and carries on from the nearest waypoint it can
+ *  see (kdtree.h), planning again only if it can't see any. With a
+ *  navigation function (navfield.h) it instead heads a little way downhill
+ *  from wherever it is.
+ *
+ *  With a DwaPlanner (dwa.h) it doesn't stop to turn, but steers smoothly
+ *  along each leg of the path, for a point a little ahead of it on the
+ *  leg, moving on to the next leg as it passes each waypoint, and keeps
+ *  clear of anything the laser sees on the way. If the planner can find
+ *  no way on for a second, the robot picks up the path again from where
+ *  it is, as it does after a bump. With a LaserScan (scan.h) as well, the
+ *  planner looks at the points kept there instead of the raw beams.
+ *
+ *  With a MissionGraph (mission.h) it doesn't plan, but goes by the
+ *  graph's roads: to the closest node it can see, along the shortest
+ *  route from there to the node at the goal, and on to the goal itself.
+ *
+ *  With an OccMap (occmap.h) it adds each scan to the map as it goes, and
+ *  keeps the planner's costmap up to date around whatever changes, and
+ *  the local planner's walls too, if it checks them with the robot's
+ *  footprint (footprint.h). If something turns up across the path it
+ *  has, it plans again.
+ *
+ *  It believes whatever pose the localizer gives it, unless it has a
+ *  PoseGuard (relocalize.h), which checks the laser against the map every
+ *  tick and, if the pose turns out to be wrong, finds the robot again and
+ *  corrects the poses from then on. Finding itself somewhere new, the
+ *  robot plans again from there.
+ */
+
+#ifndef GOTOGOAL_H
+#define GOTOGOAL_H
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "dwa.h"
+#include "kdtree.h"
+#include "mission.h"
+#include "navfield.h"
+#include "occmap.h"
+#include "planner.h"
+#include "relocalize.h"
+#include "sensorframe.h"
+
+// What goToGoalTick() returns
+#define GOAL_RUNNING  0
+#define GOAL_ARRIVED  1
+#define GOAL_NO_PATH  2
+
+/**
+ * Everything the controller remembers between ticks.
+ *
+ **/
+
+struct GoToGoal
+{
+  Planner*        planner;       // One robot's at a time; may be lent
+  const NavField* navfn;         // Follow this instead of planning, if set
+  PoseGuard*      guard;         // Check the pose against the laser, if set
+  DwaPlanner*     dwa;           // Steer with this, if set
+  LaserScan*      scan;          // The laser, preprocessed, if set
+  OccMap*         mapper;        // Keeps the map up to date, if set
+  const MissionGraph* graph;     // Route on this instead of planning, if set
+  double goal_x, goal_y;
+  bool   quiet;                  // Don't say when we plan
+
+  std::vector<Point2d> path;
+  KdTree waypoints;              // The path again, to search for the nearest
+  int    counter;
+  int    started, arrived, bumped;
+  int    finding_angle, traveling;
+  int    curr_coord, next_coord;
+  double leg_x, leg_y;           // Where the leg to next_coord starts
+  int    stuck;                  // Ticks the local planner has been boxed in
+  double speed, turnrate;
+  double curr_x, curr_y, curr_a;
+  double targ_x, targ_y, targ_a;
+};
+
+/**
+ * setGoal()
+ *
+ * Head for somewhere else from wherever we are, forgetting the old path.
+ * The robot carries on with what it was doing until the next tick.
+ *
+ **/
+
+inline void setGoal(GoToGoal& g, double goal_x, double goal_y)
+{
+  g.goal_x  = goal_x;
+  g.goal_y  = goal_y;
+  g.path.clear();
+  g.waypoints.pts.clear();
+  g.waypoints.ids.clear();
+  g.counter = 0;
+  g.started = 1;
+  g.arrived = g.bumped = 0;
+  g.finding_angle = g.traveling = 0;
+  g.curr_coord = g.next_coord = 0;
+  g.leg_x = g.leg_y = 0;
+  g.stuck = 0;
+} // End of setGoal()
+
+/**
+ * initGoToGoal()
+ *
+ **/
+
+inline void initGoToGoal(GoToGoal& g, Planner& planner, const NavField* navfn,
+                         double goal_x, double goal_y)
+{
+  g.planner = &planner;
+  g.navfn   = navfn;
+  g.guard   = NULL;
+  g.dwa     = NULL;
+  g.scan    = NULL;
+  g.mapper  = NULL;
+  g.graph   = NULL;
+  g.quiet   = false;
+  g.speed = g.turnrate = 0;
+  g.curr_x = g.curr_y = g.curr_a = 0;
+  g.targ_x = g.targ_y = g.targ_a = 0;
+  setGoal(g, goal_x, goal_y);
+} // End of initGoToGoal()
+
+/**
+ * rejoinPath()
+ *
+ * The closest waypoint, from number "from" on, that we can drive straight
+ * to from (x, y) without going through a wall. -1 if there isn't one.
+ *
+ **/
+
+inline int rejoinPath(const Planner& planner, const KdTree& waypoints,
+                      const std::vector<Point2d>& path, int from,
+                      double x, double y)
+{
+  const CostMap& cm = planner.costmap;
+  // Having just backed off a wall we are probably inside its inflated
+  // zone, so look from the nearest cell we could be in, as planPath() does.
+  int start = nearestFreeCell(cm, (int)floor((x - cm.origin_x) / cm.scale),
+                              (int)floor((y - cm.origin_y) / cm.scale));
+  int cx = start % cm.width, cy = start / cm.width;
+
+  if (from < 0 || start < 0 || waypoints.pts.size() != path.size())
+    return -1;
+  return kdNearestWhere(waypoints, x, y, [&](int id) {
+      if (id < from) return false;
+      int px = (int)floor((path[id].x - cm.origin_x) / cm.scale);
+      int py = (int)floor((path[id].y - cm.origin_y) / cm.scale);
+      return lineClear(cm, cx, cy, px, py, COST_LETHAL - 1);
+    });
+} // End of rejoinPath()
+
+/**
+ * routeOnGraph()
+ *
+ * The way from (x, y) to the goal along the roads of the graph: the
+ * closest node we can drive straight to, the nodes on from there to the
+ * closest one to the goal that it can be driven straight to from, then
+ * the goal. (A graph made from the map by roadmap.h has roads inside
+ * walls too, which there is no way to from anywhere else.) False if there
+ * is no way.
+ *
+ **/
+
+inline bool routeOnGraph(const Planner& planner, const MissionGraph& graph,
+                         double x, double y, double goal_x, double goal_y,
+                         std::vector<Point2d>& path)
+{
+  const CostMap& cm = planner.costmap;
+  // Whether node i can be driven to straight from cell c, if there is one
+  auto inSight = [&](int c, int i) {
+    if (c < 0) return true;
+    int nx = (int)floor((graph.nodes[i].x - cm.origin_x) / cm.scale);
+    int ny = (int)floor((graph.nodes[i].y - cm.origin_y) / cm.scale);
+    return lineClear(cm, c % cm.width, c / cm.width, nx, ny, COST_LETHAL - 1);
+  };
+  int start = nearestFreeCell(cm, (int)floor((x - cm.origin_x) / cm.scale),
+                              (int)floor((y - cm.origin_y) / cm.scale));
+  int end = nearestFreeCell(cm, (int)floor((goal_x - cm.origin_x) / cm.scale),
+                            (int)floor((goal_y - cm.origin_y) / cm.scale));
+  int from = nearestNodeWhere(graph, x, y, [&](int i) {
+      return inSight(start, i);
+    });
+  int to = from < 0 ? -1 : nearestNodeWhere(graph, goal_x, goal_y, [&](int i) {
+      return routeCost(graph, from, i) < GRAPH_UNREACHABLE && inSight(end, i);
+    });
+
+  if (!findRoute(graph, from, to, path)) return false;
+  Point2d goal = { goal_x, goal_y };
+  if (path.back().x != goal.x || path.back().y != goal.y)
+    path.push_back(goal);
+  return true;
+} // End of routeOnGraph()
+
+/**
+ * pathBlocked()
+ *
+ * Whether the rest of the path, from waypoint "next" on, now goes through
+ * a wall. The way to the next waypoint is from the nearest cell to (x, y)
+ * we could be in, as rejoinPath() does.
+ *
+ **/
+
+inline bool pathBlocked(const CostMap& cm, const std::vector<Point2d>& path,
+                        int next, double x, double y)
+{
+  if (next < 0 || next >= (int)path.size()) return false;
+  int start = nearestFreeCell(cm, (int)floor((x - cm.origin_x) / cm.scale),
+                              (int)floor((y - cm.origin_y) / cm.scale));
+  if (start < 0) return false;
+  int ax = start % cm.width, ay = start / cm.width;
+  for (int i = next; i < (int)path.size(); i++) {
+    int bx = (int)floor((path[i].x - cm.origin_x) / cm.scale);
+    int by = (int)floor((path[i].y - cm.origin_y) / cm.scale);
+    if (!lineClear(cm, ax, ay, bx, by, COST_LETHAL - 1)) return true;
+    ax = bx;
+    ay = by;
+  }
+  return false;
+} // End of pathBlocked()
+
+/**
+ * readPosition()
+ *
+ * Read the position of the robot from the localization proxy.
+ *
+ * The localization proxy gives us a hypothesis, and from that we extract
+ * the mean, which is a pose. Until there is one, we stay where we were.
+ *
+ **/
+
+inline player_pose2d_t readPosition(const SensorFrame& frame,
+                                    player_pose2d_t pose)
+{
+  // Need some messing around to avoid a crash when the proxy is
+  // starting up.
+  if (frame.hyp_count > 0) pose = frame.hyps[0].mean;
+  return pose;
+} // End of readPosition()
+
+/**
+ * legPassed()
+ *
+ * Whether (x, y) has got to within "within" metres of the end of the leg
+ * from (ax, ay) to (bx, by), measured along it.
+ *
+ **/
+
+inline bool legPassed(double ax, double ay, double bx, double by,
+                      double x, double y, double within)
+{
+  double dx = bx - ax, dy = by - ay;
+  double len = sqrt(dx * dx + dy * dy);
+  if (len < 1e-6) return true;
+  return ((x - ax) * dx + (y - ay) * dy) / len > len - within;
+} // End of legPassed()
+
+/**
+ * pathCarrot()
+ *
+ * The point "ahead" metres on along the path from (x, y), for the local
+ * planner to steer for: from the closest point on the leg from (ax, ay)
+ * to waypoint "next", on round the corners of the legs after it if need
+ * be, and stopping at the end. Steering for this, the robot follows the
+ * path rather than cutting across to the waypoint.
+ *
+ **/
+
+inline void pathCarrot(const std::vector<Point2d>& path, int next,
+                       double ax, double ay, double x, double y,
+                       double ahead, double* tx, double* ty)
+{
+  bool first = true;
+  *tx = ax;
+  *ty = ay;
+  for (int i = next; i < (int)path.size(); i++) {
+    double dx = path[i].x - ax, dy = path[i].y - ay;
+    double len = sqrt(dx * dx + dy * dy);
+    double along = 0;
+    if (first && len > 1e-6) {
+      along = ((x - ax) * dx + (y - ay) * dy) / len;
+      if (along < 0) along = 0;
+    }
+    first = false;
+    if (len > 1e-6 && along + ahead < len) {
+      *tx = ax + dx * (along + ahead) / len;
+      *ty = ay + dy * (along + ahead) / len;
+      return;
+    }
+    ahead -= len - along;
+    ax = *tx = path[i].x;
+    ay = *ty = path[i].y;
+  }
+} // End of pathCarrot()
+
+/**
+ * goToGoalTick()
+ *
+ * One time round the control loop. Sets g.speed and g.turnrate, and
+ * returns GOAL_RUNNING until we get there (GOAL_ARRIVED) or find there is
+ * no way there (GOAL_NO_PATH).
+ *
+ **/
+
+inline int goToGoalTick(GoToGoal& g, const SensorFrame& frame)
+{
+  player_pose2d_t pose = { g.curr_x, g.curr_y, g.curr_a };
+  bool bump = frame.bumper[0] || frame.bumper[1] || frame.stall;
+  double angle_away, dist_away, dx, dy;
+  int rejoin;
+
+  pose = readPosition(frame, pose);
+  if (g.scan != NULL) processScan(*g.scan, frame);
+  if (g.guard != NULL && frame.ranges_count > 0) {
+    Pose2d p = { pose.px, pose.py, pose.pa };
+    if (guardPose(*g.guard, frame, p) == GUARD_FOUND) {
+      if (!g.quiet) {
+        std::cout << "Lost! Found again at (" << g.guard->found.px << ", "
+                  << g.guard->found.py << ") in "
+                  << g.guard->global.seconds * 1000 << "ms" << std::endl;
+      }
+      // Wherever we were going, we need to go from here instead
+      g.bumped = g.finding_angle = g.traveling = g.arrived = 0;
+      g.started = 1;
+      g.next_coord = -1;
+    }
+    p = correctPose(*g.guard, p);
+    pose.px = p.px;
+    pose.py = p.py;
+    pose.pa = p.pa;
+  }
+  g.curr_x = pose.px;
+  g.curr_y = pose.py;
+  g.curr_a = pose.pa;
+  if (g.mapper != NULL) {
+    Pose2d p = { pose.px, pose.py, pose.pa };
+    if (mapScan(*g.mapper, frame, p) > 0 && g.mapper->field != NULL) {
+      CostMap& cm = g.planner->costmap;
+      for (size_t k = 0; k < g.mapper->dirty.size(); k++) {
+        OccRegion r = dirtyReach(*g.mapper, k);
+        updateCostMap(cm, *g.mapper->field, r.x0, r.y0, r.x1, r.y1);
+        if (g.dwa != NULL && g.dwa->walls != NULL) {
+          const OccRegion& d = g.mapper->dirty[k];
+          updateBitGrid(*g.dwa->walls, *g.mapper->map, d.x0, d.y0, d.x1,
+                        d.y1);
+        }
+      }
+      if (g.navfn == NULL && !g.started && !g.bumped
+          && pathBlocked(cm, g.path, g.next_coord, g.curr_x, g.curr_y)) {
+        if (!g.quiet) std::cout << "Something in the way" << std::endl;
+        g.finding_angle = g.traveling = g.arrived = 0;
+        g.started = 1;
+        g.next_coord = -1;     // Don't pick the old path up again
+      }
+    }
+  }
+  if (g.next_coord >= 0 && g.next_coord < (int)g.path.size()) {
+    g.targ_x = g.path[g.next_coord].x;
+    g.targ_y = g.path[g.next_coord].y;
+  }
+  // Following the navigation function, the target is always just down
+  // the hill from wherever we are, unless there's no way down from here.
+  if (g.navfn != NULL && !g.started
+      && !navCarrot(*g.navfn, g.curr_x, g.curr_y, 1.0, &g.targ_x,
+                    &g.targ_y)) {
+    if (!g.quiet) {
+      std::cout << "No way to (" << g.goal_x << ", " << g.goal_y
+                << ") from here" << std::endl;
+    }
+    g.speed = g.turnrate = 0;
+    return GOAL_NO_PATH;
+  }
+  g.targ_a = atan2(g.targ_y - g.curr_y, g.targ_x - g.curr_x);
+  angle_away = (g.targ_a - g.curr_a) * 180 / M_PI;
+
+  if (g.bumped) {
+    if (g.counter > 15) {
+      g.counter = 0;
+      g.bumped = 0;
+      g.speed = 0;
+    } else {
+      g.speed = -0.5;
+    }
+    g.counter++;
+  } else if (g.finding_angle) {
+    if (fabs(angle_away) < 1) {
+      g.turnrate = 0;
+      g.speed = 1.0;
+      g.finding_angle = 0;
+      g.traveling = 1;
+    } else {
+      // A tick at 0.4 turns further than the 2 degrees we're aiming
+      // for, so close to it slow down, or we swing from side to side
+      double rate = fabs(angle_away) < 5 ? 0.1 : 0.4;
+      if (angle_away < 0) g.turnrate = -rate;
+      else g.turnrate = rate;
+      g.speed = 0;
+    }
+  } else if (g.traveling && bump) {
+    // Hit something on the way: back off, then find the path again
+    g.bumped = 1;
+    g.traveling = 0;
+    g.started = 1;
+    g.speed = 0;
+    g.turnrate = 0;
+    g.counter = 0;
+  } else if (g.traveling) {
+    dx = g.curr_x - g.targ_x;
+    dy = g.curr_y - g.targ_y;
+    dist_away = sqrt(dx * dx + dy * dy);
+    if (g.dwa != NULL) {
+      // Pass through the waypoints on the way, rather than stopping. The
+      // robot cuts the corners, so a waypoint is passed once we are level
+      // with it, along the leg, as well as when we get close.
+      while (g.navfn == NULL && g.next_coord + 1 < (int)g.path.size()
+             && (dist_away < 0.5
+                 || legPassed(g.leg_x, g.leg_y, g.targ_x, g.targ_y,
+                              g.curr_x, g.curr_y, 0.5))) {
+        g.leg_x = g.targ_x;
+        g.leg_y = g.targ_y;
+        g.curr_coord = g.next_coord++;
+        g.targ_x = g.path[g.next_coord].x;
+        g.targ_y = g.path[g.next_coord].y;
+        dx = g.curr_x - g.targ_x;
+        dy = g.curr_y - g.targ_y;
+        dist_away = sqrt(dx * dx + dy * dy);
+      }
+      Pose2d p = { g.curr_x, g.curr_y, g.curr_a };
+      double cx = g.targ_x, cy = g.targ_y;
+      if (g.navfn == NULL) {
+        // Not so far round a corner that it would steer through the wall
+        const CostMap& cm = g.planner->costmap;
+        int start = nearestFreeCell(cm, (int)floor((g.curr_x - cm.origin_x)
+                                                   / cm.scale),
+                                    (int)floor((g.curr_y - cm.origin_y)
+                                               / cm.scale));
+        for (double ahead = 2.0; ahead > 0.2; ahead /= 2) {
+          pathCarrot(g.path, g.next_coord, g.leg_x, g.leg_y, g.curr_x,
+                     g.curr_y, ahead, &cx, &cy);
+          if (start < 0
+              || lineClear(cm, start % cm.width, start / cm.width,
+                           (int)floor((cx - cm.origin_x) / cm.scale),
+                           (int)floor((cy - cm.origin_y) / cm.scale),
+                           COST_LETHAL - 1)) break;
+        }
+      }
+      if (dwaStep(*g.dwa, frame, p, cx, cy, &g.speed, &g.turnrate,
+                  g.scan)) {
+        g.stuck = 0;
+      } else if (++g.stuck > 10) {
+        // Boxed in: find the path again from here
+        g.stuck = 0;
+        g.traveling = 0;
+        g.started = 1;
+        g.speed = g.turnrate = 0;
+      }
+    } else {
+      g.speed = 1.0;
+      if (angle_away < 0) g.turnrate = -0.4;
+      else g.turnrate = 0.4;
+    }
+    if (dist_away < 0.5) {
+      g.started = 1;
+      g.speed = 0.0;
+      g.traveling = 0;
+      g.arrived = 1;
+    }
+  } else if (g.arrived) {
+    g.speed = 0.0;
+    g.turnrate = 0.0;
+    g.curr_coord = g.next_coord;
+    g.next_coord = g.curr_coord + 1 < (int)g.path.size()
+                 ? g.curr_coord + 1 : -1;
+    if (g.next_coord == -1) return GOAL_ARRIVED;
+    g.leg_x = g.targ_x;
+    g.leg_y = g.targ_y;
+    // The local planner turns as it goes
+    g.finding_angle = g.dwa == NULL;
+    g.traveling = g.dwa != NULL;
+    g.arrived = 0;
+  } else if (bump || g.started) {
+    if (bump) g.bumped = 1;
+    // Work out how to get to the goal from where we are now. The
+    // navigation function already knows, so all it needs is the goal.
+    // Otherwise, if we can see a waypoint still to come on the path we
+    // had, carry on from there.
+    rejoin = -1;
+    if (g.navfn != NULL) {
+      double tx, ty;
+      if (!navCarrot(*g.navfn, g.curr_x, g.curr_y, 1.0, &tx, &ty)) {
+        if (!g.quiet) {
+          std::cout << "No way to (" << g.goal_x << ", " << g.goal_y
+                    << ") from here" << std::endl;
+        }
+        return GOAL_NO_PATH;
+      }
+      g.path.clear();
+    } else if (g.graph != NULL) {
+      rejoin = rejoinPath(*g.planner, g.waypoints, g.path, g.next_coord,
+                          g.curr_x, g.curr_y);
+      if (rejoin < 0 && !routeOnGraph(*g.planner, *g.graph, g.curr_x,
+                                      g.curr_y, g.goal_x, g.goal_y, g.path)) {
+        if (!g.quiet) {
+          std::cout << "No road to (" << g.goal_x << ", " << g.goal_y
+                    << ") from here" << std::endl;
+        }
+        return GOAL_NO_PATH;
+      }
+    } else {
+      rejoin = rejoinPath(*g.planner, g.waypoints, g.path, g.next_coord,
+                          g.curr_x, g.curr_y);
+      if (rejoin < 0 && !planPath(*g.planner, g.curr_x, g.curr_y,
+                                  g.goal_x, g.goal_y, g.path)) {
+        if (!g.quiet) {
+          std::cout << "No way to (" << g.goal_x << ", " << g.goal_y
+                    << ") from here" << std::endl;
+        }
+        return GOAL_NO_PATH;
+      }
+    }
+    if (g.path.empty()) {
+      Point2d goal = { g.goal_x, g.goal_y };
+      g.path.push_back(goal);
+    }
+    if (!g.quiet && rejoin >= 0) {
+      std::cout << "Back on the path at leg " << rejoin << std::endl;
+    } else if (!g.quiet && g.graph != NULL) {
+      std::cout << "Routed " << g.path.size() << " legs on the graph"
+                << std::endl;
+    } else if (!g.quiet && g.navfn == NULL) {
+      std::cout << "Planned " << g.path.size() << " legs, expanding "
+                << g.planner->expanded << " cells" << std::endl;
+    }
+    if (rejoin < 0) buildKdTree(g.waypoints, g.path);
+    g.next_coord = rejoin >= 0 ? rejoin : 0;
+    g.leg_x = g.curr_x;
+    g.leg_y = g.curr_y;
+    g.finding_angle = g.dwa == NULL;
+    g.traveling = g.dwa != NULL;
+    g.turnrate = 0;
+    g.speed = 0;
+    g.started = 0;
+  } else {
+    g.speed = -0.5;
+    g.turnrate = 0.0;
+  }
+
+  // Count how many times we do this
+  g.counter++;
+  return GOAL_RUNNING;
+} // End of goToGoalTick()
+
+#endif
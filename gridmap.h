@@ -0,0 +1,215 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Occupancy grid
+ *
+ ** Description ***************************************************************
+ *
+ *  Loads one of the map bitmaps in bitmaps/ into an occupancy grid, using
+ *  the same conventions Stage uses when it loads the "map" model in
+ *  world4.world: the image is stretched over the "size" given in the world
+ *  file and centred on the origin, dark pixels are obstacles, and since
+ *  map.inc sets "boundary 1" the edge of the map is treated as a wall.
+ *
+ *  Cell (0,0) is the bottom left corner of the map, so y grows upwards like
+ *  it does in the simulator (the bitmap itself is stored top row first).
+ */
+
+#ifndef GRIDMAP_H
+#define GRIDMAP_H
+
+#include <png.h>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+/**
+ * A pose in the world, in metres and radians. Laid out like Player's
+ * player_pose2d_t so the two convert field by field.
+ *
+ **/
+
+struct Pose2d
+{
+  double px, py, pa;
+};
+
+/**
+ * A point in the world, in metres, such as a waypoint on a path.
+ *
+ **/
+
+struct Point2d
+{
+  double x, y;
+};
+
+/**
+ * The grid itself. Cells are square, "scale" metres on a side.
+ *
+ **/
+
+struct GridMap
+{
+  int    width, height;          // Size in cells
+  double scale;                  // Metres per cell
+  double origin_x, origin_y;     // World position of the corner of cell (0,0)
+  std::vector<unsigned char> cells;  // 1 if occupied, row major from the bottom
+};
+
+/**
+ * normalizeAngle()
+ *
+ * Wrap an angle into [-pi, pi].
+ *
+ **/
+
+inline double normalizeAngle(double a)
+{
+  return atan2(sin(a), cos(a));
+} // End of normalizeAngle()
+
+/**
+ * cellOccupied()
+ *
+ * Anything off the edge of the map counts as an obstacle.
+ *
+ **/
+
+inline bool cellOccupied(const GridMap& map, int cx, int cy)
+{
+  if (cx < 0 || cy < 0 || cx >= map.width || cy >= map.height) return true;
+  return map.cells[cy * map.width + cx] != 0;
+} // End of cellOccupied()
+
+inline int worldToCellX(const GridMap& map, double x)
+{
+  return (int)floor((x - map.origin_x) / map.scale);
+}
+
+inline int worldToCellY(const GridMap& map, double y)
+{
+  return (int)floor((y - map.origin_y) / map.scale);
+}
+
+inline double cellToWorldX(const GridMap& map, int cx)
+{
+  return map.origin_x + (cx + 0.5) * map.scale;
+}
+
+inline double cellToWorldY(const GridMap& map, int cy)
+{
+  return map.origin_y + (cy + 0.5) * map.scale;
+}
+
+inline bool pointOccupied(const GridMap& map, double x, double y)
+{
+  return cellOccupied(map, worldToCellX(map, x), worldToCellY(map, y));
+}
+
+/**
+ * loadGridMap()
+ *
+ * Read a bitmap and stretch it over size_x metres, centred on the origin
+ * (this is what "size [16 16]" does in world4.world). Cells are kept
+ * square, so size_y only matters if it disagrees with the image, in which
+ * case we warn and go with the width.
+ *
+ * Returns false, after printing why, if the file can't be read.
+ *
+ **/
+
+inline bool loadGridMap(GridMap& map, const char* path,
+                        double size_x, double size_y)
+{
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    std::cerr << "Can't open map bitmap " << path << std::endl;
+    return false;
+  }
+
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                           NULL, NULL, NULL);
+  png_infop   info = png_create_info_struct(png);
+  std::vector<unsigned char> pixels;
+  std::vector<png_bytep>     rows;
+
+  if (setjmp(png_jmpbuf(png))) {
+    std::cerr << "Can't decode map bitmap " << path << std::endl;
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+    return false;
+  }
+
+  png_init_io(png, fp);
+  png_read_info(png, info);
+
+  // Whatever the bitmap is stored as, ask libpng for 8 bit grey.
+  int color_type = png_get_color_type(png, info);
+  if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+  if (color_type == PNG_COLOR_TYPE_GRAY && png_get_bit_depth(png, info) < 8)
+    png_set_expand_gray_1_2_4_to_8(png);
+  if (color_type & PNG_COLOR_MASK_COLOR) png_set_rgb_to_gray(png, 1, -1, -1);
+  if (color_type & PNG_COLOR_MASK_ALPHA) png_set_strip_alpha(png);
+  if (png_get_bit_depth(png, info) == 16) png_set_strip_16(png);
+  png_read_update_info(png, info);
+
+  int w = png_get_image_width(png, info);
+  int h = png_get_image_height(png, info);
+  int stride = png_get_rowbytes(png, info);
+  pixels.resize((size_t)stride * h);
+  rows.resize(h);
+  for (int r = 0; r < h; r++) rows[r] = &pixels[(size_t)r * stride];
+  png_read_image(png, &rows[0]);
+  png_destroy_read_struct(&png, &info, NULL);
+  fclose(fp);
+
+  map.width    = w;
+  map.height   = h;
+  map.scale    = size_x / w;
+  map.origin_x = -size_x / 2;
+  map.origin_y = -map.scale * h / 2;
+  if (fabs(map.scale * h - size_y) > map.scale) {
+    std::cerr << "Warning: " << path << " is " << w << "x" << h
+              << ", which doesn't match a " << size_x << "x" << size_y
+              << " map; using square cells" << std::endl;
+  }
+
+  // Flip so that row 0 is the bottom of the map, and draw the boundary.
+  map.cells.assign((size_t)w * h, 0);
+  for (int cy = 0; cy < h; cy++) {
+    const unsigned char* src = rows[h - 1 - cy];
+    for (int cx = 0; cx < w; cx++) {
+      bool edge = (cx == 0 || cy == 0 || cx == w - 1 || cy == h - 1);
+      map.cells[cy * w + cx] = (edge || src[cx] < 128) ? 1 : 0;
+    }
+  }
+
+  return true;
+} // End of loadGridMap()
+
+/**
+ * castRay()
+ *
+ * How far a beam fired from (x, y) along angle a travels before it hits
+ * something, capped at max_range. Steps half a cell at a time, which is
+ * slow but simple.
+ *
+ **/
+
+inline double castRay(const GridMap& map, double x, double y, double a,
+                      double max_range)
+{
+  double step = map.scale / 2;
+  double dx = cos(a) * step;
+  double dy = sin(a) * step;
+
+  for (double r = 0; r < max_range; r += step) {
+    if (pointOccupied(map, x, y)) return r;
+    x += dx;
+    y += dy;
+  }
+  return max_range;
+} // End of castRay()
+
+#endif
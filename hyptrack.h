@@ -0,0 +1,290 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Hypothesis tracking
+ *
+ ** Description ***************************************************************
+ *
+ *  Keeps track of the localizer's hypotheses from one tick to the next.
+ *  Each tick the hypotheses (amcl's, from the frame, or our own filter's)
+ *  are copied once into a fixed array of tracks, and each is matched with
+ *  the track it most likely was last tick: the nearest, measuring distance
+ *  in standard deviations (the Mahalanobis distance) using both their
+ *  covariances, so long as that is close enough to be the same one. Those
+ *  that match keep the track's number and age; the rest are new.
+ *
+ *  From that we know, without going back to the localizer, which are the
+ *  best and second best, the entropy of their weights, and how fast that
+ *  is falling (smoothed, in bits per second). Three things are flagged as
+ *  events, on the tick they happen:
+ *
+ *    converged  the best hypothesis has just got more than 99% of the
+ *               weight
+ *    split      it had, and has just lost it to others
+ *    kidnapped  it had, and the best now is a new one more than a metre
+ *               away: we have been picked up and put down somewhere else,
+ *               or were wrong all along
+ */
+
+#ifndef HYPTRACK_H
+#define HYPTRACK_H
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "mcl.h"
+#include "sensorframe.h"
+
+#define HYPTRACK_MAX  FRAME_MAX_HYPS
+
+// What trackHypotheses() returns, or'd together
+#define HYP_EVENT_CONVERGED  1
+#define HYP_EVENT_SPLIT      2
+#define HYP_EVENT_KIDNAPPED  4
+
+/**
+ * One hypothesis, as we've followed it.
+ *
+ **/
+
+struct TrackedHypoth
+{
+  int    id;                    // Same from tick to tick
+  int    age;                   // Ticks we've followed it for
+  Pose2d mean;
+  double cov[3];                // Variances of x, y and a
+  double alpha;
+};
+
+/**
+ * The tracks, and what we know about them.
+ *
+ **/
+
+struct HypTracker
+{
+  double gate;                  // Squared distance, in sd's, to match
+  double min_sd[3];             // Never less sure than this of x, y, a
+  double converged_alpha;
+  double kidnap_dist;           // Metres
+  double rate_smoothing;        // Weight of the old rate, 0 to 1
+
+  int count;
+  TrackedHypoth tracks[HYPTRACK_MAX];
+  int    best, second;          // Index into tracks, or -1
+  double entropy;               // Of the weights, in bits
+  double rate;                  // How fast entropy is falling, bits/s
+  bool   converged;
+  int    events;                // From the last update
+
+  int    next_id;
+  int    updates;
+  double last_stamp;
+};
+
+/**
+ * initHypTracker()
+ *
+ **/
+
+inline void initHypTracker(HypTracker& tr)
+{
+  tr.gate = 11.34;              // 99% of the chi-squared with 3 dof
+  tr.min_sd[0] = tr.min_sd[1] = 0.1;
+  tr.min_sd[2] = 0.1;
+  tr.converged_alpha = 0.99;
+  tr.kidnap_dist = 1.0;
+  tr.rate_smoothing = 0.8;
+  tr.count = 0;
+  tr.best = tr.second = -1;
+  tr.entropy = 0;
+  tr.rate = 0;
+  tr.converged = false;
+  tr.events = 0;
+  tr.next_id = 0;
+  tr.updates = 0;
+  tr.last_stamp = 0;
+} // End of initHypTracker()
+
+/**
+ * hypothesisEntropy()
+ *
+ * Of weights that sum to one, in bits.
+ *
+ **/
+
+inline double hypothesisEntropy(const double* p, int n)
+{
+  double h = 0;
+  for (int i = 0; i < n; i++)
+    if (p[i] > 1e-12) h -= p[i] * log2(p[i]);
+  return h;
+} // End of hypothesisEntropy()
+
+/**
+ * hypothDistance2()
+ *
+ * Squared Mahalanobis distance between a hypothesis and a track, taking
+ * their variances as independent and adding them.
+ *
+ **/
+
+inline double hypothDistance2(const HypTracker& tr, const MclHypoth& h,
+                              const TrackedHypoth& t)
+{
+  double d[3] = { h.mean.px - t.mean.px, h.mean.py - t.mean.py,
+                  normalizeAngle(h.mean.pa - t.mean.pa) };
+  double d2 = 0;
+  for (int k = 0; k < 3; k++) {
+    double var = h.cov[k] + t.cov[k] + tr.min_sd[k] * tr.min_sd[k];
+    d2 += d[k] * d[k] / var;
+  }
+  return d2;
+} // End of hypothDistance2()
+
+/**
+ * trackHypotheses()
+ *
+ * Update the tracks with this tick's n hypotheses, at time stamp. Only the
+ * heaviest HYPTRACK_MAX are tracked. Returns the events, if any.
+ *
+ **/
+
+inline int trackHypotheses(HypTracker& tr, const MclHypoth* hyps, int n,
+                           double stamp)
+{
+  TrackedHypoth old[HYPTRACK_MAX];
+  int old_count = tr.count;
+  bool matched[HYPTRACK_MAX];
+  bool used[HYPTRACK_MAX];
+  int old_best_id = tr.best >= 0 ? tr.tracks[tr.best].id : -1;
+  Pose2d old_best = { 0, 0, 0 };
+  double old_entropy = tr.entropy;
+  bool was_converged = tr.converged;
+
+  std::copy(tr.tracks, tr.tracks + old_count, old);
+  if (tr.best >= 0) old_best = tr.tracks[tr.best].mean;
+
+  // The heaviest hypotheses. mcl.h sorts them already.
+  std::vector<int> idx(n);
+  for (int i = 0; i < n; i++) idx[i] = i;
+  if (n > HYPTRACK_MAX) {
+    std::partial_sort(idx.begin(), idx.begin() + HYPTRACK_MAX, idx.end(),
+                      [&](int l, int r) {
+                        return hyps[l].alpha > hyps[r].alpha;
+                      });
+    n = HYPTRACK_MAX;
+  }
+  tr.count = n;
+  for (int i = 0; i < n; i++) {
+    const MclHypoth& h = hyps[idx[i]];
+    TrackedHypoth& t = tr.tracks[i];
+    t.id = -1;
+    t.age = 0;
+    t.mean = h.mean;
+    std::copy(h.cov, h.cov + 3, t.cov);
+    t.alpha = h.alpha;
+  }
+
+  // Match closest pairs first, so that one hypothesis moving close to
+  // another doesn't steal its track
+  for (int j = 0; j < old_count; j++) used[j] = false;
+  for (int i = 0; i < n; i++) matched[i] = false;
+  while (true) {
+    double best_d2 = tr.gate;
+    int bi = -1, bj = -1;
+    for (int i = 0; i < n; i++) {
+      if (matched[i]) continue;
+      for (int j = 0; j < old_count; j++) {
+        if (used[j]) continue;
+        double d2 = hypothDistance2(tr, hyps[idx[i]], old[j]);
+        if (d2 < best_d2) {
+          best_d2 = d2;
+          bi = i;
+          bj = j;
+        }
+      }
+    }
+    if (bi < 0) break;
+    matched[bi] = true;
+    used[bj] = true;
+    tr.tracks[bi].id = old[bj].id;
+    tr.tracks[bi].age = old[bj].age + 1;
+  }
+  for (int i = 0; i < n; i++)
+    if (tr.tracks[i].id < 0) tr.tracks[i].id = tr.next_id++;
+
+  // Best, second best, and the entropy of the weights
+  double total = 0, p[HYPTRACK_MAX];
+  tr.best = tr.second = -1;
+  for (int i = 0; i < n; i++) {
+    double a = tr.tracks[i].alpha;
+    total += a;
+    if (tr.best < 0 || a > tr.tracks[tr.best].alpha) {
+      tr.second = tr.best;
+      tr.best = i;
+    } else if (tr.second < 0 || a > tr.tracks[tr.second].alpha) {
+      tr.second = i;
+    }
+  }
+  for (int i = 0; i < n; i++)
+    p[i] = total > 0 ? tr.tracks[i].alpha / total : 0;
+  tr.entropy = hypothesisEntropy(p, n);
+
+  double dt = stamp - tr.last_stamp;
+  if (tr.updates > 0 && dt > 0) {
+    double now = (old_entropy - tr.entropy) / dt;
+    tr.rate = tr.rate_smoothing * tr.rate + (1 - tr.rate_smoothing) * now;
+  }
+  tr.last_stamp = stamp;
+  tr.updates++;
+
+  // What's changed
+  tr.events = 0;
+  tr.converged = tr.best >= 0
+                 && tr.tracks[tr.best].alpha > tr.converged_alpha;
+  if (tr.converged && !was_converged) tr.events |= HYP_EVENT_CONVERGED;
+  if (was_converged && tr.best >= 0) {
+    const TrackedHypoth& b = tr.tracks[tr.best];
+    double dx = b.mean.px - old_best.px, dy = b.mean.py - old_best.py;
+    if (b.id != old_best_id && sqrt(dx * dx + dy * dy) > tr.kidnap_dist) {
+      tr.events |= HYP_EVENT_KIDNAPPED;
+    } else if (!tr.converged && n > 1) {
+      tr.events |= HYP_EVENT_SPLIT;
+    }
+  }
+  return tr.events;
+} // End of trackHypotheses()
+
+/**
+ * bestHypoth()
+ *
+ * The best track, or NULL if there are none.
+ *
+ **/
+
+inline const TrackedHypoth* bestHypoth(const HypTracker& tr)
+{
+  return tr.best >= 0 ? &tr.tracks[tr.best] : NULL;
+} // End of bestHypoth()
+
+/**
+ * printHypotheses()
+ *
+ **/
+
+inline void printHypotheses(const HypTracker& tr)
+{
+  std::cout << "The localizer gives us " << tr.count
+            << " possible locations:" << std::endl;
+  for (int i = 0; i < tr.count; i++) {
+    const TrackedHypoth& t = tr.tracks[i];
+    std::cout << "X: " << t.mean.px << "\t";
+    std::cout << "Y: " << t.mean.py << "\t";
+    std::cout << "A: " << t.mean.pa << "\t";
+    std::cout << "W: " << t.alpha << "\t";
+    std::cout << "#" << t.id << " (" << t.age << " ticks)" << std::endl;
+  }
+} // End of printHypotheses()
+
+#endif
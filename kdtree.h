@@ -0,0 +1,288 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Spatial index
+ *
+ ** Description ***************************************************************
+ *
+ *  A 2d tree over a set of points (waypoints, roadmap nodes, landmarks,
+ *  obstacle points), for finding the nearest one to the robot without
+ *  looking at them all.
+ *
+ *  The tree is stored implicitly: the points are reordered so that each
+ *  subtree is a range [lo, hi) of the array with its splitting point in the
+ *  middle, splitting on x at even depths and y at odd ones. There are no
+ *  node pointers to chase and building it is just a series of
+ *  nth_element() calls.
+ *
+ *  As well as the nearest, k nearest and all-within-a-radius queries there
+ *  is kdNearestWhere(), which visits points in order of distance until one
+ *  passes a test. With a line of sight test that gives the closest point
+ *  the robot can actually drive straight to, which is usually what we
+ *  want, since the nearest waypoint is often on the other side of a wall.
+ */
+
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <vector>
+#include "gridmap.h"
+
+/**
+ * The tree. pts[i] is the point stored at position i, and ids[i] the index
+ * it had in the vector the tree was built from, which is what the queries
+ * return.
+ *
+ **/
+
+struct KdTree
+{
+  std::vector<Point2d> pts;
+  std::vector<int>     ids;
+};
+
+/**
+ * kdBuildRange()
+ *
+ * Put the median of [lo, hi) along this depth's axis in the middle of the
+ * range, then do the same for the two halves.
+ *
+ **/
+
+inline void kdBuildRange(KdTree& tree, std::vector<int>& order, int lo, int hi,
+                         int depth)
+{
+  if (hi - lo <= 1) return;
+  int mid = (lo + hi) / 2;
+  const std::vector<Point2d>& pts = tree.pts;
+
+  if (depth % 2 == 0) {
+    std::nth_element(order.begin() + lo, order.begin() + mid,
+                     order.begin() + hi,
+                     [&pts](int a, int b) { return pts[a].x < pts[b].x; });
+  } else {
+    std::nth_element(order.begin() + lo, order.begin() + mid,
+                     order.begin() + hi,
+                     [&pts](int a, int b) { return pts[a].y < pts[b].y; });
+  }
+  kdBuildRange(tree, order, lo, mid, depth + 1);
+  kdBuildRange(tree, order, mid + 1, hi, depth + 1);
+} // End of kdBuildRange()
+
+/**
+ * buildKdTree()
+ *
+ **/
+
+inline void buildKdTree(KdTree& tree, const std::vector<Point2d>& points)
+{
+  int n = points.size();
+  std::vector<int> order(n);
+  for (int i = 0; i < n; i++) order[i] = i;
+
+  tree.pts = points;
+  kdBuildRange(tree, order, 0, n, 0);
+
+  tree.ids = order;
+  for (int i = 0; i < n; i++) tree.pts[i] = points[order[i]];
+} // End of buildKdTree()
+
+/**
+ * kdNearestRange()
+ *
+ * Look for anything in [lo, hi) closer than best_d2 (a squared distance),
+ * going down the side of each split the query point is on first.
+ *
+ **/
+
+inline void kdNearestRange(const KdTree& tree, double x, double y, int lo,
+                           int hi, int depth, int* best, double* best_d2)
+{
+  if (lo >= hi) return;
+  int mid = (lo + hi) / 2;
+  const Point2d& p = tree.pts[mid];
+  double dx = p.x - x, dy = p.y - y;
+  double d2 = dx * dx + dy * dy;
+
+  if (d2 < *best_d2) {
+    *best_d2 = d2;
+    *best = mid;
+  }
+
+  double off = (depth % 2 == 0) ? x - p.x : y - p.y;
+  int near_lo = off < 0 ? lo : mid + 1, near_hi = off < 0 ? mid : hi;
+  int far_lo  = off < 0 ? mid + 1 : lo, far_hi  = off < 0 ? hi : mid;
+
+  kdNearestRange(tree, x, y, near_lo, near_hi, depth + 1, best, best_d2);
+  if (off * off < *best_d2)
+    kdNearestRange(tree, x, y, far_lo, far_hi, depth + 1, best, best_d2);
+} // End of kdNearestRange()
+
+/**
+ * kdNearest()
+ *
+ * The point closest to (x, y), or -1 if the tree is empty. If dist isn't
+ * NULL it gets how far away it is.
+ *
+ **/
+
+inline int kdNearest(const KdTree& tree, double x, double y,
+                     double* dist = NULL)
+{
+  int best = -1;
+  double best_d2 = 1e300;
+
+  kdNearestRange(tree, x, y, 0, tree.pts.size(), 0, &best, &best_d2);
+  if (best < 0) return -1;
+  if (dist != NULL) *dist = sqrt(best_d2);
+  return tree.ids[best];
+} // End of kdNearest()
+
+/**
+ * kdKNearestRange()
+ *
+ * As kdNearestRange(), keeping the k best in a max-heap of (d2, position).
+ *
+ **/
+
+inline void kdKNearestRange(const KdTree& tree, double x, double y, int lo,
+                            int hi, int depth, size_t k,
+                            std::priority_queue<std::pair<double, int> >& heap)
+{
+  if (lo >= hi) return;
+  int mid = (lo + hi) / 2;
+  const Point2d& p = tree.pts[mid];
+  double dx = p.x - x, dy = p.y - y;
+  double d2 = dx * dx + dy * dy;
+
+  if (heap.size() < k) {
+    heap.push(std::make_pair(d2, mid));
+  } else if (d2 < heap.top().first) {
+    heap.pop();
+    heap.push(std::make_pair(d2, mid));
+  }
+
+  double off = (depth % 2 == 0) ? x - p.x : y - p.y;
+  int near_lo = off < 0 ? lo : mid + 1, near_hi = off < 0 ? mid : hi;
+  int far_lo  = off < 0 ? mid + 1 : lo, far_hi  = off < 0 ? hi : mid;
+
+  kdKNearestRange(tree, x, y, near_lo, near_hi, depth + 1, k, heap);
+  if (heap.size() < k || off * off < heap.top().first)
+    kdKNearestRange(tree, x, y, far_lo, far_hi, depth + 1, k, heap);
+} // End of kdKNearestRange()
+
+/**
+ * kdKNearest()
+ *
+ * The k points closest to (x, y), closest first.
+ *
+ **/
+
+inline void kdKNearest(const KdTree& tree, double x, double y, int k,
+                       std::vector<int>& out)
+{
+  std::priority_queue<std::pair<double, int> > heap;
+
+  out.clear();
+  if (k <= 0) return;
+  kdKNearestRange(tree, x, y, 0, tree.pts.size(), 0, k, heap);
+  out.resize(heap.size());
+  for (int i = heap.size() - 1; i >= 0; i--) {
+    out[i] = tree.ids[heap.top().second];
+    heap.pop();
+  }
+} // End of kdKNearest()
+
+/**
+ * kdRadiusRange()
+ *
+ **/
+
+inline void kdRadiusRange(const KdTree& tree, double x, double y, double r2,
+                          int lo, int hi, int depth, std::vector<int>& out)
+{
+  if (lo >= hi) return;
+  int mid = (lo + hi) / 2;
+  const Point2d& p = tree.pts[mid];
+  double dx = p.x - x, dy = p.y - y;
+
+  if (dx * dx + dy * dy <= r2) out.push_back(tree.ids[mid]);
+
+  double off = (depth % 2 == 0) ? x - p.x : y - p.y;
+  if (off < 0 || off * off <= r2)
+    kdRadiusRange(tree, x, y, r2, lo, mid, depth + 1, out);
+  if (off >= 0 || off * off <= r2)
+    kdRadiusRange(tree, x, y, r2, mid + 1, hi, depth + 1, out);
+} // End of kdRadiusRange()
+
+/**
+ * kdRadius()
+ *
+ * Every point within r of (x, y), in no particular order.
+ *
+ **/
+
+inline void kdRadius(const KdTree& tree, double x, double y, double r,
+                     std::vector<int>& out)
+{
+  out.clear();
+  kdRadiusRange(tree, x, y, r * r, 0, tree.pts.size(), 0, out);
+} // End of kdRadius()
+
+/**
+ * kdNearestWhere()
+ *
+ * The closest point to (x, y) for which accept(id) is true, or -1 if none
+ * is. Points are offered to accept() nearest first, by a best-first walk of
+ * the tree, so an expensive test like line of sight is only done until
+ * one passes. At most max_tests are tried.
+ *
+ **/
+
+template <class Accept>
+int kdNearestWhere(const KdTree& tree, double x, double y, Accept accept,
+                   int max_tests = 64)
+{
+  // Entries are (lower bound on d2, lo, hi, depth); hi == -1 marks a single
+  // point at position lo whose d2 is exact.
+  struct Entry
+  {
+    double d2;
+    int lo, hi, depth;
+    bool operator<(const Entry& o) const { return d2 > o.d2; }
+  };
+  std::priority_queue<Entry> queue;
+  Entry root = { 0, 0, (int)tree.pts.size(), 0 };
+  int tests = 0;
+
+  if (!tree.pts.empty()) queue.push(root);
+  while (!queue.empty() && tests < max_tests) {
+    Entry e = queue.top();
+    queue.pop();
+
+    if (e.hi == -1) {
+      tests++;
+      if (accept(tree.ids[e.lo])) return tree.ids[e.lo];
+      continue;
+    }
+    if (e.lo >= e.hi) continue;
+
+    int mid = (e.lo + e.hi) / 2;
+    const Point2d& p = tree.pts[mid];
+    double dx = p.x - x, dy = p.y - y;
+    Entry point = { dx * dx + dy * dy, mid, -1, 0 };
+    queue.push(point);
+
+    double off = (e.depth % 2 == 0) ? x - p.x : y - p.y;
+    double far = std::max(e.d2, off * off);
+    Entry left  = { off < 0 ? e.d2 : far, e.lo, mid, e.depth + 1 };
+    Entry right = { off < 0 ? far : e.d2, mid + 1, e.hi, e.depth + 1 };
+    queue.push(left);
+    queue.push(right);
+  }
+  return -1;
+} // End of kdNearestWhere()
+
+#endif
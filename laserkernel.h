@@ -0,0 +1,283 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Laser kernels
+ *
+ ** Description ***************************************************************
+ *
+ *  The few things every user of the laser does with a scan, written for a
+ *  laser whose shape is known when the program is compiled: how many
+ *  beams, over how wide a field of view. sick.inc has 361 beams over 180
+ *  degrees, and nothing changes that while the program runs, so there is
+ *  no reason to work the bearings out again, or loop over a count read
+ *  from the frame, every tick.
+ *
+ *    tables     cos() and sin() of each beam's bearing, worked out by the
+ *               compiler (a Taylor series, in constexpr functions) and
+ *               compiled in as arrays of floats.
+ *    sectors    the closest reading in each of S equal sectors of the
+ *               scan. Two sectors are MinRight() and MinLeft(), as
+ *               LaserProxy gives them: the first half is the right.
+ *    cartesian  the ends of the beams, in the robot's frame.
+ *
+ *  Each is a template on the beam count and field of view, so the loops
+ *  run a fixed number of times, which the compiler unrolls and vectorizes
+ *  as it sees fit. findLaserKernels() looks at the beams in a frame and
+ *  gives back the kernels for a laser of that shape, or NULL if there
+ *  aren't any, in which case the caller works things out the old way.
+ */
+
+#ifndef LASERKERNEL_H
+#define LASERKERNEL_H
+
+#include <cmath>
+
+/**
+ * constSin(), constCos()
+ *
+ * For the compiler to work out: Taylor series, enough terms for double
+ * precision anywhere from -pi to pi.
+ *
+ **/
+
+constexpr double sinSeries(double x2, double term, double sum, int k)
+{
+  return k > 41 ? sum
+                : sinSeries(x2, -term * x2 / ((k + 1) * (k + 2)), sum + term,
+                            k + 2);
+}
+
+constexpr double constSin(double x)
+{
+  return sinSeries(x * x, x, 0, 1);
+}
+
+constexpr double constCos(double x)
+{
+  return sinSeries(x * x, 1, 0, 0);
+}
+
+/**
+ * beamBearing()
+ *
+ * Bearing of beam i of n, over fov degrees centred on straight ahead.
+ *
+ **/
+
+constexpr double beamBearing(int n, int fov, int i)
+{
+  return (-fov / 2.0 + fov * (double)i / (n - 1)) * M_PI / 180;
+}
+
+/**
+ * The numbers 0 to N - 1, as a template parameter pack, for filling in
+ * the tables.
+ *
+ **/
+
+template <int... I> struct BeamIndices {};
+template <int N, int... I> struct MakeBeams : MakeBeams<N - 1, N - 1, I...> {};
+template <int... I> struct MakeBeams<0, I...>
+{
+  typedef BeamIndices<I...> type;
+};
+
+/**
+ * cos() and sin() of each bearing, for a laser of N beams over FOV
+ * degrees.
+ *
+ **/
+
+template <int N, int FOV, class I = typename MakeBeams<N>::type>
+struct BearingTable;
+
+template <int N, int FOV, int... I>
+struct BearingTable<N, FOV, BeamIndices<I...> >
+{
+  static constexpr float cos_b[N] = {
+    (float)constCos(beamBearing(N, FOV, I))... };
+  static constexpr float sin_b[N] = {
+    (float)constSin(beamBearing(N, FOV, I))... };
+};
+
+template <int N, int FOV, int... I>
+constexpr float BearingTable<N, FOV, BeamIndices<I...> >::cos_b[N];
+template <int N, int FOV, int... I>
+constexpr float BearingTable<N, FOV, BeamIndices<I...> >::sin_b[N];
+
+/**
+ * laserSectors()
+ *
+ * The closest reading in each of S sectors of the N beams, right to left,
+ * starting from max_range. With N not a multiple of S, the last sector
+ * takes what's left over, as MinLeft() does with the middle beam.
+ *
+ * Without -ffast-math the compiler won't reorder a running minimum of
+ * doubles to vectorize it, so there are four of them, every fourth beam
+ * each, which it can keep going side by side.
+ *
+ **/
+
+template <int N, int S>
+inline void laserSectors(const double* r, double max_range, double* mins)
+{
+  for (int s = 0; s < S; s++) {
+    const int from = s * (N / S), to = s + 1 < S ? (s + 1) * (N / S) : N;
+    double m[4] = { max_range, max_range, max_range, max_range };
+    int i = from;
+    for (; i + 4 <= to; i += 4)
+      for (int k = 0; k < 4; k++) m[k] = r[i + k] < m[k] ? r[i + k] : m[k];
+    for (; i < to; i++) m[0] = r[i] < m[0] ? r[i] : m[0];
+    m[0] = m[1] < m[0] ? m[1] : m[0];
+    m[2] = m[3] < m[2] ? m[3] : m[2];
+    mins[s] = m[2] < m[0] ? m[2] : m[0];
+  }
+} // End of laserSectors()
+
+/**
+ * laserSides()
+ *
+ * MinRight() and MinLeft(): two sectors.
+ *
+ **/
+
+template <int N>
+inline void laserSides(const double* r, double max_range, double* min_left,
+                       double* min_right)
+{
+  double mins[2];
+  laserSectors<N, 2>(r, max_range, mins);
+  *min_right = mins[0];
+  *min_left = mins[1];
+} // End of laserSides()
+
+/**
+ * laserCartesian()
+ *
+ * Where each of the N beams ends, in the robot's frame.
+ *
+ **/
+
+template <int N, int FOV>
+inline void laserCartesian(const double* r, float* x, float* y)
+{
+  const float* c = BearingTable<N, FOV>::cos_b;
+  const float* s = BearingTable<N, FOV>::sin_b;
+  for (int i = 0; i < N; i++) {
+    x[i] = (float)r[i] * c[i];
+    y[i] = (float)r[i] * s[i];
+  }
+} // End of laserCartesian()
+
+/**
+ * The kernels for one shape of laser.
+ *
+ **/
+
+struct LaserKernels
+{
+  int count, fov;               // Beams, and degrees
+  const float* cos_b;
+  const float* sin_b;
+  void (*sides)(const double* r, double max_range, double* min_left,
+                double* min_right);
+  void (*cartesian)(const double* r, float* x, float* y);
+};
+
+/**
+ * laserKernelsFor()
+ *
+ **/
+
+template <int N, int FOV>
+inline const LaserKernels* laserKernelsFor()
+{
+  static const LaserKernels k = {
+    N, FOV, BearingTable<N, FOV>::cos_b, BearingTable<N, FOV>::sin_b,
+    laserSides<N>, laserCartesian<N, FOV>
+  };
+  return &k;
+} // End of laserKernelsFor()
+
+/**
+ * laserIs()
+ *
+ * Whether n bearings are those of a laser of N beams over FOV degrees:
+ * the count, and the first, middle and last bearings, to within a
+ * hundredth of a degree.
+ *
+ **/
+
+template <int N, int FOV>
+inline bool laserIs(const double* bearings, int n)
+{
+  const double tol = 0.01 * M_PI / 180;
+  return n == N
+    && fabs(bearings[0] - beamBearing(N, FOV, 0)) < tol
+    && fabs(bearings[N / 2] - beamBearing(N, FOV, N / 2)) < tol
+    && fabs(bearings[N - 1] - beamBearing(N, FOV, N - 1)) < tol;
+} // End of laserIs()
+
+/**
+ * findLaserKernels()
+ *
+ * The kernels for the laser the bearings came from, or NULL if we
+ * haven't got any for it. The SICK LMS200 in sick.inc gives 361 beams
+ * over 180 degrees, or 181 at one degree apart.
+ *
+ **/
+
+inline const LaserKernels* findLaserKernels(const double* bearings, int n)
+{
+  if (laserIs<361, 180>(bearings, n)) return laserKernelsFor<361, 180>();
+  if (laserIs<181, 180>(bearings, n)) return laserKernelsFor<181, 180>();
+  return NULL;
+} // End of findLaserKernels()
+
+/**
+ * beamSides()
+ *
+ * MinLeft() and MinRight() of n readings, with the kernel for the laser
+ * they came from if there is one.
+ *
+ **/
+
+inline void beamSides(const double* ranges, const double* bearings, int n,
+                      double max_range, double* min_left, double* min_right)
+{
+  const LaserKernels* lk = findLaserKernels(bearings, n);
+  if (lk != NULL) {
+    lk->sides(ranges, max_range, min_left, min_right);
+    return;
+  }
+  *min_left = *min_right = max_range;
+  for (int i = 0; i < n; i++) {
+    if (i < n / 2) {
+      if (ranges[i] < *min_right) *min_right = ranges[i];
+    } else if (ranges[i] < *min_left) {
+      *min_left = ranges[i];
+    }
+  }
+} // End of beamSides()
+
+/**
+ * beamEnds()
+ *
+ * Where each of n beams ends, in the robot's frame, the same way.
+ *
+ **/
+
+inline void beamEnds(const double* ranges, const double* bearings, int n,
+                     float* x, float* y)
+{
+  const LaserKernels* lk = findLaserKernels(bearings, n);
+  if (lk != NULL) {
+    lk->cartesian(ranges, x, y);
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    x[i] = ranges[i] * cos(bearings[i]);
+    y[i] = ranges[i] * sin(bearings[i]);
+  }
+} // End of beamEnds()
+
+#endif
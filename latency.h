@@ -0,0 +1,382 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Latency histograms
+ *
+ ** Description ***************************************************************
+ *
+ *  Where the time in a control tick goes. Each stage of the loop (reading
+ *  the robot, localizing, deciding, logging...) has a histogram of how long
+ *  it took, in nanoseconds, filled in by putting a ScopedTimer at the top
+ *  of the block that does it, with the number addStage() gave the stage:
+ *
+ *    {
+ *      ScopedTimer timer(profile, t_read);
+ *      fresh = clientRead(client, frame);
+ *    }
+ *
+ *  The histograms are laid out as in HdrHistogram: values below 64 get a
+ *  bucket each, and above that every power of two is split into 32 equal
+ *  buckets, so any value is known to within about 3% however big it is,
+ *  and recording one is a few shifts and an increment. 2^40ns (about 18
+ *  minutes) is as big as they go.
+ *
+ *  A profile can be printed, saved as CSV (one line per stage, times in
+ *  nanoseconds), and compared with one saved earlier to catch a stage that
+ *  has got slower. loop-bench does that for the controllers in the
+ *  simulator.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define LATENCY_SUB_BITS    5     // 32 buckets per power of two
+#define LATENCY_SUB         (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS    40    // Longest time we can record, 2^40ns
+#define LATENCY_BUCKETS     ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) \
+                             * LATENCY_SUB)
+#define PROFILE_MAX_STAGES  32
+
+/**
+ * A histogram of times.
+ *
+ **/
+
+struct LatencyHistogram
+{
+  std::vector<uint64_t> counts;
+  uint64_t count;
+  uint64_t min, max;
+  double   sum;
+};
+
+/**
+ * One histogram per stage of the loop.
+ *
+ **/
+
+struct LoopProfile
+{
+  int stages;
+  std::string      name[PROFILE_MAX_STAGES];
+  LatencyHistogram hist[PROFILE_MAX_STAGES];
+};
+
+/**
+ * Summary of one stage, as saved and read back.
+ *
+ **/
+
+struct StageSummary
+{
+  std::string name;
+  uint64_t count;
+  double   mean;
+  uint64_t p50, p90, p99, p999, max;
+};
+
+/**
+ * latencyNow()
+ *
+ * Nanoseconds on a clock that doesn't jump.
+ *
+ **/
+
+inline uint64_t latencyNow()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+} // End of latencyNow()
+
+/**
+ * clearHistogram()
+ *
+ **/
+
+inline void clearHistogram(LatencyHistogram& h)
+{
+  h.counts.assign(LATENCY_BUCKETS, 0);
+  h.count = 0;
+  h.min = UINT64_MAX;
+  h.max = 0;
+  h.sum = 0;
+} // End of clearHistogram()
+
+/**
+ * latencyBucket()
+ *
+ * Which bucket v goes in. Below LATENCY_SUB it's v itself; above, v is
+ * shifted down until it fits in LATENCY_SUB_BITS + 1 bits, and the shift
+ * says which power of two it's in.
+ *
+ **/
+
+inline int latencyBucket(uint64_t v)
+{
+  if (v >= ((uint64_t)1 << LATENCY_MAX_BITS))
+    v = ((uint64_t)1 << LATENCY_MAX_BITS) - 1;
+  if (v < LATENCY_SUB) return v;
+  int top = 63 - __builtin_clzll(v);
+  int shift = top - LATENCY_SUB_BITS;
+  return shift * LATENCY_SUB + (int)(v >> shift);
+} // End of latencyBucket()
+
+/**
+ * bucketHighest()
+ *
+ * The largest value that goes in bucket i.
+ *
+ **/
+
+inline uint64_t bucketHighest(int i)
+{
+  if (i < 2 * LATENCY_SUB) return i;
+  int shift = i / LATENCY_SUB - 1;
+  uint64_t top = i - shift * LATENCY_SUB;
+  return ((top + 1) << shift) - 1;
+} // End of bucketHighest()
+
+/**
+ * recordLatency()
+ *
+ **/
+
+inline void recordLatency(LatencyHistogram& h, uint64_t ns)
+{
+  h.counts[latencyBucket(ns)]++;
+  h.count++;
+  h.sum += ns;
+  if (ns < h.min) h.min = ns;
+  if (ns > h.max) h.max = ns;
+} // End of recordLatency()
+
+/**
+ * mergeHistogram()
+ *
+ * Add everything in "from" to "into".
+ *
+ **/
+
+inline void mergeHistogram(LatencyHistogram& into, const LatencyHistogram& from)
+{
+  for (int i = 0; i < LATENCY_BUCKETS; i++) into.counts[i] += from.counts[i];
+  into.count += from.count;
+  into.sum += from.sum;
+  if (from.min < into.min) into.min = from.min;
+  if (from.max > into.max) into.max = from.max;
+} // End of mergeHistogram()
+
+/**
+ * latencyPercentile()
+ *
+ * The time that p (0 to 1) of the samples were no longer than, to within
+ * a bucket. Never more than the longest we actually saw.
+ *
+ **/
+
+inline uint64_t latencyPercentile(const LatencyHistogram& h, double p)
+{
+  if (h.count == 0) return 0;
+  uint64_t want = (uint64_t)(p * h.count + 0.5);
+  if (want < 1) want = 1;
+  if (want > h.count) want = h.count;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += h.counts[i];
+    if (seen >= want) {
+      uint64_t v = bucketHighest(i);
+      return v < h.max ? v : h.max;
+    }
+  }
+  return h.max;
+} // End of latencyPercentile()
+
+/**
+ * initProfile()
+ *
+ **/
+
+inline void initProfile(LoopProfile& prof)
+{
+  prof.stages = 0;
+} // End of initProfile()
+
+/**
+ * addStage()
+ *
+ * A new stage to time, returning the number to give ScopedTimer.
+ *
+ **/
+
+inline int addStage(LoopProfile& prof, const char* name)
+{
+  if (prof.stages == PROFILE_MAX_STAGES) return PROFILE_MAX_STAGES - 1;
+  prof.name[prof.stages] = name;
+  clearHistogram(prof.hist[prof.stages]);
+  return prof.stages++;
+} // End of addStage()
+
+/**
+ * Times the block it's declared in, from there to the closing brace.
+ * Does nothing with a NULL profile.
+ *
+ **/
+
+struct ScopedTimer
+{
+  LatencyHistogram* hist;
+  uint64_t start;
+
+  ScopedTimer(LoopProfile& prof, int stage)
+    : hist(&prof.hist[stage]), start(latencyNow()) {}
+  ScopedTimer(LoopProfile* prof, int stage)
+    : hist(prof ? &prof->hist[stage] : NULL), start(hist ? latencyNow() : 0) {}
+  ~ScopedTimer() { if (hist) recordLatency(*hist, latencyNow() - start); }
+};
+
+/**
+ * summarizeStage()
+ *
+ **/
+
+inline StageSummary summarizeStage(const LoopProfile& prof, int stage)
+{
+  const LatencyHistogram& h = prof.hist[stage];
+  StageSummary s;
+
+  s.name  = prof.name[stage];
+  s.count = h.count;
+  s.mean  = h.count ? h.sum / h.count : 0;
+  s.p50   = latencyPercentile(h, 0.5);
+  s.p90   = latencyPercentile(h, 0.9);
+  s.p99   = latencyPercentile(h, 0.99);
+  s.p999  = latencyPercentile(h, 0.999);
+  s.max   = h.max;
+  return s;
+} // End of summarizeStage()
+
+/**
+ * printProfile()
+ *
+ * A table of the stages, in microseconds.
+ *
+ **/
+
+inline void printProfile(const LoopProfile& prof)
+{
+  printf("%-16s %10s %10s %10s %10s %10s %10s\n", "Stage (us)", "count",
+         "mean", "p50", "p99", "p99.9", "max");
+  for (int i = 0; i < prof.stages; i++) {
+    StageSummary s = summarizeStage(prof, i);
+    if (s.count == 0) continue;
+    printf("%-16s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+           s.name.c_str(), (unsigned long long)s.count, s.mean / 1e3,
+           s.p50 / 1e3, s.p99 / 1e3, s.p999 / 1e3, s.max / 1e3);
+  }
+} // End of printProfile()
+
+/**
+ * writeProfile()
+ *
+ * Save the summary of every stage as CSV.
+ *
+ **/
+
+inline bool writeProfile(const LoopProfile& prof, const char* path)
+{
+  FILE* fp = fopen(path, "w");
+
+  if (fp == NULL) {
+    std::cerr << "Can't write " << path << std::endl;
+    return false;
+  }
+  fprintf(fp, "stage,count,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+  for (int i = 0; i < prof.stages; i++) {
+    StageSummary s = summarizeStage(prof, i);
+    fprintf(fp, "%s,%llu,%.1f,%llu,%llu,%llu,%llu,%llu\n", s.name.c_str(),
+            (unsigned long long)s.count, s.mean,
+            (unsigned long long)s.p50, (unsigned long long)s.p90,
+            (unsigned long long)s.p99, (unsigned long long)s.p999,
+            (unsigned long long)s.max);
+  }
+  fclose(fp);
+  return true;
+} // End of writeProfile()
+
+/**
+ * readProfile()
+ *
+ * Read back what writeProfile() saved.
+ *
+ **/
+
+inline bool readProfile(const char* path, std::vector<StageSummary>& out)
+{
+  FILE* fp = fopen(path, "r");
+  char line[256], name[64];
+  unsigned long long count, p50, p90, p99, p999, max;
+  double mean;
+
+  out.clear();
+  if (fp == NULL) {
+    std::cerr << "Can't read " << path << std::endl;
+    return false;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "%63[^,],%llu,%lf,%llu,%llu,%llu,%llu,%llu", name,
+               &count, &mean, &p50, &p90, &p99, &p999, &max) != 8) continue;
+    StageSummary s;
+    s.name = name;
+    s.count = count;
+    s.mean = mean;
+    s.p50 = p50; s.p90 = p90; s.p99 = p99; s.p999 = p999; s.max = max;
+    out.push_back(s);
+  }
+  fclose(fp);
+  return true;
+} // End of readProfile()
+
+/**
+ * compareProfile()
+ *
+ * Check every stage against a baseline saved earlier. A stage has
+ * regressed if its median or p99 is more than "tolerance" (0.2 for 20%)
+ * slower, and by more than "floor" nanoseconds, so that stages taking next
+ * to no time don't fail on noise. Prints what it finds and returns how
+ * many stages regressed.
+ *
+ **/
+
+inline int compareProfile(const LoopProfile& prof,
+                          const std::vector<StageSummary>& base,
+                          double tolerance, uint64_t floor = 1000)
+{
+  int regressed = 0;
+
+  for (int i = 0; i < prof.stages; i++) {
+    StageSummary s = summarizeStage(prof, i);
+    for (size_t b = 0; b < base.size(); b++) {
+      if (base[b].name != s.name || s.count == 0) continue;
+      bool p50_bad = s.p50 > base[b].p50 * (1 + tolerance)
+                     && s.p50 > base[b].p50 + floor;
+      bool p99_bad = s.p99 > base[b].p99 * (1 + tolerance)
+                     && s.p99 > base[b].p99 + floor;
+      printf("%-16s p50 %9.2fus (was %9.2f)  p99 %9.2fus (was %9.2f)%s\n",
+             s.name.c_str(), s.p50 / 1e3, base[b].p50 / 1e3,
+             s.p99 / 1e3, base[b].p99 / 1e3,
+             p50_bad || p99_bad ? "  SLOWER" : "");
+      if (p50_bad || p99_bad) regressed++;
+    }
+  }
+  return regressed;
+} // End of compareProfile()
+
+#endif
@@ -15,14 +15,83 @@
  *  This program allows the robot to move around predetermined coordinates
  *  on the map. By finding the tangential angle using the difference in x and y
  *  coordinates from its current position and the goal position. 
- *  There are a total of 11 pre-recorded coordinates as a topological mapping
- *  of the simulated map. When a robot is lost, it will first first the closest
- *  coordinate, and then following the mapping to the final goal location.
+ *  The coordinates are planned with A* (planner.h) over the map in
+ *  bitmaps/local.png, from wherever the robot is to the goal, which is
+ *  (5, -3.5) unless given on the command line:
+ *
+ *    ./local-roomba [-navfn] [-dwa] [-footprint] [-monitor] [-async]
+ *                   [-hz rate] [-mission file] [-roadmap] [-scan] [-mapping]
+ *                   [-record file] [-replay file] [goal_x goal_y]
+ *
+ *  When a robot is lost or bumps into something, it picks up the path again
+ *  at the nearest waypoint it can see (kdtree.h), and only plans again from
+ *  where it is now if it can't see any of them.
+ *
+ *  With -navfn it instead works out the cost of getting to the goal from
+ *  everywhere on the map once (navfield.h, cached in bitmaps/ after the
+ *  first run) and, every time round the loop, heads a little way downhill
+ *  from where it is. Then there is nothing to replan after a bump.
+ *
+ *  With -mission file (local.mission, say) it goes by the roads in the
+ *  mission file rather than planning (mission.h), and visits each of the
+ *  mission's goals in turn instead of going to one. The file is compiled
+ *  the first time it's used, to a .graph file next to it that later runs
+ *  just map in; make-mission does that ahead of time, and checks it.
+ *  -roadmap goes by the roads roadmap.h finds on the map itself instead,
+ *  to the one goal; they are cached in bitmaps/local.road.
+ *
+ *  With -dwa it steers along the path with the dynamic window planner in
+ *  dwa.h instead of stopping to turn at every waypoint, keeping clear of
+ *  whatever the laser sees. Like -monitor, that needs world42.cfg. -scan
+ *  has it look at the scan cleaned up and thinned out by scan.h rather
+ *  than every few beams. -footprint (which means -dwa) has it check the
+ *  arcs against the walls with the robot's own shape, from footprint.h,
+ *  rather than against the costmap. The Roomba is round, so that only
+ *  makes it slower; it is there for robots that aren't.
+ *
+ *  With -mapping it adds what the laser sees to the map as it goes
+ *  (occmap.h), so something that wasn't on the map gets planned around
+ *  once the robot has seen it, and something that has gone stops being
+ *  in the way. That needs world42.cfg as well, and doesn't go with
+ *  -navfn, whose field is worked out once for the map as it was.
+ *
+ *  With -async (or -hz, 20Hz by default) the robot is read on a thread of
+ *  its own and the control loop runs at a fixed rate (robotclient.h).
+ *
+ *  Every tick is logged to local-roomba.tlog (or the file given with -log)
+ *  for telemetry-decode; -v prints where it is and where it's going every
+ *  tick as well.
+ *
+ *  -record file saves everything read from the robot; -replay file runs
+ *  the controller on a recording instead of on a robot, with no Player
+ *  server needed, and stops when it runs out. -sim [world] runs it in the
+ *  headless simulator (sim.h) on world4.world or the world given, as fast
+ *  as it will go, for up to 10 simulated minutes.
+ *
+ *  -profile file times each stage of the tick (reading the robot,
+ *  deciding, which includes any planning, printing, logging and sending
+ *  the command) and, at the end, prints the percentiles and saves them to
+ *  the file as CSV (latency.h).
+ *
+ *  -monitor checks the laser against the map every tick, and if the pose
+ *  we're given is wrong, finds the robot again on the map and corrects it
+ *  (relocalize.h). That needs a laser, which world41.cfg doesn't give us;
+ *  use world42.cfg.
+ *
+ *  What to do each tick is worked out in gotogoal.h, which montecarlo
+ *  also uses to run the controller over many random starts at once.
  */
 
 
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
 #include <libplayerc++/playerc++.h>
+#include "gotogoal.h"
+#include "latency.h"
+#include "roadmap.h"
+#include "robotclient.h"
+#include "telemetry.h"
 using namespace PlayerCc;  
 
 /**
@@ -30,9 +99,8 @@ using namespace PlayerCc;
  *
  **/
 
-player_pose2d_t readPosition(LocalizeProxy& lp);
-void printRobotData(BumperProxy& bp, player_pose2d_t pose);
-int indexOfClosest(double, double, double[11][2]);
+void printRobotData(const SensorFrame& frame, player_pose2d_t pose);
+
 /**
  * main()
  *
@@ -40,184 +108,261 @@ int indexOfClosest(double, double, double[11][2]);
 
 int main(int argc, char *argv[])
 {  
-  // Mapping of graph nodes
-  double coords[11][2] = {{-6,-6},{1,-5},{3.7,-7.3},{-6.5,-2},{-7,5.5},{-5,7},{-4,5.5},{5,5.5},{5,0},{5,-3.5},{1.5,-7.8}};
-  int map[11] = {9,9,9,1,6,6,7,8,9,-1,2};
-  // Variables
-  int counter = 0;
-  int nextIDX = 0;
-  int started = 1, arrived = 0, bumped = 0;
-  int finding_angle = 0, traveling = 0;
-  int curr_coord = 0, next_coord = 0;
-  double speed;            // How fast do we want the robot to go forwards?
-  double turnrate;         // How fast do we want the robot to turn?
-  double curr_x, curr_y, curr_a;
-  double targ_x=0, targ_y=0, targ_a=0;
-  double angle_away, dist_away, dx, dy;
-  player_pose2d_t  pose;   // For handling localization data
+  // The map, and the planner that finds paths through it
+  GridMap grid;
+  DistMap field;
+  Planner planner;
+  NavField navfn;
+  GoToGoal task;           // What to do, from one tick to the next
+  int status;
+  double goal_x = 5, goal_y = -3.5;
+  bool use_navfn = false;
+  PoseGuard guard;         // Checks the pose we're given, with the laser
+  bool use_monitor = false;
+  DwaPlanner dwa;          // Steers for us, with -dwa
+  bool use_dwa = false;
+  Footprint footprint;     // The robot's shape, with -footprint
+  BitGrid walls;           // ...and the map, to check it against
+  bool use_footprint = false;
+  LaserScan scan;          // What it sees, cleaned up, with -scan
+  bool use_scan = false;
+  OccMap mapper;           // Keeps the map up to date, with -mapping
+  bool use_mapping = false;
+  MissionGraph mission;    // Roads and goals, with -mission
+  const char* mission_path = NULL;
+  int mission_goal = 0;    // Which of its goals we're going to
+  MissionGraph roadmap;    // Roads found on the map, with -roadmap
+  bool use_roadmap = false;
+  double hz = 0;           // Control rate in async mode, 0 for sync
+  bool verbose = false;    // Print where we are every tick?
+  const char* log_path = "local-roomba.tlog";
+  const char* record = NULL;   // Save what we read from the robot here
+  const char* replay = NULL;   // ...or read it from here instead
+  const char* sim_world = NULL;  // ...or simulate this world instead
+  SimWorld world;
+  Sim sim;
+  Telemetry telemetry;
+  TelemetryRecord rec;
+  int  coords_given = 0;
+  SensorFrame      frame;  // What the robot told us this time round
+  RobotClient      client;
+  LoopProfile profile;     // Where the time in each tick goes
+  const char* profile_path = NULL;
+  int t_read, t_decide, t_print, t_log, t_command, t_tick;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-navfn") == 0) use_navfn = true;
+    else if (strcmp(argv[i], "-monitor") == 0) use_monitor = true;
+    else if (strcmp(argv[i], "-dwa") == 0) use_dwa = true;
+    else if (strcmp(argv[i], "-footprint") == 0) use_dwa = use_footprint = true;
+    else if (strcmp(argv[i], "-scan") == 0) use_scan = true;
+    else if (strcmp(argv[i], "-mapping") == 0) use_mapping = true;
+    else if (strcmp(argv[i], "-async") == 0) hz = 20;
+    else if (strcmp(argv[i], "-hz") == 0 && i + 1 < argc) hz = atof(argv[++i]);
+    else if (strcmp(argv[i], "-mission") == 0 && i + 1 < argc)
+      mission_path = argv[++i];
+    else if (strcmp(argv[i], "-roadmap") == 0) use_roadmap = true;
+    else if (strcmp(argv[i], "-log") == 0 && i + 1 < argc) log_path = argv[++i];
+    else if (strcmp(argv[i], "-v") == 0) verbose = true;
+    else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+      profile_path = argv[++i];
+    else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+      record = argv[++i];
+    else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc)
+      replay = argv[++i];
+    else if (strcmp(argv[i], "-sim") == 0) {
+      sim_world = "world4.world";
+      if (i + 1 < argc && strstr(argv[i + 1], ".world") != NULL)
+        sim_world = argv[++i];
+    }
+    else if (coords_given++ == 0) goal_x = atof(argv[i]);
+    else goal_y = atof(argv[i]);
+  }
+  // Same map and size as world4.world
+  if (!loadGridMap(grid, "bitmaps/local.png", 16, 16)) return 1;
+  if (!loadDistMap(field, "bitmaps/local.png", 16, 16, &grid)) return 1;
+  initPlanner(planner, field);
+  if (mission_path != NULL) {
+    if (use_navfn) {
+      std::cerr << "-navfn only goes to one goal; not with -mission"
+                << std::endl;
+      return 1;
+    }
+    if (!loadMission(mission, mission_path)) return 1;
+    if (mission.goal_count == 0) {
+      std::cerr << mission_path << " has no goals" << std::endl;
+      return 1;
+    }
+    goal_x = mission.nodes[mission.goals[0]].x;
+    goal_y = mission.nodes[mission.goals[0]].y;
+  }
+  if (use_mapping && use_navfn) {
+    std::cerr << "-mapping can't change the -navfn field; use one or the other"
+              << std::endl;
+    return 1;
+  }
+  if (use_roadmap) {
+    if (use_navfn || mission_path != NULL) {
+      std::cerr << "-roadmap is instead of -navfn and -mission" << std::endl;
+      return 1;
+    }
+    RoadmapParams roads;
+    initRoadmapParams(roads);
+    if (!loadRoadmap(roadmap, "bitmaps/local.png", 16, 16, grid,
+                     planner.costmap, roads)) return 1;
+  }
+  if (use_navfn && !loadNavField(navfn, planner.costmap, "bitmaps/local.png",
+                                 16, 16, goal_x, goal_y)) return 1;
+  initGoToGoal(task, planner, use_navfn ? &navfn : NULL, goal_x, goal_y);
+  if (mission_path != NULL) task.graph = &mission;
+  if (use_roadmap) task.graph = &roadmap;
+  if (use_monitor) {
+    initPoseGuard(guard, field);
+    task.guard = &guard;
+  }
+  if (use_dwa) {
+    initDwaPlanner(dwa, planner.costmap);
+    task.dwa = &dwa;
+  }
+  if (use_footprint) {
+    initFootprint(footprint, grid.scale);
+    buildBitGrid(walls, grid);
+    dwa.footprint = &footprint;
+    dwa.walls = &walls;
+  }
+  if (use_scan && use_dwa) {
+    initLaserScan(scan);
+    task.scan = &scan;
+  }
+  if (use_mapping) {
+    initOccMap(mapper, grid, &field);
+    task.mapper = &mapper;
+  }
+  initProfile(profile);
+  t_read    = addStage(profile, "read");
+  t_decide  = addStage(profile, "decide");
+  t_print   = addStage(profile, "print");
+  t_log     = addStage(profile, "log");
+  t_command = addStage(profile, "command");
+  t_tick    = addStage(profile, "tick");
 
   // Set up proxies. These are the names we will use to connect to 
-  // the interface to the robot.
-  PlayerClient    robot("localhost");  
-  BumperProxy     bp(&robot,0);  
-  Position2dProxy pp(&robot,0);
-  LocalizeProxy   lp (&robot, 0);
+  // the interface to the robot. A replay or simulation doesn't need any.
+  PlayerClient*    robot = NULL;
+  BumperProxy*     bp = NULL;
+  Position2dProxy* pp = NULL;
+  LocalizeProxy*   lp = NULL;
+  LaserProxy*      laser = NULL;
 
-  // Allow the program to take charge of the motors (take care now)
-  pp.SetMotorEnable(true);
+  if (replay != NULL) {
+    if (!startReplay(client, replay)) return 1;
+  } else if (sim_world != NULL) {
+    if (!loadSimWorld(world, sim_world)) return 1;
+    initSim(sim, world);
+    sim.laser = use_monitor || use_dwa || use_mapping;  // Only these use it
+    startSim(client, sim, 600, record, "local-roomba");
+  } else {
+    robot = new PlayerClient("localhost");
+    bp = new BumperProxy(robot, 0);
+    pp = new Position2dProxy(robot, 0);
+    lp = new LocalizeProxy(robot, 0);
+    if (use_monitor || use_dwa || use_mapping)
+      laser = new LaserProxy(robot, 0);
+    // Allow the program to take charge of the motors (take care now)
+    pp->SetMotorEnable(true);
+    startClient(client, robot, pp, bp, laser, lp, hz, record, "local-roomba");
+  }
+  openTelemetry(telemetry, log_path, "local-roomba");
 
   // Main control loop
   while(true) 
     {    
       // Update information from the robot.
-      robot.Read();
-      // Read new information about position
-      pose = readPosition(lp);
+      {
+        ScopedTimer timer(profile, t_read);
+        clientRead(client, frame);
+      }
+      if (client.finished) break;
+      // Time the rest of the tick, up to the closing brace
+      ScopedTimer tick_timer(profile, t_tick);
 
-      // Print data on the robot to the terminal
-      // printRobotData(bp, pose);
-
-      // This part of the code should be very familiar by now.
-      //
-      // If either bumper is pressed, stop. Otherwise just go forwards
-      
-      curr_x = pose.px;
-      curr_y = pose.py;
-      curr_a = pose.pa;
-      targ_x = coords[next_coord][0];
-      targ_y = coords[next_coord][1];
-      targ_a = atan2(targ_y-curr_y, targ_x-curr_x);           
-      angle_away = rtod(targ_a)-rtod(curr_a);
-      // if (curr_a < 0) curr_a = 2*M_PI + curr_a;
-      
-      if (bumped) {
-        if (counter > 15) {
-          counter = 0;
-          bumped = 0;
-          speed = 0;
-        } else {
-          speed = -0.5;
+      // Work out what to do (gotogoal.h)
+      {
+        ScopedTimer timer(profile, t_decide);
+        status = goToGoalTick(task, frame);
+        if (status == GOAL_ARRIVED && mission_path != NULL
+            && mission_goal + 1 < mission.goal_count) {
+          const GraphNode& next = mission.nodes[mission.goals[++mission_goal]];
+          std::cout << "Got to " << nodeName(mission,
+                                             mission.goals[mission_goal - 1])
+                    << ", on to " << nodeName(mission,
+                                              mission.goals[mission_goal])
+                    << std::endl;
+          setGoal(task, next.x, next.y);
+          status = GOAL_RUNNING;
         }
-        counter++;
-      } else if (finding_angle) {
-        if (abs(angle_away) < 1) {
-          turnrate = 0;
-          speed = 1.0;
-          finding_angle = 0;
-          traveling = 1;
-        } else {
-          if (angle_away < 0) turnrate = -0.4;
-          else turnrate = 0.4;
-          speed = 0;
-        }
-      } else if (traveling) {
-        
-        dx = curr_x-targ_x;
-        dy = curr_y-targ_y;
-        dist_away = sqrt(dx*dx+dy*dy);
-        speed = 1.0;
-        if (angle_away < 0) turnrate = -0.4;
-        else turnrate = 0.4;
-        if (dist_away < 0.5) {
-          started = 1;
-          speed = 0.0;
-          traveling = 0;
-          arrived = 1;
-        }
-      } else if (arrived) {
-        speed = 0.0;
-        turnrate = 0.0;
-        curr_coord = next_coord;
-        next_coord = map[curr_coord];
-        if (next_coord == -1) {
-          pp.SetSpeed(0, 0);
-          break;
-        }
-        finding_angle = 1;
-        arrived = 0;
-      } else if (bp[0] || bp[1] || pp.GetStall() || started) {
-        if (started && abs(curr_x+6)<0.01 && abs(curr_y+6)<0.01) {
-          arrived = 1;  
-        } else {
-          if (bp[0] || bp[1] || pp.GetStall())
-            bumped = 1;
-          next_coord = indexOfClosest(curr_x, curr_y, coords);
-          finding_angle = 1;
-          turnrate = 0;
-          speed = 0;
-          started = 0;
-        }
-      } else {
-        speed = -0.5;
-        turnrate = 0.0;
+      }
+      if (status != GOAL_RUNNING) {
+        clientSetSpeed(client, 0, 0);
+        break;
       }
 
-      std::cout << "X: " << curr_x << std::endl;
-      std::cout << "Y: " << curr_y << std::endl;
-      std::cout << "A: " << rtod(curr_a) << std::endl;
-      std::cout << "TX: " << targ_x << std::endl;
-      std::cout << "TY: " << targ_y << std::endl;
-      std::cout << "TA: " << rtod(targ_a) << std::endl;
-      // What are we doing?
-      //std::cout << "Speed: " << speed << std::endl;      
-      //std::cout << "Turn rate: " << turnrate << std::endl << std::endl;
+      // Print data on the robot to the terminal
+      if (verbose) {
+        ScopedTimer timer(profile, t_print);
+        std::cout << "X: " << task.curr_x << "\n";
+        std::cout << "Y: " << task.curr_y << "\n";
+        std::cout << "A: " << rtod(task.curr_a) << "\n";
+        std::cout << "TX: " << task.targ_x << "\n";
+        std::cout << "TY: " << task.targ_y << "\n";
+        std::cout << "TA: " << rtod(task.targ_a) << std::endl;
+      }
+      {
+        ScopedTimer timer(profile, t_log);
+        fillTelemetry(client, frame, rec);
+        rec.pose_x   = task.curr_x;
+        rec.pose_y   = task.curr_y;
+        rec.pose_a   = task.curr_a;
+        rec.targ_x   = task.targ_x;
+        rec.targ_y   = task.targ_y;
+        rec.speed    = task.speed;
+        rec.turnrate = task.turnrate;
+        rec.state    = task.next_coord;
+        logTelemetry(telemetry, rec);
+      }
 
       // Send the commands to the robot
-      pp.SetSpeed(speed, turnrate);  
-      // Count how many times we do this
-      counter++;
+      {
+        ScopedTimer timer(profile, t_command);
+        clientSetSpeed(client, task.speed, task.turnrate);  
+      }
     }
+  stopClient(client);
+  if (use_monitor) {
+    std::cout << "Lost and found again " << guard.recoveries << " times"
+              << std::endl;
+  }
+  if (use_mapping) {
+    std::cout << "Map: " << mapper.scans << " scans (" << mapper.skipped
+              << " didn't fit), " << mapper.changes << " cells changed, "
+              << mapper.tiles.size() << " tiles" << std::endl;
+  }
+  if (profile_path != NULL) {
+    printProfile(profile);
+    writeProfile(profile, profile_path);
+  }
+  closeTelemetry(telemetry);
+  if (mission_path != NULL) freeMission(mission);
+  if (use_roadmap) freeMission(roadmap);
+  delete laser;
+  delete lp;
+  delete pp;
+  delete bp;
+  delete robot;
   
 } // end of main()
 
 
-/**
- * readPosition()
- *
- * Read the position of the robot from the localization proxy. 
- *
- * The localization proxy gives us a hypothesis, and from that we extract
- * the mean, which is a pose. 
- *
- **/
-
-int indexOfClosest(double x, double y, double coords[11][2]) {
-  double minDist = 99999999, dist;
-  double dx, dy;
-  int idx = -1;
-  for (int i = 0; i < 11; i++) {
-    dx = x-coords[i][0];
-    dy = y-coords[i][1];
-    dist = sqrt(dx*dx+dy*dy);
-    if (dist < minDist) {
-      minDist = dist;
-      idx = i;
-    }
-  } 
-  return idx;
-}
-
-player_pose2d_t readPosition(LocalizeProxy& lp)
-{
-
-  player_localize_hypoth_t hypothesis;
-  player_pose2d_t          pose;
-  uint32_t                 hCount;
-
-  // Need some messing around to avoid a crash when the proxy is
-  // starting up.
-
-  hCount = lp.GetHypothCount();
-
-  if(hCount > 0){
-    hypothesis = lp.GetHypoth(0);
-    pose       = hypothesis.mean;
-  }
-
-  return pose;
-} // End of readPosition()
-
-
 /**
  *  printRobotData
  *
@@ -226,12 +371,12 @@ player_pose2d_t readPosition(LocalizeProxy& lp)
  *
  **/
 
-void printRobotData(BumperProxy& bp, player_pose2d_t pose)
+void printRobotData(const SensorFrame& frame, player_pose2d_t pose)
 {
 
   // Print out what the bumpers tell us:
-  std::cout << "Left  bumper: " << bp[0] << std::endl;
-  std::cout << "Right bumper: " << bp[1] << std::endl;
+  std::cout << "Left  bumper: " << frame.bumper[0] << std::endl;
+  std::cout << "Right bumper: " << frame.bumper[1] << std::endl;
 
   // Print out where we are
   std::cout << "We are at" << std::endl;
@@ -0,0 +1,633 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Control loop benchmark
+ *
+ ** Description ***************************************************************
+ *
+ *  Times the control loops of real-local (with -mcl) and local-roomba,
+ *  stage by stage, running them in the headless simulator from a fixed set
+ *  of random starts, and then the pieces they are built from on their own:
+ *
+ *    ./loop-bench [-episodes n] [-o report.csv] [-baseline old.csv]
+ *                 [-tolerance 0.2] [world]
+ *
+ *  Prints the latency percentiles of each stage (latency.h) and saves them
+ *  to loop-bench.csv, or the file given. With -baseline it compares them
+ *  with a report saved earlier and exits with status 1 if any stage's
+ *  median or p99 is more than 20% (or the tolerance given) slower, so it
+ *  can be run before trying a change on the robot. Everything runs on one
+ *  thread, and the starts and seeds are the same every run, so two runs on
+ *  the same machine do the same work.
+ *
+ *  Defaults to 10 episodes of each on world4.world.
+ */
+
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "gotogoal.h"
+#include "latency.h"
+#include "robotclient.h"
+#include "telemetry.h"
+#include "wander.h"
+
+// Stages of each loop, as in the programs themselves
+struct LoopStages
+{
+  int read, localize, decide, log, command, tick;
+};
+
+/**
+ * Function headers
+ *
+ **/
+
+Pose2d randomStart(const SimWorld& world, std::mt19937& rng);
+void addLoopStages(LoopProfile& prof, const char* loop, LoopStages& st,
+                   bool localize);
+void benchWander(const SimWorld& world, Mcl& mcl, Pose2d start,
+                 unsigned seed, Telemetry& tm, LoopProfile& prof,
+                 const LoopStages& st);
+void benchGoal(const SimWorld& world, Planner& planner, Pose2d start,
+               Telemetry& tm, LoopProfile& prof, const LoopStages& st);
+void benchScanMatch(const SimWorld& world, Pose2d start, LoopProfile& prof,
+                    int stage);
+void benchRelocalize(const SimWorld& world, const std::vector<Pose2d>& poses,
+                     LoopProfile& prof, int check, int search);
+void benchDwa(const SimWorld& world, const Planner& planner,
+              const std::vector<Pose2d>& poses, LoopProfile& prof, int stage,
+              int scan_stage, int with_scan);
+void benchMapping(const SimWorld& world, const std::vector<Pose2d>& poses,
+                  LoopProfile& prof, int stage);
+void benchVfh(const SimWorld& world, const std::vector<Pose2d>& poses,
+              LoopProfile& prof, int stage);
+void benchFootprint(const SimWorld& world, const Planner& planner,
+                    const std::vector<Pose2d>& poses, LoopProfile& prof,
+                    int stage, int dwa_stage);
+void benchLaserKernels(const SimWorld& world, const std::vector<Pose2d>& poses,
+                       LoopProfile& prof, int ends, int sides);
+
+/**
+ * main()
+ *
+ **/
+
+int main(int argc, char *argv[])
+{
+  int episodes = 10;
+  const char* world_path = "world4.world";
+  const char* report = "loop-bench.csv";
+  const char* baseline = NULL;
+  double tolerance = 0.2;
+  SimWorld world;
+  Mcl mcl;
+  Planner planner;
+  NavField navfn;
+  Telemetry telemetry;
+  LoopProfile profile;
+  LoopStages wander_st, goal_st;
+  std::mt19937 rng(1);
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-episodes") == 0 && i + 1 < argc)
+      episodes = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) report = argv[++i];
+    else if (strcmp(argv[i], "-baseline") == 0 && i + 1 < argc)
+      baseline = argv[++i];
+    else if (strcmp(argv[i], "-tolerance") == 0 && i + 1 < argc)
+      tolerance = atof(argv[++i]);
+    else world_path = argv[i];
+  }
+
+  if (!loadSimWorld(world, world_path)) return 1;
+  initPlanner(planner, world.dist);
+  if (!loadNavField(navfn, planner.costmap, world.bitmap.c_str(),
+                    world.size_x, world.size_y, 5, -3.5)) return 1;
+  // The loops log telemetry, as the programs do, but nobody wants it
+  openTelemetry(telemetry, "/dev/null", "loop-bench");
+
+  initProfile(profile);
+  addLoopStages(profile, "wander", wander_st, true);
+  addLoopStages(profile, "goal", goal_st, false);
+  int t_scan   = addStage(profile, "castScan");
+  int t_plan   = addStage(profile, "planPath");
+  int t_carrot = addStage(profile, "navCarrot");
+  int t_kd     = addStage(profile, "kdNearest");
+  int t_telem  = addStage(profile, "logTelemetry");
+  int t_match  = addStage(profile, "matchScan");
+  int t_check  = addStage(profile, "checkScan");
+  int t_global = addStage(profile, "globalLocalize");
+  int t_dwa    = addStage(profile, "dwaStep");
+  int t_prep   = addStage(profile, "processScan");
+  int t_dwa_sc = addStage(profile, "dwaStep.scan");
+  int t_map    = addStage(profile, "mapScan");
+  int t_vfh    = addStage(profile, "vfhStep");
+  int t_fp     = addStage(profile, "footprintHits");
+  int t_dwa_fp = addStage(profile, "dwaStep.footprint");
+  int t_ends   = addStage(profile, "beamEnds");
+  int t_sides  = addStage(profile, "beamSides");
+
+  // The loops themselves
+  for (int e = 0; e < episodes; e++) {
+    Pose2d start = randomStart(world, rng);
+    benchWander(world, mcl, start, 1 + e, telemetry, profile, wander_st);
+    benchGoal(world, planner, start, telemetry, profile, goal_st);
+  }
+
+  // ...and the pieces
+  std::vector<Pose2d> poses(1000);
+  for (size_t i = 0; i < poses.size(); i++)
+    poses[i] = randomStart(world, rng);
+  std::vector<float> scan(world.laser.count);
+  for (size_t i = 0; i < poses.size(); i++) {
+    ScopedTimer timer(profile, t_scan);
+    castScan(world.caster, world.laser, poses[i], &scan[0]);
+  }
+  std::vector<Point2d> path;
+  for (size_t i = 0; i + 1 < poses.size() && i < 200; i += 2) {
+    ScopedTimer timer(profile, t_plan);
+    planPath(planner, poses[i].px, poses[i].py,
+             poses[i + 1].px, poses[i + 1].py, path);
+  }
+  double tx, ty;
+  for (size_t i = 0; i < poses.size(); i++) {
+    ScopedTimer timer(profile, t_carrot);
+    navCarrot(navfn, poses[i].px, poses[i].py, 1.0, &tx, &ty);
+  }
+  std::vector<Point2d> points(poses.size());
+  for (size_t i = 0; i < poses.size(); i++) {
+    points[i].x = poses[i].px;
+    points[i].y = poses[i].py;
+  }
+  KdTree tree;
+  buildKdTree(tree, points);
+  volatile int sink = 0;
+  for (int i = 0; i < 10000; i++) {
+    const Pose2d& p = poses[(i * 7) % poses.size()];
+    ScopedTimer timer(profile, t_kd);
+    sink += kdNearest(tree, p.px + 0.1, p.py - 0.1);
+  }
+  TelemetryRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  for (int i = 0; i < 10000; i++) {
+    ScopedTimer timer(profile, t_telem);
+    logTelemetry(telemetry, rec);
+  }
+  for (int e = 0; e < episodes; e++)
+    benchScanMatch(world, poses[e], profile, t_match);
+  benchRelocalize(world, poses, profile, t_check, t_global);
+  benchDwa(world, planner, poses, profile, t_dwa, t_prep, t_dwa_sc);
+  benchMapping(world, poses, profile, t_map);
+  benchVfh(world, poses, profile, t_vfh);
+  benchFootprint(world, planner, poses, profile, t_fp, t_dwa_fp);
+  benchLaserKernels(world, poses, profile, t_ends, t_sides);
+  closeTelemetry(telemetry);
+  freeNavField(navfn);
+
+  printProfile(profile);
+  writeProfile(profile, report);
+
+  if (baseline != NULL) {
+    std::vector<StageSummary> base;
+    if (!readProfile(baseline, base)) return 1;
+    std::cout << std::endl << "Against " << baseline << ":" << std::endl;
+    int slower = compareProfile(profile, base, tolerance);
+    if (slower > 0) {
+      std::cout << slower << " stages are slower than they were" << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+} // end of main()
+
+/**
+ * randomStart()
+ *
+ * A pose anywhere on the map with room for the robot.
+ *
+ **/
+
+Pose2d randomStart(const SimWorld& world, std::mt19937& rng)
+{
+  const GridMap& map = world.map;
+  std::uniform_real_distribution<double> ux(0, map.width * map.scale);
+  std::uniform_real_distribution<double> uy(0, map.height * map.scale);
+  std::uniform_real_distribution<double> ua(-M_PI, M_PI);
+  Pose2d pose;
+
+  do {
+    pose.px = map.origin_x + ux(rng);
+    pose.py = map.origin_y + uy(rng);
+  } while (distAt(world.dist, pose.px, pose.py) < ROOMBA_RADIUS + 0.1);
+  pose.pa = ua(rng);
+  return pose;
+} // End of randomStart()
+
+/**
+ * addLoopStages()
+ *
+ * The stages of one loop, named "loop.stage".
+ *
+ **/
+
+void addLoopStages(LoopProfile& prof, const char* loop, LoopStages& st,
+                   bool localize)
+{
+  std::string name(loop);
+
+  st.read     = addStage(prof, (name + ".read").c_str());
+  st.localize = localize ? addStage(prof, (name + ".localize").c_str()) : -1;
+  st.decide   = addStage(prof, (name + ".decide").c_str());
+  st.log      = addStage(prof, (name + ".log").c_str());
+  st.command  = addStage(prof, (name + ".command").c_str());
+  st.tick     = addStage(prof, (name + ".tick").c_str());
+} // End of addLoopStages()
+
+/**
+ * benchWander()
+ *
+ * One episode of real-local's loop, localizing with our own filter.
+ *
+ **/
+
+void benchWander(const SimWorld& world, Mcl& mcl, Pose2d start,
+                 unsigned seed, Telemetry& tm, LoopProfile& prof,
+                 const LoopStages& st)
+{
+  static SensorFrame frame;
+  RobotClient client;
+  TelemetryRecord rec;
+  Sim sim;
+  Wander task;
+  bool fresh;
+  int status;
+
+  initSim(sim, world, seed);
+  sim.pose = sim.odom = start;
+  sim.localize = false;
+  mclInit(mcl, world.map, &world.dist, seed);
+  initWander(task, &mcl);
+  task.quiet = true;
+  startSim(client, sim, 600);
+
+  while (true) {
+    {
+      ScopedTimer timer(prof, st.read);
+      fresh = clientRead(client, frame);
+    }
+    if (client.finished) break;
+    ScopedTimer tick_timer(prof, st.tick);
+    {
+      ScopedTimer timer(prof, st.localize);
+      wanderLocalize(task, frame, fresh);
+    }
+    {
+      ScopedTimer timer(prof, st.decide);
+      status = wanderDecide(task, frame);
+    }
+    if (status == WANDER_LOCALIZED) break;
+    {
+      ScopedTimer timer(prof, st.log);
+      fillTelemetry(client, frame, rec);
+      rec.pose_x   = task.pose.px;
+      rec.pose_y   = task.pose.py;
+      rec.pose_a   = task.pose.pa;
+      rec.speed    = task.speed;
+      rec.turnrate = task.turnrate;
+      rec.state    = task.main_counter;
+      logTelemetry(tm, rec);
+    }
+    {
+      ScopedTimer timer(prof, st.command);
+      clientSetSpeed(client, task.speed, task.turnrate);
+    }
+  }
+  stopClient(client, true);
+} // End of benchWander()
+
+/**
+ * benchGoal()
+ *
+ * One episode of local-roomba's loop, planning with A*.
+ *
+ **/
+
+void benchGoal(const SimWorld& world, Planner& planner, Pose2d start,
+               Telemetry& tm, LoopProfile& prof, const LoopStages& st)
+{
+  static SensorFrame frame;
+  RobotClient client;
+  TelemetryRecord rec;
+  Sim sim;
+  GoToGoal task;
+  int status;
+
+  initSim(sim, world);
+  sim.pose = sim.odom = start;
+  sim.laser = false;
+  initGoToGoal(task, planner, NULL, 5, -3.5);
+  task.quiet = true;
+  // Give up sooner than the real thing; a robot that's stuck is just
+  // timing the same few branches over and over
+  startSim(client, sim, 120);
+
+  while (true) {
+    {
+      ScopedTimer timer(prof, st.read);
+      clientRead(client, frame);
+    }
+    if (client.finished) break;
+    ScopedTimer tick_timer(prof, st.tick);
+    {
+      ScopedTimer timer(prof, st.decide);
+      status = goToGoalTick(task, frame);
+    }
+    if (status != GOAL_RUNNING) break;
+    {
+      ScopedTimer timer(prof, st.log);
+      fillTelemetry(client, frame, rec);
+      rec.pose_x   = task.curr_x;
+      rec.pose_y   = task.curr_y;
+      rec.pose_a   = task.curr_a;
+      rec.targ_x   = task.targ_x;
+      rec.targ_y   = task.targ_y;
+      rec.speed    = task.speed;
+      rec.turnrate = task.turnrate;
+      rec.state    = task.next_coord;
+      logTelemetry(tm, rec);
+    }
+    {
+      ScopedTimer timer(prof, st.command);
+      clientSetSpeed(client, task.speed, task.turnrate);
+    }
+  }
+  stopClient(client, true);
+} // End of benchGoal()
+
+/**
+ * benchScanMatch()
+ *
+ * Match the scans a robot sees wandering about for a minute, with noisy
+ * odometry, as real-local -scanmatch would.
+ *
+ **/
+
+void benchScanMatch(const SimWorld& world, Pose2d start, LoopProfile& prof,
+                    int stage)
+{
+  static SensorFrame frame;
+  ScanMatcher sm;
+  Sim sim;
+
+  initSim(sim, world);
+  sim.pose = sim.odom = start;
+  sim.localize = false;
+  sim.noise.range = 0.01;
+  sim.noise.odom_trans = sim.noise.odom_rot = 0.1;
+  initScanMatcher(sm);
+
+  for (int i = 0; i < 600; i++) {
+    simSense(sim, frame);
+    {
+      ScopedTimer timer(prof, stage);
+      matchScan(sm, frame);
+    }
+    // Steer as wanderDecide() does
+    sim.speed = 1.0;
+    if (frame.min_left < 1.2) sim.turnrate = -0.8;
+    else if (frame.min_right < 1.2) sim.turnrate = 0.8;
+    else sim.turnrate = frame.min_left < frame.min_right ? -0.4 : 0.4;
+    if (frame.bumper[0] || frame.bumper[1] || frame.stall) {
+      sim.speed = -0.5;
+      sim.turnrate = -0.4;
+    }
+    simStep(sim);
+  }
+} // End of benchScanMatch()
+
+/**
+ * benchRelocalize()
+ *
+ * Check the scan from each pose against the map, as the guard does every
+ * tick, and find the first 50 of them from scratch, as it does when lost.
+ *
+ **/
+
+void benchRelocalize(const SimWorld& world, const std::vector<Pose2d>& poses,
+                     LoopProfile& prof, int check, int search)
+{
+  static SensorFrame frame;
+  PoseGuard guard;
+  Sim sim;
+
+  initSim(sim, world);
+  sim.localize = false;
+  sim.noise.range = 0.01;
+  initPoseGuard(guard, world.dist);
+
+  for (size_t i = 0; i < poses.size(); i++) {
+    sim.pose = sim.odom = poses[i];
+    simSense(sim, frame);
+    {
+      ScopedTimer timer(prof, check);
+      checkScan(guard.monitor, frame, poses[i]);
+    }
+    if (i >= 50) continue;
+    ScopedTimer timer(prof, search);
+    globalLocalize(guard.global, frame);
+  }
+} // End of benchRelocalize()
+
+/**
+ * benchDwa()
+ *
+ * Choose a speed and turn rate at each pose, as the local planner does
+ * every tick, heading for the next pose along: from the raw beams, and
+ * again from the scan preprocessed by scan.h, timing that on its own too.
+ *
+ **/
+
+void benchDwa(const SimWorld& world, const Planner& planner,
+              const std::vector<Pose2d>& poses, LoopProfile& prof, int stage,
+              int scan_stage, int with_scan)
+{
+  static SensorFrame frame;
+  static LaserScan scan;
+  DwaPlanner dwa;
+  Sim sim;
+
+  initSim(sim, world);
+  sim.localize = false;
+  initDwaPlanner(dwa, planner.costmap);
+  initLaserScan(scan);
+
+  for (size_t i = 0; i + 1 < poses.size(); i++) {
+    sim.pose = sim.odom = poses[i];
+    simSense(sim, frame);
+    double speed = 0.5, turnrate = 0;
+    {
+      ScopedTimer timer(prof, stage);
+      dwaStep(dwa, frame, poses[i], poses[i + 1].px, poses[i + 1].py,
+              &speed, &turnrate);
+    }
+    {
+      ScopedTimer timer(prof, scan_stage);
+      processScan(scan, frame);
+    }
+    speed = 0.5;
+    turnrate = 0;
+    ScopedTimer timer(prof, with_scan);
+    dwaStep(dwa, frame, poses[i], poses[i + 1].px, poses[i + 1].py,
+            &speed, &turnrate, &scan);
+  }
+} // End of benchDwa()
+
+/**
+ * benchMapping()
+ *
+ * Add the scan from each pose to a map of its own, with the distances
+ * kept up to date, as -mapping does every tick.
+ *
+ **/
+
+void benchMapping(const SimWorld& world, const std::vector<Pose2d>& poses,
+                  LoopProfile& prof, int stage)
+{
+  static SensorFrame frame;
+  GridMap map;
+  DistMap field;
+  OccMap mapper;
+  Sim sim;
+
+  if (!loadGridMap(map, world.bitmap.c_str(), world.size_x, world.size_y)
+      || !loadDistMap(field, world.bitmap.c_str(), world.size_x,
+                      world.size_y, &map)) return;
+  initSim(sim, world);
+  sim.localize = false;
+  sim.noise.range = 0.01;
+  initOccMap(mapper, map, &field);
+
+  for (size_t i = 0; i < poses.size(); i++) {
+    sim.pose = sim.odom = poses[i];
+    simSense(sim, frame);
+    frame.seq = i + 1;         // The sim hasn't moved, but it's a new scan
+    ScopedTimer timer(prof, stage);
+    mapScan(mapper, frame, poses[i]);
+  }
+  freeDistMap(field);
+} // End of benchMapping()
+
+/**
+ * benchVfh()
+ *
+ * Steer round what the laser sees from each pose, as real-local -vfh does
+ * every tick, from the whole scan.
+ *
+ **/
+
+void benchVfh(const SimWorld& world, const std::vector<Pose2d>& poses,
+              LoopProfile& prof, int stage)
+{
+  static SensorFrame frame;
+  Vfh vfh;
+  Sim sim;
+
+  initSim(sim, world);
+  sim.localize = false;
+  sim.noise.range = 0.01;
+  initVfh(vfh);
+
+  for (size_t i = 0; i < poses.size(); i++) {
+    sim.pose = sim.odom = poses[i];
+    simSense(sim, frame);
+    double speed, turnrate;
+    ScopedTimer timer(prof, stage);
+    vfhStep(vfh, frame, 0, &speed, &turnrate);
+  }
+} // End of benchVfh()
+
+/**
+ * benchFootprint()
+ *
+ * Check the robot's footprint against the walls at poses close to them,
+ * where all of its rows get looked at, and then steer with the local
+ * planner checking its arcs that way, as local-roomba -footprint does.
+ *
+ **/
+
+void benchFootprint(const SimWorld& world, const Planner& planner,
+                    const std::vector<Pose2d>& poses, LoopProfile& prof,
+                    int stage, int dwa_stage)
+{
+  static SensorFrame frame;
+  static Footprint footprint;
+  BitGrid walls;
+  DwaPlanner dwa;
+  Sim sim;
+  volatile int sink = 0;
+
+  initFootprint(footprint, world.map.scale);
+  buildBitGrid(walls, world.map);
+  for (int i = 0; i < 10000; i++) {
+    const Pose2d& p = poses[(i * 7) % poses.size()];
+    double a = i * 0.1;
+    ScopedTimer timer(prof, stage);
+    sink += footprintHits(footprint, walls, p.px + 0.1 * cos(a),
+                          p.py + 0.1 * sin(a), a);
+  }
+
+  initSim(sim, world);
+  sim.localize = false;
+  initDwaPlanner(dwa, planner.costmap);
+  dwa.footprint = &footprint;
+  dwa.walls = &walls;
+  for (size_t i = 0; i + 1 < poses.size(); i++) {
+    sim.pose = sim.odom = poses[i];
+    simSense(sim, frame);
+    double speed = 0.5, turnrate = 0;
+    ScopedTimer timer(prof, dwa_stage);
+    dwaStep(dwa, frame, poses[i], poses[i + 1].px, poses[i + 1].py,
+            &speed, &turnrate);
+  }
+} // End of benchFootprint()
+
+/**
+ * benchLaserKernels()
+ *
+ * Turn each scan into points, and find the closest thing either side, with
+ * the kernels for the laser (laserkernel.h), as everything that reads the
+ * laser now does.
+ *
+ **/
+
+void benchLaserKernels(const SimWorld& world, const std::vector<Pose2d>& poses,
+                       LoopProfile& prof, int ends, int sides)
+{
+  static SensorFrame frame;
+  static float x[FRAME_MAX_BEAMS], y[FRAME_MAX_BEAMS];
+  volatile double sink = 0;
+  Sim sim;
+
+  initSim(sim, world);
+  sim.localize = false;
+  sim.noise.range = 0.01;
+
+  for (size_t i = 0; i < poses.size(); i++) {
+    sim.pose = sim.odom = poses[i];
+    simSense(sim, frame);
+    {
+      ScopedTimer timer(prof, ends);
+      beamEnds(frame.ranges, frame.bearings, frame.ranges_count, x, y);
+    }
+    double left, right;
+    {
+      ScopedTimer timer(prof, sides);
+      beamSides(frame.ranges, frame.bearings, frame.ranges_count,
+                frame.max_range, &left, &right);
+    }
+    sink += x[i % frame.ranges_count] + left + right;
+  }
+} // End of benchLaserKernels()
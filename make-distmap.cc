@@ -0,0 +1,112 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Distance map builder
+ *
+ ** Description ***************************************************************
+ *
+ *  Builds the distance map cache (see distmap.h) for a map bitmap ahead of
+ *  time, so the controllers don't have to on their first run:
+ *
+ *    ./make-distmap bitmaps/local.png 16 16
+ *
+ *  The size is the "size" the bitmap is given in the world file, and
+ *  defaults to 16 by 16 as in world4.world. Any number of bitmaps can be
+ *  given, each followed by its size if it isn't the default. The result
+ *  goes next to the bitmap, e.g. bitmaps/local.dmap.
+ */
+
+
+#include <iostream>
+#include <cstdlib>
+#include <sys/time.h>
+#include "distmap.h"
+
+/**
+ * Function headers
+ *
+ **/
+
+double now();
+bool isNumber(const char* s);
+
+/**
+ * main()
+ *
+ **/
+
+int main(int argc, char *argv[])
+{
+  int failed = 0;
+
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " bitmap [size_x size_y] [bitmap [size_x size_y] ...]"
+              << std::endl;
+    return 1;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    const char* bitmap = argv[i];
+    double size_x = 16, size_y = 16;
+    if (i + 2 < argc && isNumber(argv[i + 1]) && isNumber(argv[i + 2])) {
+      size_x = atof(argv[i + 1]);
+      size_y = atof(argv[i + 2]);
+      i += 2;
+    }
+
+    double start = now();
+    GridMap map;
+    std::vector<float> dist;
+    if (!loadGridMap(map, bitmap, size_x, size_y)) {
+      failed++;
+      continue;
+    }
+    computeDistances(map, dist);
+    double took = now() - start;
+
+    std::string path = cachePath(bitmap, ".dmap");
+    if (!writeDistMap(path.c_str(), map, dist,
+                      bitmapHash(bitmap, size_x, size_y))) {
+      std::cerr << "Can't write " << path << std::endl;
+      failed++;
+      continue;
+    }
+
+    float furthest = 0;
+    for (size_t j = 0; j < dist.size(); j++)
+      if (dist[j] > furthest) furthest = dist[j];
+
+    std::cout << path << ": " << map.width << "x" << map.height
+              << " cells of " << map.scale << "m, furthest from a wall "
+              << furthest << "m, built in " << took * 1000 << "ms"
+              << std::endl;
+  }
+
+  return failed ? 1 : 0;
+} // end of main()
+
+/**
+ * now()
+ *
+ * Wall clock time in seconds.
+ *
+ **/
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+} // End of now()
+
+/**
+ * isNumber()
+ *
+ **/
+
+bool isNumber(const char* s)
+{
+  char* end;
+  strtod(s, &end);
+  return end != s && *end == '\0';
+} // End of isNumber()
@@ -0,0 +1,186 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Mission compiler
+ *
+ ** Description ***************************************************************
+ *
+ *  Compiles mission files (see mission.h) ahead of time, so the
+ *  controllers don't have to on their first run, and says what is wrong
+ *  with them:
+ *
+ *    ./make-mission [-map bitmap [size_x size_y]] local.mission ...
+ *
+ *  The result goes next to the text, e.g. local.graph. For each mission it
+ *  prints how big the graph is, how long it took to compile and to load
+ *  again, and warns about goals that can't be got to from every node.
+ *  With -map (16 by 16 metres unless the size is given, as in
+ *  world4.world) it also warns about nodes in walls and edges the robot
+ *  can't drive straight along.
+ */
+
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <sys/time.h>
+#include "mission.h"
+#include "planner.h"
+
+/**
+ * Function headers
+ *
+ **/
+
+double now();
+bool isNumber(const char* s);
+int checkOnMap(const MissionGraph& g, const CostMap& cm);
+
+/**
+ * main()
+ *
+ **/
+
+int main(int argc, char *argv[])
+{
+  int failed = 0;
+  const char* bitmap = NULL;
+  double size_x = 16, size_y = 16;
+  std::vector<const char*> paths;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-map") == 0 && i + 1 < argc) {
+      bitmap = argv[++i];
+      if (i + 2 < argc && isNumber(argv[i + 1]) && isNumber(argv[i + 2])) {
+        size_x = atof(argv[++i]);
+        size_y = atof(argv[++i]);
+      }
+    }
+    else paths.push_back(argv[i]);
+  }
+  if (paths.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-map bitmap [size_x size_y]] mission [mission ...]"
+              << std::endl;
+    return 1;
+  }
+
+  DistMap field;
+  Planner planner;
+  if (bitmap != NULL) {
+    if (!loadDistMap(field, bitmap, size_x, size_y)) return 1;
+    initPlanner(planner, field);
+  }
+
+  for (size_t i = 0; i < paths.size(); i++) {
+    const char* path = paths[i];
+    MissionSource src;
+    std::vector<char> data;
+
+    double start = now();
+    if (!parseMission(src, path)) {
+      failed++;
+      continue;
+    }
+    compileMission(src, bitmapHash(path, 0, 0), data);
+    double took = now() - start;
+
+    std::string compiled = cachePath(path, ".graph");
+    if (!writeMission(compiled.c_str(), data)) {
+      std::cerr << "Can't write " << compiled << std::endl;
+      failed++;
+      continue;
+    }
+
+    // What the controllers will do with it
+    MissionGraph g;
+    start = now();
+    bool opened = loadMission(g, path);
+    double load = now() - start;
+    if (!opened) {
+      failed++;
+      continue;
+    }
+
+    std::cout << compiled << ": " << g.node_count << " nodes, "
+              << g.edge_count << " edges, " << g.goal_count << " goals in "
+              << data.size() << " bytes, compiled in " << took * 1000
+              << "ms, loads in " << load * 1e6 << "us" << std::endl;
+
+    int warnings = 0;
+    for (int k = 0; k < g.goal_count; k++) {
+      int goal = g.goals[k];
+      for (int n = 0; n < g.node_count; n++) {
+        if (routeCost(g, n, goal) < GRAPH_UNREACHABLE) continue;
+        std::cout << "  Warning: can't get to goal " << nodeName(g, goal)
+                  << " from " << nodeName(g, n) << std::endl;
+        warnings++;
+      }
+    }
+    if (bitmap != NULL) warnings += checkOnMap(g, planner.costmap);
+    if (warnings > 0) std::cout << "  " << warnings << " warnings" << std::endl;
+    freeMission(g);
+  }
+
+  if (bitmap != NULL) freeDistMap(field);
+  return failed ? 1 : 0;
+} // end of main()
+
+/**
+ * now()
+ *
+ * Wall clock time in seconds.
+ *
+ **/
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+} // End of now()
+
+/**
+ * isNumber()
+ *
+ **/
+
+bool isNumber(const char* s)
+{
+  char* end;
+  strtod(s, &end);
+  return end != s && *end == '\0';
+} // End of isNumber()
+
+/**
+ * checkOnMap()
+ *
+ * Warn about nodes the robot can't be at, and edges it can't drive along
+ * without hitting a wall. Returns how many warnings.
+ *
+ **/
+
+int checkOnMap(const MissionGraph& g, const CostMap& cm)
+{
+  int warnings = 0;
+  std::vector<int> cx(g.node_count), cy(g.node_count);
+
+  for (int i = 0; i < g.node_count; i++) {
+    cx[i] = (int)floor((g.nodes[i].x - cm.origin_x) / cm.scale);
+    cy[i] = (int)floor((g.nodes[i].y - cm.origin_y) / cm.scale);
+    if (costAt(cm, cx[i], cy[i]) >= COST_LETHAL) {
+      std::cout << "  Warning: node " << nodeName(g, i) << " at ("
+                << g.nodes[i].x << ", " << g.nodes[i].y << ") is in a wall"
+                << std::endl;
+      warnings++;
+    }
+  }
+  for (int i = 0; i < g.edge_count; i++) {
+    const GraphEdge& e = g.edges[i];
+    if (lineClear(cm, cx[e.a], cy[e.a], cx[e.b], cy[e.b], COST_LETHAL - 1))
+      continue;
+    std::cout << "  Warning: edge " << nodeName(g, e.a) << " - "
+              << nodeName(g, e.b) << " goes through a wall" << std::endl;
+    warnings++;
+  }
+  return warnings;
+} // End of checkOnMap()
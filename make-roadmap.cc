@@ -0,0 +1,219 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Roadmap maker
+ *
+ ** Description ***************************************************************
+ *
+ *  Makes the roadmaps (see roadmap.h) for map bitmaps ahead of time, so
+ *  the controllers don't have to on their first run, and says what they
+ *  came out like:
+ *
+ *    ./make-roadmap [-text] bitmap [size_x size_y] ...
+ *
+ *  Each bitmap is stretched over 16 by 16 metres, as in world4.world,
+ *  unless its size follows it. The roadmap goes next to the bitmap, e.g.
+ *  bitmaps/cave.road. For each one it prints how many nodes and edges it
+ *  has, how many pieces they are in (two nodes are in the same piece if
+ *  there is a way between them), the narrowest edge, and how long each
+ *  step of making it took and how long it takes to load again. With -text
+ *  it also writes it out as a mission (bitmaps/cave.mission), to be
+ *  edited by hand and given goals.
+ */
+
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <sys/time.h>
+#include "roadmap.h"
+
+/**
+ * Function headers
+ *
+ **/
+
+double now();
+bool isNumber(const char* s);
+int countPieces(const MissionGraph& g);
+bool writeText(const MissionGraph& g, const char* path);
+
+/**
+ * main()
+ *
+ **/
+
+int main(int argc, char *argv[])
+{
+  int failed = 0;
+  bool text = false;
+  std::vector<const char*> bitmaps;
+  std::vector<double> sizes;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-text") == 0) {
+      text = true;
+      continue;
+    }
+    bitmaps.push_back(argv[i]);
+    double size_x = 16, size_y = 16;
+    if (i + 2 < argc && isNumber(argv[i + 1]) && isNumber(argv[i + 2])) {
+      size_x = atof(argv[++i]);
+      size_y = atof(argv[++i]);
+    }
+    sizes.push_back(size_x);
+    sizes.push_back(size_y);
+  }
+  if (bitmaps.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-text] bitmap [size_x size_y] [bitmap ...]" << std::endl;
+    return 1;
+  }
+
+  for (size_t i = 0; i < bitmaps.size(); i++) {
+    const char* bitmap = bitmaps[i];
+    double size_x = sizes[2 * i], size_y = sizes[2 * i + 1];
+    GridMap grid;
+    DistMap field;
+    CostMap costmap;
+    RoadmapParams params;
+    RoadmapStats stats;
+    MissionSource src;
+    std::vector<char> data;
+
+    if (!loadGridMap(grid, bitmap, size_x, size_y)
+        || !loadDistMap(field, bitmap, size_x, size_y, &grid)) {
+      failed++;
+      continue;
+    }
+    buildCostMap(costmap, field, ROOMBA_RADIUS, 0.5);
+    initRoadmapParams(params);
+
+    double start = now();
+    if (!buildRoadmap(grid, costmap, params, src, &stats)) {
+      freeDistMap(field);
+      failed++;
+      continue;
+    }
+    uint64_t hash = roadmapHash(bitmap, size_x, size_y, costmap, params);
+    compileMission(src, hash, data);
+    double took = now() - start;
+
+    std::string path = cachePath(bitmap, ".road");
+    if (!writeMission(path.c_str(), data)) {
+      std::cerr << "Can't write " << path << std::endl;
+      freeDistMap(field);
+      failed++;
+      continue;
+    }
+
+    // What the controllers will do with it
+    MissionGraph g;
+    start = now();
+    bool opened = loadRoadmap(g, bitmap, size_x, size_y, grid, costmap,
+                              params);
+    double load = now() - start;
+    freeDistMap(field);
+    if (!opened) {
+      failed++;
+      continue;
+    }
+
+    float narrowest = 1e30f;
+    for (int k = 0; k < g.edge_count; k++)
+      narrowest = std::min(narrowest, g.edges[k].clearance);
+    std::cout << path << ": " << grid.width << "x" << grid.height
+              << " cells, " << g.node_count << " nodes, " << g.edge_count
+              << " edges in " << countPieces(g) << " pieces, narrowest "
+              << (g.edge_count > 0 ? narrowest : 0) << "m" << std::endl;
+    std::cout << "  Skeleton " << stats.skeleton << " cells, "
+              << stats.chains << " chains, " << stats.pruned << " pruned"
+              << std::endl;
+    std::cout << "  Made in " << took * 1000 << "ms: distances "
+              << stats.t_features * 1000 << "ms, skeleton "
+              << stats.t_skeleton * 1000 << "ms, graph "
+              << stats.t_graph * 1000 << "ms, legs " << stats.t_legs * 1000
+              << "ms; loads in " << load * 1e6 << "us" << std::endl;
+
+    if (text) {
+      std::string mission = cachePath(bitmap, ".mission");
+      if (writeText(g, mission.c_str()))
+        std::cout << "  Written out to " << mission << std::endl;
+      else failed++;
+    }
+    freeMission(g);
+  }
+  return failed ? 1 : 0;
+} // end of main()
+
+/**
+ * now()
+ *
+ * Wall clock time in seconds.
+ *
+ **/
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+} // End of now()
+
+/**
+ * isNumber()
+ *
+ **/
+
+bool isNumber(const char* s)
+{
+  char* end;
+  strtod(s, &end);
+  return end != s && *end == '\0';
+} // End of isNumber()
+
+/**
+ * countPieces()
+ *
+ * How many parts the graph is in, that there is no way between, from the
+ * route table: a node starts a new piece if none before it can get to it.
+ *
+ **/
+
+int countPieces(const MissionGraph& g)
+{
+  int pieces = 0;
+  for (int i = 0; i < g.node_count; i++) {
+    bool joined = false;
+    for (int j = 0; j < i && !joined; j++)
+      joined = routeCost(g, j, i) < GRAPH_UNREACHABLE;
+    if (!joined) pieces++;
+  }
+  return pieces;
+} // End of countPieces()
+
+/**
+ * writeText()
+ *
+ * The graph as a mission file, as parseMission() reads them.
+ *
+ **/
+
+bool writeText(const MissionGraph& g, const char* path)
+{
+  std::ofstream out(path);
+  if (!out) {
+    std::cerr << "Can't write " << path << std::endl;
+    return false;
+  }
+  out << "# Made by make-roadmap; the clearance of each node and edge is"
+      << std::endl << "# after it" << std::endl;
+  for (int i = 0; i < g.node_count; i++)
+    out << "node  " << nodeName(g, i) << "  " << g.nodes[i].x << "  "
+        << g.nodes[i].y << "    # " << g.nodes[i].clearance << std::endl;
+  for (int i = 0; i < g.edge_count; i++)
+    out << "edge  " << nodeName(g, g.edges[i].a) << "  "
+        << nodeName(g, g.edges[i].b) << "    # " << g.edges[i].clearance
+        << std::endl;
+  return (bool)out;
+} // End of writeText()
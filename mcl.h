@@ -0,0 +1,556 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - In-process Monte Carlo localization
+ *
+ ** Description ***************************************************************
+ *
+ *  A particle filter that does the same job as the amcl driver in
+ *  world42.cfg, but runs inside the controller. It is fed straight from the
+ *  odometry in Position2dProxy and the ranges in LaserProxy, so it updates
+ *  every time round the control loop rather than whenever Player gets
+ *  around to sending a new localize message.
+ *
+ *  Particles are stored as one array per field (x, y, a, w) so the weight
+ *  update runs as a straight loop over floats that the compiler can
+ *  vectorize. The number of particles is chosen by KLD sampling: lots while
+ *  the robot is lost, a few hundred once the cloud has collapsed.
+ *
+ *  Given a distance map (distmap.h) the laser is scored with amcl's
+ *  "likelihood field" model, which is one lookup per beam; without one it
+ *  falls back to the "beam" model, which casts a ray per beam per particle
+ *  with the kernel in raycast.h.
+ *
+ *  The filter reports "hypotheses" the way amcl does, by clustering the
+ *  particles and giving each cluster a mean and a total weight, so the
+ *  controller can treat the two sources interchangeably.
+ */
+
+#ifndef MCL_H
+#define MCL_H
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "distmap.h"
+#include "gridmap.h"
+#include "raycast.h"
+
+/**
+ * One cluster of particles, like player_localize_hypoth_t.
+ *
+ **/
+
+struct MclHypoth
+{
+  Pose2d mean;
+  double cov[3];  // Variance of x, y (m^2) and angle (rad^2), as amcl's
+  double alpha;   // Total weight of the particles in the cluster
+};
+
+/**
+ * The filter. Parameter names and defaults follow the amcl driver.
+ *
+ **/
+
+struct Mcl
+{
+  const GridMap* map;
+  const DistMap* field;   // Likelihood field model if set, else beam model
+  RayCaster caster;       // For the beam model
+
+  // The particles
+  int count;
+  std::vector<float> x, y, a, w;
+
+  // Scratch space, kept so we don't allocate every update
+  std::vector<float> nx, ny, na, p, expected, ca, sa;
+  std::vector<double> cdf;
+
+  // Sample count limits and KLD parameters
+  int    min_samples, max_samples;
+  double kld_err, kld_z;
+
+  // Odometry noise (odom_alpha1..4) and when to bother updating
+  double odom_alpha[4];
+  double update_min_d, update_min_a;
+
+  // Laser model
+  int    max_beams;
+  double max_range;
+  double sigma_hit, z_hit, z_rand;
+
+  // Where odometry said we were last time we updated
+  bool   have_odom;
+  Pose2d last_odom;
+
+  int updates;
+  std::mt19937 rng;
+};
+
+/**
+ * mclResize()
+ *
+ * Make room for n particles.
+ *
+ **/
+
+inline void mclResize(Mcl& mcl, int n)
+{
+  mcl.x.resize(n);  mcl.y.resize(n);  mcl.a.resize(n);  mcl.w.resize(n);
+  mcl.nx.resize(n); mcl.ny.resize(n); mcl.na.resize(n);
+  mcl.p.resize(n);  mcl.expected.resize(n);
+  mcl.ca.resize(n); mcl.sa.resize(n);
+  mcl.cdf.resize(n);
+} // End of mclResize()
+
+/**
+ * mclInitGlobal()
+ *
+ * Spread max_samples particles uniformly over the free space in the map.
+ * This is what amcl's "init_pose_var [8 8 6.3]" amounts to on a 16x16
+ * world.
+ *
+ **/
+
+inline void mclInitGlobal(Mcl& mcl)
+{
+  const GridMap& map = *mcl.map;
+  std::uniform_real_distribution<double> ux(0, map.width * map.scale);
+  std::uniform_real_distribution<double> uy(0, map.height * map.scale);
+  std::uniform_real_distribution<double> ua(-M_PI, M_PI);
+
+  mclResize(mcl, mcl.max_samples);
+  mcl.count = mcl.max_samples;
+  for (int i = 0; i < mcl.count; i++) {
+    double px, py;
+    do {
+      px = map.origin_x + ux(mcl.rng);
+      py = map.origin_y + uy(mcl.rng);
+    } while (pointOccupied(map, px, py));
+    mcl.x[i] = px;
+    mcl.y[i] = py;
+    mcl.a[i] = ua(mcl.rng);
+    mcl.w[i] = 1.0f / mcl.count;
+  }
+  mcl.have_odom = false;
+  mcl.updates = 0;
+} // End of mclInitGlobal()
+
+/**
+ * mclInitPose()
+ *
+ * Start again with the particles round a pose, as amcl does when it is
+ * given one: x and y with standard deviation sd_xy, heading sd_a. The
+ * odometry carries on from where it was.
+ *
+ **/
+
+inline void mclInitPose(Mcl& mcl, Pose2d pose, double sd_xy, double sd_a)
+{
+  std::normal_distribution<double> nxy(0, sd_xy);
+  std::normal_distribution<double> na(0, sd_a);
+
+  // Resampling may want all of max_samples again
+  mclResize(mcl, mcl.max_samples);
+  mcl.count = mcl.min_samples;
+  for (int i = 0; i < mcl.count; i++) {
+    mcl.x[i] = pose.px + nxy(mcl.rng);
+    mcl.y[i] = pose.py + nxy(mcl.rng);
+    mcl.a[i] = normalizeAngle(pose.pa + na(mcl.rng));
+    mcl.w[i] = 1.0f / mcl.count;
+  }
+} // End of mclInitPose()
+
+/**
+ * mclInit()
+ *
+ * Set up the filter with amcl's defaults, apart from the number of beams:
+ * amcl is limited to 6 in world42.cfg to keep it affordable, but we can
+ * use more since we're not paying for the messages.
+ *
+ **/
+
+inline void mclInit(Mcl& mcl, const GridMap& map,
+                    const DistMap* field = NULL, unsigned seed = 42)
+{
+  mcl.map = &map;
+  mcl.field = field;
+  if (field == NULL) initRayCaster(mcl.caster, map);
+  mcl.min_samples = 500;
+  mcl.max_samples = 10000;
+  mcl.kld_err = 0.01;
+  mcl.kld_z   = 2.326;   // 99% upper quantile of the standard normal
+  mcl.odom_alpha[0] = mcl.odom_alpha[1] = 0.2;
+  mcl.odom_alpha[2] = mcl.odom_alpha[3] = 0.2;
+  mcl.update_min_d = 0.05;
+  mcl.update_min_a = 0.05;
+  mcl.max_beams = 30;
+  mcl.max_range = 8.0;   // From sick.inc
+  mcl.sigma_hit = 0.2;
+  mcl.z_hit  = 0.95;
+  mcl.z_rand = 0.05;
+  mcl.rng.seed(seed);
+  mclInitGlobal(mcl);
+} // End of mclInit()
+
+/**
+ * mclPredict()
+ *
+ * Move the particles by the change in odometry since the last update,
+ * using the odometry motion model from Probabilistic Robotics (the "diff"
+ * model in amcl). Returns false, and does nothing, if we haven't moved far
+ * enough to be worth an update.
+ *
+ **/
+
+inline bool mclPredict(Mcl& mcl, Pose2d odom)
+{
+  if (!mcl.have_odom) {
+    mcl.last_odom = odom;
+    mcl.have_odom = true;
+    return false;
+  }
+
+  double dx = odom.px - mcl.last_odom.px;
+  double dy = odom.py - mcl.last_odom.py;
+  double da = normalizeAngle(odom.pa - mcl.last_odom.pa);
+  double trans = sqrt(dx * dx + dy * dy);
+
+  if (trans < mcl.update_min_d && fabs(da) < mcl.update_min_a) return false;
+
+  // Don't let a tiny reversal turn into a half-circle first rotation.
+  double rot1 = (trans < 0.01) ? 0.0
+    : normalizeAngle(atan2(dy, dx) - mcl.last_odom.pa);
+  double rot2 = normalizeAngle(da - rot1);
+  mcl.last_odom = odom;
+
+  double rot1_n = std::min(fabs(rot1), fabs(normalizeAngle(rot1 - M_PI)));
+  double rot2_n = std::min(fabs(rot2), fabs(normalizeAngle(rot2 - M_PI)));
+  const double* al = mcl.odom_alpha;
+  double sd_rot1  = sqrt(al[0] * rot1_n * rot1_n + al[1] * trans * trans);
+  double sd_trans = sqrt(al[2] * trans * trans
+                         + al[3] * (rot1_n * rot1_n + rot2_n * rot2_n));
+  double sd_rot2  = sqrt(al[0] * rot2_n * rot2_n + al[1] * trans * trans);
+
+  std::normal_distribution<float> n_rot1(0, sd_rot1);
+  std::normal_distribution<float> n_trans(0, sd_trans);
+  std::normal_distribution<float> n_rot2(0, sd_rot2);
+
+  for (int i = 0; i < mcl.count; i++) {
+    float r1 = rot1 + n_rot1(mcl.rng);
+    float t  = trans + n_trans(mcl.rng);
+    float r2 = rot2 + n_rot2(mcl.rng);
+    float h  = mcl.a[i] + r1;
+    mcl.x[i] += t * cosf(h);
+    mcl.y[i] += t * sinf(h);
+    mcl.a[i]  = h + r2;
+  }
+  return true;
+} // End of mclPredict()
+
+/**
+ * beamModel()
+ *
+ * Add each beam's contribution to p for every particle by casting a ray
+ * from the particle and comparing the range it should have seen.
+ *
+ **/
+
+inline void beamModel(Mcl& mcl, const double* ranges,
+                      const double* bearings, int n, int step)
+{
+  int   count = mcl.count;
+  float inv_2s2 = 1.0f / (2 * mcl.sigma_hit * mcl.sigma_hit);
+  float z_hit = mcl.z_hit;
+  float z_rand = mcl.z_rand / mcl.max_range;
+  float* p  = &mcl.p[0];
+  float* ca = &mcl.ca[0];
+  float* sa = &mcl.sa[0];
+  float* expected = &mcl.expected[0];
+
+  for (int j = 0; j < n; j += step) {
+    float z = ranges[j];
+    if (z >= mcl.max_range) continue;   // Max range readings tell us little
+
+    // One ray per particle, all along this beam's bearing.
+    for (int i = 0; i < count; i++) {
+      ca[i] = cosf(mcl.a[i] + bearings[j]);
+      sa[i] = sinf(mcl.a[i] + bearings[j]);
+    }
+    castRays(mcl.caster, &mcl.x[0], &mcl.y[0], ca, sa, count, mcl.max_range,
+             expected);
+
+    // Straight float arithmetic over the whole particle set, though expf()
+    // keeps it from vectorizing without -ffast-math.
+    for (int i = 0; i < count; i++) {
+      float d  = z - expected[i];
+      float pz = z_hit * expf(-d * d * inv_2s2) + z_rand;
+      p[i] += pz * pz * pz;
+    }
+  }
+} // End of beamModel()
+
+/**
+ * likelihoodFieldModel()
+ *
+ * Add each beam's contribution to p for every particle by looking up how
+ * far the end of the beam would be from the nearest obstacle. The beam
+ * offset only has to be rotated into each particle's frame, so apart from
+ * the lookup this is plain arithmetic across the particle arrays.
+ *
+ **/
+
+inline void likelihoodFieldModel(Mcl& mcl, const double* ranges,
+                                 const double* bearings, int n, int step)
+{
+  const DistMap& field = *mcl.field;
+  int   count = mcl.count;
+  float inv_2s2 = 1.0f / (2 * mcl.sigma_hit * mcl.sigma_hit);
+  float z_hit = mcl.z_hit;
+  float z_rand = mcl.z_rand / mcl.max_range;
+  float* p  = &mcl.p[0];
+  float* ca = &mcl.ca[0];
+  float* sa = &mcl.sa[0];
+  const float* x = &mcl.x[0];
+  const float* y = &mcl.y[0];
+
+  for (int i = 0; i < count; i++) {
+    ca[i] = cosf(mcl.a[i]);
+    sa[i] = sinf(mcl.a[i]);
+  }
+
+  for (int j = 0; j < n; j += step) {
+    float z = ranges[j];
+    if (z >= mcl.max_range) continue;
+    float bx = z * cos(bearings[j]);
+    float by = z * sin(bearings[j]);
+
+    for (int i = 0; i < count; i++) {
+      float ex = x[i] + ca[i] * bx - sa[i] * by;
+      float ey = y[i] + sa[i] * bx + ca[i] * by;
+      float d  = distAt(field, ex, ey, mcl.max_range);
+      float pz = z_hit * expf(-d * d * inv_2s2) + z_rand;
+      p[i] += pz * pz * pz;
+    }
+  }
+} // End of likelihoodFieldModel()
+
+/**
+ * mclUpdateLaser()
+ *
+ * Weight the particles by how well the scan fits the map from where each
+ * of them thinks the robot is. Uses max_beams of the n readings, evenly
+ * spread, and amcl's trick of summing the cubes of the per-beam
+ * probabilities rather than multiplying them, which is much less prone to
+ * collapsing onto one particle.
+ *
+ **/
+
+inline void mclUpdateLaser(Mcl& mcl, const double* ranges,
+                           const double* bearings, int n)
+{
+  const GridMap& map = *mcl.map;
+  int    count = mcl.count;
+  int    step = std::max(1, n / mcl.max_beams);
+  float* p = &mcl.p[0];
+
+  std::fill(p, p + count, 1.0f);
+  if (mcl.field != NULL) likelihoodFieldModel(mcl, ranges, bearings, n, step);
+  else beamModel(mcl, ranges, bearings, n, step);
+
+  // Particles that ended up inside walls get nothing.
+  float total = 0;
+  for (int i = 0; i < count; i++) {
+    if (pointOccupied(map, mcl.x[i], mcl.y[i])) p[i] = 0;
+    mcl.w[i] *= p[i];
+    total += mcl.w[i];
+  }
+
+  if (total > 0) {
+    float inv = 1.0f / total;
+    for (int i = 0; i < count; i++) mcl.w[i] *= inv;
+  } else {
+    for (int i = 0; i < count; i++) mcl.w[i] = 1.0f / count;
+  }
+  mcl.updates++;
+} // End of mclUpdateLaser()
+
+/**
+ * kldLimit()
+ *
+ * How many samples we need so that, with probability 1-delta, the KL
+ * distance between the sampled and true distribution is under kld_err,
+ * given the samples so far fall in k histogram bins (Fox, 2003).
+ *
+ **/
+
+inline int kldLimit(const Mcl& mcl, int k)
+{
+  if (k <= 1) return mcl.max_samples;
+  double b = 2.0 / (9.0 * (k - 1));
+  double c = 1.0 - b + sqrt(b) * mcl.kld_z;
+  double n = ceil((k - 1) / (2.0 * mcl.kld_err) * c * c * c);
+  if (n < mcl.min_samples) return mcl.min_samples;
+  if (n > mcl.max_samples) return mcl.max_samples;
+  return (int)n;
+} // End of kldLimit()
+
+/**
+ * mclBinKey()
+ *
+ * The histogram bin a pose falls in: 0.5m by 0.5m by 10 degrees, as amcl.
+ *
+ **/
+
+inline long long mclBinKey(float x, float y, float a)
+{
+  long long bx = (long long)floorf(x / 0.5f);
+  long long by = (long long)floorf(y / 0.5f);
+  long long ba = (long long)floorf(normalizeAngle(a) / (M_PI / 18));
+  if (ba > 17) ba = -18;
+  return ((bx & 0xfffff) << 40) | ((by & 0xfffff) << 20) | (ba & 0xfffff);
+} // End of mclBinKey()
+
+/**
+ * mclResample()
+ *
+ * Draw a new particle set from the weighted one, stopping as soon as the
+ * KLD bound says we have enough.
+ *
+ **/
+
+inline void mclResample(Mcl& mcl)
+{
+  double total = 0;
+  for (int i = 0; i < mcl.count; i++) {
+    total += mcl.w[i];
+    mcl.cdf[i] = total;
+  }
+
+  std::uniform_real_distribution<double> u(0, total);
+  std::unordered_map<long long, char> bins;
+  int n = 0;
+  int limit = mcl.max_samples;
+  double* cdf_end = &mcl.cdf[0] + mcl.count;
+
+  bins.reserve(1024);
+  while (n < limit) {
+    double r = u(mcl.rng);
+    int i = std::lower_bound(&mcl.cdf[0], cdf_end, r) - &mcl.cdf[0];
+    if (i >= mcl.count) i = mcl.count - 1;
+    mcl.nx[n] = mcl.x[i];
+    mcl.ny[n] = mcl.y[i];
+    mcl.na[n] = mcl.a[i];
+    n++;
+    size_t k = bins.size();
+    bins[mclBinKey(mcl.x[i], mcl.y[i], mcl.a[i])] = 1;
+    if (bins.size() != k) limit = kldLimit(mcl, bins.size());
+  }
+
+  mcl.count = n;
+  mcl.x.swap(mcl.nx);
+  mcl.y.swap(mcl.ny);
+  mcl.a.swap(mcl.na);
+  std::fill(mcl.w.begin(), mcl.w.begin() + n, 1.0f / n);
+} // End of mclResample()
+
+/**
+ * mclUpdate()
+ *
+ * One step of the filter: call this every time round the control loop.
+ * Returns true if the particles were updated.
+ *
+ **/
+
+inline bool mclUpdate(Mcl& mcl, Pose2d odom, const double* ranges,
+                      const double* bearings, int n)
+{
+  if (!mclPredict(mcl, odom)) return false;
+  mclUpdateLaser(mcl, ranges, bearings, n);
+  mclResample(mcl);
+  return true;
+} // End of mclUpdate()
+
+/**
+ * mclHypotheses()
+ *
+ * Group the particles into clusters of touching histogram bins and report
+ * one hypothesis per cluster, heaviest first.
+ *
+ **/
+
+inline void mclHypotheses(const Mcl& mcl, std::vector<MclHypoth>& hyps)
+{
+  struct Bin { double w, sx, sy, sxx, syy, sc, ss; int label; };
+  std::unordered_map<long long, Bin> bins;
+
+  for (int i = 0; i < mcl.count; i++) {
+    Bin& b = bins[mclBinKey(mcl.x[i], mcl.y[i], mcl.a[i])];
+    if (b.w == 0) b.label = -1;
+    b.w  += mcl.w[i];
+    b.sx += mcl.w[i] * mcl.x[i];
+    b.sy += mcl.w[i] * mcl.y[i];
+    b.sxx += mcl.w[i] * mcl.x[i] * mcl.x[i];
+    b.syy += mcl.w[i] * mcl.y[i] * mcl.y[i];
+    b.sc += mcl.w[i] * cosf(mcl.a[i]);
+    b.ss += mcl.w[i] * sinf(mcl.a[i]);
+  }
+
+  hyps.clear();
+  std::vector<long long> stack;
+  for (auto it = bins.begin(); it != bins.end(); ++it) {
+    if (it->second.label >= 0) continue;
+
+    // Flood fill the cluster this bin belongs to.
+    int label = hyps.size();
+    double w = 0, sx = 0, sy = 0, sxx = 0, syy = 0, sc = 0, ss = 0;
+    it->second.label = label;
+    stack.push_back(it->first);
+    while (!stack.empty()) {
+      long long key = stack.back();
+      stack.pop_back();
+      Bin& b = bins[key];
+      w += b.w; sx += b.sx; sy += b.sy; sxx += b.sxx; syy += b.syy;
+      sc += b.sc; ss += b.ss;
+
+      long long bx = key >> 40, by = (key >> 20) & 0xfffff, ba = key & 0xfffff;
+      if (ba >= 0x80000) ba -= 0x100000;
+      for (int i = -1; i <= 1; i++)
+        for (int j = -1; j <= 1; j++)
+          for (int k = -1; k <= 1; k++) {
+            long long nba = ba + k;
+            if (nba < -18) nba = 17;   // Wrap round at +-180 degrees
+            if (nba > 17) nba = -18;
+            long long nkey = (((bx + i) & 0xfffff) << 40)
+              | (((by + j) & 0xfffff) << 20) | (nba & 0xfffff);
+            auto n = bins.find(nkey);
+            if (n != bins.end() && n->second.label < 0) {
+              n->second.label = label;
+              stack.push_back(nkey);
+            }
+          }
+    }
+
+    MclHypoth h;
+    h.alpha = w;
+    h.mean.px = (w > 0) ? sx / w : 0;
+    h.mean.py = (w > 0) ? sy / w : 0;
+    h.mean.pa = atan2(ss, sc);
+    // The angle's spread is the circular variance, -2 ln R, where R is how
+    // long the mean of the headings as unit vectors is
+    h.cov[0] = (w > 0) ? std::max(sxx / w - h.mean.px * h.mean.px, 0.0) : 0;
+    h.cov[1] = (w > 0) ? std::max(syy / w - h.mean.py * h.mean.py, 0.0) : 0;
+    double r = (w > 0) ? sqrt(sc * sc + ss * ss) / w : 0;
+    h.cov[2] = (r > 1e-6) ? std::min(-2 * log(std::min(r, 1.0)), 10.0) : 10.0;
+    hyps.push_back(h);
+  }
+
+  std::sort(hyps.begin(), hyps.end(),
+            [](const MclHypoth& l, const MclHypoth& r) {
+              return l.alpha > r.alpha;
+            });
+} // End of mclHypotheses()
+
+#endif
@@ -0,0 +1,562 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Mission graphs
+ *
+ ** Description ***************************************************************
+ *
+ *  A graph of named places on a map, the ways between them, and a list of
+ *  places to go to, read from a text file so that routes can be changed
+ *  without building the controllers again. For example:
+ *
+ *    # Comments run to the end of the line
+ *    node  start   -6    -6
+ *    node  door     1    -5
+ *    node  goal     5    -3.5
+ *    edge  start door            # costs the distance between them
+ *    edge  door  goal   10       # ...or what it's given
+ *    goal  goal
+ *
+ *  Edges go both ways. The goals are visited in the order given.
+ *
+ *  The text is compiled into a binary file next to it (local.mission gives
+ *  local.graph), which later runs just map into memory, as distmap.h does
+ *  with its distance maps. Along with the graph itself, the compiled file
+ *  holds the cheapest cost between every pair of nodes and the first node
+ *  to go to on the way, found with Dijkstra's algorithm run out from each
+ *  node in turn, so a route between any two nodes is just a matter of
+ *  following the table, with no searching. The file is:
+ *
+ *    MissionHeader   (64 bytes, see below)
+ *    GraphNode[n]    where each node is, and where its name is
+ *    GraphEdge[e]    which nodes, and what it costs to go between them
+ *    uint16[n * n]   next[from * n + to], GRAPH_NONE if there's no way
+ *    float[n * n]    cost[from * n + to], GRAPH_UNREACHABLE likewise
+ *    uint16[g]       the goals, padded to 4 bytes
+ *    char[]          the names, each ending in a 0
+ *
+ *  Nodes and edges also say how far the robot stays from the walls at the
+ *  node, and all along the edge. Graphs made from the map (roadmap.h) fill
+ *  that in; for one written by hand it is 0, not known.
+ *
+ *  The compiled file is only used if its version matches MISSION_VERSION
+ *  and it was compiled from the same text; otherwise it is compiled again.
+ *  make-mission compiles them ahead of time.
+ */
+
+#ifndef MISSION_H
+#define MISSION_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "distmap.h"
+#include "gridmap.h"
+
+#define MISSION_VERSION    2
+#define GRAPH_MAX_NODES    65535
+#define GRAPH_NONE         0xffff
+#define GRAPH_UNREACHABLE  1e30f
+
+/**
+ * What's at the front of a .graph file.
+ *
+ **/
+
+struct MissionHeader
+{
+  char     magic[4];          // "MGRF"
+  uint32_t version;
+  uint32_t node_count, edge_count, goal_count;
+  uint32_t names_size;        // Bytes
+  uint64_t source_hash;       // See bitmapHash()
+  char     pad[32];
+};
+static_assert(sizeof(MissionHeader) == 64, "MissionHeader must be 64 bytes");
+
+struct GraphNode
+{
+  float    x, y;
+  uint32_t name;              // Offset into the names
+  float    clearance;         // Metres to the nearest wall, 0 if not known
+};
+
+struct GraphEdge
+{
+  uint16_t a, b;
+  float    cost;
+  float    clearance;         // Closest it comes to a wall, likewise
+};
+
+/**
+ * A mission as read from the text, before it is compiled.
+ *
+ **/
+
+struct MissionSource
+{
+  std::vector<std::string> names;
+  std::vector<Point2d>     points;
+  std::vector<float>       clearances;   // Of the nodes, if known
+  std::vector<GraphEdge>   edges;
+  std::vector<int>         goals;
+};
+
+/**
+ * A loaded mission. As with DistMap, the pointers point either into the
+ * mapped file or into "owned".
+ *
+ **/
+
+struct MissionGraph
+{
+  int node_count, edge_count, goal_count;
+  const GraphNode* nodes;
+  const GraphEdge* edges;
+  const uint16_t*  next;
+  const float*     cost;
+  const uint16_t*  goals;
+  const char*      names;
+
+  void*  mapping;
+  size_t mapping_size;
+  std::vector<char> owned;
+};
+
+/**
+ * missionNode()
+ *
+ * The index of the node called "name", or -1.
+ *
+ **/
+
+inline int missionNode(const MissionSource& src, const std::string& name)
+{
+  for (size_t i = 0; i < src.names.size(); i++)
+    if (src.names[i] == name) return i;
+  return -1;
+} // End of missionNode()
+
+/**
+ * parseMission()
+ *
+ * Read a mission from its text. Says what's wrong, and where, and returns
+ * false if it can't.
+ *
+ **/
+
+inline bool parseMission(MissionSource& src, const char* path)
+{
+  std::ifstream in(path);
+  std::string line;
+  int line_no = 0;
+
+  src.names.clear();
+  src.points.clear();
+  src.clearances.clear();
+  src.edges.clear();
+  src.goals.clear();
+  if (!in) {
+    std::cerr << "Can't read mission " << path << std::endl;
+    return false;
+  }
+
+  while (std::getline(in, line)) {
+    line_no++;
+    size_t hash = line.find('#');
+    if (hash != std::string::npos) line.erase(hash);
+    std::istringstream words(line);
+    std::string what, a, b, extra;
+    if (!(words >> what)) continue;
+
+    bool ok = true;
+    if (what == "node") {
+      Point2d p;
+      ok = (words >> a >> p.x >> p.y) && missionNode(src, a) < 0
+        && src.names.size() < GRAPH_MAX_NODES;
+      if (ok) {
+        src.names.push_back(a);
+        src.points.push_back(p);
+      }
+    } else if (what == "edge") {
+      GraphEdge e;
+      int ia, ib;
+      ok = (words >> a >> b) && (ia = missionNode(src, a)) >= 0
+        && (ib = missionNode(src, b)) >= 0 && ia != ib;
+      if (ok) {
+        e.a = ia;
+        e.b = ib;
+        e.cost = hypot(src.points[ia].x - src.points[ib].x,
+                       src.points[ia].y - src.points[ib].y);
+        e.clearance = 0;
+        double cost;
+        if (words >> cost) e.cost = cost;
+        else words.clear();
+        ok = e.cost >= 0;
+        src.edges.push_back(e);
+      }
+    } else if (what == "goal") {
+      int ia = -1;
+      ok = (words >> a) && (ia = missionNode(src, a)) >= 0;
+      if (ok) src.goals.push_back(ia);
+    } else {
+      ok = false;
+    }
+    if (ok && (words >> extra)) ok = false;
+    if (!ok) {
+      std::cerr << path << ":" << line_no << ": can't make sense of \""
+                << line << "\"" << std::endl;
+      return false;
+    }
+  }
+  if (src.names.empty()) {
+    std::cerr << path << ": no nodes" << std::endl;
+    return false;
+  }
+  return true;
+} // End of parseMission()
+
+/**
+ * routeTable()
+ *
+ * For every node, the cheapest cost to every other and which neighbour to
+ * go to first. Dijkstra's algorithm is run out from each node "to"; since
+ * the edges go both ways, the node each node was reached from is its next
+ * step towards "to".
+ *
+ **/
+
+inline void routeTable(const MissionSource& src, std::vector<uint16_t>& next,
+                       std::vector<float>& cost)
+{
+  typedef std::pair<float, int> Entry;
+  int n = src.names.size();
+  std::vector<std::vector<std::pair<int, float> > > adj(n);
+
+  for (size_t i = 0; i < src.edges.size(); i++) {
+    const GraphEdge& e = src.edges[i];
+    adj[e.a].push_back(std::make_pair((int)e.b, e.cost));
+    adj[e.b].push_back(std::make_pair((int)e.a, e.cost));
+  }
+  next.assign((size_t)n * n, GRAPH_NONE);
+  cost.assign((size_t)n * n, GRAPH_UNREACHABLE);
+
+  std::vector<float> d(n);
+  for (int to = 0; to < n; to++) {
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > open;
+    std::fill(d.begin(), d.end(), GRAPH_UNREACHABLE);
+    d[to] = 0;
+    next[(size_t)to * n + to] = to;
+    open.push(Entry(0, to));
+    while (!open.empty()) {
+      Entry top = open.top();
+      open.pop();
+      int u = top.second;
+      if (top.first > d[u]) continue;
+      for (size_t k = 0; k < adj[u].size(); k++) {
+        int v = adj[u][k].first;
+        float dv = d[u] + adj[u][k].second;
+        if (dv < d[v]) {
+          d[v] = dv;
+          next[(size_t)v * n + to] = u;
+          open.push(Entry(dv, v));
+        }
+      }
+    }
+    for (int from = 0; from < n; from++) cost[(size_t)from * n + to] = d[from];
+  }
+} // End of routeTable()
+
+/**
+ * compileMission()
+ *
+ * The whole of the .graph file for a mission, in memory.
+ *
+ **/
+
+inline void compileMission(const MissionSource& src, uint64_t hash,
+                           std::vector<char>& out)
+{
+  MissionHeader hdr;
+  std::vector<GraphNode> nodes(src.names.size());
+  std::vector<uint16_t> next, goals(src.goals.begin(), src.goals.end());
+  std::vector<float> cost;
+  std::string names;
+
+  routeTable(src, next, cost);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    nodes[i].x = src.points[i].x;
+    nodes[i].y = src.points[i].y;
+    nodes[i].name = names.size();
+    nodes[i].clearance = i < src.clearances.size() ? src.clearances[i] : 0;
+    names += src.names[i];
+    names += '\0';
+  }
+  // Everything after the uint16 arrays stays 4 byte aligned
+  if (next.size() % 2) next.push_back(GRAPH_NONE);
+  if (goals.size() % 2) goals.push_back(GRAPH_NONE);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, "MGRF", 4);
+  hdr.version     = MISSION_VERSION;
+  hdr.node_count  = nodes.size();
+  hdr.edge_count  = src.edges.size();
+  hdr.goal_count  = src.goals.size();
+  hdr.names_size  = names.size();
+  hdr.source_hash = hash;
+
+  out.clear();
+  out.insert(out.end(), (const char*)&hdr, (const char*)(&hdr + 1));
+  out.insert(out.end(), (const char*)&nodes[0],
+             (const char*)(&nodes[0] + nodes.size()));
+  if (!src.edges.empty())
+    out.insert(out.end(), (const char*)&src.edges[0],
+               (const char*)(&src.edges[0] + src.edges.size()));
+  out.insert(out.end(), (const char*)&next[0],
+             (const char*)(&next[0] + next.size()));
+  out.insert(out.end(), (const char*)&cost[0],
+             (const char*)(&cost[0] + cost.size()));
+  if (!goals.empty())
+    out.insert(out.end(), (const char*)&goals[0],
+               (const char*)(&goals[0] + goals.size()));
+  out.insert(out.end(), names.begin(), names.end());
+} // End of compileMission()
+
+/**
+ * attachMission()
+ *
+ * Point a MissionGraph at a compiled mission in memory, checking that it
+ * is one. Returns false, leaving the pointers alone, if it isn't.
+ *
+ **/
+
+inline bool attachMission(MissionGraph& g, const char* mem, size_t size,
+                          uint64_t hash)
+{
+  MissionHeader hdr;
+
+  if (size < sizeof(hdr)) return false;
+  memcpy(&hdr, mem, sizeof(hdr));
+  if (memcmp(hdr.magic, "MGRF", 4) != 0 || hdr.version != MISSION_VERSION
+      || (hash != 0 && hdr.source_hash != hash)) return false;
+
+  size_t n = hdr.node_count;
+  size_t at_nodes = sizeof(hdr);
+  size_t at_edges = at_nodes + n * sizeof(GraphNode);
+  size_t at_next  = at_edges + hdr.edge_count * sizeof(GraphEdge);
+  size_t at_cost  = at_next + (n * n + 1) / 2 * 2 * sizeof(uint16_t);
+  size_t at_goals = at_cost + n * n * sizeof(float);
+  size_t at_names = at_goals + (hdr.goal_count + 1) / 2 * 2 * sizeof(uint16_t);
+  if (size != at_names + hdr.names_size) return false;
+
+  g.node_count = hdr.node_count;
+  g.edge_count = hdr.edge_count;
+  g.goal_count = hdr.goal_count;
+  g.nodes = (const GraphNode*)(mem + at_nodes);
+  g.edges = (const GraphEdge*)(mem + at_edges);
+  g.next  = (const uint16_t*)(mem + at_next);
+  g.cost  = (const float*)(mem + at_cost);
+  g.goals = (const uint16_t*)(mem + at_goals);
+  g.names = mem + at_names;
+  return true;
+} // End of attachMission()
+
+/**
+ * openMission()
+ *
+ * Map a .graph file into memory. If "hash" is non-zero it must have been
+ * compiled from text with that hash.
+ *
+ **/
+
+inline bool openMission(MissionGraph& g, const char* path, uint64_t hash)
+{
+  struct stat st;
+
+  g.mapping = NULL;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(MissionHeader)) {
+    close(fd);
+    return false;
+  }
+  void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  if (!attachMission(g, (const char*)mem, st.st_size, hash)) {
+    munmap(mem, st.st_size);
+    return false;
+  }
+  g.mapping = mem;
+  g.mapping_size = st.st_size;
+  return true;
+} // End of openMission()
+
+/**
+ * writeMission()
+ *
+ * Save a compiled mission, by way of a temporary file as writeDistMap()
+ * does.
+ *
+ **/
+
+inline bool writeMission(const char* path, const std::vector<char>& data)
+{
+  std::string tmp = std::string(path) + ".tmp";
+
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  if (fp == NULL) return false;
+  bool ok = fwrite(&data[0], 1, data.size(), fp) == data.size();
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), path) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+} // End of writeMission()
+
+/**
+ * freeMission()
+ *
+ **/
+
+inline void freeMission(MissionGraph& g)
+{
+  if (g.mapping != NULL) munmap(g.mapping, g.mapping_size);
+  g.mapping = NULL;
+  g.owned.clear();
+  g.node_count = g.edge_count = g.goal_count = 0;
+} // End of freeMission()
+
+/**
+ * loadMission()
+ *
+ * Get the compiled form of a mission, from the .graph file next to it if
+ * that is up to date and otherwise by compiling it (and saving that for
+ * next time).
+ *
+ **/
+
+inline bool loadMission(MissionGraph& g, const char* path)
+{
+  // The text is hashed as if it were a bitmap of no size
+  uint64_t hash = bitmapHash(path, 0, 0);
+  std::string compiled = cachePath(path, ".graph");
+  MissionSource src;
+  std::vector<char> data;
+
+  g.mapping = NULL;
+  if (hash == 0) {
+    std::cerr << "Can't read mission " << path << std::endl;
+    return false;
+  }
+  if (openMission(g, compiled.c_str(), hash)) return true;
+
+  if (!parseMission(src, path)) return false;
+  compileMission(src, hash, data);
+  if (writeMission(compiled.c_str(), data)
+      && openMission(g, compiled.c_str(), hash)) return true;
+
+  std::cerr << "Warning: can't save compiled mission in " << compiled
+            << std::endl;
+  g.owned.swap(data);
+  return attachMission(g, &g.owned[0], g.owned.size(), hash);
+} // End of loadMission()
+
+/**
+ * nodeName()
+ *
+ **/
+
+inline const char* nodeName(const MissionGraph& g, int i)
+{
+  return g.names + g.nodes[i].name;
+} // End of nodeName()
+
+/**
+ * findNode()
+ *
+ * The index of the node called "name", or -1.
+ *
+ **/
+
+inline int findNode(const MissionGraph& g, const char* name)
+{
+  for (int i = 0; i < g.node_count; i++)
+    if (strcmp(nodeName(g, i), name) == 0) return i;
+  return -1;
+} // End of findNode()
+
+/**
+ * nearestNodeWhere()
+ *
+ * The closest node to (x, y) for which ok(i) is true, or -1.
+ *
+ **/
+
+template <typename Pred>
+inline int nearestNodeWhere(const MissionGraph& g, double x, double y,
+                            Pred ok)
+{
+  int best = -1;
+  double best_d2 = 0;
+  for (int i = 0; i < g.node_count; i++) {
+    double dx = g.nodes[i].x - x, dy = g.nodes[i].y - y;
+    double d2 = dx * dx + dy * dy;
+    if ((best < 0 || d2 < best_d2) && ok(i)) {
+      best = i;
+      best_d2 = d2;
+    }
+  }
+  return best;
+} // End of nearestNodeWhere()
+
+/**
+ * routeCost()
+ *
+ **/
+
+inline float routeCost(const MissionGraph& g, int from, int to)
+{
+  return g.cost[(size_t)from * g.node_count + to];
+} // End of routeCost()
+
+/**
+ * findRoute()
+ *
+ * The nodes to go through to get from one node to another, including
+ * both, as points. False if there is no way.
+ *
+ **/
+
+inline bool findRoute(const MissionGraph& g, int from, int to,
+                      std::vector<Point2d>& route)
+{
+  route.clear();
+  if (from < 0 || to < 0 || from >= g.node_count || to >= g.node_count)
+    return false;
+  int at = from;
+  while (true) {
+    Point2d p = { g.nodes[at].x, g.nodes[at].y };
+    route.push_back(p);
+    if (at == to) return true;
+    at = g.next[(size_t)at * g.node_count + to];
+    if (at == GRAPH_NONE) {
+      route.clear();
+      return false;
+    }
+  }
+} // End of findRoute()
+
+#endif
@@ -0,0 +1,586 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Monte Carlo runner
+ *
+ ** Description ***************************************************************
+ *
+ *  Runs one of the controllers many times over in the headless simulator
+ *  (sim.h), from random starting points, and says how well it does:
+ *
+ *    ./montecarlo [-task localize|goal] [-n episodes] [-threads n]
+ *                 [-noise none|low|high|mixed] [-goal x y] [-navfn]
+ *                 [-roadmap]
+ *                 [-dwa] [-footprint] [-scanmatch] [-active] [-kidnap]
+ *                 [-scan] [-vfh] [-time seconds] [-seed n] [-csv file]
+ *                 [world]
+ *
+ *  "localize" is real-local with our own particle filter (there is no amcl
+ *  in the simulator), and an episode succeeds when it is 99% sure where it
+ *  is; -scanmatch feeds the filter odometry corrected by scanmatch.h, and
+ *  -active has it move to tell its hypotheses apart (activeloc.h) rather
+ *  than wander. With -kidnap the robot, having localized, is picked up two
+ *  seconds later and put down somewhere else at random, and the episode
+ *  succeeds when relocalize.h (or the filter, if that gives up) finds it
+ *  again, to within half a metre; the time is from the kidnapping. "goal"
+ *  is local-roomba, with fakelocalize, driving to (5, -3.5) or the goal
+ *  given, and succeeds when it gets there; -dwa has it steer with the
+ *  local planner in dwa.h, which gives it a laser, and -footprint (which
+ *  means -dwa) has that check the walls with the robot's shape, from
+ *  footprint.h, rather than the costmap (for the round Roomba that gives
+ *  the same results, more slowly); -roadmap has it go by the roads
+ *  roadmap.h finds on the world's map rather than planning. Either gives
+ *  up after 10 simulated minutes, or the time given. -scan has whatever
+ *  uses the laser use it by way of scan.h. -vfh has real-local steer round
+ *  things with the vector field histogram in vfh.h.
+ *
+ *  Each episode starts the robot at a random pose at least 10cm clear of
+ *  anything, with the noise model given, or with none, low and high noise
+ *  in turn for "mixed". Everything random about an episode comes from the
+ *  seed and the episode number, so the results are the same however many
+ *  threads there are. The episodes are spread over the cores with the
+ *  work stealing pool in workpool.h; the world is loaded once and shared.
+ *
+ *  For each noise model we print how many episodes succeeded and, over
+ *  those, the time taken, the collisions on the way (times a bumper went
+ *  down or the robot stalled), and the final error: how far the best
+ *  hypothesis was from the truth, or how far from the goal the robot
+ *  stopped. -csv saves every episode. Defaults to 100 episodes on
+ *  world4.world with as many threads as there are cores.
+ */
+
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <sys/time.h>
+#include "gotogoal.h"
+#include "roadmap.h"
+#include "robotclient.h"
+#include "wander.h"
+#include "workpool.h"
+
+#define TASK_LOCALIZE  0
+#define TASK_GOAL      1
+
+#define NOISE_MODELS   3
+#define NOISE_MIXED    -1
+
+// How far from anything a robot may start
+#define START_CLEARANCE 0.1
+
+/**
+ * One episode: how it was set up, and how it went.
+ *
+ **/
+
+struct Episode
+{
+  int    noise;                // Which noise model
+  Pose2d start;
+  Pose2d kidnap;               // Where it's put down, with -kidnap
+  unsigned seed;
+
+  bool   ok;                   // Localized, or got to the goal
+  const char* outcome;
+  double time;                 // Simulated seconds
+  int    ticks;
+  int    collisions;
+  double error;                // Metres, see above
+  double angle_error;          // Radians, localizing only
+  double wall;                 // Seconds it took to run
+};
+
+/**
+ * What each thread needs to itself.
+ *
+ **/
+
+struct Worker
+{
+  Planner planner;
+  Mcl     mcl;
+  ScanMatcher matcher;
+  ActiveLocalizer active;
+  PoseGuard guard;
+  DwaPlanner dwa;
+  LaserScan scan;
+  Vfh     vfh;
+  BitGrid walls;
+  SensorFrame frame;
+};
+
+/**
+ * Everything the episodes share, none of which they change.
+ *
+ **/
+
+struct Setup
+{
+  int    task;
+  const SimWorld* world;
+  const NavField* navfn;
+  const MissionGraph* roadmap;
+  double goal_x, goal_y;
+  double time_limit;
+  unsigned seed;
+  bool   scanmatch;            // Correct the odometry by scan matching
+  bool   active;               // Move to localize rather than wander
+  bool   kidnap;               // Then move it, and see if it notices
+  bool   dwa;                  // Steer with the local planner
+  bool   scan;                 // Preprocess the laser
+  bool   vfh;                  // Steer with the histogram
+  const Footprint* footprint;  // Check the local planner's arcs with this
+};
+
+const char* noise_names[NOISE_MODELS] = { "none", "low", "high" };
+
+// Range sd (m), odometry error per metre and per radian, as in SimNoise
+const SimNoise noise_models[NOISE_MODELS] = {
+  { 0,    0,    0    },
+  { 0.01, 0.02, 0.02 },
+  { 0.05, 0.1,  0.1  }
+};
+
+/**
+ * Function headers
+ *
+ **/
+
+double now();
+Pose2d randomStart(const SimWorld& world, std::mt19937& rng);
+void runEpisode(const Setup& setup, Worker& worker, Episode& ep);
+double percentile(std::vector<double>& v, double p);
+void report(const char* name, const std::vector<Episode>& eps, int noise);
+void writeCsv(const char* path, const std::vector<Episode>& eps);
+
+/**
+ * main()
+ *
+ **/
+
+int main(int argc, char *argv[])
+{
+  int n_episodes = 100;
+  int n_threads = std::thread::hardware_concurrency();
+  int noise = NOISE_MIXED;
+  bool use_navfn = false;
+  MissionGraph roadmap;
+  bool use_roadmap = false;
+  const char* world_path = "world4.world";
+  const char* csv = NULL;
+  SimWorld world;
+  NavField navfn;
+  Footprint footprint;
+  bool use_footprint = false;
+  Setup setup;
+
+  setup.task = TASK_LOCALIZE;
+  setup.goal_x = 5;
+  setup.goal_y = -3.5;
+  setup.time_limit = 600;
+  setup.seed = 1;
+  setup.navfn = NULL;
+  setup.roadmap = NULL;
+  setup.scanmatch = false;
+  setup.active = false;
+  setup.kidnap = false;
+  setup.dwa = false;
+  setup.scan = false;
+  setup.vfh = false;
+  setup.footprint = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-task") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "goal") == 0) setup.task = TASK_GOAL;
+      else if (strcmp(argv[i], "localize") == 0) setup.task = TASK_LOCALIZE;
+      else {
+        std::cerr << "Unknown task " << argv[i] << std::endl;
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      n_episodes = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+      n_threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-noise") == 0 && i + 1 < argc) {
+      i++;
+      noise = -2;
+      if (strcmp(argv[i], "mixed") == 0) noise = NOISE_MIXED;
+      for (int k = 0; k < NOISE_MODELS; k++)
+        if (strcmp(argv[i], noise_names[k]) == 0) noise = k;
+      if (noise == -2) {
+        std::cerr << "Unknown noise model " << argv[i] << std::endl;
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "-goal") == 0 && i + 2 < argc) {
+      setup.goal_x = atof(argv[++i]);
+      setup.goal_y = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-navfn") == 0) use_navfn = true;
+    else if (strcmp(argv[i], "-roadmap") == 0) use_roadmap = true;
+    else if (strcmp(argv[i], "-dwa") == 0) setup.dwa = true;
+    else if (strcmp(argv[i], "-footprint") == 0)
+      setup.dwa = use_footprint = true;
+    else if (strcmp(argv[i], "-scanmatch") == 0) setup.scanmatch = true;
+    else if (strcmp(argv[i], "-scan") == 0) setup.scan = true;
+    else if (strcmp(argv[i], "-vfh") == 0) setup.vfh = true;
+    else if (strcmp(argv[i], "-active") == 0) setup.active = true;
+    else if (strcmp(argv[i], "-kidnap") == 0) setup.kidnap = true;
+    else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc)
+      setup.time_limit = atof(argv[++i]);
+    else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+      setup.seed = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-csv") == 0 && i + 1 < argc) csv = argv[++i];
+    else world_path = argv[i];
+  }
+  if (n_threads < 1) n_threads = 1;
+
+  if (!loadSimWorld(world, world_path)) return 1;
+  setup.world = &world;
+  if (setup.task == TASK_GOAL && use_navfn) {
+    Planner planner;
+    initPlanner(planner, world.dist);
+    if (!loadNavField(navfn, planner.costmap, world.bitmap.c_str(),
+                      world.size_x, world.size_y,
+                      setup.goal_x, setup.goal_y)) return 1;
+    setup.navfn = &navfn;
+  }
+  if (use_navfn && use_roadmap) {
+    std::cerr << "-roadmap is instead of -navfn" << std::endl;
+    return 1;
+  }
+  if (setup.task == TASK_GOAL && use_roadmap) {
+    Planner planner;
+    RoadmapParams roads;
+    initPlanner(planner, world.dist);
+    initRoadmapParams(roads);
+    if (!loadRoadmap(roadmap, world.bitmap.c_str(), world.size_x,
+                     world.size_y, world.map, planner.costmap, roads))
+      return 1;
+    setup.roadmap = &roadmap;
+  }
+  if (setup.task == TASK_GOAL && use_footprint) {
+    initFootprint(footprint, world.map.scale);
+    setup.footprint = &footprint;
+  }
+
+  // Set up every episode before we start, so they don't depend on the order
+  // they run in
+  std::vector<Episode> eps(n_episodes);
+  for (int e = 0; e < n_episodes; e++) {
+    std::seed_seq seq = { setup.seed, (unsigned)e };
+    std::mt19937 rng(seq);
+    eps[e].noise = noise == NOISE_MIXED ? e % NOISE_MODELS : noise;
+    eps[e].start = randomStart(world, rng);
+    eps[e].seed  = rng();
+    eps[e].kidnap = randomStart(world, rng);
+  }
+
+  // Planners and filters are big, so each thread keeps its own rather
+  // than each episode making new ones
+  std::vector<Worker*> workers;
+  for (int t = 0; t < n_threads && t < n_episodes; t++) {
+    workers.push_back(new Worker);
+    if (setup.task == TASK_GOAL) initPlanner(workers[t]->planner, world.dist);
+    if (setup.footprint != NULL) buildBitGrid(workers[t]->walls, world.map);
+  }
+
+  double start = now();
+  PoolStats stats = runParallel(n_episodes, n_threads,
+                                [&](int e, int t) {
+                                  runEpisode(setup, *workers[t], eps[e]);
+                                });
+  double took = now() - start;
+
+  std::cout << n_episodes << " "
+            << (setup.task == TASK_GOAL ? "goal" : "localize")
+            << " episodes on " << world_path << " in " << took << "s, "
+            << stats.threads << " threads, " << stats.stolen
+            << " episodes stolen" << std::endl;
+  for (int k = 0; k < NOISE_MODELS; k++) report(noise_names[k], eps, k);
+  if (noise == NOISE_MIXED) report("all", eps, NOISE_MIXED);
+
+  if (csv != NULL) writeCsv(csv, eps);
+  for (size_t t = 0; t < workers.size(); t++) delete workers[t];
+  if (setup.navfn != NULL) freeNavField(navfn);
+  if (setup.roadmap != NULL) freeMission(roadmap);
+  return 0;
+} // end of main()
+
+/**
+ * now()
+ *
+ * Wall clock time in seconds.
+ *
+ **/
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+} // End of now()
+
+/**
+ * randomStart()
+ *
+ * A pose anywhere on the map with room for the robot.
+ *
+ **/
+
+Pose2d randomStart(const SimWorld& world, std::mt19937& rng)
+{
+  const GridMap& map = world.map;
+  std::uniform_real_distribution<double> ux(0, map.width * map.scale);
+  std::uniform_real_distribution<double> uy(0, map.height * map.scale);
+  std::uniform_real_distribution<double> ua(-M_PI, M_PI);
+  Pose2d pose;
+
+  do {
+    pose.px = map.origin_x + ux(rng);
+    pose.py = map.origin_y + uy(rng);
+  } while (distAt(world.dist, pose.px, pose.py)
+           < ROOMBA_RADIUS + START_CLEARANCE);
+  pose.pa = ua(rng);
+  return pose;
+} // End of randomStart()
+
+/**
+ * runEpisode()
+ *
+ * Run the controller from ep.start until it succeeds, gives up, or runs
+ * out of time, and fill in the rest of ep.
+ *
+ **/
+
+void runEpisode(const Setup& setup, Worker& worker, Episode& ep)
+{
+  double started = now();
+  SensorFrame& frame = worker.frame;
+  RobotClient client;
+  Sim sim;
+  Wander wander;
+  GoToGoal goal;
+  bool fresh, hit, was_hit = false;
+  int status;
+  double kidnap_at = -1;       // When to kidnap the robot, with -kidnap
+  int recoveries = -1;         // ...and how many it had made by then
+
+  initSim(sim, *setup.world, ep.seed);
+  sim.pose = sim.odom = ep.start;
+  sim.noise = noise_models[ep.noise];
+  if (setup.task == TASK_LOCALIZE) {
+    sim.localize = false;
+    mclInit(worker.mcl, setup.world->map, &setup.world->dist, ep.seed);
+    initWander(wander, &worker.mcl);
+    if (setup.scanmatch) {
+      initScanMatcher(worker.matcher);
+      useScanMatcher(wander, worker.matcher);
+    }
+    if (setup.active) {
+      // The episodes already keep every core busy
+      initActiveLocalizer(worker.active, setup.world->map, setup.world->dist);
+      worker.active.threads = 1;
+      wander.active = &worker.active;
+    }
+    if (setup.kidnap) {
+      initPoseGuard(worker.guard, setup.world->dist);
+      wander.guard = &worker.guard;
+      wander.keep_going = true;
+    }
+    if (setup.scan) {
+      initLaserScan(worker.scan);
+      wander.scan = &worker.scan;
+    }
+    if (setup.vfh) {
+      initVfh(worker.vfh);
+      wander.vfh = &worker.vfh;
+    }
+    wander.quiet = true;
+  } else {
+    sim.laser = setup.dwa;
+    initGoToGoal(goal, worker.planner, setup.navfn,
+                 setup.goal_x, setup.goal_y);
+    goal.graph = setup.roadmap;
+    if (setup.dwa) {
+      initDwaPlanner(worker.dwa, worker.planner.costmap);
+      goal.dwa = &worker.dwa;
+    }
+    if (setup.footprint != NULL) {
+      worker.dwa.footprint = setup.footprint;
+      worker.dwa.walls = &worker.walls;
+    }
+    if (setup.scan && setup.dwa) {
+      initLaserScan(worker.scan);
+      goal.scan = &worker.scan;
+    }
+    goal.quiet = true;
+  }
+  startSim(client, sim, setup.time_limit);
+
+  ep.ok = false;
+  ep.outcome = "timeout";
+  ep.collisions = 0;
+  ep.error = ep.angle_error = 0;
+  while (true) {
+    fresh = clientRead(client, frame);
+    if (client.finished) break;
+
+    // Count each time we run into something, not each tick we're stuck
+    hit = frame.bumper[0] || frame.bumper[1] || frame.stall;
+    if (hit && !was_hit) ep.collisions++;
+    was_hit = hit;
+
+    if (setup.task == TASK_LOCALIZE) {
+      status = wanderTick(wander, frame, fresh);
+      if (status == WANDER_LOCALIZED && !setup.kidnap) {
+        ep.ok = true;
+        ep.outcome = "localized";
+        break;
+      }
+      if (status == WANDER_LOCALIZED && kidnap_at < 0)
+        kidnap_at = sim.time + 2;
+      if (kidnap_at > 0 && recoveries < 0 && sim.time >= kidnap_at) {
+        // Odometry carries on as if nothing happened
+        sim.pose = ep.kidnap;
+        recoveries = worker.guard.recoveries;
+      }
+      // Found by the guard, or by the filter if the guard gave up
+      if (recoveries >= 0 && (worker.guard.recoveries > recoveries
+                              || status == WANDER_LOCALIZED)) {
+        recoveries = worker.guard.recoveries;
+        if (hypot(wander.pose.px - sim.pose.px,
+                  wander.pose.py - sim.pose.py) < 0.5) {
+          ep.ok = true;
+          ep.outcome = "recovered";
+          break;
+        }
+      }
+      clientSetSpeed(client, wander.speed, wander.turnrate);
+    } else {
+      status = goToGoalTick(goal, frame);
+      if (status == GOAL_ARRIVED) {
+        ep.ok = true;
+        ep.outcome = "arrived";
+        break;
+      }
+      if (status == GOAL_NO_PATH) {
+        ep.outcome = "no path";
+        break;
+      }
+      clientSetSpeed(client, goal.speed, goal.turnrate);
+    }
+  }
+  stopClient(client, true);
+
+  if (setup.task == TASK_LOCALIZE) {
+    // How wrong the best guess was, whether or not we were sure of it
+    player_pose2d_t best = wander.checked ? wander.best_pose : wander.pose;
+    ep.error = hypot(best.px - sim.pose.px, best.py - sim.pose.py);
+    ep.angle_error = fabs(normalizeAngle(best.pa - sim.pose.pa));
+  } else {
+    ep.error = hypot(setup.goal_x - sim.pose.px, setup.goal_y - sim.pose.py);
+  }
+  ep.time  = sim.time - (kidnap_at > 0 ? kidnap_at : 0);
+  ep.ticks = sim.steps;
+  ep.wall  = now() - started;
+} // End of runEpisode()
+
+/**
+ * percentile()
+ *
+ * The p'th percentile (0 to 1) of v, which gets sorted.
+ *
+ **/
+
+double percentile(std::vector<double>& v, double p)
+{
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  int i = (int)ceil(p * v.size()) - 1;
+  if (i < 0) i = 0;
+  return v[i];
+} // End of percentile()
+
+/**
+ * report()
+ *
+ * Summarise the episodes with the given noise model (or all of them, for
+ * NOISE_MIXED). Times and errors are over the ones that succeeded.
+ *
+ **/
+
+void report(const char* name, const std::vector<Episode>& eps, int noise)
+{
+  std::vector<double> times, errors, angles;
+  int runs = 0, collisions = 0, most = 0;
+  double time_sum = 0, error_sum = 0;
+
+  for (size_t e = 0; e < eps.size(); e++) {
+    const Episode& ep = eps[e];
+    if (noise != NOISE_MIXED && ep.noise != noise) continue;
+    runs++;
+    collisions += ep.collisions;
+    if (ep.collisions > most) most = ep.collisions;
+    if (!ep.ok) continue;
+    times.push_back(ep.time);
+    errors.push_back(ep.error);
+    angles.push_back(ep.angle_error);
+    time_sum += ep.time;
+    error_sum += ep.error;
+  }
+  if (runs == 0) return;
+
+  int ok = times.size();
+  std::cout << "Noise " << name << ": " << ok << "/" << runs
+            << " succeeded" << std::endl;
+  std::cout << "  Collisions: mean " << (double)collisions / runs
+            << ", max " << most << std::endl;
+  if (ok == 0) return;
+  std::cout << "  Time: mean " << time_sum / ok
+            << "s, median " << percentile(times, 0.5)
+            << "s, 90% " << percentile(times, 0.9)
+            << "s, max " << times.back() << "s" << std::endl;
+  std::cout << "  Error: mean " << error_sum / ok
+            << "m, median " << percentile(errors, 0.5)
+            << "m, 90% " << percentile(errors, 0.9)
+            << "m, max " << errors.back() << "m";
+  if (percentile(angles, 1) > 0) {
+    std::cout << ", heading 90% " << percentile(angles, 0.9) * 180 / M_PI
+              << " degrees";
+  }
+  std::cout << std::endl;
+} // End of report()
+
+/**
+ * writeCsv()
+ *
+ * One line per episode.
+ *
+ **/
+
+void writeCsv(const char* path, const std::vector<Episode>& eps)
+{
+  std::ofstream ofs(path);
+
+  if (!ofs) {
+    std::cerr << "Can't write " << path << std::endl;
+    return;
+  }
+  ofs << "episode,noise,start_x,start_y,start_a,seed,outcome,time,ticks,"
+         "collisions,error,angle_error,wall\n";
+  for (size_t e = 0; e < eps.size(); e++) {
+    const Episode& ep = eps[e];
+    ofs << e << "," << noise_names[ep.noise] << ","
+        << ep.start.px << "," << ep.start.py << "," << ep.start.pa << ","
+        << ep.seed << "," << ep.outcome << "," << ep.time << ","
+        << ep.ticks << "," << ep.collisions << "," << ep.error << ","
+        << ep.angle_error << "," << ep.wall << "\n";
+  }
+} // End of writeCsv()
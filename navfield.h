@@ -0,0 +1,394 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Navigation function
+ *
+ ** Description ***************************************************************
+ *
+ *  For one goal, the cost of the cheapest path to it from every cell in the
+ *  map, worked out once with Dijkstra's algorithm run outwards from the
+ *  goal over the planner's costmap (planner.h). Which way to go from
+ *  anywhere is then just a walk downhill from the cell the robot is in, so
+ *  a robot that gets bumped off course or loses track of its path never
+ *  has to plan again.
+ *
+ *  Fields are saved next to the bitmap, named after a hash of the bitmap,
+ *  the robot size the costmap was built for and the goal cell, e.g.
+ *  bitmaps/local-1f2e3d4c5b6a7988.nav, so each goal is only done once.
+ *  The file is a NavFieldHeader followed by a float per cell, row major
+ *  from the bottom of the map, with NAV_UNREACHABLE for cells that can't
+ *  get to the goal.
+ */
+
+#ifndef NAVFIELD_H
+#define NAVFIELD_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <string>
+#include "distmap.h"
+#include "planner.h"
+
+#define NAVFIELD_VERSION 1
+#define NAV_UNREACHABLE  1e30f
+
+/**
+ * What's at the front of a .nav file.
+ *
+ **/
+
+struct NavFieldHeader
+{
+  char     magic[4];          // "NAVF"
+  uint32_t version;
+  uint32_t width, height;
+  double   scale;
+  double   origin_x, origin_y;
+  uint64_t key;               // See navFieldKey()
+  int32_t  goal_cell;
+  char     pad[12];
+};
+static_assert(sizeof(NavFieldHeader) == 64, "NavFieldHeader must be 64 bytes");
+
+/**
+ * A loaded field. As with DistMap, "cost" points either into the mapped
+ * file or at "owned".
+ *
+ **/
+
+struct NavField
+{
+  int    width, height;
+  double scale;
+  double origin_x, origin_y;
+  int    goal_cell;
+  double goal_x, goal_y;      // The goal exactly, not just its cell
+  const float* cost;
+
+  void*  mapping;
+  size_t mapping_size;
+  std::vector<float> owned;
+};
+
+/**
+ * navFieldKey()
+ *
+ * What a cached field depends on: the bitmap (via bitmapHash()), what the
+ * costmap was built for, and the goal cell.
+ *
+ **/
+
+inline uint64_t navFieldKey(uint64_t map_hash, const CostMap& cm,
+                            int goal_cell)
+{
+  uint64_t hash = map_hash;
+  double params[2] = { cm.radius, cm.inflation };
+  const unsigned char* p = (const unsigned char*)params;
+
+  for (size_t i = 0; i < sizeof(params); i++) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  p = (const unsigned char*)&goal_cell;
+  for (size_t i = 0; i < sizeof(goal_cell); i++) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+} // End of navFieldKey()
+
+/**
+ * computeNavField()
+ *
+ * Dijkstra outwards from the goal cell. Moving into a cell costs its
+ * costmap cost times the length of the step, as in planPath(), so walking
+ * downhill in the field follows the same sort of path A* would plan.
+ *
+ **/
+
+inline void computeNavField(const CostMap& cm, int goal,
+                            std::vector<float>& out)
+{
+  const int   w = cm.width, h = cm.height;
+  const int   nbr_dx[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+  const int   nbr_dy[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+  const float nbr_len[8] = { 1, 1, 1, 1, M_SQRT2, M_SQRT2, M_SQRT2, M_SQRT2 };
+  typedef std::pair<float, int> Entry;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > open;
+
+  out.assign((size_t)w * h, NAV_UNREACHABLE);
+  out[goal] = 0;
+  open.push(Entry(0, goal));
+
+  while (!open.empty()) {
+    float d = open.top().first;
+    int cell = open.top().second;
+    open.pop();
+    if (d > out[cell]) continue;   // Stale entry
+
+    int cx = cell % w, cy = cell / w;
+    for (int k = 0; k < 8; k++) {
+      int nx = cx + nbr_dx[k], ny = cy + nbr_dy[k];
+      if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+      int n = ny * w + nx;
+      int c = cm.cost[n];
+      if (c >= COST_LETHAL) continue;
+      float nd = d + nbr_len[k] * c;
+      if (nd < out[n]) {
+        out[n] = nd;
+        open.push(Entry(nd, n));
+      }
+    }
+  }
+} // End of computeNavField()
+
+/**
+ * openNavField()
+ *
+ * Map a cached field into memory, if there is one for this key.
+ *
+ **/
+
+inline bool openNavField(NavField& nf, const char* path, uint64_t key)
+{
+  struct stat st;
+  NavFieldHeader hdr;
+
+  nf.mapping = NULL;
+  nf.cost = NULL;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr)) {
+    close(fd);
+    return false;
+  }
+  void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  memcpy(&hdr, mem, sizeof(hdr));
+  size_t need = sizeof(hdr) + (size_t)hdr.width * hdr.height * sizeof(float);
+  if (memcmp(hdr.magic, "NAVF", 4) != 0 || hdr.version != NAVFIELD_VERSION
+      || hdr.key != key || (size_t)st.st_size != need) {
+    munmap(mem, st.st_size);
+    return false;
+  }
+
+  nf.width     = hdr.width;
+  nf.height    = hdr.height;
+  nf.scale     = hdr.scale;
+  nf.origin_x  = hdr.origin_x;
+  nf.origin_y  = hdr.origin_y;
+  nf.goal_cell = hdr.goal_cell;
+  nf.mapping   = mem;
+  nf.mapping_size = st.st_size;
+  nf.cost      = (const float*)((const char*)mem + sizeof(hdr));
+  return true;
+} // End of openNavField()
+
+/**
+ * writeNavField()
+ *
+ **/
+
+inline bool writeNavField(const char* path, const CostMap& cm, int goal,
+                          const std::vector<float>& cost, uint64_t key)
+{
+  NavFieldHeader hdr;
+  std::string tmp = std::string(path) + ".tmp";
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, "NAVF", 4);
+  hdr.version   = NAVFIELD_VERSION;
+  hdr.width     = cm.width;
+  hdr.height    = cm.height;
+  hdr.scale     = cm.scale;
+  hdr.origin_x  = cm.origin_x;
+  hdr.origin_y  = cm.origin_y;
+  hdr.key       = key;
+  hdr.goal_cell = goal;
+
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  if (fp == NULL) return false;
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+    && fwrite(&cost[0], sizeof(float), cost.size(), fp) == cost.size();
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), path) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+} // End of writeNavField()
+
+/**
+ * freeNavField()
+ *
+ **/
+
+inline void freeNavField(NavField& nf)
+{
+  if (nf.mapping != NULL) munmap(nf.mapping, nf.mapping_size);
+  nf.mapping = NULL;
+  nf.cost = NULL;
+  nf.owned.clear();
+} // End of freeNavField()
+
+/**
+ * loadNavField()
+ *
+ * The field for getting to (gx, gy) on the costmap of "bitmap" (stretched
+ * over size_x by size_y as usual), from the cache if we've done this goal
+ * before and otherwise computed and cached.
+ *
+ **/
+
+inline bool loadNavField(NavField& nf, const CostMap& cm, const char* bitmap,
+                         double size_x, double size_y, double gx, double gy)
+{
+  int goal = nearestFreeCell(cm, (int)floor((gx - cm.origin_x) / cm.scale),
+                             (int)floor((gy - cm.origin_y) / cm.scale));
+  if (goal < 0) {
+    std::cerr << "Goal (" << gx << ", " << gy << ") is in a wall"
+              << std::endl;
+    return false;
+  }
+
+  uint64_t key = navFieldKey(bitmapHash(bitmap, size_x, size_y), cm, goal);
+  char name[32];
+  snprintf(name, sizeof(name), "-%016llx.nav", (unsigned long long)key);
+  std::string path = cachePath(bitmap, name);
+
+  nf.goal_x = gx;
+  nf.goal_y = gy;
+  if (openNavField(nf, path.c_str(), key)) return true;
+
+  std::vector<float> cost;
+  computeNavField(cm, goal, cost);
+  if (writeNavField(path.c_str(), cm, goal, cost, key)
+      && openNavField(nf, path.c_str(), key)) return true;
+
+  std::cerr << "Warning: can't cache navigation field in " << path
+            << std::endl;
+  nf.width     = cm.width;
+  nf.height    = cm.height;
+  nf.scale     = cm.scale;
+  nf.origin_x  = cm.origin_x;
+  nf.origin_y  = cm.origin_y;
+  nf.goal_cell = goal;
+  nf.owned.swap(cost);
+  nf.cost      = &nf.owned[0];
+  return true;
+} // End of loadNavField()
+
+/**
+ * navCostAt()
+ *
+ * Cost to go from a point, NAV_UNREACHABLE if we can't get there from it.
+ *
+ **/
+
+inline float navCostAt(const NavField& nf, double x, double y)
+{
+  int cx = (int)floor((x - nf.origin_x) / nf.scale);
+  int cy = (int)floor((y - nf.origin_y) / nf.scale);
+  if (cx < 0 || cy < 0 || cx >= nf.width || cy >= nf.height)
+    return NAV_UNREACHABLE;
+  return nf.cost[cy * nf.width + cx];
+} // End of navCostAt()
+
+/**
+ * navCarrot()
+ *
+ * Where to head for from (x, y): walk downhill through the field for up to
+ * "lookahead" metres and return where we end up in (tx, ty). That's the
+ * goal itself once it is within reach. Looking a little way ahead rather
+ * than just at the steepest neighbour gives a heading that isn't stuck to
+ * multiples of 45 degrees.
+ *
+ * If (x, y) is in a wall, or too close to one for the robot to fit, as it
+ * can be just after a bump, we start from the nearest cell that isn't.
+ * Returns false if the goal can't be reached from here at all.
+ *
+ **/
+
+inline bool navCarrot(const NavField& nf, double x, double y,
+                      double lookahead, double* tx, double* ty)
+{
+  const int w = nf.width, h = nf.height;
+  int cx = (int)floor((x - nf.origin_x) / nf.scale);
+  int cy = (int)floor((y - nf.origin_y) / nf.scale);
+  int steps = (int)(lookahead / nf.scale);
+
+  if (cx < 0 || cy < 0 || cx >= w || cy >= h) return false;
+  int cell = cy * w + cx;
+
+  for (int r = 1; r <= 20 && nf.cost[cell] >= NAV_UNREACHABLE; r++) {
+    double best_d = 1e9;
+    for (int dy = -r; dy <= r; dy++) {
+      for (int dx = -r; dx <= r; dx++) {
+        int nx = cx + dx, ny = cy + dy;
+        if (abs(dx) != r && abs(dy) != r) continue;   // Just the ring
+        if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+        if (nf.cost[ny * w + nx] >= NAV_UNREACHABLE) continue;
+        if (dx * dx + dy * dy < best_d) {
+          best_d = dx * dx + dy * dy;
+          cell = ny * w + nx;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i <= steps && cell != nf.goal_cell; i++) {
+    int   best = cell;
+    float best_cost = nf.cost[cell];
+    cx = cell % w;
+    cy = cell / w;
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        int nx = cx + dx, ny = cy + dy;
+        if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+        float c = nf.cost[ny * w + nx];
+        if (c < best_cost) {
+          best_cost = c;
+          best = ny * w + nx;
+        }
+      }
+    }
+    if (best == cell) break;   // At the bottom
+    cell = best;
+  }
+
+  if (nf.cost[cell] >= NAV_UNREACHABLE) return false;
+  if (cell == nf.goal_cell) {
+    *tx = nf.goal_x;
+    *ty = nf.goal_y;
+  } else {
+    *tx = nf.origin_x + (cell % w + 0.5) * nf.scale;
+    *ty = nf.origin_y + (cell / w + 0.5) * nf.scale;
+  }
+  return true;
+} // End of navCarrot()
+
+/**
+ * navHeading()
+ *
+ * The best heading from (x, y), in radians. False if there isn't one.
+ *
+ **/
+
+inline bool navHeading(const NavField& nf, double x, double y,
+                       double* heading)
+{
+  double tx, ty;
+  if (!navCarrot(nf, x, y, 1.0, &tx, &ty)) return false;
+  *heading = atan2(ty - y, tx - x);
+  return true;
+} // End of navHeading()
+
+#endif
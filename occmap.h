@@ -0,0 +1,436 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Occupancy mapping
+ *
+ ** Description ***************************************************************
+ *
+ *  Keeps the map up to date from the laser, so that a chair or a box that
+ *  isn't where the bitmap says doesn't throw the robot off for good. Each
+ *  scan, taken where the robot is sure it is, is added into a grid of log
+ *  odds the same size and shape as the map:
+ *
+ *    - the cell each beam ends in is more likely occupied;
+ *    - the cells the beam went through, short of that, more likely free.
+ *
+ *  The log odds start from the bitmap (occupied or free, and very sure of
+ *  it), and are kept as a signed byte a cell, in sixteenths, clamped so
+ *  that nothing is ever so sure that a few scans can't change its mind. A
+ *  cell only counts once a scan, however many beams cross it, or the beams
+ *  fanning out from the robot would clear whatever is near it many times
+ *  over, and a cell a beam ends in isn't cleared by any other. A cell
+ *  changes from free to occupied, or back, when its log odds cross a
+ *  threshold, with some hysteresis so it doesn't flicker.
+ *
+ *  This isn't SLAM: the map is only as good as the poses it's given, and
+ *  a pose a little out wears walls away and thickens them. So a scan is
+ *  only added if hardly any of its beams go on into the walls of the
+ *  bitmap, and the misses stop a little short of each hit.
+ *
+ *  The grid is kept in tiles of 16 by 16 cells, and a tile only gets its
+ *  log odds once a beam goes into it; until then it is the bitmap. The
+ *  beams are walked in fixed point, a cell along the longer axis at a
+ *  time, which is one add per axis a step with no error term to keep.
+ *
+ *  Whenever cells change, the boxes round the cells that changed, a box per
+ *  tile merged with its neighbours, are left in "dirty" until the next
+ *  scan. mapScan() uses them to change the GridMap and DistMap it was
+ *  given to match, just around the boxes (distmap.h), and anyone else who
+ *  keeps something made from them (the planner's costmap, say) can do the
+ *  same, rather than building it all again.
+ */
+
+#ifndef OCCMAP_H
+#define OCCMAP_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "distmap.h"
+#include "gridmap.h"
+#include "sensorframe.h"
+
+#define OCC_TILE_SHIFT 4
+#define OCC_TILE       (1 << OCC_TILE_SHIFT)    // Cells on a side
+#define OCC_TILE_CELLS (OCC_TILE * OCC_TILE)
+
+/**
+ * A tile's log odds, whether each cell is occupied now, and the last scan
+ * that changed each cell.
+ *
+ **/
+
+struct OccTile
+{
+  int8_t  l[OCC_TILE_CELLS];
+  uint8_t occ[OCC_TILE_CELLS];
+  uint8_t seen[OCC_TILE_CELLS];
+};
+
+/**
+ * Cells x0 to x1, y0 to y1, inclusive.
+ *
+ **/
+
+struct OccRegion
+{
+  int x0, y0, x1, y1;
+};
+
+/**
+ * The grid, and what the last scan changed. Log odds are in sixteenths.
+ *
+ **/
+
+struct OccMap
+{
+  int    width, height;         // In cells, as the map
+  double scale, origin_x, origin_y;
+  int    tiles_x, tiles_y;
+
+  GridMap* map;                 // Where it starts from, kept up to date
+  DistMap* field;               // ...and its distances, if set
+  double   reach;               // How far the distances are kept exact
+
+  // Log odds of a hit and a miss, where the bitmap starts, and the levels
+  // at which a cell becomes occupied and free again
+  int    hit, miss, prior;
+  int    occupied, free;
+  double min_range;             // Beams shorter than this are ignored
+  double max_range;             // ...and beams are only followed this far
+  double slack;                 // How far a beam may end inside a wall
+  double max_through;           // Fraction that may go further, or the
+                                // pose is too far out to map from
+  std::vector<unsigned char> walls;  // The bitmap, as it was
+
+  std::vector<int>     index;   // Tile at each tile position, or -1
+  std::vector<OccTile> tiles;
+  uint8_t  stamp;               // Which scan this is, as in "seen"
+  uint64_t last_seq;            // Frame last added
+
+  std::vector<OccRegion> dirty; // What the last scan changed
+  std::vector<OccRegion> boxes; // Scratch: changes in each tile
+  std::vector<int>       touched;
+  std::vector<double>    ex, ey;  // Scratch: where the beams end, in cells
+  int    scans, changes;        // Totals
+  int    skipped;               // Scans that didn't fit well enough
+};
+
+/**
+ * initOccMap()
+ *
+ * Start from "map", and keep it (and "field", if given) up to date. The
+ * distance map gets memory of its own, so the file it came from isn't
+ * changed. The bitmap is kept as it was, to check poses against.
+ *
+ **/
+
+inline void initOccMap(OccMap& om, GridMap& map, DistMap* field = NULL)
+{
+  om.width    = map.width;
+  om.height   = map.height;
+  om.scale    = map.scale;
+  om.origin_x = map.origin_x;
+  om.origin_y = map.origin_y;
+  om.tiles_x  = (map.width + OCC_TILE - 1) >> OCC_TILE_SHIFT;
+  om.tiles_y  = (map.height + OCC_TILE - 1) >> OCC_TILE_SHIFT;
+  om.map   = &map;
+  om.field = field;
+  om.reach = 1.0;
+  // About p = 0.78 for a hit and 0.35 for a miss; the bitmap is 0.998
+  // sure, so that a pose a little out doesn't wear the walls away or
+  // thicken them. It takes a handful of scans to put something in free
+  // space, and a good many seeing through a wall to take it away.
+  om.hit = 20;
+  om.miss = -10;
+  om.prior = 100;
+  om.occupied = 24;
+  om.free = -24;
+  om.min_range = 0.05;
+  om.max_range = 5.0;
+  om.slack = 0.05;
+  om.max_through = 0.1;
+  om.index.assign(om.tiles_x * om.tiles_y, -1);
+  om.tiles.clear();
+  om.stamp = 1;
+  om.last_seq = 0;
+  om.dirty.clear();
+  om.boxes.clear();
+  om.touched.clear();
+  om.scans = om.changes = om.skipped = 0;
+  om.walls = map.cells;
+  if (field != NULL) ownDistMap(*field);
+} // End of initOccMap()
+
+/**
+ * occTile()
+ *
+ * The tile at tile position t, starting it from the map if it hasn't been
+ * needed before.
+ *
+ **/
+
+inline OccTile& occTile(OccMap& om, int t)
+{
+  if (om.index[t] >= 0) return om.tiles[om.index[t]];
+
+  OccTile tile;
+  int tx = (t % om.tiles_x) << OCC_TILE_SHIFT;
+  int ty = (t / om.tiles_x) << OCC_TILE_SHIFT;
+  memset(tile.seen, 0, sizeof(tile.seen));
+  for (int i = 0; i < OCC_TILE_CELLS; i++) {
+    int cx = tx + (i & (OCC_TILE - 1)), cy = ty + (i >> OCC_TILE_SHIFT);
+    bool occ = cellOccupied(*om.map, cx, cy);
+    tile.occ[i] = occ;
+    tile.l[i] = occ ? om.prior : -om.prior;
+  }
+  om.index[t] = om.tiles.size();
+  om.tiles.push_back(tile);
+  return om.tiles.back();
+} // End of occTile()
+
+/**
+ * occupancyAt()
+ *
+ * Whether a cell is occupied now. Off the map counts as occupied.
+ *
+ **/
+
+inline bool occupancyAt(const OccMap& om, int cx, int cy)
+{
+  if (cx < 0 || cy < 0 || cx >= om.width || cy >= om.height) return true;
+  int t = (cy >> OCC_TILE_SHIFT) * om.tiles_x + (cx >> OCC_TILE_SHIFT);
+  if (om.index[t] < 0) return cellOccupied(*om.map, cx, cy);
+  const OccTile& tile = om.tiles[om.index[t]];
+  return tile.occ[((cy & (OCC_TILE - 1)) << OCC_TILE_SHIFT)
+                  | (cx & (OCC_TILE - 1))];
+} // End of occupancyAt()
+
+/**
+ * occUpdate()
+ *
+ * Add "delta" to the log odds of a cell, unless this scan already has,
+ * and note it if that changes whether it's occupied.
+ *
+ **/
+
+inline void occUpdate(OccMap& om, int cx, int cy, int delta)
+{
+  int t = (cy >> OCC_TILE_SHIFT) * om.tiles_x + (cx >> OCC_TILE_SHIFT);
+  OccTile& tile = occTile(om, t);
+  int i = ((cy & (OCC_TILE - 1)) << OCC_TILE_SHIFT) | (cx & (OCC_TILE - 1));
+  if (tile.seen[i] == om.stamp) return;
+  tile.seen[i] = om.stamp;
+
+  int l = std::max(-127, std::min(127, tile.l[i] + delta));
+  tile.l[i] = l;
+  if (tile.occ[i] ? l > om.free : l < om.occupied) return;
+  tile.occ[i] = !tile.occ[i];
+
+  // The box round what changed in this tile
+  OccRegion& box = om.boxes[t];
+  if (box.x0 > box.x1) {
+    box.x0 = box.x1 = cx;
+    box.y0 = box.y1 = cy;
+    om.touched.push_back(t);
+  } else {
+    box.x0 = std::min(box.x0, cx);
+    box.x1 = std::max(box.x1, cx);
+    box.y0 = std::min(box.y0, cy);
+    box.y1 = std::max(box.y1, cy);
+  }
+  om.changes++;
+} // End of occUpdate()
+
+/**
+ * occClearRay()
+ *
+ * One miss for every cell from (x0, y0) to (x1, y1), in cells, short of
+ * the one it ends in. Steps one cell along the longer axis at a time in
+ * 16.16 fixed point, and stops at the edge of the map.
+ *
+ **/
+
+inline void occClearRay(OccMap& om, double x0, double y0, double x1,
+                        double y1)
+{
+  double dx = x1 - x0, dy = y1 - y0;
+  int n = (int)ceil(std::max(fabs(dx), fabs(dy)));
+  if (n <= 0) return;
+  int32_t fx = (int32_t)(x0 * 65536), fy = (int32_t)(y0 * 65536);
+  int32_t sx = (int32_t)(dx / n * 65536), sy = (int32_t)(dy / n * 65536);
+  for (int k = 0; k < n; k++, fx += sx, fy += sy) {
+    int cx = fx >> 16, cy = fy >> 16;
+    if ((unsigned)cx >= (unsigned)om.width
+        || (unsigned)cy >= (unsigned)om.height) return;
+    occUpdate(om, cx, cy, om.miss);
+  }
+} // End of occClearRay()
+
+/**
+ * mergeDirty()
+ *
+ * Turn the boxes in each tile into as few boxes as we can without taking
+ * in much that didn't change: boxes that touch, or nearly, are merged.
+ *
+ **/
+
+inline void mergeDirty(OccMap& om)
+{
+  const int slack = OCC_TILE / 2;
+
+  om.dirty.clear();
+  for (size_t k = 0; k < om.touched.size(); k++) {
+    OccRegion& box = om.boxes[om.touched[k]];
+    om.dirty.push_back(box);
+    box.x0 = 0;
+    box.x1 = -1;
+  }
+  om.touched.clear();
+
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < om.dirty.size() && !merged; i++) {
+      for (size_t j = i + 1; j < om.dirty.size(); j++) {
+        OccRegion& a = om.dirty[i];
+        const OccRegion& b = om.dirty[j];
+        if (b.x0 > a.x1 + slack || a.x0 > b.x1 + slack
+            || b.y0 > a.y1 + slack || a.y0 > b.y1 + slack) continue;
+        a.x0 = std::min(a.x0, b.x0);
+        a.y0 = std::min(a.y0, b.y0);
+        a.x1 = std::max(a.x1, b.x1);
+        a.y1 = std::max(a.y1, b.y1);
+        om.dirty.erase(om.dirty.begin() + j);
+        merged = true;
+        break;
+      }
+    }
+  }
+} // End of mergeDirty()
+
+/**
+ * mapScan()
+ *
+ * Add the laser scan in a frame, taken from pose, to the map, and bring
+ * the GridMap and DistMap up to date. Each frame is only added once, and
+ * not at all if it doesn't fit the bitmap from pose.
+ * Returns how many cells changed; the boxes round them are in om.dirty.
+ *
+ **/
+
+inline int mapScan(OccMap& om, const SensorFrame& frame, Pose2d pose)
+{
+  om.dirty.clear();
+  if (frame.ranges_count == 0 || frame.seq == om.last_seq) return 0;
+  om.last_seq = frame.seq;
+  int before = om.changes;
+
+  // The next scan; when the stamp comes round again, forget the old ones
+  if (++om.stamp == 0) {
+    for (size_t i = 0; i < om.tiles.size(); i++)
+      memset(om.tiles[i].seen, 0, sizeof(om.tiles[i].seen));
+    om.stamp = 1;
+  }
+  if (om.boxes.size() != om.index.size()) {
+    OccRegion none = { 0, 0, -1, -1 };
+    om.boxes.assign(om.index.size(), none);
+  }
+
+  // In cells, from the corner of the map
+  double ox = (pose.px - om.origin_x) / om.scale;
+  double oy = (pose.py - om.origin_y) / om.scale;
+  double max_r = std::min(om.max_range, frame.max_range - 0.01);
+
+  // Where each beam ends, or gives up. A beam ends on the face of
+  // whatever it hit, which is as often the edge of the free cell in front
+  // as of the cell behind, so take it half a cell further on.
+  int n = frame.ranges_count;
+  om.ex.resize(n);
+  om.ey.resize(n);
+  for (int i = 0; i < n; i++) {
+    double r = std::min(frame.ranges[i], max_r) / om.scale + 0.5;
+    double a = pose.pa + frame.bearings[i];
+    om.ex[i] = ox + r * cos(a);
+    om.ey[i] = oy + r * sin(a);
+  }
+
+  // A pose a few centimetres out would smear the walls about, so only map
+  // from one the scan fits. Something new in the way only makes beams
+  // shorter, but with the pose out, some go on into the walls. It's the
+  // bitmap they mustn't go into, not the map so far, or a wall smeared a
+  // little would let in poses that smear it more.
+  double margin = om.slack / om.scale + 0.5;
+  int beams = 0, through = 0;
+  for (int i = 0; i < n; i++) {
+    double r = frame.ranges[i];
+    if (r < om.min_range || r >= max_r) continue;
+    double k = std::max(0.0, 1 - margin / (r / om.scale + 0.5));
+    int cx = (int)floor(ox + k * (om.ex[i] - ox));
+    int cy = (int)floor(oy + k * (om.ey[i] - oy));
+    if (cx < 0 || cy < 0 || cx >= om.width || cy >= om.height) continue;
+    beams++;
+    through += om.walls[cy * om.width + cx];
+  }
+  if (through > om.max_through * beams) {
+    om.skipped++;
+    return 0;
+  }
+
+  // The hits first, so that no beam clears a cell another one ended in
+  for (int i = 0; i < n; i++) {
+    double r = frame.ranges[i];
+    if (r < om.min_range || r >= max_r) continue;
+    int cx = (int)floor(om.ex[i]), cy = (int)floor(om.ey[i]);
+    if (cx < 0 || cy < 0 || cx >= om.width || cy >= om.height) continue;
+    occUpdate(om, cx, cy, om.hit);
+  }
+  // ...and the misses, stopping short of a hit by the slack, so a wall
+  // isn't worn away from in front
+  for (int i = 0; i < n; i++) {
+    double r = frame.ranges[i];
+    if (r < om.min_range) continue;
+    double k = 1;
+    if (r < max_r) k = std::max(0.0, 1 - margin / (r / om.scale + 0.5));
+    occClearRay(om, ox, oy, ox + k * (om.ex[i] - ox), oy + k * (om.ey[i] - oy));
+  }
+  mergeDirty(om);
+
+  // Bring the map and its distances into line
+  for (size_t k = 0; k < om.dirty.size(); k++) {
+    const OccRegion& d = om.dirty[k];
+    for (int cy = d.y0; cy <= d.y1; cy++)
+      for (int cx = d.x0; cx <= d.x1; cx++)
+        om.map->cells[cy * om.width + cx] = occupancyAt(om, cx, cy);
+  }
+  if (om.field != NULL) {
+    for (size_t k = 0; k < om.dirty.size(); k++) {
+      const OccRegion& d = om.dirty[k];
+      updateDistances(*om.field, *om.map, d.x0, d.y0, d.x1, d.y1, om.reach);
+    }
+  }
+  om.scans++;
+  return om.changes - before;
+} // End of mapScan()
+
+/**
+ * dirtyReach()
+ *
+ * The cells whose distances the change in dirty box k could have
+ * changed, for anyone keeping something made from the distances.
+ *
+ **/
+
+inline OccRegion dirtyReach(const OccMap& om, int k)
+{
+  int r = (int)ceil(om.reach / om.scale);
+  OccRegion d = om.dirty[k];
+  d.x0 = std::max(0, d.x0 - r);
+  d.y0 = std::max(0, d.y0 - r);
+  d.x1 = std::min(om.width - 1, d.x1 + r);
+  d.y1 = std::min(om.height - 1, d.y1 + r);
+  return d;
+} // End of dirtyReach()
+
+#endif
@@ -0,0 +1,344 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Global path planner
+ *
+ ** Description ***************************************************************
+ *
+ *  Plans a path between any two points on the map with A*, rather than
+ *  following a hand-made table of waypoints.
+ *
+ *  The search runs over a costmap made from the distance map (distmap.h):
+ *  cells closer to a wall than the robot's radius can't be entered at all,
+ *  and cells a little further out cost more the closer they are, so paths
+ *  keep away from walls where there is room to. Open cells are kept in a
+ *  binary heap, and the search arrays are kept between plans so planning
+ *  doesn't allocate.
+ *
+ *  The raw A* path zig-zags from cell to cell, so it is then smoothed by
+ *  cutting out every waypoint that the robot can see past, leaving just the
+ *  corners.
+ */
+
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <vector>
+#include "distmap.h"
+#include "gridmap.h"
+
+#define COST_FREE     1
+#define COST_LETHAL   255
+
+// The Roomba in roomba.inc is 0.33m across.
+#define ROOMBA_RADIUS 0.165
+
+/**
+ * Cost of moving through each cell: COST_FREE well away from walls,
+ * rising towards them, and COST_LETHAL where the robot would hit one.
+ *
+ **/
+
+struct CostMap
+{
+  int    width, height;
+  double scale;
+  double origin_x, origin_y;
+  double radius, inflation;   // What it was built for
+  std::vector<unsigned char> cost;
+};
+
+/**
+ * The costmap plus the A* search state.
+ *
+ **/
+
+struct Planner
+{
+  CostMap costmap;
+  std::vector<float>    g;        // Best cost found to each cell so far
+  std::vector<int>      parent;   // Where we got to each cell from
+  std::vector<unsigned> seen;     // Search in which g and parent were set
+  std::vector<unsigned> closed;   // Search in which the cell was expanded
+  unsigned search;
+  int      expanded;              // Cells expanded by the last plan
+};
+
+/**
+ * cellCost()
+ *
+ * The cost of a cell d metres from the nearest wall.
+ *
+ **/
+
+inline unsigned char cellCost(const CostMap& cm, double d)
+{
+  if (d < cm.radius) return COST_LETHAL;
+  if (d < cm.radius + cm.inflation)
+    return COST_FREE + (int)(253 * exp(-3.0 / cm.inflation * (d - cm.radius)));
+  return COST_FREE;
+} // End of cellCost()
+
+/**
+ * buildCostMap()
+ *
+ * Inflate the obstacles in a distance map by the robot's radius, with a
+ * cost that falls off over "inflation" metres beyond that.
+ *
+ **/
+
+inline void buildCostMap(CostMap& cm, const DistMap& dm, double radius,
+                         double inflation)
+{
+  cm.width    = dm.width;
+  cm.height   = dm.height;
+  cm.scale    = dm.scale;
+  cm.origin_x = dm.origin_x;
+  cm.origin_y = dm.origin_y;
+  cm.radius    = radius;
+  cm.inflation = inflation;
+  cm.cost.resize((size_t)dm.width * dm.height);
+
+  for (size_t i = 0; i < cm.cost.size(); i++)
+    cm.cost[i] = cellCost(cm, dm.dist[i]);
+} // End of buildCostMap()
+
+/**
+ * updateCostMap()
+ *
+ * Work the costs out again for cells x0 to x1, y0 to y1, whose distances
+ * have changed.
+ *
+ **/
+
+inline void updateCostMap(CostMap& cm, const DistMap& dm, int x0, int y0,
+                          int x1, int y1)
+{
+  x0 = std::max(0, x0);
+  y0 = std::max(0, y0);
+  x1 = std::min(cm.width - 1, x1);
+  y1 = std::min(cm.height - 1, y1);
+  for (int cy = y0; cy <= y1; cy++)
+    for (int cx = x0; cx <= x1; cx++)
+      cm.cost[cy * cm.width + cx] = cellCost(cm, dm.dist[cy * dm.width + cx]);
+} // End of updateCostMap()
+
+/**
+ * initPlanner()
+ *
+ * Set up a planner for a robot of the given radius.
+ *
+ **/
+
+inline void initPlanner(Planner& planner, const DistMap& dm,
+                        double radius = ROOMBA_RADIUS, double inflation = 0.5)
+{
+  buildCostMap(planner.costmap, dm, radius, inflation);
+  size_t n = planner.costmap.cost.size();
+  planner.g.assign(n, 0);
+  planner.parent.assign(n, -1);
+  planner.seen.assign(n, 0);
+  planner.closed.assign(n, 0);
+  planner.search = 0;
+  planner.expanded = 0;
+} // End of initPlanner()
+
+/**
+ * costAt()
+ *
+ **/
+
+inline int costAt(const CostMap& cm, int cx, int cy)
+{
+  if (cx < 0 || cy < 0 || cx >= cm.width || cy >= cm.height)
+    return COST_LETHAL;
+  return cm.cost[cy * cm.width + cx];
+} // End of costAt()
+
+/**
+ * nearestFreeCell()
+ *
+ * The closest cell to (cx, cy) that the robot can be in, searching
+ * outwards in rings up to "limit" cells away. We need this because the
+ * robot often thinks it is just inside the inflated zone round a wall, and
+ * goals get picked there too. Returns -1 if there is none.
+ *
+ **/
+
+inline int nearestFreeCell(const CostMap& cm, int cx, int cy, int limit = 50)
+{
+  if (costAt(cm, cx, cy) < COST_LETHAL) return cy * cm.width + cx;
+
+  for (int r = 1; r <= limit; r++) {
+    int best = -1;
+    double best_d = 1e9;
+    for (int dy = -r; dy <= r; dy++) {
+      for (int dx = -r; dx <= r; dx++) {
+        if (abs(dx) != r && abs(dy) != r) continue;   // Just the ring
+        if (costAt(cm, cx + dx, cy + dy) >= COST_LETHAL) continue;
+        double d = dx * dx + dy * dy;
+        if (d < best_d) {
+          best_d = d;
+          best = (cy + dy) * cm.width + cx + dx;
+        }
+      }
+    }
+    if (best >= 0) return best;
+  }
+  return -1;
+} // End of nearestFreeCell()
+
+/**
+ * lineClear()
+ *
+ * Can the robot drive straight from cell a to cell b without entering a
+ * cell costing more than max_cost? Visits every cell the line touches.
+ *
+ **/
+
+inline bool lineClear(const CostMap& cm, int ax, int ay, int bx, int by,
+                      int max_cost)
+{
+  int dx = abs(bx - ax), dy = abs(by - ay);
+  int sx = bx > ax ? 1 : -1, sy = by > ay ? 1 : -1;
+  int x = ax, y = ay;
+  int err = dx - dy;
+
+  for (int n = dx + dy; n >= 0; n--) {
+    if (costAt(cm, x, y) > max_cost) return false;
+    // Step in x or y only, never both at once, so no corner is cut.
+    if (err > 0 || (err == 0 && dx > dy)) {
+      x += sx;
+      err -= 2 * dy;
+    } else {
+      y += sy;
+      err += 2 * dx;
+    }
+  }
+  return true;
+} // End of lineClear()
+
+/**
+ * smoothPath()
+ *
+ * Replace a cell-by-cell path with as few straight legs as we can: from
+ * each waypoint, skip to the furthest later one that can be reached in a
+ * straight line without getting any closer to the walls than the path
+ * itself did.
+ *
+ **/
+
+inline void smoothPath(const CostMap& cm, std::vector<int>& cells)
+{
+  if (cells.size() < 3) return;
+
+  int worst = COST_FREE;
+  for (size_t i = 0; i < cells.size(); i++)
+    if (cm.cost[cells[i]] > worst) worst = cm.cost[cells[i]];
+
+  std::vector<int> out;
+  size_t i = 0;
+  out.push_back(cells[0]);
+  while (i + 1 < cells.size()) {
+    size_t j = cells.size() - 1;
+    int ax = cells[i] % cm.width, ay = cells[i] / cm.width;
+    while (j > i + 1) {
+      int bx = cells[j] % cm.width, by = cells[j] / cm.width;
+      if (lineClear(cm, ax, ay, bx, by, worst)) break;
+      j--;
+    }
+    out.push_back(cells[j]);
+    i = j;
+  }
+  cells.swap(out);
+} // End of smoothPath()
+
+/**
+ * planPath()
+ *
+ * Plan from (sx, sy) to (gx, gy), in metres. On success "path" holds the
+ * smoothed waypoints, ending at the goal (but not including the start),
+ * and we return true.
+ *
+ **/
+
+inline bool planPath(Planner& planner, double sx, double sy,
+                     double gx, double gy, std::vector<Point2d>& path)
+{
+  const CostMap& cm = planner.costmap;
+  const int   w = cm.width, h = cm.height;
+  const int   nbr_dx[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+  const int   nbr_dy[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+  const float nbr_len[8] = { 1, 1, 1, 1, M_SQRT2, M_SQRT2, M_SQRT2, M_SQRT2 };
+  typedef std::pair<float, int> Entry;   // (f, cell), smallest f first
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > open;
+
+  path.clear();
+  int start = nearestFreeCell(cm, (int)floor((sx - cm.origin_x) / cm.scale),
+                              (int)floor((sy - cm.origin_y) / cm.scale));
+  int goal  = nearestFreeCell(cm, (int)floor((gx - cm.origin_x) / cm.scale),
+                              (int)floor((gy - cm.origin_y) / cm.scale));
+  if (start < 0 || goal < 0) return false;
+
+  int gcx = goal % w, gcy = goal / w;
+  unsigned search = ++planner.search;
+  planner.expanded = 0;
+
+  planner.g[start] = 0;
+  planner.parent[start] = -1;
+  planner.seen[start] = search;
+  open.push(Entry(0, start));
+
+  while (!open.empty()) {
+    int cell = open.top().second;
+    open.pop();
+    if (planner.closed[cell] == search) continue;   // Stale entry
+    planner.closed[cell] = search;
+    planner.expanded++;
+    if (cell == goal) break;
+
+    int cx = cell % w, cy = cell / w;
+    for (int k = 0; k < 8; k++) {
+      int nx = cx + nbr_dx[k], ny = cy + nbr_dy[k];
+      if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+      int n = ny * w + nx;
+      int c = cm.cost[n];
+      if (c >= COST_LETHAL || planner.closed[n] == search) continue;
+
+      float g = planner.g[cell] + nbr_len[k] * c;
+      if (planner.seen[n] == search && g >= planner.g[n]) continue;
+      planner.g[n] = g;
+      planner.parent[n] = cell;
+      planner.seen[n] = search;
+
+      // Octile distance: exact in an empty map, so never an overestimate.
+      int ddx = abs(nx - gcx), ddy = abs(ny - gcy);
+      float hh = (ddx + ddy) + (M_SQRT2 - 2) * (ddx < ddy ? ddx : ddy);
+      open.push(Entry(g + hh * COST_FREE, n));
+    }
+  }
+  if (planner.closed[goal] != search) return false;
+
+  std::vector<int> cells;
+  for (int c = goal; c != -1; c = planner.parent[c]) cells.push_back(c);
+  std::reverse(cells.begin(), cells.end());
+  smoothPath(cm, cells);
+
+  for (size_t i = 1; i < cells.size(); i++) {
+    Point2d p;
+    p.x = cm.origin_x + (cells[i] % w + 0.5) * cm.scale;
+    p.y = cm.origin_y + (cells[i] / w + 0.5) * cm.scale;
+    path.push_back(p);
+  }
+  // Finish exactly on the goal if it was reachable as given.
+  if (!path.empty() && goal == (int)floor((gy - cm.origin_y) / cm.scale) * w
+                               + (int)floor((gx - cm.origin_x) / cm.scale)) {
+    path.back().x = gx;
+    path.back().y = gy;
+  }
+  return true;
+} // End of planPath()
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Ray casting benchmark
+ *
+ ** Description ***************************************************************
+ *
+ *  Times the ray casting kernels in raycast.h against the simple castRay()
+ *  in gridmap.h, casting full 361 beam SICK scans from random free poses,
+ *  and checks that they agree:
+ *
+ *    ./raycast-bench [bitmap [size_x size_y [poses]]]
+ *
+ *  Defaults to bitmaps/local.png over 16x16m and 2000 poses.
+ */
+
+
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include <sys/time.h>
+#include "raycast.h"
+
+/**
+ * Function headers
+ *
+ **/
+
+double now();
+void report(const char* name, double took, int rays, double err);
+
+/**
+ * main()
+ *
+ **/
+
+int main(int argc, char *argv[])
+{
+  const char* bitmap = argc > 1 ? argv[1] : "bitmaps/local.png";
+  double size_x = argc > 3 ? atof(argv[2]) : 16;
+  double size_y = argc > 3 ? atof(argv[3]) : 16;
+  int    count  = argc > 4 ? atoi(argv[4]) : 2000;
+  GridMap      map;
+  RayCaster    dda, pyramid;
+  ScanGeometry geom;
+  std::mt19937 rng(1);
+
+  if (!loadGridMap(map, bitmap, size_x, size_y)) return 1;
+  initRayCaster(dda, map);
+  initRayCaster(pyramid, map, 5);
+  initSickGeometry(geom);
+
+  // Random poses in free space
+  std::vector<Pose2d> poses(count);
+  std::uniform_real_distribution<double> ux(0, map.width * map.scale);
+  std::uniform_real_distribution<double> uy(0, map.height * map.scale);
+  std::uniform_real_distribution<double> ua(-M_PI, M_PI);
+  for (int p = 0; p < count; p++) {
+    do {
+      poses[p].px = map.origin_x + ux(rng);
+      poses[p].py = map.origin_y + uy(rng);
+    } while (pointOccupied(map, poses[p].px, poses[p].py));
+    poses[p].pa = ua(rng);
+  }
+
+  int rays = count * geom.count;
+  std::vector<float> simple(rays), fast(rays);
+  double start, err;
+
+  start = now();
+  for (int p = 0; p < count; p++)
+    for (int i = 0; i < geom.count; i++)
+      simple[p * geom.count + i] = castRay(map, poses[p].px, poses[p].py,
+                                           poses[p].pa + geom.bearing[i],
+                                           geom.max_range);
+  report("castRay (half cell steps)", now() - start, rays, 0);
+
+  start = now();
+  castScans(dda, geom, &poses[0], count, &fast[0]);
+  double took = now() - start;
+  err = 0;
+  for (int i = 0; i < rays; i++) err += fabs(fast[i] - simple[i]);
+  report("castScans, DDA", took, rays, err / rays);
+
+  start = now();
+  castScans(pyramid, geom, &poses[0], count, &fast[0]);
+  took = now() - start;
+  err = 0;
+  for (int i = 0; i < rays; i++) err += fabs(fast[i] - simple[i]);
+  report("castScans, 5 level pyramid", took, rays, err / rays);
+
+  return 0;
+} // end of main()
+
+/**
+ * now()
+ *
+ * Wall clock time in seconds.
+ *
+ **/
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+} // End of now()
+
+/**
+ * report()
+ *
+ * One line of results: time taken, rays per second, and the mean
+ * difference from castRay().
+ *
+ **/
+
+void report(const char* name, double took, int rays, double err)
+{
+  std::cout << name << ": " << took * 1000 << "ms, "
+            << rays / took / 1e6 << "M rays/s";
+  if (err > 0) std::cout << ", mean difference " << err << "m";
+  std::cout << std::endl;
+} // End of report()
@@ -0,0 +1,304 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Batched ray casting
+ *
+ ** Description ***************************************************************
+ *
+ *  Works out what the laser should see: the range along each of a batch of
+ *  rays to the first occupied cell of a GridMap. This is what localization
+ *  needs to score a particle, what a simulator needs to fake a scan, and
+ *  what collision prediction needs to know how far is clear ahead, so they
+ *  all share this one kernel.
+ *
+ *  Rays are walked through the grid cell by cell with the DDA of Amanatides
+ *  and Woo, each ray on its own. There is no version that runs several
+ *  rays in lockstep across SIMD lanes.
+ *
+ *  If the RayCaster is given more than one level it also keeps a pyramid of
+ *  coarser occupancy grids, where a cell at level k is occupied if any of
+ *  the 2^k by 2^k map cells under it are. A ray in open space then jumps
+ *  straight across the largest empty block it is in rather than visiting
+ *  every cell. That only pays on open maps: it is a third quicker on
+ *  blank.png but no better than plain DDA on local.png, where most beams
+ *  hit something within a few blocks.
+ *
+ *  Ranges follow castRay() in gridmap.h: the distance from the origin to
+ *  where the ray enters the first occupied cell, capped at max_range.
+ */
+
+#ifndef RAYCAST_H
+#define RAYCAST_H
+
+#include <cmath>
+#include <vector>
+#include "gridmap.h"
+
+/**
+ * The map plus, optionally, its occupancy pyramid.
+ *
+ **/
+
+struct RayCaster
+{
+  const GridMap* map;
+  int levels;                     // 1 means plain DDA, no pyramid
+  std::vector<int> widths, heights;
+  std::vector<std::vector<unsigned char> > pyramid;   // [0] is unused
+};
+
+/**
+ * Precomputed bearings for a laser, e.g. the 361 beams over 180 degrees of
+ * the SICK in sick.inc.
+ *
+ **/
+
+struct ScanGeometry
+{
+  int   count;
+  float min_angle, resolution, max_range;
+  std::vector<float> bearing, cos_b, sin_b;
+};
+
+/**
+ * initScanGeometry()
+ *
+ **/
+
+inline void initScanGeometry(ScanGeometry& geom, int count, double min_angle,
+                             double resolution, double max_range)
+{
+  geom.count = count;
+  geom.min_angle = min_angle;
+  geom.resolution = resolution;
+  geom.max_range = max_range;
+  geom.bearing.resize(count);
+  geom.cos_b.resize(count);
+  geom.sin_b.resize(count);
+  for (int i = 0; i < count; i++) {
+    double b = min_angle + i * resolution;
+    geom.bearing[i] = b;
+    geom.cos_b[i] = cos(b);
+    geom.sin_b[i] = sin(b);
+  }
+} // End of initScanGeometry()
+
+/**
+ * initSickGeometry()
+ *
+ * The laser in sick.inc: 361 samples over 180 degrees out to 8m.
+ *
+ **/
+
+inline void initSickGeometry(ScanGeometry& geom)
+{
+  initScanGeometry(geom, 361, -M_PI / 2, M_PI / 360, 8.0);
+} // End of initSickGeometry()
+
+/**
+ * initRayCaster()
+ *
+ * Build "levels" levels of pyramid over the map, the first being the map
+ * itself, so the default of 1 means plain DDA. Five levels takes blocks up
+ * to 16 cells, half a metre on local.png.
+ *
+ **/
+
+inline void initRayCaster(RayCaster& rc, const GridMap& map, int levels = 1)
+{
+  rc.map = &map;
+  rc.levels = levels < 1 ? 1 : levels;
+  rc.widths.assign(rc.levels, 0);
+  rc.heights.assign(rc.levels, 0);
+  rc.pyramid.assign(rc.levels, std::vector<unsigned char>());
+  rc.widths[0] = map.width;
+  rc.heights[0] = map.height;
+
+  for (int l = 1; l < rc.levels; l++) {
+    int pw = rc.widths[l - 1], ph = rc.heights[l - 1];
+    int w = (pw + 1) / 2, h = (ph + 1) / 2;
+    const unsigned char* below = (l == 1) ? &map.cells[0]
+                                          : &rc.pyramid[l - 1][0];
+    std::vector<unsigned char>& level = rc.pyramid[l];
+    level.assign((size_t)w * h, 0);
+    for (int y = 0; y < ph; y++)
+      for (int x = 0; x < pw; x++)
+        if (below[y * pw + x]) level[(y / 2) * w + x / 2] = 1;
+    rc.widths[l] = w;
+    rc.heights[l] = h;
+  }
+} // End of initRayCaster()
+
+/**
+ * castRaysDDA()
+ *
+ * Cast n rays, ray i starting at (ox[i], oy[i]) in world coordinates and
+ * heading along (ca[i], sa[i]), a unit vector. Ranges go in out[i].
+ *
+ **/
+
+inline void castRaysDDA(const GridMap& map, const float* ox, const float* oy,
+                        const float* ca, const float* sa, int n,
+                        float max_range, float* out)
+{
+  const float big = 1e30f;
+  const float inv_scale = 1.0f / map.scale;
+  const float tmax = max_range * inv_scale;
+  const unsigned w = map.width, h = map.height;
+  const unsigned char* cells = &map.cells[0];
+
+  for (int r = 0; r < n; r++) {
+    // Which cell we start in, which way we step, and the ray parameter (in
+    // cells) at the next x and y cell boundaries.
+    float px = (ox[r] - map.origin_x) * inv_scale;
+    float py = (oy[r] - map.origin_y) * inv_scale;
+    float cx = ca[r], cy = sa[r];
+    int   ix = (int)floorf(px), iy = (int)floorf(py);
+    int   sx = cx > 0 ? 1 : -1, sy = cy > 0 ? 1 : -1;
+    float dx = cx != 0 ? fabsf(1.0f / cx) : big;
+    float dy = cy != 0 ? fabsf(1.0f / cy) : big;
+    float nx = cx > 0 ? (ix + 1 - px) * dx : (px - ix) * dx;
+    float ny = cy > 0 ? (iy + 1 - py) * dy : (py - iy) * dy;
+    float t  = 0;
+
+    // Unsigned compares catch running off either side of the map.
+    if ((unsigned)ix < w && (unsigned)iy < h && !cells[iy * w + ix]) {
+      while (t < tmax) {
+        if (nx < ny) {
+          t = nx;
+          nx += dx;
+          ix += sx;
+        } else {
+          t = ny;
+          ny += dy;
+          iy += sy;
+        }
+        if ((unsigned)ix >= w || (unsigned)iy >= h || cells[iy * w + ix])
+          break;
+      }
+    }
+
+    float range = t * map.scale;
+    out[r] = range < max_range ? range : max_range;
+  }
+} // End of castRaysDDA()
+
+/**
+ * castRaysPyramid()
+ *
+ * As castRaysDDA(), but using the pyramid to hop over empty space. Each
+ * hop goes from wherever the ray is to the edge of the biggest empty block
+ * around it, so rays here are handled one at a time.
+ *
+ **/
+
+inline void castRaysPyramid(const RayCaster& rc, const float* ox,
+                            const float* oy, const float* ca, const float* sa,
+                            int n, float max_range, float* out)
+{
+  const GridMap& map = *rc.map;
+  const float inv_scale = 1.0f / map.scale;
+  const float tmax = max_range * inv_scale;
+  const float big = 1e30f;
+  const unsigned w = map.width, h = map.height;
+  const unsigned char* level[32];
+  int top = rc.levels < 32 ? rc.levels : 32;
+
+  level[0] = &map.cells[0];
+  for (int l = 1; l < top; l++) level[l] = &rc.pyramid[l][0];
+
+  for (int r = 0; r < n; r++) {
+    float px = (ox[r] - map.origin_x) * inv_scale;
+    float py = (oy[r] - map.origin_y) * inv_scale;
+    float cx = ca[r], cy = sa[r];
+    float icx = cx != 0 ? 1.0f / cx : big;
+    float icy = cy != 0 ? 1.0f / cy : big;
+    float t = 0;
+    int   l = 0;
+
+    while (t < tmax) {
+      int x = (int)floorf(px + cx * t);
+      int y = (int)floorf(py + cy * t);
+      if ((unsigned)x >= w || (unsigned)y >= h || level[0][y * w + x]) break;
+
+      // Find the coarsest level whose block around us is empty, starting
+      // from the level of the last hop since neighbouring blocks tend to
+      // be alike.
+      while (l > 0 && level[l][(y >> l) * rc.widths[l] + (x >> l)]) l--;
+      while (l + 1 < top
+             && !level[l + 1][(y >> (l + 1)) * rc.widths[l + 1]
+                              + (x >> (l + 1))])
+        l++;
+
+      // And jump to where the ray leaves that block.
+      int   size = 1 << l;
+      float x0 = (float)((x >> l) << l), y0 = (float)((y >> l) << l);
+      float tx = cx > 0 ? (x0 + size - px) * icx
+               : cx < 0 ? (x0 - px) * icx : big;
+      float ty = cy > 0 ? (y0 + size - py) * icy
+               : cy < 0 ? (y0 - py) * icy : big;
+      float next = (tx < ty ? tx : ty) + 1e-4f;
+      t = next > t ? next : t + 1e-4f;
+    }
+
+    float range = t * map.scale;
+    out[r] = range < max_range ? range : max_range;
+  }
+} // End of castRaysPyramid()
+
+/**
+ * castRays()
+ *
+ * Cast a batch of rays with whichever kernel the caster is set up for.
+ *
+ **/
+
+inline void castRays(const RayCaster& rc, const float* ox, const float* oy,
+                     const float* ca, const float* sa, int n,
+                     float max_range, float* out)
+{
+  if (rc.levels > 1) castRaysPyramid(rc, ox, oy, ca, sa, n, max_range, out);
+  else castRaysDDA(*rc.map, ox, oy, ca, sa, n, max_range, out);
+} // End of castRays()
+
+/**
+ * castScans()
+ *
+ * The scan the laser would return from each of "count" poses; ranges for
+ * pose p go in out[p * geom.count ...]. The laser is assumed to sit at the
+ * centre of the robot, as it does in world4.world.
+ *
+ **/
+
+inline void castScans(const RayCaster& rc, const ScanGeometry& geom,
+                      const Pose2d* poses, int count, float* out)
+{
+  int n = geom.count;
+  std::vector<float> ox(n), oy(n), ca(n), sa(n);
+
+  for (int p = 0; p < count; p++) {
+    float c = cos(poses[p].pa), s = sin(poses[p].pa);
+    for (int i = 0; i < n; i++) {
+      ox[i] = poses[p].px;
+      oy[i] = poses[p].py;
+      ca[i] = c * geom.cos_b[i] - s * geom.sin_b[i];
+      sa[i] = s * geom.cos_b[i] + c * geom.sin_b[i];
+    }
+    castRays(rc, &ox[0], &oy[0], &ca[0], &sa[0], n, geom.max_range,
+             out + (size_t)p * n);
+  }
+} // End of castScans()
+
+/**
+ * castScan()
+ *
+ * The scan from a single pose.
+ *
+ **/
+
+inline void castScan(const RayCaster& rc, const ScanGeometry& geom,
+                     Pose2d pose, float* out)
+{
+  castScans(rc, geom, &pose, 1, out);
+} // End of castScan()
+
+#endif
@@ -17,12 +17,74 @@
  *  traveled some distance, if the robot has only two hypotheses of its
  *  location remaining, it will choose the best hypotheses, only if it is at
  *  least 99% sure, otherwise it will continue to scan. 
+ *
+ *  Run with -mcl to localize with the particle filter in mcl.h instead of
+ *  the amcl driver. It is fed straight from the laser and odometry every
+ *  time round the loop, so it doesn't need the 1000 iterations of wandering
+ *  that amcl does before we check it (use world43.cfg, which has no amcl).
+ *  Distances from the map are cached in bitmaps/local.dmap after the first
+ *  run; make-distmap builds them ahead of time. -scanmatch (which implies
+ *  -mcl) corrects the odometry the filter gets by matching laser scans
+ *  against each other (scanmatch.h). -active makes the robot, rather than
+ *  wander, choose the moves that will best tell its hypotheses apart
+ *  (activeloc.h), and lets amcl be checked without waiting 1000 ticks.
+ *
+ *  -scan cleans up each laser scan and thins it out once a tick (scan.h)
+ *  for the filter, the scan matcher and the steering to use, which drops
+ *  spikes and saves them looking at more beams than they need. With -v it
+ *  also prints the walls and corners it found in the scan.
+ *
+ *  With -monitor the robot doesn't stop once it knows where it is, but
+ *  carries on wandering, checking every scan against the map. If it finds
+ *  itself somewhere other than it thought (it has been picked up and put
+ *  down, say), it searches the whole map for where it is (relocalize.h),
+ *  which takes a few tens of milliseconds, and carries on from there.
+ *
+ *  -vfh steers round what the laser sees with the vector field histogram
+ *  in vfh.h, rather than turning hard away from whichever side has
+ *  something within 1.2m, so it bumps into things less and keeps its
+ *  speed up.
+ *
+ *  -mapping (which implies -monitor) adds each scan to the map once the
+ *  robot knows where it is (occmap.h), so that what has been moved about
+ *  since the map was drawn doesn't throw the filter or the guard off.
+ *
+ *  With -async (or -hz, 20Hz by default) the robot is read on a thread of
+ *  its own and the control loop runs at a fixed rate (robotclient.h).
+ *
+ *  Every tick is logged to real-local.tlog (or the file given with -log),
+ *  in binary so that it doesn't slow the loop down; telemetry-decode turns
+ *  it into CSV. log.txt just gets the best hypotheses. With -v the robot's
+ *  state is also printed every tick, as it used to be.
+ *
+ *  -record file saves everything read from the robot; -replay file runs
+ *  the controller on a recording instead of on a robot, with no Player
+ *  server needed, and stops when it runs out. -sim [world] runs it in the
+ *  headless simulator (sim.h) on world4.world or the world given, as fast
+ *  as it will go, for up to 10 simulated minutes. Since the particle filter
+ *  always starts from the same seed, replaying with -mcl gives the same
+ *  answer every time.
+ *
+ *  -profile file times each stage of the tick (reading the robot,
+ *  localizing, printing, deciding, logging and sending the command, and
+ *  the whole tick after the read) and, at the end, prints the percentiles
+ *  and saves them to the file as CSV (latency.h). loop-bench does the same
+ *  in the simulator and can compare against an earlier run.
+ *
+ *  What to do each tick is worked out in wander.h, which montecarlo also
+ *  uses to run the controller over many random starts at once.
  */
 
 
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <vector>
 #include <libplayerc++/playerc++.h>
+#include "latency.h"
+#include "robotclient.h"
+#include "telemetry.h"
+#include "wander.h"
 using namespace PlayerCc;  
 
 /**
@@ -30,9 +92,8 @@ using namespace PlayerCc;
  *
  **/
 
-player_pose2d_t readPosition(LocalizeProxy& lp);
-void printLaserData(LaserProxy& sp);
-void printRobotData(BumperProxy& bp, player_pose2d_t pose);
+void printLaserData(const SensorFrame& frame, const LaserScan* scan);
+void printRobotData(const SensorFrame& frame, player_pose2d_t pose);
 
 /**
  * main()
@@ -42,189 +103,268 @@ void printRobotData(BumperProxy& bp, player_pose2d_t pose);
 int main(int argc, char *argv[])
 {  
   // Variables
-  int counter = 0;
-  int main_counter = 0;
-  int bumped = 0;
-  int hc = 0;
-  double speed;            // How fast do we want the robot to go forwards?
-  double turnrate;         // How fast do we want the robot to turn?
-  player_pose2d_t  pose;   // For handling localization data
-  player_laser_data laser; // For handling laser data
+  SensorFrame      frame;  // What the robot told us this time round
+  RobotClient      client;
+  Wander           task;   // What we decide to do about it
+  double hz = 0;           // Control rate in async mode, 0 for sync
+  bool fresh;
+  bool verbose = false;    // Print everything every tick?
+  const char* log_path = "real-local.tlog";
+  const char* record = NULL;   // Save what we read from the robot here
+  const char* replay = NULL;   // ...or read it from here instead
+  const char* sim_world = NULL;  // ...or simulate this world instead
+  SimWorld world;
+  Sim sim;
+  Telemetry telemetry;
+  TelemetryRecord rec;
+  bool use_mcl = false;    // Localize in-process rather than with amcl?
+  GridMap map;             // The map our own filter localizes against
+  DistMap field;           // ...and how far each point in it is from a wall
+  Mcl mcl;
+  ScanMatcher matcher;     // Corrects the odometry the filter gets
+  bool use_scanmatch = false;
+  ActiveLocalizer active;  // Chooses moves that help us localize
+  bool use_active = false;
+  PoseGuard guard;         // Notices if we get lost again
+  bool use_monitor = false;
+  LaserScan scan;          // The laser, cleaned up, with -scan
+  bool use_scan = false;
+  Vfh vfh;                 // Steers round things, with -vfh
+  bool use_vfh = false;
+  OccMap mapper;           // Keeps the map up to date, with -mapping
+  bool use_mapping = false;
+  int status;
   std::ofstream ofs;
+  LoopProfile profile;     // Where the time in each tick goes
+  const char* profile_path = NULL;
+  int t_read, t_localize, t_print, t_decide, t_log, t_command, t_tick;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-mcl") == 0) use_mcl = true;
+    else if (strcmp(argv[i], "-scanmatch") == 0) use_mcl = use_scanmatch = true;
+    else if (strcmp(argv[i], "-active") == 0) use_active = true;
+    else if (strcmp(argv[i], "-monitor") == 0) use_monitor = true;
+    else if (strcmp(argv[i], "-scan") == 0) use_scan = true;
+    else if (strcmp(argv[i], "-vfh") == 0) use_vfh = true;
+    else if (strcmp(argv[i], "-mapping") == 0)
+      use_mapping = use_monitor = true;
+    else if (strcmp(argv[i], "-async") == 0) hz = 20;
+    else if (strcmp(argv[i], "-hz") == 0 && i + 1 < argc) hz = atof(argv[++i]);
+    else if (strcmp(argv[i], "-log") == 0 && i + 1 < argc) log_path = argv[++i];
+    else if (strcmp(argv[i], "-v") == 0) verbose = true;
+    else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+      profile_path = argv[++i];
+    else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+      record = argv[++i];
+    else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc)
+      replay = argv[++i];
+    else if (strcmp(argv[i], "-sim") == 0) {
+      sim_world = "world4.world";
+      if (i + 1 < argc && strstr(argv[i + 1], ".world") != NULL)
+        sim_world = argv[++i];
+    }
+  }
+  if (use_mcl || use_active || use_monitor) {
+    // Same map and size as world4.world
+    if (!loadGridMap(map, "bitmaps/local.png", 16, 16)) return 1;
+    if (!loadDistMap(field, "bitmaps/local.png", 16, 16, &map)) return 1;
+  }
+  if (use_mcl) mclInit(mcl, map, &field);
+  initWander(task, use_mcl ? &mcl : NULL);
+  if (use_scanmatch) {
+    initScanMatcher(matcher);
+    useScanMatcher(task, matcher);
+  }
+  if (use_active) {
+    initActiveLocalizer(active, map, field);
+    task.active = &active;
+  }
+  if (use_monitor) {
+    initPoseGuard(guard, field);
+    task.guard = &guard;
+    task.keep_going = true;
+  }
+  if (use_scan) {
+    initLaserScan(scan);
+    task.scan = &scan;
+  }
+  if (use_vfh) {
+    initVfh(vfh);
+    task.vfh = &vfh;
+  }
+  if (use_mapping) {
+    initOccMap(mapper, map, &field);
+    task.mapper = &mapper;
+  }
+  task.verbose = verbose;
+  initProfile(profile);
+  t_read     = addStage(profile, "read");
+  t_localize = addStage(profile, "localize");
+  t_print    = addStage(profile, "print");
+  t_decide   = addStage(profile, "decide");
+  t_log      = addStage(profile, "log");
+  t_command  = addStage(profile, "command");
+  t_tick     = addStage(profile, "tick");
+
   ofs.open("log.txt");
+  openTelemetry(telemetry, log_path, "real-local");
   // Set up proxies. These are the names we will use to connect to 
-  // the interface to the robot.
-  PlayerClient    robot("localhost");  
-  BumperProxy     bp(&robot,0);  
-  Position2dProxy pp(&robot,0);
-  LocalizeProxy   lp (&robot, 0);
-  LaserProxy      sp (&robot, 0);
+  // the interface to the robot. A replay or simulation doesn't need any.
+  PlayerClient*    robot = NULL;
+  BumperProxy*     bp = NULL;
+  Position2dProxy* pp = NULL;
+  LaserProxy*      sp = NULL;
+  LocalizeProxy*   lp = NULL;
 
-  // Allow the program to take charge of the motors (take care now)
-  pp.SetMotorEnable(true);
+  if (replay != NULL) {
+    if (!startReplay(client, replay)) return 1;
+  } else if (sim_world != NULL) {
+    if (!loadSimWorld(world, sim_world)) return 1;
+    initSim(sim, world);
+    sim.localize = !use_mcl;     // fakelocalize stands in for amcl
+    startSim(client, sim, 600, record, "real-local");
+  } else {
+    robot = new PlayerClient("localhost");
+    bp = new BumperProxy(robot, 0);
+    pp = new Position2dProxy(robot, 0);
+    sp = new LaserProxy(robot, 0);
+    // With -mcl there need not be a localize device at all
+    if (!use_mcl) lp = new LocalizeProxy(robot, 0);
+    // Allow the program to take charge of the motors (take care now)
+    pp->SetMotorEnable(true);
+    startClient(client, robot, pp, bp, sp, lp, hz, record, "real-local");
+  }
 
   // Main control loop
   while(true) 
     {    
       // Update information from the robot.
-      robot.Read();
-      // Read new information about position
-      pose = readPosition(lp);
-      // Print information about the laser. Check the counter first to stop
-      // problems on startup
-      if(counter > 2){
-	printLaserData(sp);
+      {
+        ScopedTimer timer(profile, t_read);
+        fresh = clientRead(client, frame);
       }
+      if (client.finished) break;
+      // Time the rest of the tick, up to the closing brace
+      ScopedTimer tick_timer(profile, t_tick);
 
-      // Print data on the robot to the terminal
-      printRobotData(bp, pose);
-      
-      hc = lp.GetHypothCount();
-      // If either bumper is pressed, stop. Otherwise just go forwards
-      if (bumped) {
-        if (counter < 50) {
-          speed = -0.5;
-          turnrate = -0.4;
-        } else {
-          counter = 0;
-          bumped = 0;
-          speed = 0.5;
-          turnrate = 0.0;
-        }
-        counter ++;
-      } else if(bp[0] || bp[1]){
-	speed= 0;
-	turnrate= 0;
-        bumped = 1;
-      // After 1000 iterations, and if hypoth count <= 2
-      // Record the current best hypothesis
-      } else if (main_counter > 1000 && hc <= 2) {
-        player_localize_hypoth hypo;
-        player_pose2d_t pose;
-        double best = 0.0;
-        int best_index = 0;
-        for (int i = 0; i < hc; i++) {
-          hypo = lp.GetHypoth(i);
-          pose = hypo.mean;
-          if (hypo.alpha > best) {
-            best = hypo.alpha;
-            best_index = i;
-          }
-        }
-        hypo = lp.GetHypoth(best_index);
-        pose = hypo.mean;
-        std::cout << "Best hypothesis..." << std::endl;
-        std::cout << "X: " << pose.px  << std::endl;
-        std::cout << "Y: " << pose.py  << std::endl;
-        std::cout << "A: " << pose.pa  << std::endl;
-        std::cout << "W: " << best << std::endl;
-        ofs << "Best hypothesis..." << std::endl;
-        ofs << "X: " << pose.px  << std::endl;
-        ofs << "Y: " << pose.py  << std::endl;
-        ofs << "A: " << pose.pa  << std::endl;
-        ofs << "W: " << best << std::endl;
-        // If the best hypothesis is 99% certain, we've done a successful run.
-        if (best > 0.99) {
-          std::cout << "Success!" << std::endl;
-          std::cout << "I am " << best << " sure that I am at ";
-          std::cout << "(" << pose.px << ", " << pose.py << ")..." << std::endl;
-          ofs << "Success!" << std::endl;
-          ofs << "I am " << best*100 << "% sure that I am at ";
-          ofs << "(" << pose.px << ", " << pose.py << ")..." << std::endl;
-          pp.SetSpeed(0, 0);
+      // Work out where we are (wander.h)
+      {
+        ScopedTimer timer(profile, t_localize);
+        wanderLocalize(task, frame, fresh);
+      }
+
+      if (verbose) {
+        ScopedTimer timer(profile, t_print);
+        // Print information about the laser. Check the counter first to
+        // stop problems on startup
+        if (task.counter > 2) printLaserData(frame, task.scan);
+        // Print data on the robot to the terminal
+        printRobotData(frame, task.pose);
+      }
+
+      // ...and what to do about it
+      {
+        ScopedTimer timer(profile, t_decide);
+        status = wanderDecide(task, frame);
+      }
+
+      // Record the best hypothesis, if we looked at it
+      if (task.checked) {
+        ScopedTimer timer(profile, t_log);
+        ofs << "Best hypothesis...\n";
+        ofs << "X: " << task.best_pose.px  << "\n";
+        ofs << "Y: " << task.best_pose.py  << "\n";
+        ofs << "A: " << task.best_pose.pa  << "\n";
+        ofs << "W: " << task.best << "\n";
+      }
+      if (status == WANDER_LOCALIZED) {
+        ofs << "Success!" << std::endl;
+        ofs << "I am " << task.best*100 << "% sure that I am at ";
+        ofs << "(" << task.best_pose.px << ", " << task.best_pose.py << ")..."
+            << std::endl;
+        if (!use_monitor) {
+          clientSetSpeed(client, 0, 0);
           break;
         }
-        main_counter = 200;
-      } else {
-        // Navigation adjustments using laser data
-        speed = 1.0;
-        if (sp.MinLeft() < 1.2) {
-          turnrate = -0.8;
-        } else if (sp.MinRight() < 1.2) {
-          turnrate = 0.8;
-        } else {
-          if (sp.MinLeft() < sp.MinRight()) turnrate = -0.4;
-          else turnrate = 0.4;
-        }
-      }     
+      }
 
       // What are we doing?
-      std::cout << "Speed: " << speed << std::endl;      
-      std::cout << "Turn rate: " << turnrate << std::endl;
-      std::cout << "Counter: " << main_counter << std::endl << std::endl;
-      ofs << "Speed: " << speed << std::endl;      
-      ofs << "Turn rate: " << turnrate << std::endl;
-      ofs << "Counter: " << main_counter << std::endl << std::endl;
+      if (verbose) {
+        ScopedTimer timer(profile, t_print);
+        std::cout << "Speed: " << task.speed << "\n";
+        std::cout << "Turn rate: " << task.turnrate << "\n";
+        std::cout << "Counter: " << task.main_counter << "\n" << std::endl;
+      }
+      {
+        ScopedTimer timer(profile, t_log);
+        fillTelemetry(client, frame, rec);
+        rec.pose_x   = task.pose.px;
+        rec.pose_y   = task.pose.py;
+        rec.pose_a   = task.pose.pa;
+        rec.speed    = task.speed;
+        rec.turnrate = task.turnrate;
+        rec.state    = task.main_counter;
+        if (use_mcl) {
+          rec.hyp_count = task.hc;
+          for (int i = 0; i < task.hc && i < TELEMETRY_HYPS; i++) {
+            rec.hyps[i].x     = task.hyps[i].mean.px;
+            rec.hyps[i].y     = task.hyps[i].mean.py;
+            rec.hyps[i].a     = task.hyps[i].mean.pa;
+            rec.hyps[i].alpha = task.hyps[i].alpha;
+          }
+        }
+        logTelemetry(telemetry, rec);
+      }
       // Send the commands to the robot
-      pp.SetSpeed(speed, turnrate);  
-      // Count how many times we do this
-      counter++;
-      main_counter++;
+      {
+        ScopedTimer timer(profile, t_command);
+        clientSetSpeed(client, task.speed, task.turnrate);  
+      }
     }
+  stopClient(client);
+  if (use_scanmatch) {
+    std::cout << "Scan matcher: " << matcher.matches << " matches, "
+              << matcher.fallbacks << " fell back on the wheels" << std::endl;
+  }
+  if (use_monitor) {
+    std::cout << "Lost and found again " << guard.recoveries << " times"
+              << std::endl;
+  }
+  if (use_mapping) {
+    std::cout << "Map: " << mapper.scans << " scans (" << mapper.skipped
+              << " didn't fit), " << mapper.changes << " cells changed, "
+              << mapper.tiles.size() << " tiles" << std::endl;
+  }
+  if (use_active) {
+    std::cout << "Chose a move to localize " << active.decisions << " times"
+              << std::endl;
+  }
+  if (profile_path != NULL) {
+    printProfile(profile);
+    writeProfile(profile, profile_path);
+  }
+  closeTelemetry(telemetry);
   ofs.close();
+  delete lp;
+  delete sp;
+  delete pp;
+  delete bp;
+  delete robot;
   
 } // end of main()
 
-/**
- * readPosition()
- *
- * Read the position of the robot from the localization proxy. 
- *
- * The localization proxy gives us a set of "hypotheses", each of
- * which is a number of possible locations for the robot, and from
- * each we extract the mean, which is a pose.
- *
- * As the number of hypotheses drops, the robot should be more sure
- * of where it is.
- *
- **/
-
-player_pose2d_t readPosition(LocalizeProxy& lp)
-{
-
-  player_localize_hypoth_t hypothesis;
-  player_pose2d_t          pose;
-  uint32_t                 hCount;
-  double                   weight;
-
-  // Need some messing around to avoid a crash when the proxy is
-  // starting up.
-
-  hCount = lp.GetHypothCount();
-
-  std::cout << "AMCL gives us " << hCount + 1 
-            << " possible locations:" << std::endl;
-
-  if(hCount > 0){
-    for(int i = 0; i <= hCount; i++){
-      hypothesis = lp.GetHypoth(i);
-      pose       = hypothesis.mean;
-      weight     = hypothesis.alpha;
-      std::cout << "X: " << pose.px << "\t";
-      std::cout << "Y: " << pose.py << "\t";
-      std::cout << "A: " << pose.pa << "\t";
-      std::cout << "W: " << weight  << std::endl;
-    }
-  }
-
-  // This just returns the mean of the last hypothesis, it isn't necessarily
-  // the right one.
-
-  return pose;
-} // End of readPosition()
-
-void printLaserData(LaserProxy& sp)
+void printLaserData(const SensorFrame& frame, const LaserScan* scan)
 {
 
   double maxRange, minLeft, minRight, range, bearing;
   int points;
 
-  maxRange  = sp.GetMaxRange();
-  minLeft   = sp.MinLeft();
-  minRight  = sp.MinRight();
-  range     = sp.GetRange(5);
-  bearing   = sp.GetBearing(5);
-  points    = sp.GetCount();
+  maxRange  = frame.max_range;
+  minLeft   = frame.min_left;
+  minRight  = frame.min_right;
+  range     = frame.ranges[5];
+  bearing   = frame.bearings[5];
+  points    = frame.ranges_count;
 
   //Print out useful laser data
   std::cout << "Laser says..." << std::endl;
@@ -235,6 +375,21 @@ void printLaserData(LaserProxy& sp)
   std::cout << "Range of a single point: " << range << std::endl;
   std::cout << "Bearing of a single point: " << bearing << std::endl;
 
+  // What the scan made of it, with -scan
+  if (scan == NULL) return;
+  std::cout << "Kept " << scan->count << " of " << scan->valid
+            << " points, dropped " << scan->outliers << " outliers"
+            << std::endl;
+  for (size_t i = 0; i < scan->segments.size(); i++) {
+    const ScanSegment& s = scan->segments[i];
+    std::cout << "Wall from (" << s.x0 << ", " << s.y0 << ") to ("
+              << s.x1 << ", " << s.y1 << ")" << std::endl;
+  }
+  for (size_t i = 0; i < scan->corners.size(); i++) {
+    const ScanCorner& c = scan->corners[i];
+    std::cout << "Corner at (" << c.x << ", " << c.y << ")" << std::endl;
+  }
+
   return;
 } // End of printLaserData()
 
@@ -246,12 +401,12 @@ void printLaserData(LaserProxy& sp)
  *
  **/
 
-void printRobotData(BumperProxy& bp, player_pose2d_t pose)
+void printRobotData(const SensorFrame& frame, player_pose2d_t pose)
 {
 
   // Print out what the bumpers tell us:
-  std::cout << "Left  bumper: " << bp[0] << std::endl;
-  std::cout << "Right bumper: " << bp[1] << std::endl;
+  std::cout << "Left  bumper: " << frame.bumper[0] << std::endl;
+  std::cout << "Right bumper: " << frame.bumper[1] << std::endl;
   // Can also print the bumpers with:
   //std::cout << bp << std::endl;
 
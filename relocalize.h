@@ -0,0 +1,600 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Kidnap detection and global relocalization
+ *
+ ** Description ***************************************************************
+ *
+ *  Once the robot knows where it is, it goes on trusting the localizer.
+ *  If it is picked up and put down somewhere else, or the localizer was
+ *  wrong to begin with, nothing notices. This does.
+ *
+ *  Every tick the monitor puts the laser scan down on the map at the pose
+ *  we think we're at, and asks how far the end of each beam is from the
+ *  nearest wall (the distance map of distmap.h has the answer in a
+ *  lookup). Where we are right, nearly all of them land on walls; where
+ *  we're wrong, most land in the open. Rotating the beams into the map is
+ *  plain float arithmetic over arrays, so the check costs a few
+ *  microseconds. When more than half the beams have missed by more than
+ *  30cm for three ticks running, we're lost.
+ *
+ *  Then the whole map is searched for the pose that best explains the
+ *  scan, as Cartographer does it. The map is turned into a grid scoring
+ *  each cell by how close it is to a wall, and a stack of coarser grids in
+ *  which each cell holds the best score in the block of 2x2, 4x4, 8x8...
+ *  cells from it. For every heading, the scan laid down over a whole block
+ *  of positions at once can score no better than it does against the
+ *  coarse grid, so blocks are split, best first, only while they could
+ *  beat the best pose found so far. That gets the pose to within a cell
+ *  and a degree or so, which a quick climb on the distance map then
+ *  improves on. The whole search takes tens of milliseconds.
+ *
+ *  A PoseGuard puts the two together for a localizer we can't tell to
+ *  start again (amcl, fakelocalize): it keeps a correction to apply to
+ *  whatever pose the localizer gives us, worked out when it relocalizes.
+ *  Our own filter can instead be started again round the pose found.
+ */
+
+#ifndef RELOCALIZE_H
+#define RELOCALIZE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include "distmap.h"
+#include "gridmap.h"
+#include "laserkernel.h"
+#include "planner.h"
+#include "sensorframe.h"
+
+// What guardPose() returns
+#define GUARD_OK     0
+#define GUARD_FOUND  1
+#define GUARD_LOST   2
+
+/**
+ * Checks each scan against the map.
+ *
+ **/
+
+struct ScanMonitor
+{
+  const DistMap* field;
+  int    step;                  // Use every step'th beam
+  double max_range;             // Beams this long saw nothing
+  double outlier;               // A beam ending further from a wall missed
+  double threshold;             // Fraction missing for a tick to be bad
+  int    trip_ticks;            // Bad ticks in a row before we're lost
+  int    min_beams;             // Fewer than this, and we can't tell
+
+  std::vector<float> bx, by;    // Ends of the beams, in the robot's frame
+  std::vector<float> ex, ey;    // ...and in the map
+  double residual;              // Fraction that missed, last tick
+  int    bad_ticks;
+  int    trips;
+};
+
+/**
+ * Finds the robot anywhere on the map from one scan.
+ *
+ **/
+
+struct GlobalLocalizer
+{
+  const DistMap* field;
+  double resolution;            // Metres per cell of the finest grid
+  double sigma;                 // Scores fall off this far from a wall
+  int    levels;                // Grids, each with blocks twice the last
+  double step_a;                // Between headings tried
+  int    max_points;            // Of the scan, evenly spread
+  double min_score;             // Average per point, 0 to 1, to believe it
+  double margin;                // Fraction the runner up must be worse by
+  double elsewhere;             // ...if it's this many metres away
+
+  // The grids, padded all round by the size of the biggest block
+  int    width, height, pad;    // Map cells, and padding
+  int    stride;                // Padded width
+  double origin_x, origin_y;    // World position of map cell (0, 0)
+  std::vector<std::vector<float> > grids;
+  std::vector<unsigned char> room;  // 1 where the robot fits
+
+  int    rotations;
+  std::vector<float> rot_cos, rot_sin;
+
+  // Scratch
+  std::vector<float> px, py;    // The scan's points, robot frame
+  std::vector<int>   ox, oy;    // ...in cells from the robot, by heading
+
+  // Results
+  Pose2d pose;
+  double score;
+  bool   ambiguous;             // Somewhere else did nearly as well
+  int    nodes;                 // Blocks and cells scored
+  double seconds;
+};
+
+/**
+ * A localizer, watched and corrected.
+ *
+ **/
+
+struct PoseGuard
+{
+  ScanMonitor     monitor;
+  GlobalLocalizer global;
+  Pose2d correction;            // Applied to the localizer's poses
+  Pose2d found;                 // Where we were found, last time
+  int    max_tries;             // Searches before we give up
+  int    retry_ticks;           // Ticks between them
+  int    tries;
+  int    recoveries, failures;
+};
+
+/**
+ * initScanMonitor()
+ *
+ **/
+
+inline void initScanMonitor(ScanMonitor& mon, const DistMap& field)
+{
+  mon.field = &field;
+  mon.step = 2;
+  mon.max_range = 8.0;
+  mon.outlier = 0.3;
+  mon.threshold = 0.5;
+  mon.trip_ticks = 3;
+  mon.min_beams = 20;
+  mon.residual = 0;
+  mon.bad_ticks = 0;
+  mon.trips = 0;
+} // End of initScanMonitor()
+
+/**
+ * checkScan()
+ *
+ * How well the scan in the frame fits the map from pose. Returns true on
+ * the tick we decide we're lost, which it then forgets, so the caller
+ * should do something about it.
+ *
+ **/
+
+inline bool checkScan(ScanMonitor& mon, const SensorFrame& frame, Pose2d pose)
+{
+  int n = 0;
+  if (frame.ranges_count == 0) return false;
+
+  mon.bx.resize(frame.ranges_count);
+  mon.by.resize(frame.ranges_count);
+  mon.ex.resize(frame.ranges_count);
+  mon.ey.resize(frame.ranges_count);
+  beamEnds(frame.ranges, frame.bearings, frame.ranges_count, &mon.bx[0],
+           &mon.by[0]);
+  // Keep the ones we use at the front; n never gets ahead of i
+  for (int i = 0; i < frame.ranges_count; i += mon.step) {
+    double r = frame.ranges[i];
+    if (r < 0.05 || r >= mon.max_range - 0.01) continue;
+    mon.bx[n] = mon.bx[i];
+    mon.by[n] = mon.by[i];
+    n++;
+  }
+  if (n < mon.min_beams) return false;
+
+  // Into the map
+  const float c = cos(pose.pa), s = sin(pose.pa);
+  const float x = pose.px, y = pose.py;
+  const float* bx = &mon.bx[0];
+  const float* by = &mon.by[0];
+  float* ex = &mon.ex[0];
+  float* ey = &mon.ey[0];
+  for (int i = 0; i < n; i++) {
+    ex[i] = x + c * bx[i] - s * by[i];
+    ey[i] = y + s * bx[i] + c * by[i];
+  }
+  int missed = 0;
+  for (int i = 0; i < n; i++)
+    missed += distAt(*mon.field, ex[i], ey[i], mon.max_range) > mon.outlier;
+
+  mon.residual = (double)missed / n;
+  if (mon.residual <= mon.threshold) {
+    mon.bad_ticks = 0;
+    return false;
+  }
+  if (++mon.bad_ticks < mon.trip_ticks) return false;
+  mon.bad_ticks = 0;
+  mon.trips++;
+  return true;
+} // End of checkScan()
+
+/**
+ * initGlobalLocalizer()
+ *
+ * Build the grids from the distance map.
+ *
+ **/
+
+inline void initGlobalLocalizer(GlobalLocalizer& gl, const DistMap& field)
+{
+  gl.field = &field;
+  gl.resolution = 0.1;
+  gl.sigma = 0.15;
+  gl.levels = 6;                // Blocks of up to 32x32 cells, 3.2m
+  gl.step_a = 0.02;             // Just over a degree
+  gl.max_points = 90;
+  gl.min_score = 0.5;
+  gl.margin = 0.05;
+  gl.elsewhere = 1.0;
+
+  const double res = gl.resolution;
+  gl.origin_x = field.origin_x;
+  gl.origin_y = field.origin_y;
+  gl.width  = (int)ceil(field.width * field.scale / res);
+  gl.height = (int)ceil(field.height * field.scale / res);
+  gl.pad = 1 << (gl.levels - 1);
+  gl.stride = gl.width + 2 * gl.pad;
+  int rows = gl.height + 2 * gl.pad;
+
+  // The finest grid scores the middle of each cell; the padding scores 0
+  double inv_2s2 = 1.0 / (2 * gl.sigma * gl.sigma);
+  gl.grids.assign(gl.levels, std::vector<float>(gl.stride * rows, 0.0f));
+  gl.room.assign(gl.width * gl.height, 0);
+  for (int y = 0; y < gl.height; y++)
+    for (int x = 0; x < gl.width; x++) {
+      float d = distAt(field, gl.origin_x + (x + 0.5) * res,
+                       gl.origin_y + (y + 0.5) * res);
+      gl.grids[0][(y + gl.pad) * gl.stride + x + gl.pad] =
+        exp(-d * d * inv_2s2);
+      gl.room[y * gl.width + x] = d >= ROOMBA_RADIUS;
+    }
+
+  // Each coarser grid is the best of four cells of the one before, half a
+  // block apart, so cell c holds the best of the block starting at c
+  for (int l = 1; l < gl.levels; l++) {
+    int h = 1 << (l - 1);
+    const std::vector<float>& fine = gl.grids[l - 1];
+    std::vector<float>& coarse = gl.grids[l];
+    for (int y = 0; y < rows; y++)
+      for (int x = 0; x < gl.stride; x++) {
+        float m = fine[y * gl.stride + x];
+        if (x + h < gl.stride) m = std::max(m, fine[y * gl.stride + x + h]);
+        if (y + h < rows) {
+          m = std::max(m, fine[(y + h) * gl.stride + x]);
+          if (x + h < gl.stride)
+            m = std::max(m, fine[(y + h) * gl.stride + x + h]);
+        }
+        coarse[y * gl.stride + x] = m;
+      }
+  }
+
+  gl.rotations = (int)ceil(2 * M_PI / gl.step_a);
+  gl.step_a = 2 * M_PI / gl.rotations;
+  gl.rot_cos.resize(gl.rotations);
+  gl.rot_sin.resize(gl.rotations);
+  for (int k = 0; k < gl.rotations; k++) {
+    gl.rot_cos[k] = cos(k * gl.step_a - M_PI);
+    gl.rot_sin[k] = sin(k * gl.step_a - M_PI);
+  }
+  gl.score = 0;
+  gl.ambiguous = false;
+  gl.nodes = 0;
+  gl.seconds = 0;
+} // End of initGlobalLocalizer()
+
+/**
+ * blockScore()
+ *
+ * Sum over the points at heading k of grid "level", with the robot in the
+ * block of cells starting at (x, y). At level 0 that is the score of the
+ * robot in cell (x, y); above, no cell in the block can do better.
+ *
+ **/
+
+inline double blockScore(const GlobalLocalizer& gl, int level, int k,
+                         int x, int y)
+{
+  int n = gl.px.size();
+  const int* ox = &gl.ox[k * n];
+  const int* oy = &gl.oy[k * n];
+  const float* grid = &gl.grids[level][0];
+  int rows = gl.height + 2 * gl.pad;
+  double sum = 0;
+
+  for (int i = 0; i < n; i++) {
+    int cx = x + ox[i] + gl.pad, cy = y + oy[i] + gl.pad;
+    if (cx < 0 || cy < 0 || cx >= gl.stride || cy >= rows) continue;
+    sum += grid[cy * gl.stride + cx];
+  }
+  return sum;
+} // End of blockScore()
+
+/**
+ * The best pose a search has found, and where it mustn't look.
+ *
+ **/
+
+struct RelocBest
+{
+  double score;
+  int    k, x, y;
+  int    skip_x, skip_y;        // Cells no nearer this than skip_r...
+  int    skip_r;                // ...or 0 to look everywhere
+};
+
+/**
+ * searchBlock()
+ *
+ * Split the block at (x, y), "level", heading k, into its four quarters
+ * and search those that could beat the best so far, best first.
+ *
+ **/
+
+inline void searchBlock(GlobalLocalizer& gl, int level, int k, int x, int y,
+                        RelocBest& best)
+{
+  if (level == 0) {
+    if (x >= gl.width || y >= gl.height || !gl.room[y * gl.width + x]) return;
+    int dx = x - best.skip_x, dy = y - best.skip_y;
+    if (dx * dx + dy * dy < best.skip_r * best.skip_r) return;
+    double s = blockScore(gl, 0, k, x, y);
+    gl.nodes++;
+    if (s > best.score) {
+      best.score = s;
+      best.k = k;
+      best.x = x;
+      best.y = y;
+    }
+    return;
+  }
+
+  int h = 1 << (level - 1);
+  struct Child { double bound; int x, y; } child[4];
+  for (int c = 0; c < 4; c++) {
+    child[c].x = x + (c & 1) * h;
+    child[c].y = y + (c >> 1) * h;
+    child[c].bound = (child[c].x < gl.width && child[c].y < gl.height)
+      ? blockScore(gl, level - 1, k, child[c].x, child[c].y) : -1;
+    gl.nodes++;
+  }
+  std::sort(child, child + 4, [](const Child& a, const Child& b) {
+      return a.bound > b.bound;
+    });
+  for (int c = 0; c < 4; c++) {
+    if (child[c].bound <= best.score) break;
+    searchBlock(gl, level - 1, k, child[c].x, child[c].y, best);
+  }
+} // End of searchBlock()
+
+/**
+ * searchMap()
+ *
+ * Search the blocks, best first, for anything scoring more than
+ * best.score.
+ *
+ **/
+
+template<class Candidates>
+inline void searchMap(GlobalLocalizer& gl, const Candidates& top,
+                      RelocBest& best)
+{
+  for (size_t c = 0; c < top.size() && top[c].bound > best.score; c++)
+    searchBlock(gl, gl.levels - 1, top[c].k, top[c].x, top[c].y, best);
+} // End of searchMap()
+
+/**
+ * refinePose()
+ *
+ * Climb the distance map from pose: try a step either way in x, y and a,
+ * keep any that brings the beam ends closer to walls, and halve the steps
+ * when none does.
+ *
+ **/
+
+inline void refinePose(const GlobalLocalizer& gl, Pose2d& pose)
+{
+  auto cost = [&](const Pose2d& p) {
+    double c = cos(p.pa), s = sin(p.pa), sum = 0;
+    for (size_t i = 0; i < gl.px.size(); i++) {
+      double d = distAt(*gl.field, p.px + c * gl.px[i] - s * gl.py[i],
+                        p.py + s * gl.px[i] + c * gl.py[i], 1.0);
+      sum += std::min(d, 0.5) * std::min(d, 0.5);
+    }
+    return sum;
+  };
+  double step[3] = { gl.resolution / 2, gl.resolution / 2, gl.step_a / 2 };
+  double best = cost(pose);
+
+  for (int it = 0; it < 40 && step[0] > 0.005; it++) {
+    bool moved = false;
+    for (int k = 0; k < 3; k++)
+      for (int sign = -1; sign <= 1; sign += 2) {
+        Pose2d p = pose;
+        if (k == 0) p.px += sign * step[0];
+        if (k == 1) p.py += sign * step[1];
+        if (k == 2) p.pa = normalizeAngle(p.pa + sign * step[2]);
+        double c = cost(p);
+        if (c < best) {
+          best = c;
+          pose = p;
+          moved = true;
+        }
+      }
+    if (!moved)
+      for (int k = 0; k < 3; k++) step[k] /= 2;
+  }
+} // End of refinePose()
+
+/**
+ * globalLocalize()
+ *
+ * Search the whole map for where the scan in the frame was taken from.
+ * Leaves the answer in gl.pose, and returns false if it isn't good enough
+ * to believe.
+ *
+ **/
+
+inline bool globalLocalize(GlobalLocalizer& gl, const SensorFrame& frame)
+{
+  std::chrono::steady_clock::time_point started =
+    std::chrono::steady_clock::now();
+  const double res = gl.resolution;
+
+  // The scan's points, no more than max_points of them
+  gl.px.clear();
+  gl.py.clear();
+  int valid = 0;
+  for (int i = 0; i < frame.ranges_count; i++)
+    if (frame.ranges[i] > 0.05 && frame.ranges[i] < frame.max_range - 0.01)
+      valid++;
+  double every = std::max(1.0, (double)valid / gl.max_points), next = 0;
+  float ends_x[FRAME_MAX_BEAMS], ends_y[FRAME_MAX_BEAMS];
+  beamEnds(frame.ranges, frame.bearings, frame.ranges_count, ends_x, ends_y);
+  valid = 0;
+  for (int i = 0; i < frame.ranges_count; i++) {
+    double r = frame.ranges[i];
+    if (r <= 0.05 || r >= frame.max_range - 0.01) continue;
+    if (valid++ < next) continue;
+    next += every;
+    gl.px.push_back(ends_x[i]);
+    gl.py.push_back(ends_y[i]);
+  }
+  int n = gl.px.size();
+  gl.score = 0;
+  gl.ambiguous = false;
+  gl.nodes = 0;
+  if (n < 10) return false;
+
+  // Where each point lands, in cells from the robot's, at each heading.
+  // The robot is in the middle of its cell.
+  gl.ox.resize(gl.rotations * n);
+  gl.oy.resize(gl.rotations * n);
+  for (int k = 0; k < gl.rotations; k++)
+    for (int i = 0; i < n; i++) {
+      float x = gl.rot_cos[k] * gl.px[i] - gl.rot_sin[k] * gl.py[i];
+      float y = gl.rot_sin[k] * gl.px[i] + gl.rot_cos[k] * gl.py[i];
+      gl.ox[k * n + i] = (int)floor(x / res + 0.5);
+      gl.oy[k * n + i] = (int)floor(y / res + 0.5);
+    }
+
+  // The biggest blocks at every heading, best first
+  struct Candidate { double bound; int k, x, y; };
+  std::vector<Candidate> top;
+  int size = 1 << (gl.levels - 1);
+  for (int k = 0; k < gl.rotations; k++)
+    for (int y = 0; y < gl.height; y += size)
+      for (int x = 0; x < gl.width; x += size) {
+        Candidate c = { blockScore(gl, gl.levels - 1, k, x, y), k, x, y };
+        top.push_back(c);
+      }
+  gl.nodes += top.size();
+  std::sort(top.begin(), top.end(),
+            [](const Candidate& a, const Candidate& b) {
+              return a.bound > b.bound;
+            });
+
+  // Anything worth having must beat min_score
+  RelocBest best = { gl.min_score * n, -1, 0, 0, 0, 0, 0 };
+  searchMap(gl, top, best);
+  gl.ambiguous = false;
+  if (best.k >= 0) {
+    gl.pose.px = gl.origin_x + (best.x + 0.5) * res;
+    gl.pose.py = gl.origin_y + (best.y + 0.5) * res;
+    gl.pose.pa = normalizeAngle(best.k * gl.step_a - M_PI);
+    gl.score = best.score / n;
+
+    // Is there anywhere else nearly as good? Much of the map looks like
+    // other parts of it, and one scan may not be enough to tell which.
+    RelocBest other = { best.score * (1 - gl.margin), -1, 0, 0,
+                        best.x, best.y, (int)ceil(gl.elsewhere / res) };
+    searchMap(gl, top, other);
+    gl.ambiguous = other.k >= 0;
+    refinePose(gl, gl.pose);
+  }
+  gl.seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - started).count();
+  return best.k >= 0 && !gl.ambiguous;
+} // End of globalLocalize()
+
+/**
+ * initPoseGuard()
+ *
+ **/
+
+inline void initPoseGuard(PoseGuard& g, const DistMap& field)
+{
+  initScanMonitor(g.monitor, field);
+  initGlobalLocalizer(g.global, field);
+  g.correction.px = g.correction.py = g.correction.pa = 0;
+  g.found = g.correction;
+  g.max_tries = 5;
+  g.retry_ticks = 5;
+  g.tries = 0;
+  g.recoveries = g.failures = 0;
+} // End of initPoseGuard()
+
+/**
+ * correctPose()
+ *
+ * A pose from the localizer, with the correction applied: rotated about
+ * the origin by correction.pa, then moved by (correction.px, .py).
+ *
+ **/
+
+inline Pose2d correctPose(const PoseGuard& g, Pose2d pose)
+{
+  const Pose2d& k = g.correction;
+  Pose2d out;
+  out.px = k.px + cos(k.pa) * pose.px - sin(k.pa) * pose.py;
+  out.py = k.py + sin(k.pa) * pose.px + cos(k.pa) * pose.py;
+  out.pa = normalizeAngle(pose.pa + k.pa);
+  return out;
+} // End of correctPose()
+
+/**
+ * guardPose()
+ *
+ * Check the scan against the corrected pose and, if we're lost, find
+ * ourselves again and change the correction to match. Returns GUARD_FOUND
+ * on a tick we relocalized, with the pose we were found at in g.found, and
+ * GUARD_LOST if we've searched max_tries times and still can't tell where
+ * we are; the caller may be able to do better, by starting its localizer
+ * again from scratch. Otherwise, GUARD_OK.
+ *
+ **/
+
+inline int guardPose(PoseGuard& g, const SensorFrame& frame, Pose2d pose)
+{
+  if (!checkScan(g.monitor, frame, correctPose(g, pose))) return GUARD_OK;
+  if (!globalLocalize(g.global, frame)) {
+    // Look again after retry_ticks more bad ticks, which is longer than
+    // the trip count on purpose: searching again from the same spot would
+    // only see the same thing, so give the robot time to move first
+    g.monitor.bad_ticks = g.monitor.trip_ticks - g.retry_ticks;
+    g.failures++;
+    if (++g.tries < g.max_tries) return GUARD_OK;
+    g.tries = 0;
+    return GUARD_LOST;
+  }
+
+  // The correction that takes pose to where we were found
+  g.found = g.global.pose;
+  g.correction.pa = normalizeAngle(g.found.pa - pose.pa);
+  double c = cos(g.correction.pa), s = sin(g.correction.pa);
+  g.correction.px = g.found.px - (c * pose.px - s * pose.py);
+  g.correction.py = g.found.py - (s * pose.px + c * pose.py);
+  g.tries = 0;
+  g.recoveries++;
+  return GUARD_FOUND;
+} // End of guardPose()
+
+/**
+ * clearCorrection()
+ *
+ * For when the localizer has been told where we are.
+ *
+ **/
+
+inline void clearCorrection(PoseGuard& g)
+{
+  g.correction.px = g.correction.py = g.correction.pa = 0;
+} // End of clearCorrection()
+
+#endif
@@ -0,0 +1,654 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Roadmaps
+ *
+ ** Description ***************************************************************
+ *
+ *  Makes a mission graph (mission.h) for any map, from the bitmap, rather
+ *  than placing the nodes by hand as local.mission does: roads down the
+ *  middle of the free space, as far from the walls as they can be, with a
+ *  node wherever they meet, end or bend.
+ *
+ *  The roads are the generalized Voronoi diagram of the walls: the cells
+ *  with two or more walls equally close. The distance transform in
+ *  distmap.h, which is linear in the number of cells, is run again with
+ *  edt1d() saying which cell each distance is to, giving the nearest wall
+ *  cell to every cell (the "feature transform"). Two cells side by side
+ *  whose nearest walls are at least "gap" apart lie either side of the
+ *  diagram, and both are marked, as long as the robot fits there. That
+ *  line, a cell or two thick, is thinned to one cell (Zhang and Suen).
+ *  The edge of the map counts as a wall.
+ *
+ *  Then the skeleton is followed from cell to cell. Cells with one
+ *  neighbour are dead ends and cells with three or more are junctions (a
+ *  few junction cells together are one junction); between them are the
+ *  chains of cells with two. Short dead ends, which every corner of a
+ *  room has running into it, are pruned: those shorter than the clearance
+ *  at their junction plus "spur", so that the one ending in a room's
+ *  corner goes but a corridor that goes nowhere stays. Bits of road on
+ *  their own shorter than "min_length" go too. Each chain left is then
+ *  cut into straight legs the robot can drive along (lineClear() in
+ *  planner.h, on the costmap) that stray no more than "tolerance" from it,
+ *  with a node at each cut, as the Douglas-Peucker algorithm does.
+ *
+ *  The nodes are called jN for junctions, eN for dead ends and bN for the
+ *  bends in between. Each node and edge has its clearance, the distance to
+ *  the nearest wall, at the node and the closest the edge comes. There are
+ *  no goals.
+ *
+ *  The graph is compiled as a mission is and saved next to the bitmap
+ *  (bitmaps/cave.png gives bitmaps/cave.road), so that later runs just
+ *  map it in. It is only used if it was made from the same bitmap,
+ *  stretched over the same size, with the same settings and robot radius;
+ *  otherwise it is made again. make-roadmap makes them ahead of time.
+ */
+
+#ifndef ROADMAP_H
+#define ROADMAP_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "distmap.h"
+#include "gridmap.h"
+#include "mission.h"
+#include "planner.h"
+
+#define ROADMAP_VERSION 1
+
+/**
+ * Settings, in metres.
+ *
+ **/
+
+struct RoadmapParams
+{
+  double clearance;             // Closest a road comes to a wall
+  double gap;                   // Walls closer together have no road between
+  double spur;                  // Dead ends shorter than this, past the
+                                // junction's clearance, are pruned
+  double min_length;            // Roads on their own shorter than this go
+  double tolerance;             // How far a leg strays from its road
+};
+
+/**
+ * What making one found, and how long each part took, in seconds.
+ *
+ **/
+
+struct RoadmapStats
+{
+  int    skeleton;              // Cells, after thinning
+  int    chains, pruned;        // Between junctions and dead ends
+  int    nodes, edges;
+  double t_features, t_skeleton, t_graph, t_legs;
+};
+
+/**
+ * A road from one junction or dead end to another: the cells along it,
+ * including those at both ends.
+ *
+ **/
+
+struct RoadChain
+{
+  int a, b;                     // Which junctions or dead ends
+  std::vector<int> cells;
+  bool dead;
+};
+
+/**
+ * initRoadmapParams()
+ *
+ * For a robot of the given radius: roads it fits down, and no roads
+ * between walls it wouldn't fit between.
+ *
+ **/
+
+inline void initRoadmapParams(RoadmapParams& p, double radius = ROOMBA_RADIUS)
+{
+  p.clearance = radius;
+  p.gap = 2 * radius;
+  p.spur = 0.5;
+  p.min_length = 0.5;
+  p.tolerance = 0.2;
+} // End of initRoadmapParams()
+
+/**
+ * wallFeatures()
+ *
+ * For each cell of the map with a cell of wall all round it, w by h, the
+ * squared distance in cells to the nearest wall and which cell that is:
+ * the distance transform in computeDistancesIn(), keeping track of where
+ * the distances are to.
+ *
+ **/
+
+inline void wallFeatures(const GridMap& map, std::vector<float>& d2,
+                         std::vector<int>& feature)
+{
+  const int w = map.width + 2, h = map.height + 2;
+  const int n = std::max(w, h);
+  std::vector<float> f(n), d(n), z(n + 1);
+  std::vector<int>   v(n), from(n);
+  std::vector<int>   row_of((size_t)w * h);   // Nearest wall in the column
+
+  d2.resize((size_t)w * h);
+  feature.resize((size_t)w * h);
+  for (int cx = 0; cx < w; cx++) {
+    for (int cy = 0; cy < h; cy++) {
+      bool wall = cx == 0 || cy == 0 || cx == w - 1 || cy == h - 1
+        || map.cells[(size_t)(cy - 1) * map.width + cx - 1];
+      f[cy] = wall ? 0.0f : 1e20f;
+    }
+    edt1d(&f[0], &d[0], h, &v[0], &z[0], &from[0]);
+    for (int cy = 0; cy < h; cy++) {
+      d2[(size_t)cy * w + cx] = d[cy];
+      row_of[(size_t)cy * w + cx] = from[cy];
+    }
+  }
+  for (int cy = 0; cy < h; cy++) {
+    float* row = &d2[(size_t)cy * w];
+    std::copy(row, row + w, f.begin());
+    edt1d(&f[0], row, w, &v[0], &z[0], &from[0]);
+    for (int cx = 0; cx < w; cx++) {
+      int wx = from[cx];
+      feature[(size_t)cy * w + cx] = row_of[(size_t)cy * w + wx] * w + wx;
+    }
+  }
+} // End of wallFeatures()
+
+/**
+ * thinSkeleton()
+ *
+ * Zhang and Suen's thinning, of the cells that are on, to lines one cell
+ * across. Only the cells in "cells" can be on, and those turned off are
+ * taken out of it. None of them are on the edge of the grid.
+ *
+ **/
+
+inline void thinSkeleton(std::vector<unsigned char>& on, int w,
+                         std::vector<int>& cells)
+{
+  // Round the cell from above, clockwise
+  const int ring[8] = { w, w + 1, 1, 1 - w, -w, -w - 1, -1, w - 1 };
+  std::vector<int> off;
+  bool changed = true;
+
+  while (changed) {
+    changed = false;
+    for (int pass = 0; pass < 2; pass++) {
+      off.clear();
+      for (size_t i = 0; i < cells.size(); i++) {
+        int c = cells[i];
+        int p[8], count = 0, rises = 0;
+        for (int k = 0; k < 8; k++) count += p[k] = on[c + ring[k]];
+        for (int k = 0; k < 8; k++) rises += !p[k] && p[(k + 1) % 8];
+        if (count < 2 || count > 6 || rises != 1) continue;
+        // Above, right, below, left
+        if (pass == 0 ? (p[0] && p[2] && p[4]) || (p[2] && p[4] && p[6])
+                      : (p[0] && p[2] && p[6]) || (p[0] && p[4] && p[6]))
+          continue;
+        off.push_back(c);
+      }
+      for (size_t i = 0; i < off.size(); i++) on[off[i]] = 0;
+      if (!off.empty()) changed = true;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < cells.size(); i++)
+      if (on[cells[i]]) cells[kept++] = cells[i];
+    cells.resize(kept);
+  }
+} // End of thinSkeleton()
+
+/**
+ * skeletonNeighbours()
+ *
+ * The cells of the skeleton next to cell c, counting a diagonal one only
+ * if there isn't one beside it that it is next to as well, so that a
+ * line one cell across has two neighbours all along it. Returns how many.
+ *
+ **/
+
+inline int skeletonNeighbours(const std::vector<unsigned char>& on, int w,
+                              int c, int* out)
+{
+  const int dx[8] = { 1, 0, -1, 0, 1, -1, -1, 1 };
+  const int dy[8] = { 0, 1, 0, -1, 1, 1, -1, -1 };
+  int n = 0;
+
+  for (int k = 0; k < 8; k++) {
+    if (k >= 4 && (on[c + dx[k]] || on[c + dy[k] * w])) continue;
+    int q = c + dx[k] + dy[k] * w;
+    if (on[q]) out[n++] = q;
+  }
+  return n;
+} // End of skeletonNeighbours()
+
+/**
+ * chainLength()
+ *
+ * Along the cells of a chain, in cells.
+ *
+ **/
+
+inline double chainLength(const RoadChain& chain, int w)
+{
+  double length = 0;
+  for (size_t i = 1; i < chain.cells.size(); i++) {
+    int d = abs(chain.cells[i] - chain.cells[i - 1]);
+    length += d == 1 || d == w ? 1.0 : M_SQRT2;
+  }
+  return length;
+} // End of chainLength()
+
+/**
+ * traceChains()
+ *
+ * Find the junctions and dead ends on the skeleton, and the chains between
+ * them. "node_of" says which junction or dead end each of their cells is
+ * part of, or -1, and "centre" which of its cells is furthest from the
+ * walls. A loop with no junction on it gets a node of its own.
+ *
+ **/
+
+inline void traceChains(const std::vector<unsigned char>& on,
+                        const std::vector<float>& d2, int w,
+                        const std::vector<int>& cells,
+                        std::vector<int>& node_of, std::vector<int>& centre,
+                        std::vector<RoadChain>& chains)
+{
+  std::vector<unsigned char> seen(on.size(), 0);
+  std::vector<int> stack;
+  int nb[8], nb2[8];
+
+  node_of.assign(on.size(), -1);
+  centre.clear();
+  chains.clear();
+
+  // Cells that aren't in the middle of a line, joined up into nodes
+  for (size_t i = 0; i < cells.size(); i++) {
+    int c = cells[i];
+    if (node_of[c] >= 0 || skeletonNeighbours(on, w, c, nb) == 2) continue;
+    int id = centre.size();
+    centre.push_back(c);
+    node_of[c] = id;
+    stack.assign(1, c);
+    while (!stack.empty()) {
+      int p = stack.back();
+      stack.pop_back();
+      if (d2[p] > d2[centre[id]]) centre[id] = p;
+      int n = skeletonNeighbours(on, w, p, nb);
+      for (int k = 0; k < n; k++) {
+        int q = nb[k];
+        if (node_of[q] >= 0 || skeletonNeighbours(on, w, q, nb2) == 2)
+          continue;
+        node_of[q] = id;
+        stack.push_back(q);
+      }
+    }
+  }
+
+  // Follow each line out of a node to the node at the other end. Loops
+  // with no node on them are left over, and get one.
+  for (int round = 0; round < 2; round++) {
+    for (size_t i = 0; i < cells.size(); i++) {
+      int s = cells[i];
+      if (round == 1 && node_of[s] < 0 && !seen[s]) {
+        node_of[s] = centre.size();
+        centre.push_back(s);
+      }
+      if (node_of[s] < 0) continue;
+      int n = skeletonNeighbours(on, w, s, nb);
+      for (int k = 0; k < n; k++) {
+        if (node_of[nb[k]] >= 0 || seen[nb[k]]) continue;
+        RoadChain chain;
+        chain.a = node_of[s];
+        chain.dead = false;
+        chain.cells.push_back(s);
+        int prev = s, at = nb[k];
+        while (node_of[at] < 0) {
+          seen[at] = 1;
+          chain.cells.push_back(at);
+          skeletonNeighbours(on, w, at, nb2);
+          int next = nb2[0] == prev ? nb2[1] : nb2[0];
+          prev = at;
+          at = next;
+        }
+        chain.cells.push_back(at);
+        chain.b = node_of[at];
+        chains.push_back(chain);
+      }
+    }
+  }
+} // End of traceChains()
+
+/**
+ * pruneChains()
+ *
+ * Take out the short dead ends, and short roads on their own, joining up
+ * the chains either side of a junction that is left with two. Lengths are
+ * in cells. Returns how many chains were pruned.
+ *
+ **/
+
+inline int pruneChains(std::vector<RoadChain>& chains, int nodes,
+                       const std::vector<int>& centre,
+                       const std::vector<float>& d2, int w, double spur,
+                       double min_length)
+{
+  std::vector<int> degree(nodes);
+  std::vector<std::vector<int> > at(nodes);
+  int pruned = 0;
+  bool changed = true;
+
+  while (changed) {
+    changed = false;
+    std::fill(degree.begin(), degree.end(), 0);
+    for (int i = 0; i < nodes; i++) at[i].clear();
+    for (size_t i = 0; i < chains.size(); i++) {
+      if (chains[i].dead) continue;
+      degree[chains[i].a]++;
+      degree[chains[i].b]++;
+      at[chains[i].a].push_back(i);
+      at[chains[i].b].push_back(i);
+    }
+
+    for (size_t i = 0; i < chains.size(); i++) {
+      RoadChain& c = chains[i];
+      if (c.dead) continue;
+      double length = chainLength(c, w);
+      int da = degree[c.a], db = degree[c.b];
+      bool lone = da == 1 && db == 1;
+      double junction = sqrt(d2[centre[da == 1 ? c.b : c.a]]);
+      bool spurious = ((da == 1 && db >= 3) || (db == 1 && da >= 3))
+        && length < junction + spur;
+      if ((lone && length < min_length) || spurious) {
+        c.dead = true;
+        degree[c.a]--;
+        degree[c.b]--;
+        pruned++;
+        changed = true;
+      }
+    }
+    if (changed) continue;
+
+    // Junctions with two roads left aren't junctions. A chain joined onto
+    // another waits for the next time round to be joined again.
+    std::vector<unsigned char> joined(chains.size(), 0);
+    for (int n = 0; n < nodes; n++) {
+      if (degree[n] != 2 || at[n].size() != 2 || at[n][0] == at[n][1]
+          || joined[at[n][0]] || joined[at[n][1]]) continue;
+      RoadChain& c1 = chains[at[n][0]];
+      RoadChain& c2 = chains[at[n][1]];
+      joined[at[n][0]] = joined[at[n][1]] = 1;
+      if (c1.b != n) {
+        std::reverse(c1.cells.begin(), c1.cells.end());
+        std::swap(c1.a, c1.b);
+      }
+      if (c2.a != n) {
+        std::reverse(c2.cells.begin(), c2.cells.end());
+        std::swap(c2.a, c2.b);
+      }
+      c1.cells.insert(c1.cells.end(), c2.cells.begin() + 1, c2.cells.end());
+      c1.b = c2.b;
+      c2.dead = true;
+      changed = true;
+    }
+  }
+  return pruned;
+} // End of pruneChains()
+
+/**
+ * splitChain()
+ *
+ * Where to cut cells first to last of a chain so that it can be driven in
+ * straight legs none of which strays more than "tolerance" cells from it:
+ * if the leg from first to last won't do, cut it at the cell furthest
+ * from the leg and try each half.
+ *
+ **/
+
+inline void splitChain(const CostMap& cm, const std::vector<int>& cells,
+                       int w, int first, int last, double tolerance,
+                       std::vector<int>& cuts)
+{
+  if (last - first < 2) return;
+  // Cells of the map, which has no cell of wall round it
+  int ax = cells[first] % w - 1, ay = cells[first] / w - 1;
+  int bx = cells[last] % w - 1, by = cells[last] / w - 1;
+  double dx = bx - ax, dy = by - ay, len = hypot(dx, dy);
+
+  int worst = (first + last) / 2;
+  double worst_d = -1;
+  for (int i = first + 1; i < last; i++) {
+    double px = cells[i] % w - 1 - ax, py = cells[i] / w - 1 - ay;
+    double d = len > 0 ? fabs(px * dy - py * dx) / len : hypot(px, py);
+    if (d > worst_d) {
+      worst_d = d;
+      worst = i;
+    }
+  }
+  if (worst_d <= tolerance
+      && lineClear(cm, ax, ay, bx, by, COST_LETHAL - 1)) return;
+
+  splitChain(cm, cells, w, first, worst, tolerance, cuts);
+  cuts.push_back(worst);
+  splitChain(cm, cells, w, worst, last, tolerance, cuts);
+} // End of splitChain()
+
+/**
+ * buildRoadmap()
+ *
+ * Make the roadmap for a map, as a mission with no goals. The costmap
+ * should be the map's, for the robot. Returns false, saying why, if there
+ * are no roads or too many nodes.
+ *
+ **/
+
+inline bool buildRoadmap(const GridMap& map, const CostMap& cm,
+                         const RoadmapParams& p, MissionSource& src,
+                         RoadmapStats* stats = NULL)
+{
+  typedef std::chrono::steady_clock Clock;
+  const int w = map.width + 2, h = map.height + 2;
+  const double scale = map.scale;
+  RoadmapStats st;
+  std::vector<float> d2;
+  std::vector<int> feature;
+
+  src.names.clear();
+  src.points.clear();
+  src.clearances.clear();
+  src.edges.clear();
+  src.goals.clear();
+
+  Clock::time_point t0 = Clock::now();
+  wallFeatures(map, d2, feature);
+  Clock::time_point t1 = Clock::now();
+
+  // Either side of the diagram: next to each other, with their nearest
+  // walls far apart
+  const float clear2 = (p.clearance / scale) * (p.clearance / scale);
+  const float gap2 = (p.gap / scale) * (p.gap / scale);
+  std::vector<unsigned char> on((size_t)w * h, 0);
+  std::vector<int> cells;
+  for (int cy = 1; cy < h - 1; cy++) {
+    for (int cx = 1; cx < w - 1; cx++) {
+      int c = cy * w + cx;
+      if (d2[c] < clear2) continue;
+      const int next[2] = { c + 1, c + w };
+      for (int k = 0; k < 2; k++) {
+        int q = next[k];
+        if (d2[q] < clear2) continue;
+        int fx = feature[c] % w - feature[q] % w;
+        int fy = feature[c] / w - feature[q] / w;
+        if ((float)(fx * fx + fy * fy) < gap2) continue;
+        if (!on[c]) cells.push_back(c);
+        if (!on[q]) cells.push_back(q);
+        on[c] = on[q] = 1;
+      }
+    }
+  }
+  thinSkeleton(on, w, cells);
+  std::sort(cells.begin(), cells.end());
+  st.skeleton = cells.size();
+  Clock::time_point t2 = Clock::now();
+
+  std::vector<int> node_of, centre;
+  std::vector<RoadChain> chains;
+  traceChains(on, d2, w, cells, node_of, centre, chains);
+  st.chains = chains.size();
+  st.pruned = pruneChains(chains, centre.size(), centre, d2, w,
+                          p.spur / scale, p.min_length / scale);
+  Clock::time_point t3 = Clock::now();
+
+  // The nodes still on a road, then the legs
+  std::vector<int> index(centre.size(), -1), degree(centre.size(), 0);
+  for (size_t i = 0; i < chains.size(); i++) {
+    if (chains[i].dead) continue;
+    degree[chains[i].a]++;
+    degree[chains[i].b]++;
+  }
+  for (size_t n = 0; n < centre.size(); n++) {
+    if (degree[n] == 0) continue;
+    index[n] = src.names.size();
+    char name[32];
+    snprintf(name, sizeof(name), "%c%d", degree[n] == 1 ? 'e'
+             : degree[n] == 2 ? 'b' : 'j', (int)src.names.size());
+    Point2d pt = { cellToWorldX(map, centre[n] % w - 1),
+                   cellToWorldY(map, centre[n] / w - 1) };
+    src.names.push_back(name);
+    src.points.push_back(pt);
+    src.clearances.push_back(sqrt(d2[centre[n]]) * scale);
+  }
+  std::vector<int> cuts;
+  for (size_t i = 0; i < chains.size(); i++) {
+    RoadChain& c = chains[i];
+    if (c.dead) continue;
+    // From the middle of the node at each end
+    c.cells.front() = centre[c.a];
+    c.cells.back() = centre[c.b];
+    cuts.clear();
+    cuts.push_back(0);
+    splitChain(cm, c.cells, w, 0, c.cells.size() - 1, p.tolerance / scale,
+               cuts);
+    cuts.push_back(c.cells.size() - 1);
+
+    int from = index[c.a];
+    for (size_t k = 1; k < cuts.size(); k++) {
+      int to;
+      if (k + 1 == cuts.size()) {
+        to = index[c.b];
+      } else {
+        int cell = c.cells[cuts[k]];
+        char name[32];
+        to = src.names.size();
+        snprintf(name, sizeof(name), "b%d", to);
+        Point2d pt = { cellToWorldX(map, cell % w - 1),
+                       cellToWorldY(map, cell / w - 1) };
+        src.names.push_back(name);
+        src.points.push_back(pt);
+        src.clearances.push_back(sqrt(d2[cell]) * scale);
+      }
+      float least = 1e30f;
+      for (int j = cuts[k - 1]; j <= cuts[k]; j++)
+        least = std::min(least, d2[c.cells[j]]);
+      GraphEdge e;
+      e.a = from;
+      e.b = to;
+      e.cost = hypot(src.points[to].x - src.points[from].x,
+                     src.points[to].y - src.points[from].y);
+      e.clearance = sqrt(least) * scale;
+      if (from != to) src.edges.push_back(e);
+      from = to;
+    }
+  }
+  Clock::time_point t4 = Clock::now();
+
+  st.nodes = src.names.size();
+  st.edges = src.edges.size();
+  st.t_features = std::chrono::duration<double>(t1 - t0).count();
+  st.t_skeleton = std::chrono::duration<double>(t2 - t1).count();
+  st.t_graph    = std::chrono::duration<double>(t3 - t2).count();
+  st.t_legs     = std::chrono::duration<double>(t4 - t3).count();
+  if (stats != NULL) *stats = st;
+
+  if (src.names.empty()) {
+    std::cerr << "No roads: nowhere on the map is " << p.clearance
+              << "m from the walls" << std::endl;
+    return false;
+  }
+  if (src.names.size() > GRAPH_MAX_NODES) {
+    std::cerr << "Roadmap has " << src.names.size() << " nodes, more than "
+              << GRAPH_MAX_NODES << std::endl;
+    return false;
+  }
+  return true;
+} // End of buildRoadmap()
+
+/**
+ * roadmapHash()
+ *
+ * bitmapHash() of the bitmap, carried on over the settings and the robot,
+ * so that changing any of them makes the roadmap again.
+ *
+ **/
+
+inline uint64_t roadmapHash(const char* bitmap, double size_x, double size_y,
+                            const CostMap& cm, const RoadmapParams& p)
+{
+  uint64_t hash = bitmapHash(bitmap, size_x, size_y);
+  if (hash == 0) return 0;
+
+  double settings[7] = { p.clearance, p.gap, p.spur, p.min_length,
+                         p.tolerance, cm.radius, ROADMAP_VERSION };
+  const unsigned char* s = (const unsigned char*)settings;
+  for (size_t i = 0; i < sizeof(settings); i++) {
+    hash ^= s[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+} // End of roadmapHash()
+
+/**
+ * loadRoadmap()
+ *
+ * Get the roadmap for a bitmap stretched over size_x by size_y metres,
+ * already loaded into "map", with its costmap: from the .road file next
+ * to it if that is up to date, and otherwise by making it (and saving
+ * that for next time).
+ *
+ **/
+
+inline bool loadRoadmap(MissionGraph& g, const char* bitmap, double size_x,
+                        double size_y, const GridMap& map, const CostMap& cm,
+                        const RoadmapParams& p)
+{
+  uint64_t hash = roadmapHash(bitmap, size_x, size_y, cm, p);
+  std::string path = cachePath(bitmap, ".road");
+  MissionSource src;
+  std::vector<char> data;
+
+  g.mapping = NULL;
+  if (hash == 0) {
+    std::cerr << "Can't read map bitmap " << bitmap << std::endl;
+    return false;
+  }
+  if (openMission(g, path.c_str(), hash)) return true;
+
+  if (!buildRoadmap(map, cm, p, src)) return false;
+  compileMission(src, hash, data);
+  if (writeMission(path.c_str(), data)
+      && openMission(g, path.c_str(), hash)) return true;
+
+  std::cerr << "Warning: can't cache roadmap in " << path << std::endl;
+  g.owned.swap(data);
+  return attachMission(g, &g.owned[0], g.owned.size(), hash);
+} // End of loadRoadmap()
+
+#endif
@@ -0,0 +1,689 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Threaded robot client
+ *
+ ** Description ***************************************************************
+ *
+ *  Both controllers used to go round a loop of robot.Read(), work out what
+ *  to do, pp.SetSpeed(). That ties the control rate to however long the
+ *  server takes to answer, and a slow read stalls everything.
+ *
+ *  A RobotClient hides where the data comes from. In the default mode it
+ *  does exactly what the old loop did. In async mode a separate I/O thread
+ *  owns the PlayerClient: it reads whatever the server sends, copies what
+ *  the controller needs out of the proxies into a SensorFrame, and sends
+ *  the latest speed command. The controller runs at a fixed rate on its own
+ *  thread and only ever sees the newest frame.
+ *
+ *  The two threads swap data through LatestValue, a triple buffer: the
+ *  writer and the reader each have a slot of their own and trade it for the
+ *  shared middle one with a single atomic exchange, so neither ever waits
+ *  for the other and old values are simply overwritten. All Player calls
+ *  stay on the I/O thread, since the proxies aren't safe to share.
+ *
+ *  Either way, the client keeps track of how regular the control ticks are
+ *  and how old the data was when the controller acted on it, and prints
+ *  both when it stops.
+ *
+ *  Every frame read can also be recorded to a file, and a client started
+ *  with startReplay() plays such a file back instead of talking to Player
+ *  at all, one frame per tick as fast as the controller will take them.
+ *  The controller can't tell the difference, so decision making and
+ *  localization can be rerun against the same inputs on a machine with no
+ *  simulator. A frame log is a FrameLogHeader followed, for each frame, by
+ *  a FrameLogEntry, its ranges, its bearings and its hypotheses.
+ *
+ *  A client started with startSim() drives a robot in the headless
+ *  simulator in sim.h instead: each clientRead() steps the simulation on
+ *  by one interval with the last speed set, so the controller runs as fast
+ *  as it can think, with simulated time in the frames.
+ */
+
+#ifndef ROBOTCLIENT_H
+#define ROBOTCLIENT_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <libplayerc++/playerc++.h>
+#include "laserkernel.h"
+#include "sensorframe.h"
+#include "sim.h"
+#include "telemetry.h"
+
+// How long the I/O thread waits for data before checking for commands (ms)
+#define IO_POLL_MS      2
+
+#define FRAMELOG_VERSION 1
+
+/**
+ * A single-writer, single-reader slot that always holds the newest value.
+ * Bit 2 of "middle" is set when the middle slot holds something the
+ * reader hasn't taken yet.
+ *
+ **/
+
+template <class T>
+struct LatestValue
+{
+  T slots[3];
+  std::atomic<int> middle;
+  int back;    // The writer's slot
+  int front;   // The reader's slot
+};
+
+#define LATEST_FRESH 4
+
+template <class T>
+void initLatest(LatestValue<T>& lv)
+{
+  lv.back  = 0;
+  lv.middle.store(1);
+  lv.front = 2;
+} // End of initLatest()
+
+/**
+ * latestBack()
+ *
+ * The writer fills this in place, then calls publishLatest().
+ *
+ **/
+
+template <class T>
+T& latestBack(LatestValue<T>& lv)
+{
+  return lv.slots[lv.back];
+} // End of latestBack()
+
+template <class T>
+void publishLatest(LatestValue<T>& lv)
+{
+  lv.back = lv.middle.exchange(lv.back | LATEST_FRESH,
+                               std::memory_order_acq_rel) & 3;
+} // End of publishLatest()
+
+/**
+ * takeLatest()
+ *
+ * Copy out the newest value, if there is one we haven't seen. Returns
+ * false, leaving "out" alone, if nothing new has been published.
+ *
+ **/
+
+template <class T>
+bool takeLatest(LatestValue<T>& lv, T& out)
+{
+  if (!(lv.middle.load(std::memory_order_acquire) & LATEST_FRESH))
+    return false;
+  lv.front = lv.middle.exchange(lv.front, std::memory_order_acq_rel) & 3;
+  out = lv.slots[lv.front];
+  return true;
+} // End of takeLatest()
+
+struct SpeedCommand
+{
+  double speed, turnrate;
+};
+
+/**
+ * How frames are stored in a recording.
+ *
+ **/
+
+struct FrameLogHeader
+{
+  char     magic[4];        // "FRAM"
+  uint32_t version;
+  char     program[56];     // Which controller recorded it
+};
+
+static_assert(sizeof(FrameLogHeader) == 64, "FrameLogHeader must be 64 bytes");
+
+struct FrameLogEntry
+{
+  uint64_t seq;
+  double   stamp;
+  double   odom_x, odom_y, odom_a;
+  double   max_range, min_left, min_right;
+  int32_t  ranges_count, hyp_count;
+  uint8_t  bumper[2], stall, pad[5];
+};
+
+/**
+ * Running mean, spread and worst case of something, in seconds.
+ *
+ **/
+
+struct LoopStats
+{
+  long   count;
+  double sum, sum_sq, max;
+};
+
+inline void addStat(LoopStats& s, double v)
+{
+  s.count++;
+  s.sum    += v;
+  s.sum_sq += v * v;
+  if (v > s.max) s.max = v;
+}
+
+inline void printStat(const char* name, const LoopStats& s)
+{
+  double mean = s.count ? s.sum / s.count : 0;
+  double var  = s.count ? s.sum_sq / s.count - mean * mean : 0;
+  std::cout << name << ": mean " << mean * 1000 << " ms, sd "
+            << sqrt(var > 0 ? var : 0) * 1000 << " ms, max "
+            << s.max * 1000 << " ms over " << s.count << std::endl;
+}
+
+/**
+ * The client. Set up with startClient(), then call clientRead() at the top
+ * of the control loop and clientSetSpeed() at the bottom.
+ *
+ **/
+
+struct RobotClient
+{
+  PlayerCc::PlayerClient*    robot;
+  PlayerCc::Position2dProxy* pp;
+  PlayerCc::BumperProxy*     bp;   // Any of these three may be NULL
+  PlayerCc::LaserProxy*      sp;
+  PlayerCc::LocalizeProxy*   lp;
+
+  bool   async;
+  FILE*  record;                   // Where frames are recorded, if anywhere
+  FILE*  replay;                   // Where they come from if not from Player
+  Sim*   sim;                      // ...or the simulator they come from
+  double time_limit;               // Simulated seconds before giving up
+  bool   finished;                 // Set when a replay or simulation ends
+  double period;                   // Control period in async mode
+  double next_tick, last_tick;
+  double tick_dt, data_age;        // For the tick just started
+  double tick_start;               // clientNow() when it started
+  uint64_t last_seq, reads;
+
+  LatestValue<SensorFrame>  sensors;
+  LatestValue<SpeedCommand> commands;
+  std::atomic<bool> running;
+  std::thread       io;
+
+  LoopStats tick;                  // Time between control ticks
+  LoopStats late;                  // How far past its deadline each tick was
+  LoopStats age;                   // Age of the data each tick acted on
+};
+
+/**
+ * clientNow()
+ *
+ * Seconds on a clock that doesn't jump.
+ *
+ **/
+
+inline double clientNow()
+{
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+} // End of clientNow()
+
+/**
+ * readProxies()
+ *
+ * Copy the proxies of one robot into a frame. Any but pp may be NULL.
+ *
+ **/
+
+inline void readProxies(PlayerCc::Position2dProxy* pp,
+                        PlayerCc::BumperProxy* bp, PlayerCc::LaserProxy* sp,
+                        PlayerCc::LocalizeProxy* lp, SensorFrame& f)
+{
+  f.stamp   = clientNow();
+  f.odom.px = pp->GetXPos();
+  f.odom.py = pp->GetYPos();
+  f.odom.pa = pp->GetYaw();
+  f.stall   = pp->GetStall();
+  f.bumper[0] = bp != NULL && (*bp)[0];
+  f.bumper[1] = bp != NULL && (*bp)[1];
+
+  f.ranges_count = 0;
+  f.max_range = f.min_left = f.min_right = 0;
+  if (sp != NULL) {
+    int n = sp->GetCount();
+    if (n > FRAME_MAX_BEAMS) n = FRAME_MAX_BEAMS;
+    for (int i = 0; i < n; i++) {
+      f.ranges[i]   = sp->GetRange(i);
+      f.bearings[i] = sp->GetBearing(i);
+    }
+    f.ranges_count = n;
+    f.max_range = sp->GetMaxRange();
+    // MinLeft() and MinRight() would go through the proxy again
+    beamSides(f.ranges, f.bearings, n, f.max_range, &f.min_left,
+              &f.min_right);
+  }
+
+  f.hyp_count = 0;
+  memset(f.hyps, 0, sizeof(f.hyps));
+  if (lp != NULL) {
+    int n = lp->GetHypothCount();
+    if (n > FRAME_MAX_HYPS) n = FRAME_MAX_HYPS;
+    for (int i = 0; i < n; i++) f.hyps[i] = lp->GetHypoth(i);
+    f.hyp_count = n;
+  }
+} // End of readProxies()
+
+/**
+ * readSensors()
+ *
+ * Copy the proxies into a frame. Only call this from whichever thread is
+ * doing the reading.
+ *
+ **/
+
+inline void readSensors(const RobotClient& rc, SensorFrame& f)
+{
+  readProxies(rc.pp, rc.bp, rc.sp, rc.lp, f);
+} // End of readSensors()
+
+/**
+ * writeFrame()
+ *
+ **/
+
+inline bool writeFrame(FILE* fp, const SensorFrame& f)
+{
+  FrameLogEntry e;
+
+  memset(&e, 0, sizeof(e));
+  e.seq    = f.seq;
+  e.stamp  = f.stamp;
+  e.odom_x = f.odom.px;
+  e.odom_y = f.odom.py;
+  e.odom_a = f.odom.pa;
+  e.max_range = f.max_range;
+  e.min_left  = f.min_left;
+  e.min_right = f.min_right;
+  e.ranges_count = f.ranges_count;
+  e.hyp_count    = f.hyp_count;
+  e.bumper[0] = f.bumper[0];
+  e.bumper[1] = f.bumper[1];
+  e.stall     = f.stall;
+
+  return fwrite(&e, sizeof(e), 1, fp) == 1
+    && fwrite(f.ranges, sizeof(double), f.ranges_count, fp)
+       == (size_t)f.ranges_count
+    && fwrite(f.bearings, sizeof(double), f.ranges_count, fp)
+       == (size_t)f.ranges_count
+    && fwrite(f.hyps, sizeof(f.hyps[0]), f.hyp_count, fp)
+       == (size_t)f.hyp_count;
+} // End of writeFrame()
+
+/**
+ * readFrame()
+ *
+ * The next frame in a recording. False at the end, or if the file is
+ * damaged.
+ *
+ **/
+
+inline bool readFrame(FILE* fp, SensorFrame& f)
+{
+  FrameLogEntry e;
+
+  if (fread(&e, sizeof(e), 1, fp) != 1) return false;
+  if (e.ranges_count < 0 || e.ranges_count > FRAME_MAX_BEAMS
+      || e.hyp_count < 0 || e.hyp_count > FRAME_MAX_HYPS) return false;
+
+  f.seq     = e.seq;
+  f.stamp   = e.stamp;
+  f.odom.px = e.odom_x;
+  f.odom.py = e.odom_y;
+  f.odom.pa = e.odom_a;
+  f.max_range = e.max_range;
+  f.min_left  = e.min_left;
+  f.min_right = e.min_right;
+  f.ranges_count = e.ranges_count;
+  f.hyp_count    = e.hyp_count;
+  f.bumper[0] = e.bumper[0];
+  f.bumper[1] = e.bumper[1];
+  f.stall     = e.stall;
+  memset(f.hyps, 0, sizeof(f.hyps));
+
+  return fread(f.ranges, sizeof(double), e.ranges_count, fp)
+       == (size_t)e.ranges_count
+    && fread(f.bearings, sizeof(double), e.ranges_count, fp)
+       == (size_t)e.ranges_count
+    && fread(f.hyps, sizeof(f.hyps[0]), e.hyp_count, fp)
+       == (size_t)e.hyp_count;
+} // End of readFrame()
+
+/**
+ * openFrameLog()
+ *
+ * Open a recording to write (with the program's name) or to read (with
+ * program NULL, checking it is one we understand). NULL if we can't.
+ *
+ **/
+
+inline FILE* openFrameLog(const char* path, const char* program)
+{
+  FrameLogHeader header;
+  FILE* fp = fopen(path, program != NULL ? "wb" : "rb");
+
+  if (fp == NULL) {
+    std::cerr << "Can't open frame log " << path << std::endl;
+    return NULL;
+  }
+  if (program != NULL) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "FRAM", 4);
+    header.version = FRAMELOG_VERSION;
+    strncpy(header.program, program, sizeof(header.program) - 1);
+    fwrite(&header, sizeof(header), 1, fp);
+  } else if (fread(&header, sizeof(header), 1, fp) != 1
+             || memcmp(header.magic, "FRAM", 4) != 0
+             || header.version != FRAMELOG_VERSION) {
+    std::cerr << path << " isn't a version " << FRAMELOG_VERSION
+              << " frame log" << std::endl;
+    fclose(fp);
+    return NULL;
+  }
+  return fp;
+} // End of openFrameLog()
+
+/**
+ * clientIoLoop()
+ *
+ * The I/O thread in async mode: read when there is something to read,
+ * and pass on the newest speed command as soon as there is one.
+ *
+ **/
+
+inline void clientIoLoop(RobotClient* rc)
+{
+  SpeedCommand cmd;
+
+  while (rc->running.load(std::memory_order_relaxed)) {
+    if (rc->robot->Peek(IO_POLL_MS)) {
+      rc->robot->ReadIfWaiting();
+      SensorFrame& f = latestBack(rc->sensors);
+      readSensors(*rc, f);
+      f.seq = ++rc->reads;
+      if (rc->record != NULL) writeFrame(rc->record, f);
+      publishLatest(rc->sensors);
+    }
+    if (takeLatest(rc->commands, cmd))
+      rc->pp->SetSpeed(cmd.speed, cmd.turnrate);
+  }
+} // End of clientIoLoop()
+
+/**
+ * initClient()
+ *
+ **/
+
+inline void initClient(RobotClient& rc)
+{
+  rc.robot = NULL;
+  rc.pp = NULL;
+  rc.bp = NULL;
+  rc.sp = NULL;
+  rc.lp = NULL;
+  rc.async  = false;
+  rc.record = rc.replay = NULL;
+  rc.sim = NULL;
+  rc.time_limit = 0;
+  rc.finished = false;
+  rc.period = 0;
+  rc.next_tick = rc.last_tick = 0;
+  rc.tick_dt = rc.data_age = rc.tick_start = 0;
+  rc.last_seq = rc.reads = 0;
+  memset(&rc.tick, 0, sizeof(rc.tick));
+  memset(&rc.late, 0, sizeof(rc.late));
+  memset(&rc.age, 0, sizeof(rc.age));
+  initLatest(rc.sensors);
+  initLatest(rc.commands);
+} // End of initClient()
+
+/**
+ * startClient()
+ *
+ * With hz > 0, read on a separate thread and run the controller at hz;
+ * otherwise read in clientRead() like the old loop did. If "record" is
+ * given, every frame read is saved there for startReplay().
+ *
+ **/
+
+inline void startClient(RobotClient& rc, PlayerCc::PlayerClient* robot,
+                        PlayerCc::Position2dProxy* pp,
+                        PlayerCc::BumperProxy* bp, PlayerCc::LaserProxy* sp,
+                        PlayerCc::LocalizeProxy* lp, double hz = 0,
+                        const char* record = NULL, const char* program = "")
+{
+  initClient(rc);
+  rc.robot = robot;
+  rc.pp = pp;
+  rc.bp = bp;
+  rc.sp = sp;
+  rc.lp = lp;
+  rc.async  = hz > 0;
+  rc.period = hz > 0 ? 1.0 / hz : 0;
+  if (record != NULL) rc.record = openFrameLog(record, program);
+
+  if (rc.async) {
+    rc.running.store(true);
+    rc.io = std::thread(clientIoLoop, &rc);
+  }
+} // End of startClient()
+
+/**
+ * startReplay()
+ *
+ * Read frames from a recording instead of from a robot. Speeds are thrown
+ * away, and clientRead() sets "finished" once the frames run out.
+ * Returns false if the recording can't be read.
+ *
+ **/
+
+inline bool startReplay(RobotClient& rc, const char* path)
+{
+  initClient(rc);
+  rc.replay = openFrameLog(path, NULL);
+  return rc.replay != NULL;
+} // End of startReplay()
+
+/**
+ * startSim()
+ *
+ * Drive a simulated robot. The simulation ends, setting "finished", after
+ * time_limit simulated seconds (0 for never). Frames can be recorded as
+ * for a real robot.
+ *
+ **/
+
+inline void startSim(RobotClient& rc, Sim& sim, double time_limit = 0,
+                     const char* record = NULL, const char* program = "")
+{
+  initClient(rc);
+  rc.sim = &sim;
+  rc.time_limit = time_limit;
+  if (record != NULL) rc.record = openFrameLog(record, program);
+} // End of startSim()
+
+/**
+ * clientRead()
+ *
+ * Wait for the next control tick and fill in the newest data. Returns
+ * true if the data is new since the last call; in async mode the
+ * controller may tick faster than the robot sends data, and then "frame"
+ * is left as it was. The first call waits until there is some data.
+ *
+ **/
+
+inline bool clientRead(RobotClient& rc, SensorFrame& frame)
+{
+  bool fresh;
+  double now;
+
+  if (rc.sim != NULL) {
+    // The first read is of where the robot starts
+    if (rc.reads > 0) simStep(*rc.sim);
+    if (rc.time_limit > 0 && rc.sim->time > rc.time_limit) {
+      rc.finished = true;
+      return false;
+    }
+    simSense(*rc.sim, frame);
+    rc.reads++;
+    if (rc.record != NULL) writeFrame(rc.record, frame);
+    fresh = true;
+    now = frame.stamp;
+  } else if (rc.replay != NULL) {
+    // Time stands still between frames, so the timings come out as they
+    // were when the frames were recorded.
+    if (!readFrame(rc.replay, frame)) {
+      rc.finished = true;
+      return false;
+    }
+    rc.reads++;
+    fresh = true;
+    now = frame.stamp;
+  } else if (!rc.async) {
+    rc.robot->Read();
+    readSensors(rc, frame);
+    frame.seq = ++rc.reads;
+    if (rc.record != NULL) writeFrame(rc.record, frame);
+    fresh = true;
+    now = clientNow();
+  } else {
+    now = clientNow();
+    if (rc.next_tick == 0) rc.next_tick = now;
+    if (now < rc.next_tick) {
+      std::this_thread::sleep_until(std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(rc.next_tick))));
+      now = clientNow();
+    }
+    addStat(rc.late, now - rc.next_tick);
+    // If we overran by more than a tick, drop the missed ones rather than
+    // running them back to back.
+    rc.next_tick += rc.period;
+    if (now > rc.next_tick) rc.next_tick = now + rc.period;
+
+    fresh = takeLatest(rc.sensors, frame);
+    while (rc.last_seq == 0 && !fresh) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(IO_POLL_MS));
+      fresh = takeLatest(rc.sensors, frame);
+      now = clientNow();
+      rc.next_tick = now + rc.period;
+    }
+  }
+
+  rc.tick_dt  = rc.last_tick > 0 ? now - rc.last_tick : 0;
+  rc.data_age = now - frame.stamp;
+  if (rc.last_tick > 0) addStat(rc.tick, rc.tick_dt);
+  rc.last_tick = now;
+  addStat(rc.age, rc.data_age);
+  rc.last_seq = frame.seq;
+  rc.tick_start = clientNow();
+  return fresh;
+} // End of clientRead()
+
+/**
+ * clientSetSpeed()
+ *
+ **/
+
+inline void clientSetSpeed(RobotClient& rc, double speed, double turnrate)
+{
+  if (rc.replay != NULL) return;
+  if (rc.sim != NULL) {
+    rc.sim->speed    = speed;
+    rc.sim->turnrate = turnrate;
+    return;
+  }
+  if (!rc.async) {
+    rc.pp->SetSpeed(speed, turnrate);
+    return;
+  }
+  SpeedCommand& cmd = latestBack(rc.commands);
+  cmd.speed    = speed;
+  cmd.turnrate = turnrate;
+  publishLatest(rc.commands);
+} // End of clientSetSpeed()
+
+/**
+ * fillTelemetry()
+ *
+ * Start a telemetry record (telemetry.h) for this tick with everything
+ * the client knows: timing, odometry, bumpers, the laser summary and the
+ * localizer's hypotheses. The controller adds the rest.
+ *
+ **/
+
+inline void fillTelemetry(const RobotClient& rc, const SensorFrame& frame,
+                          TelemetryRecord& rec)
+{
+  memset(&rec, 0, sizeof(rec));
+  rec.tick        = rc.tick.count + 1;
+  rec.frame       = frame.seq;
+  rec.tick_period = rc.tick_dt;
+  rec.data_age    = rc.data_age;
+  rec.loop_time   = clientNow() - rc.tick_start;
+  rec.odom_x = frame.odom.px;
+  rec.odom_y = frame.odom.py;
+  rec.odom_a = frame.odom.pa;
+  rec.flags  = (frame.bumper[0] ? TELEMETRY_BUMP_LEFT : 0)
+             | (frame.bumper[1] ? TELEMETRY_BUMP_RIGHT : 0)
+             | (frame.stall ? TELEMETRY_STALL : 0);
+
+  rec.ranges_count = frame.ranges_count;
+  rec.min_left  = frame.min_left;
+  rec.min_right = frame.min_right;
+  rec.min_range = frame.max_range;
+  for (int i = 0; i < frame.ranges_count; i++)
+    if (frame.ranges[i] < rec.min_range) rec.min_range = frame.ranges[i];
+
+  rec.hyp_count = frame.hyp_count;
+  for (int i = 0; i < frame.hyp_count && i < TELEMETRY_HYPS; i++) {
+    rec.hyps[i].x     = frame.hyps[i].mean.px;
+    rec.hyps[i].y     = frame.hyps[i].mean.py;
+    rec.hyps[i].a     = frame.hyps[i].mean.pa;
+    rec.hyps[i].alpha = frame.hyps[i].alpha;
+  }
+} // End of fillTelemetry()
+
+/**
+ * stopClient()
+ *
+ * Stop the I/O thread, make sure the robot is stopped, and say how the
+ * control loop did (unless quiet).
+ *
+ **/
+
+inline void stopClient(RobotClient& rc, bool quiet = false)
+{
+  if (rc.async && rc.io.joinable()) {
+    rc.running.store(false);
+    rc.io.join();
+  }
+  if (rc.pp != NULL) rc.pp->SetSpeed(0, 0);
+
+  if (!quiet) {
+    std::cout << (rc.sim ? "Simulated" : rc.replay ? "Replayed"
+                  : rc.async ? "Async" : "Sync")
+              << " control loop, " << rc.reads << " reads" << std::endl;
+    printStat("Tick period", rc.tick);
+    if (rc.async) printStat("Tick lateness", rc.late);
+    printStat("Data age", rc.age);
+  }
+
+  if (rc.record != NULL) fclose(rc.record);
+  if (rc.replay != NULL) fclose(rc.replay);
+  rc.record = rc.replay = NULL;
+} // End of stopClient()
+
+#endif
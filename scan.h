@@ -0,0 +1,380 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Scan preprocessing
+ *
+ ** Description ***************************************************************
+ *
+ *  Turns the raw ranges in a frame into what the rest of the controller
+ *  wants from them, in one go along the scan:
+ *
+ *    outliers   a beam that is further than "spike" from both of its
+ *               neighbours, the same way, is dropped: a mixed reading at
+ *               the edge of something, or noise. (So is something thin
+ *               enough that only one beam hits it.)
+ *    sides      the closest thing on the left and on the right, as
+ *               LaserProxy::MinLeft() and MinRight() give them, but
+ *               without the outliers.
+ *    points     the ends of the beams, in the robot's frame, no closer
+ *               together than "spacing". Beams fan out, so that is every
+ *               beam far away and every few close up: the same number of
+ *               points per metre of wall wherever the wall is, and fewer
+ *               of them to look at. The first and last point of each run
+ *               of beams is always kept.
+ *    segments   straight lines through the points, split wherever the
+ *               range jumps or the scan goes out of range, and then again
+ *               wherever a point is more than "split" off the line
+ *               (iterative end point fit), each fitted by least squares.
+ *    corners    where two segments next to each other meet, turning by
+ *               more than "corner_angle".
+ *
+ *  Nothing is copied out of the frame but the points kept. The cosine and
+ *  sine of each bearing are worked out once and kept for as long as the
+ *  laser's bearings stay the same, so a beam costs a few comparisons, and
+ *  two multiplies if it is kept.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "laserkernel.h"
+#include "sensorframe.h"
+
+/**
+ * A straight piece of wall: points first to last of the scan lie along
+ * nx * x + ny * y = d.
+ *
+ **/
+
+struct ScanSegment
+{
+  int   first, last;
+  float x0, y0, x1, y1;         // Its ends, on the line
+  float nx, ny, d;
+  float rms;                    // Of the points' distances from the line
+};
+
+/**
+ * Where two segments, seg and seg + 1, meet.
+ *
+ **/
+
+struct ScanCorner
+{
+  float x, y;
+  float turn;                   // How far the wall turns, up to pi/2
+  int   seg;
+};
+
+/**
+ * The settings, and what came of the last scan. Distances in metres,
+ * angles in radians, and everything in the robot's frame.
+ *
+ **/
+
+struct LaserScan
+{
+  double min_range;             // Anything closer is the robot itself
+  double spike;                 // Outlier, if this far from both neighbours
+  double spacing;               // Between the points kept
+  double jump;                  // Change in range that breaks a segment
+  double split;                 // Furthest a point may be off its segment
+  int    min_points;            // In a segment
+  double min_length;            // ...and how long it has to be
+  double corner_angle;
+
+  const SensorFrame* frame;     // Where the ranges are
+
+  // cos() and sin() of the bearings, and which bearings they are of:
+  // the laser's tables (laserkernel.h) if it has them, or else our own
+  int    geom_count;
+  double geom_first, geom_last;
+  const LaserKernels* kernels;
+  float  bc[FRAME_MAX_BEAMS], bs[FRAME_MAX_BEAMS];
+
+  // The points kept
+  int    count;
+  int    beam[FRAME_MAX_BEAMS];       // Which beam each is
+  double range[FRAME_MAX_BEAMS];
+  double bearing[FRAME_MAX_BEAMS];
+  float  x[FRAME_MAX_BEAMS], y[FRAME_MAX_BEAMS];
+  char   brk[FRAME_MAX_BEAMS];        // Not joined to the one before
+
+  int    valid, outliers;       // Beams in range, and those dropped
+  double min_left, min_right;
+  std::vector<ScanSegment> segments;
+  std::vector<ScanCorner>  corners;
+};
+
+/**
+ * initLaserScan()
+ *
+ * Settings for the 361 beam SICK in world42.cfg.
+ *
+ **/
+
+inline void initLaserScan(LaserScan& ls)
+{
+  ls.min_range = 0.05;
+  ls.spike = 0.3;
+  ls.spacing = 0.05;
+  ls.jump = 0.3;
+  ls.split = 0.05;
+  ls.min_points = 5;
+  ls.min_length = 0.3;
+  ls.corner_angle = M_PI / 6;
+  ls.frame = NULL;
+  ls.geom_count = 0;
+  ls.geom_first = ls.geom_last = 0;
+  ls.kernels = NULL;
+  ls.count = ls.valid = ls.outliers = 0;
+  ls.min_left = ls.min_right = 0;
+  ls.segments.clear();
+  ls.corners.clear();
+} // End of initLaserScan()
+
+/**
+ * scanBearings()
+ *
+ * Find cos() and sin() of the bearings in the frame, unless we already
+ * have them: from the laser's tables, or else work them out.
+ *
+ **/
+
+inline void scanBearings(LaserScan& ls, const SensorFrame& frame)
+{
+  int n = frame.ranges_count;
+  if (n == ls.geom_count && n > 0 && frame.bearings[0] == ls.geom_first
+      && frame.bearings[n - 1] == ls.geom_last) return;
+
+  ls.kernels = findLaserKernels(frame.bearings, n);
+  if (ls.kernels == NULL) {
+    for (int i = 0; i < n; i++) {
+      ls.bc[i] = cos(frame.bearings[i]);
+      ls.bs[i] = sin(frame.bearings[i]);
+    }
+  }
+  ls.geom_count = n;
+  ls.geom_first = n > 0 ? frame.bearings[0] : 0;
+  ls.geom_last  = n > 0 ? frame.bearings[n - 1] : 0;
+} // End of scanBearings()
+
+/**
+ * fitSegment()
+ *
+ * Fit a line to points first to last by least squares, as a segment.
+ * False if they are too few or too short a line to be worth having.
+ *
+ **/
+
+inline bool fitSegment(const LaserScan& ls, int first, int last,
+                       ScanSegment& seg)
+{
+  int n = last - first + 1;
+  if (n < ls.min_points) return false;
+  float dx = ls.x[last] - ls.x[first], dy = ls.y[last] - ls.y[first];
+  if (dx * dx + dy * dy < ls.min_length * ls.min_length) return false;
+
+  float mx = 0, my = 0;
+  for (int i = first; i <= last; i++) {
+    mx += ls.x[i];
+    my += ls.y[i];
+  }
+  mx /= n;
+  my /= n;
+  float sxx = 0, syy = 0, sxy = 0;
+  for (int i = first; i <= last; i++) {
+    float ex = ls.x[i] - mx, ey = ls.y[i] - my;
+    sxx += ex * ex;
+    syy += ey * ey;
+    sxy += ex * ey;
+  }
+  // The way the points spread most is along the line
+  float a = 0.5f * atan2f(2 * sxy, sxx - syy);
+  float ux = cosf(a), uy = sinf(a);
+  seg.first = first;
+  seg.last = last;
+  seg.nx = -uy;
+  seg.ny = ux;
+  seg.d = seg.nx * mx + seg.ny * my;
+  float t0 = (ls.x[first] - mx) * ux + (ls.y[first] - my) * uy;
+  float t1 = (ls.x[last] - mx) * ux + (ls.y[last] - my) * uy;
+  seg.x0 = mx + t0 * ux;
+  seg.y0 = my + t0 * uy;
+  seg.x1 = mx + t1 * ux;
+  seg.y1 = my + t1 * uy;
+  float ss = 0;
+  for (int i = first; i <= last; i++) {
+    float e = seg.nx * ls.x[i] + seg.ny * ls.y[i] - seg.d;
+    ss += e * e;
+  }
+  seg.rms = sqrtf(ss / n);
+  return true;
+} // End of fitSegment()
+
+/**
+ * splitRun()
+ *
+ * Break the run of points first to last into straight pieces, worst
+ * point first, and add those long enough to be segments, in order along
+ * the scan. A run that bends gently all the way round gets broken up too,
+ * which is what we want.
+ *
+ **/
+
+inline void splitRun(LaserScan& ls, int first, int last)
+{
+  // Pieces still to look at, the leftmost on top
+  int stack[2 * FRAME_MAX_BEAMS];
+  int top = 0;
+  stack[top++] = first;
+  stack[top++] = last;
+  while (top > 0) {
+    int b = stack[--top], a = stack[--top];
+    float dx = ls.x[b] - ls.x[a], dy = ls.y[b] - ls.y[a];
+    float len = sqrtf(dx * dx + dy * dy);
+    int worst = -1;
+    float worst_d = ls.split;
+    if (len > 1e-6f) {
+      for (int i = a + 1; i < b; i++) {
+        float d = fabsf((ls.x[i] - ls.x[a]) * dy - (ls.y[i] - ls.y[a]) * dx)
+                / len;
+        if (d > worst_d) {
+          worst = i;
+          worst_d = d;
+        }
+      }
+    }
+    if (worst >= 0) {
+      stack[top++] = worst;
+      stack[top++] = b;
+      stack[top++] = a;
+      stack[top++] = worst;
+      continue;
+    }
+    ScanSegment seg;
+    if (fitSegment(ls, a, b, seg)) ls.segments.push_back(seg);
+  }
+} // End of splitRun()
+
+/**
+ * findCorners()
+ *
+ * Corners between segments that share a point and turn by enough.
+ *
+ **/
+
+inline void findCorners(LaserScan& ls)
+{
+  ls.corners.clear();
+  for (size_t i = 0; i + 1 < ls.segments.size(); i++) {
+    const ScanSegment& s = ls.segments[i];
+    const ScanSegment& t = ls.segments[i + 1];
+    if (t.first != s.last) continue;
+    // The normals are at the same angle as the lines
+    float dot = s.nx * t.nx + s.ny * t.ny;
+    float turn = acosf(std::min(1.0f, fabsf(dot)));
+    if (turn < ls.corner_angle) continue;
+    float det = s.nx * t.ny - s.ny * t.nx;
+    ScanCorner c;
+    c.x = (s.d * t.ny - t.d * s.ny) / det;
+    c.y = (s.nx * t.d - t.nx * s.d) / det;
+    c.turn = turn;
+    c.seg = i;
+    // A corner miles from the point it is meant to be at is a bad fit
+    float ex = c.x - ls.x[s.last], ey = c.y - ls.y[s.last];
+    if (ex * ex + ey * ey > ls.jump * ls.jump) continue;
+    ls.corners.push_back(c);
+  }
+} // End of findCorners()
+
+/**
+ * processScan()
+ *
+ * Everything above, for the laser in the frame. The scan keeps a pointer
+ * to the frame, which has to stay put while the scan is used. Returns how
+ * many points were kept.
+ *
+ **/
+
+inline int processScan(LaserScan& ls, const SensorFrame& frame)
+{
+  const int n = frame.ranges_count;
+  const double* r = frame.ranges;
+  const double lo = ls.min_range, hi = frame.max_range - 0.01;
+  const double spike = ls.spike, jump = ls.jump;
+  const float spacing2 = ls.spacing * ls.spacing;
+
+  scanBearings(ls, frame);
+  const float* bc = ls.kernels != NULL ? ls.kernels->cos_b : ls.bc;
+  const float* bs = ls.kernels != NULL ? ls.kernels->sin_b : ls.bs;
+  ls.frame = &frame;
+  ls.count = ls.valid = ls.outliers = 0;
+  ls.min_left = ls.min_right = frame.max_range;
+  ls.segments.clear();
+  ls.corners.clear();
+
+  // In range, and so may be kept, is "ok". We look one beam ahead, to
+  // check for spikes and to know whether this is the end of a run.
+  bool ok_next = n > 0 && r[0] > lo && r[0] < hi;
+  bool gap = true;              // Since the last point we kept
+  double last_r = 0;            // Of the last beam we didn't drop
+  float last_x = 0, last_y = 0;
+  for (int i = 0; i < n; i++) {
+    double ri = r[i];
+    bool ok = ok_next;
+    ok_next = i + 1 < n && r[i + 1] > lo && r[i + 1] < hi;
+    if (ok && i > 0 && ok_next) {
+      double a = r[i - 1], b = r[i + 1];
+      if (a > lo && a < hi
+          && ((ri - a > spike && ri - b > spike)
+              || (a - ri > spike && b - ri > spike))) {
+        ls.outliers++;
+        ok = false;
+      }
+    }
+    if (!ok) {
+      gap = true;
+      continue;
+    }
+    ls.valid++;
+    // As LaserProxy::MinLeft/MinRight: the first half is the right
+    if (i < n / 2) {
+      if (ri < ls.min_right) ls.min_right = ri;
+    } else if (ri < ls.min_left) {
+      ls.min_left = ri;
+    }
+
+    if (!gap && fabs(ri - last_r) > jump) gap = true;
+    last_r = ri;
+    bool end = !ok_next || fabs(r[i + 1] - ri) > jump;
+    float px = ri * bc[i], py = ri * bs[i];
+    float dx = px - last_x, dy = py - last_y;
+    if (!gap && !end && dx * dx + dy * dy < spacing2) continue;
+
+    int k = ls.count++;
+    ls.beam[k] = i;
+    ls.range[k] = ri;
+    ls.bearing[k] = frame.bearings[i];
+    ls.x[k] = px;
+    ls.y[k] = py;
+    ls.brk[k] = gap;
+    last_x = px;
+    last_y = py;
+    gap = false;
+  }
+
+  // The runs of points between breaks, into segments
+  int start = 0;
+  for (int k = 1; k <= ls.count; k++) {
+    if (k < ls.count && !ls.brk[k]) continue;
+    if (k - start >= ls.min_points) splitRun(ls, start, k - 1);
+    start = k;
+  }
+  findCorners(ls);
+  return ls.count;
+} // End of processScan()
+
+#endif
@@ -0,0 +1,548 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Scan matching
+ *
+ ** Description ***************************************************************
+ *
+ *  Corrects the wheel odometry by matching each laser scan against an
+ *  earlier one. The odometry says roughly how far the robot moved between
+ *  the two; the matcher looks for the move, within a window around that
+ *  guess, that best lines the new scan up with the old one, and works out
+ *  a corrected pose from it that can be used wherever the odometry was.
+ *  The old scan is kept until the robot has moved half a metre or so from
+ *  it, since matching every scan to the one before adds up small errors
+ *  ten times a second.
+ *
+ *  The search is done the way Olson's real-time correlative scan matcher
+ *  does it. The old scan is drawn into a grid, each point blurred out into
+ *  a little Gaussian hill, so that a new point scores well for landing near
+ *  an old one. For every rotation to try, the new scan is rotated once,
+ *  using a table of the cosines and sines of the rotations worked out when
+ *  the matcher is set up, and each translation just shifts its cells. The
+ *  translations are first tried in blocks, against a second grid holding
+ *  the highest value in each block, which bounds the best score anywhere in
+ *  the block; only the blocks that could beat the best so far are searched
+ *  cell by cell.
+ *
+ *  That gets to within a grid cell. Point-to-line ICP then finishes the
+ *  job: each new point is paired with the nearest old point (kdtree.h) and
+ *  the line to its neighbour along the old scan, and the pose is moved to
+ *  minimise the distances to those lines, a few times over.
+ *
+ *  Given a LaserScan (scan.h) it matches the points kept there, evenly
+ *  spaced along the walls and without the outliers, rather than every beam.
+ *
+ *  If the scan doesn't match well enough (too few points, or nothing but a
+ *  blank wall) the odometry is used for that step instead.
+ */
+
+#ifndef SCANMATCH_H
+#define SCANMATCH_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "gridmap.h"
+#include "kdtree.h"
+#include "laserkernel.h"
+#include "scan.h"
+#include "sensorframe.h"
+
+/**
+ * The matcher, with its parameters, the scan it matches against, and what
+ * it has worked out so far.
+ *
+ **/
+
+struct ScanMatcher
+{
+  // Search
+  double resolution;          // Grid cell size, metres
+  int    block;               // Cells per side of a block in the first pass
+  double sigma;               // How much each old point is blurred, metres
+  double window_xy;           // How far from the odometry to look, metres
+  double window_a;            // ...and how far round, radians
+  double step_a;              // Between rotations tried
+  double min_range;           // Beams shorter than this are ignored
+  double min_score;           // Below this (0 to 1) we use the odometry
+  int    min_points;
+
+  // Refinement
+  int    icp_iters;
+  double icp_max_dist;        // Furthest a point can be from its partner
+
+  // cos and sin of each rotation offset, from -window_a to window_a
+  int rotations;
+  std::vector<float> rot_cos, rot_sin;
+
+  // The old scan, in the robot's frame when it was taken
+  bool have_ref;
+  std::vector<Point2d> ref;
+  KdTree ref_tree;
+  Pose2d ref_pose;            // Corrected pose when it was taken
+  double keyframe_dist;       // Take a new one after moving this far
+  double keyframe_angle;      // ...or turning this far
+
+  // Grids round the old scan
+  int    width, height;
+  double origin_x, origin_y;
+  std::vector<float> fine;    // Each old point blurred
+  std::vector<float> bound;   // Highest value in the block from each cell
+
+  // Scratch for the new scan
+  std::vector<Point2d> pts;
+  std::vector<float> rx, ry;  // pts rotated, rotation by rotation
+  std::vector<int>   cx, cy;
+
+  // Results
+  bool   started;             // Set by the first frame
+  Pose2d pose;                // Corrected odometry
+  Pose2d rel;                 // The same, relative to the reference scan
+  Pose2d delta;               // The last step, relative to the one before
+  Pose2d last_odom;           // Wheel odometry last time
+  double score;               // How well it matched, 0 to 1
+  bool   matched;             // False if we used the odometry
+  int    matches, fallbacks;
+};
+
+/**
+ * initScanMatcher()
+ *
+ * Parameters suit the SICK on a Roomba going at up to 1m/s with a 100ms
+ * tick: the window allows for the odometry being a quarter of a metre and
+ * 6 degrees out since the last match, which is plenty.
+ *
+ **/
+
+inline void initScanMatcher(ScanMatcher& sm, double max_range = 8.0)
+{
+  sm.resolution = 0.04;
+  sm.block = 4;
+  sm.sigma = 0.05;
+  sm.window_xy = 0.24;
+  sm.window_a = 0.1;
+  // Turning by this moves the furthest point by one cell; ICP does the rest
+  sm.step_a = sm.resolution / max_range;
+  sm.min_range = 0.05;
+  sm.min_score = 0.35;
+  sm.min_points = 30;
+  sm.icp_iters = 8;
+  sm.icp_max_dist = 0.2;
+  sm.keyframe_dist = 0.5;
+  sm.keyframe_angle = 0.35;
+
+  int half = (int)ceil(sm.window_a / sm.step_a);
+  sm.rotations = 2 * half + 1;
+  sm.rot_cos.resize(sm.rotations);
+  sm.rot_sin.resize(sm.rotations);
+  for (int k = 0; k < sm.rotations; k++) {
+    sm.rot_cos[k] = cos((k - half) * sm.step_a);
+    sm.rot_sin[k] = sin((k - half) * sm.step_a);
+  }
+
+  sm.started = false;
+  sm.have_ref = false;
+  sm.ref.clear();
+  sm.pose.px = sm.pose.py = sm.pose.pa = 0;
+  sm.delta = sm.pose;
+  sm.score = 0;
+  sm.matched = false;
+  sm.matches = sm.fallbacks = 0;
+} // End of initScanMatcher()
+
+/**
+ * scanPoints()
+ *
+ * The laser returns in a frame as points in the robot's frame, leaving out
+ * beams that saw nothing.
+ *
+ **/
+
+inline void scanPoints(const ScanMatcher& sm, const SensorFrame& frame,
+                       std::vector<Point2d>& out)
+{
+  float ends_x[FRAME_MAX_BEAMS], ends_y[FRAME_MAX_BEAMS];
+  beamEnds(frame.ranges, frame.bearings, frame.ranges_count, ends_x, ends_y);
+  out.clear();
+  for (int i = 0; i < frame.ranges_count; i++) {
+    double r = frame.ranges[i];
+    if (r < sm.min_range || r >= frame.max_range - 0.01) continue;
+    Point2d p = { ends_x[i], ends_y[i] };
+    out.push_back(p);
+  }
+} // End of scanPoints()
+
+/**
+ * scanPoints()
+ *
+ * The same, from the points a LaserScan kept.
+ *
+ **/
+
+inline void scanPoints(const ScanMatcher& sm, const LaserScan& scan,
+                       std::vector<Point2d>& out)
+{
+  out.clear();
+  for (int i = 0; i < scan.count; i++) {
+    if (scan.range[i] < sm.min_range) continue;
+    Point2d p = { scan.x[i], scan.y[i] };
+    out.push_back(p);
+  }
+} // End of scanPoints()
+
+/**
+ * buildMatchGrids()
+ *
+ * Draw the old scan into the grids.
+ *
+ **/
+
+inline void buildMatchGrids(ScanMatcher& sm)
+{
+  const double res = sm.resolution;
+  int r = (int)ceil(3 * sm.sigma / res);
+  double min_x = 1e30, min_y = 1e30, max_x = -1e30, max_y = -1e30;
+
+  for (size_t i = 0; i < sm.ref.size(); i++) {
+    min_x = std::min(min_x, sm.ref[i].x);
+    max_x = std::max(max_x, sm.ref[i].x);
+    min_y = std::min(min_y, sm.ref[i].y);
+    max_y = std::max(max_y, sm.ref[i].y);
+  }
+  // Room for the blur, and for the blocks to hang off the edge
+  sm.origin_x = min_x - (r + 1) * res;
+  sm.origin_y = min_y - (r + 1) * res;
+  sm.width  = (int)ceil((max_x - sm.origin_x) / res) + r + 1 + sm.block;
+  sm.height = (int)ceil((max_y - sm.origin_y) / res) + r + 1 + sm.block;
+  sm.fine.assign(sm.width * sm.height, 0.0f);
+
+  // Blur each point about where it really is, not the middle of its cell
+  std::vector<float> kernel((2 * r + 1) * (2 * r + 1));
+  double inv_2s2 = 1.0 / (2 * sm.sigma * sm.sigma);
+  for (size_t i = 0; i < sm.ref.size(); i++) {
+    double fx = (sm.ref[i].x - sm.origin_x) / res;
+    double fy = (sm.ref[i].y - sm.origin_y) / res;
+    int px = (int)floor(fx), py = (int)floor(fy);
+    double ox = (fx - px - 0.5) * res, oy = (fy - py - 0.5) * res;
+    for (int dy = -r; dy <= r; dy++)
+      for (int dx = -r; dx <= r; dx++) {
+        double ex = dx * res - ox, ey = dy * res - oy;
+        kernel[(dy + r) * (2 * r + 1) + dx + r] =
+          exp(-(ex * ex + ey * ey) * inv_2s2);
+      }
+    for (int dy = -r; dy <= r; dy++) {
+      float* row = &sm.fine[(py + dy) * sm.width + px];
+      const float* k = &kernel[(dy + r) * (2 * r + 1) + r];
+      for (int dx = -r; dx <= r; dx++)
+        if (k[dx] > row[dx]) row[dx] = k[dx];
+    }
+  }
+
+  // bound[c] is the highest value in the block of cells starting at c:
+  // the highest along each row, then the highest of those down each column
+  int b = sm.block;
+  std::vector<float> rows(sm.width * sm.height, 0.0f);
+  sm.bound.assign(sm.width * sm.height, 0.0f);
+  for (int y = 0; y < sm.height; y++)
+    for (int x = 0; x < sm.width; x++) {
+      float m = 0;
+      for (int k = 0; k < b && x + k < sm.width; k++)
+        m = std::max(m, sm.fine[y * sm.width + x + k]);
+      rows[y * sm.width + x] = m;
+    }
+  for (int y = 0; y < sm.height; y++)
+    for (int x = 0; x < sm.width; x++) {
+      float m = 0;
+      for (int k = 0; k < b && y + k < sm.height; k++)
+        m = std::max(m, rows[(y + k) * sm.width + x]);
+      sm.bound[y * sm.width + x] = m;
+    }
+} // End of buildMatchGrids()
+
+/**
+ * gridScore()
+ *
+ * Sum of the grid values under the points of rotation k, shifted by
+ * (sx, sy) cells.
+ *
+ **/
+
+inline double gridScore(const ScanMatcher& sm, const std::vector<float>& grid,
+                        int k, int sx, int sy)
+{
+  int n = sm.pts.size();
+  const int* cx = &sm.cx[k * n];
+  const int* cy = &sm.cy[k * n];
+  double sum = 0;
+
+  for (int i = 0; i < n; i++) {
+    int x = cx[i] + sx, y = cy[i] + sy;
+    if (x < 0 || y < 0 || x >= sm.width || y >= sm.height) continue;
+    sum += grid[y * sm.width + x];
+  }
+  return sum;
+} // End of gridScore()
+
+/**
+ * correlativeSearch()
+ *
+ * Find the best rotation and shift of the new scan around the guess
+ * (gx, gy, ga). Returns the score, with the pose in out.
+ *
+ **/
+
+inline double correlativeSearch(ScanMatcher& sm, double gx, double gy,
+                                double ga, Pose2d& out)
+{
+  const double res = sm.resolution;
+  int n = sm.pts.size();
+  int half_a = sm.rotations / 2;
+  int half_t = (int)ceil(sm.window_xy / res);
+  double cg = cos(ga), sg = sin(ga);
+
+  // Rotate the scan once for each rotation, and find where each point
+  // lands in the grid when it's also moved by the guess
+  sm.rx.resize(sm.rotations * n);
+  sm.ry.resize(sm.rotations * n);
+  sm.cx.resize(sm.rotations * n);
+  sm.cy.resize(sm.rotations * n);
+  for (int k = 0; k < sm.rotations; k++) {
+    float c = cg * sm.rot_cos[k] - sg * sm.rot_sin[k];
+    float s = sg * sm.rot_cos[k] + cg * sm.rot_sin[k];
+    for (int i = 0; i < n; i++) {
+      float x = c * sm.pts[i].x - s * sm.pts[i].y;
+      float y = s * sm.pts[i].x + c * sm.pts[i].y;
+      sm.rx[k * n + i] = x;
+      sm.ry[k * n + i] = y;
+      sm.cx[k * n + i] = (int)floor((x + gx - sm.origin_x) / res);
+      sm.cy[k * n + i] = (int)floor((y + gy - sm.origin_y) / res);
+    }
+  }
+
+  // First pass: the bound for every block of shifts at every rotation
+  struct Candidate { double bound; int k, sx, sy; };
+  std::vector<Candidate> blocks;
+  for (int k = 0; k < sm.rotations; k++)
+    for (int sy = -half_t; sy <= half_t; sy += sm.block)
+      for (int sx = -half_t; sx <= half_t; sx += sm.block) {
+        Candidate c = { gridScore(sm, sm.bound, k, sx, sy), k, sx, sy };
+        blocks.push_back(c);
+      }
+  std::sort(blocks.begin(), blocks.end(),
+            [](const Candidate& a, const Candidate& b) {
+              return a.bound > b.bound;
+            });
+
+  // Second pass: search blocks cell by cell, best first, until none of
+  // the rest could do better
+  double best = -1;
+  int best_k = half_a, best_x = 0, best_y = 0;
+  for (size_t c = 0; c < blocks.size(); c++) {
+    if (blocks[c].bound <= best) break;
+    for (int dy = 0; dy < sm.block && blocks[c].sy + dy <= half_t; dy++)
+      for (int dx = 0; dx < sm.block && blocks[c].sx + dx <= half_t; dx++) {
+        double s = gridScore(sm, sm.fine, blocks[c].k,
+                             blocks[c].sx + dx, blocks[c].sy + dy);
+        // Prefer the guess when there's a tie, as on a blank wall
+        if (s > best + 1e-9) {
+          best = s;
+          best_k = blocks[c].k;
+          best_x = blocks[c].sx + dx;
+          best_y = blocks[c].sy + dy;
+        }
+      }
+  }
+
+  out.px = gx + best_x * res;
+  out.py = gy + best_y * res;
+  out.pa = normalizeAngle(ga + (best_k - half_a) * sm.step_a);
+  return n > 0 ? best / n : 0;
+} // End of correlativeSearch()
+
+/**
+ * refineICP()
+ *
+ * Point-to-line ICP from the pose the search found. Leaves the pose alone
+ * and returns false if the scan doesn't pin it down (a long straight
+ * wall, say) or the answer wanders off.
+ *
+ **/
+
+inline bool refineICP(const ScanMatcher& sm, Pose2d& pose)
+{
+  Pose2d p = pose;
+  int n = sm.pts.size();
+
+  for (int it = 0; it < sm.icp_iters; it++) {
+    double c = cos(p.pa), s = sin(p.pa);
+    double H[3][3] = { { 0 } }, g[3] = { 0 };
+    int used = 0;
+
+    for (int i = 0; i < n; i++) {
+      double qx = c * sm.pts[i].x - s * sm.pts[i].y + p.px;
+      double qy = s * sm.pts[i].x + c * sm.pts[i].y + p.py;
+      double d;
+      int j = kdNearest(sm.ref_tree, qx, qy, &d);
+      if (j < 0 || d > sm.icp_max_dist) continue;
+
+      // The line is to whichever neighbour along the scan is closer
+      int m = -1;
+      double best = sm.icp_max_dist;
+      for (int nb = j - 1; nb <= j + 1; nb += 2) {
+        if (nb < 0 || nb >= (int)sm.ref.size()) continue;
+        double e = hypot(sm.ref[nb].x - sm.ref[j].x,
+                         sm.ref[nb].y - sm.ref[j].y);
+        if (e > 1e-6 && e < best) { best = e; m = nb; }
+      }
+      if (m < 0) continue;
+
+      double lx = sm.ref[m].x - sm.ref[j].x, ly = sm.ref[m].y - sm.ref[j].y;
+      double len = hypot(lx, ly);
+      double nx = -ly / len, ny = lx / len;
+      double err = nx * (qx - sm.ref[j].x) + ny * (qy - sm.ref[j].y);
+      // d(q)/d(angle)
+      double ax = -s * sm.pts[i].x - c * sm.pts[i].y;
+      double ay =  c * sm.pts[i].x - s * sm.pts[i].y;
+      double J[3] = { nx, ny, nx * ax + ny * ay };
+      // Huber weight, so the odd bad pairing doesn't drag us off
+      double w = fabs(err) < 0.05 ? 1.0 : 0.05 / fabs(err);
+      for (int r = 0; r < 3; r++) {
+        g[r] += w * J[r] * err;
+        for (int q = 0; q < 3; q++) H[r][q] += w * J[r] * J[q];
+      }
+      used++;
+    }
+    if (used < sm.min_points) return false;
+
+    // Solve H step = -g by Cramer's rule; a tiny determinant means some
+    // direction isn't constrained
+    double det = H[0][0] * (H[1][1] * H[2][2] - H[1][2] * H[2][1])
+               - H[0][1] * (H[1][0] * H[2][2] - H[1][2] * H[2][0])
+               + H[0][2] * (H[1][0] * H[2][1] - H[1][1] * H[2][0]);
+    double scale = H[0][0] * H[1][1] * H[2][2];
+    if (scale <= 0 || det < 1e-6 * scale) return false;
+    double step[3];
+    for (int col = 0; col < 3; col++) {
+      double M[3][3];
+      for (int r = 0; r < 3; r++)
+        for (int q = 0; q < 3; q++) M[r][q] = q == col ? -g[r] : H[r][q];
+      step[col] = (M[0][0] * (M[1][1] * M[2][2] - M[1][2] * M[2][1])
+                 - M[0][1] * (M[1][0] * M[2][2] - M[1][2] * M[2][0])
+                 + M[0][2] * (M[1][0] * M[2][1] - M[1][1] * M[2][0])) / det;
+    }
+    p.px += step[0];
+    p.py += step[1];
+    p.pa = normalizeAngle(p.pa + step[2]);
+    if (fabs(step[0]) + fabs(step[1]) < 1e-4 && fabs(step[2]) < 1e-4) break;
+  }
+
+  // It should only have been tidying up the search's answer
+  if (hypot(p.px - pose.px, p.py - pose.py) > 2 * sm.resolution) return false;
+  pose = p;
+  return true;
+} // End of refineICP()
+
+/**
+ * composePose()
+ *
+ * Where b, given relative to a, is in the frame a is given in.
+ *
+ **/
+
+inline Pose2d composePose(Pose2d a, Pose2d b)
+{
+  Pose2d p;
+  double c = cos(a.pa), s = sin(a.pa);
+  p.px = a.px + c * b.px - s * b.py;
+  p.py = a.py + s * b.px + c * b.py;
+  p.pa = normalizeAngle(a.pa + b.pa);
+  return p;
+} // End of composePose()
+
+/**
+ * relativePose()
+ *
+ * Where b is relative to a. The opposite of composePose().
+ *
+ **/
+
+inline Pose2d relativePose(Pose2d a, Pose2d b)
+{
+  Pose2d p;
+  double c = cos(a.pa), s = sin(a.pa);
+  double dx = b.px - a.px, dy = b.py - a.py;
+  p.px =  c * dx + s * dy;
+  p.py = -s * dx + c * dy;
+  p.pa = normalizeAngle(b.pa - a.pa);
+  return p;
+} // End of relativePose()
+
+/**
+ * matchScan()
+ *
+ * Match the scan in a new frame against the reference scan, and move the
+ * corrected pose on to wherever that says we are. Returns true if the
+ * match was used, false if it fell back on the odometry. With a scan
+ * already made from the frame, its points are used.
+ *
+ * Every match is a little bit out, and the errors add up, so rather than
+ * match each scan against the one just before it we keep the same
+ * reference until the robot has gone far enough from it that the scans
+ * won't overlap well, and only then take a new one.
+ *
+ **/
+
+inline bool matchScan(ScanMatcher& sm, const SensorFrame& frame,
+                      const LaserScan* scan = NULL)
+{
+  if (scan != NULL) scanPoints(sm, *scan, sm.pts);
+  else scanPoints(sm, frame, sm.pts);
+  if (!sm.started) {
+    // The first frame is where the corrected odometry starts
+    sm.pose = sm.ref_pose = frame.odom;
+    sm.rel.px = sm.rel.py = sm.rel.pa = 0;
+    sm.delta = sm.rel;
+    sm.matched = false;
+    sm.started = true;
+  } else {
+    // Where the wheels say we are now relative to the reference, starting
+    // from where we last worked out we were
+    Pose2d guess = composePose(sm.rel, relativePose(sm.last_odom, frame.odom));
+    Pose2d found = guess;
+    sm.score = 0;
+    sm.matched = false;
+    if (sm.have_ref && (int)sm.pts.size() >= sm.min_points
+        && (int)sm.ref.size() >= sm.min_points) {
+      sm.score = correlativeSearch(sm, guess.px, guess.py, guess.pa, found);
+      if (sm.score >= sm.min_score) {
+        refineICP(sm, found);
+        sm.matched = true;
+      }
+    }
+    if (sm.matched) sm.matches++;
+    else sm.fallbacks++;
+
+    sm.delta = relativePose(sm.rel, found);
+    sm.rel = found;
+    sm.pose = composePose(sm.ref_pose, sm.rel);
+  }
+  sm.last_odom = frame.odom;
+
+  // Take a new reference once we've moved far enough from the old one, or
+  // if it no longer matches
+  if (!sm.have_ref || !sm.matched
+      || hypot(sm.rel.px, sm.rel.py) > sm.keyframe_dist
+      || fabs(sm.rel.pa) > sm.keyframe_angle) {
+    sm.ref.swap(sm.pts);
+    sm.ref_pose = sm.pose;
+    sm.rel.px = sm.rel.py = sm.rel.pa = 0;
+    sm.have_ref = sm.ref.size() > 0;
+    if (sm.have_ref) {
+      buildKdTree(sm.ref_tree, sm.ref);
+      buildMatchGrids(sm);
+    }
+  }
+  return sm.matched;
+} // End of matchScan()
+
+#endif
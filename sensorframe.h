@@ -0,0 +1,48 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Sensor frame
+ *
+ ** Description ***************************************************************
+ *
+ *  A SensorFrame is everything a controller reads from the robot in one go
+ *  round its loop. The frame is the same whether it comes from the Player
+ *  proxies, from a recording, or from the simulator in sim.h, which is
+ *  what lets the controllers run on any of them (see robotclient.h).
+ */
+
+#ifndef SENSORFRAME_H
+#define SENSORFRAME_H
+
+#include <stdint.h>
+#include <libplayerc++/playerc++.h>
+#include "gridmap.h"
+
+#define FRAME_MAX_BEAMS 1024
+#define FRAME_MAX_HYPS  16
+
+/**
+ * Times are in seconds. Live frames are stamped with clientNow(); frames
+ * from the simulator with simulated time.
+ *
+ **/
+
+struct SensorFrame
+{
+  uint64_t seq;                 // Counts reads; 0 means no data yet
+  double   stamp;               // When it was read
+  Pose2d   odom;
+  bool     bumper[2];
+  bool     stall;
+
+  // Laser, if there is one
+  int      ranges_count;
+  double   max_range, min_left, min_right;
+  double   ranges[FRAME_MAX_BEAMS];
+  double   bearings[FRAME_MAX_BEAMS];
+
+  // Localizer, if there is one. Entries past hyp_count are zeroed.
+  int      hyp_count;
+  player_localize_hypoth_t hyps[FRAME_MAX_HYPS];
+};
+
+#endif
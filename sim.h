@@ -0,0 +1,394 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Headless simulator
+ *
+ ** Description ***************************************************************
+ *
+ *  A stand-in for Stage, for running the controllers without Player, a GUI
+ *  or real time. It reads the parts of a world file that matter here (the
+ *  map bitmap and its size, interval_sim, and the robot's starting pose)
+ *  and simulates the robots in roomba.inc and sick.inc:
+ *
+ *    - "diff" drive: the commanded speed and turn rate are followed
+ *      exactly, as Stage does, and the robot stops dead (and reports a
+ *      stall) rather than move into a wall;
+ *    - the two bumpers, each a 0.33m segment at (0.12, +/-0.12) facing
+ *      +/-45 degrees, pressed when the segment touches an obstacle;
+ *    - the 361 beam, 180 degree, 8m laser, cast with raycast.h;
+ *    - a "fakelocalize" localizer (as in world41.cfg) that reports the
+ *      true pose as a single hypothesis.
+ *
+ *  The static part of a world (map, distances, laser geometry) is a
+ *  SimWorld, loaded once and shared by any number of Sims, each of which is
+ *  one robot in its own copy of the world. Noise on the laser and odometry
+ *  is off by default, as in Stage, and comes from the Sim's own generator,
+ *  so a run is repeatable given its seed.
+ *
+ *  A step of 100ms (interval_sim in world4.world) takes tens of
+ *  microseconds, most of it casting the laser.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "distmap.h"
+#include "gridmap.h"
+#include "laserkernel.h"
+#include "planner.h"
+#include "raycast.h"
+#include "sensorframe.h"
+
+// roomba.inc and sick.inc; the robot's radius is ROOMBA_RADIUS (planner.h)
+#define SIM_BUMPER_X     0.12
+#define SIM_BUMPER_Y     0.12
+#define SIM_BUMPER_A     (M_PI / 4)
+#define SIM_BUMPER_LEN   0.33
+
+/**
+ * The world, as far as the simulator is concerned.
+ *
+ **/
+
+struct SimWorld
+{
+  std::string bitmap;
+  double  size_x, size_y;       // Of the map, in metres
+  double  dt;                   // interval_sim, in seconds
+  Pose2d  start;                // Where the robot starts
+  GridMap map;
+  DistMap dist;                 // For collisions
+  RayCaster    caster;          // For the laser
+  ScanGeometry laser;
+};
+
+/**
+ * Noise to add, as standard deviations: metres of range per beam, and
+ * odometry error in proportion to how far the robot moves and turns.
+ *
+ **/
+
+struct SimNoise
+{
+  double range;
+  double odom_trans, odom_rot;
+};
+
+/**
+ * One simulated robot.
+ *
+ **/
+
+struct Sim
+{
+  const SimWorld* world;
+  Pose2d   pose;                // Where it really is
+  Pose2d   odom;                // Where its odometry says it is
+  double   speed, turnrate;     // What it was last told to do
+  bool     bumper[2], stall;
+  double   time;                // Simulated seconds
+  uint64_t steps;
+  bool     laser, localize;     // Which devices it has
+  SimNoise noise;
+  std::mt19937 rng;
+  std::vector<float> scan;      // Scratch for the laser
+};
+
+/**
+ * readWorldTokens()
+ *
+ * Split a world file into words, quoted strings and brackets, dropping
+ * comments.
+ *
+ **/
+
+inline bool readWorldTokens(const char* path, std::vector<std::string>& tokens)
+{
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) return false;
+
+  std::string tok;
+  int c;
+  bool quoted = false, comment = false;
+  while ((c = fgetc(fp)) != EOF) {
+    if (comment) {
+      if (c == '\n') comment = false;
+      continue;
+    }
+    if (quoted) {
+      if (c == '"') {
+        tokens.push_back(tok);
+        tok.clear();
+        quoted = false;
+      } else {
+        tok += (char)c;
+      }
+      continue;
+    }
+    if (c == '#' || c == '"' || isspace(c) || strchr("()[]", c) != NULL) {
+      if (!tok.empty()) tokens.push_back(tok);
+      tok.clear();
+      if (c == '#') comment = true;
+      if (c == '"') quoted = true;
+      if (c != '#' && c != '"' && !isspace(c))
+        tokens.push_back(std::string(1, c));
+      continue;
+    }
+    tok += (char)c;
+  }
+  if (!tok.empty()) tokens.push_back(tok);
+  fclose(fp);
+  return true;
+} // End of readWorldTokens()
+
+/**
+ * loadSimWorld()
+ *
+ * Read a world file like world4.world. The bitmap is found relative to
+ * the world file. Returns false, after saying why, if it can't be loaded.
+ *
+ **/
+
+inline bool loadSimWorld(SimWorld& world, const char* path)
+{
+  std::vector<std::string> t;
+  std::vector<std::string> blocks;   // Names of the blocks we are inside
+  bool have_pose = false;
+
+  if (!readWorldTokens(path, t)) {
+    std::cerr << "Can't read world file " << path << std::endl;
+    return false;
+  }
+
+  world.size_x = world.size_y = 16;
+  world.dt = 0.1;
+  world.start.px = world.start.py = world.start.pa = 0;
+  world.bitmap.clear();
+
+  for (size_t i = 0; i < t.size(); i++) {
+    std::string block = blocks.empty() ? "" : blocks.back();
+    if (t[i] == "(" ) {
+      blocks.push_back(i > 0 ? t[i - 1] : "");
+    } else if (t[i] == ")") {
+      if (!blocks.empty()) blocks.pop_back();
+    } else if (t[i] == "interval_sim" && i + 1 < t.size() && blocks.empty()) {
+      world.dt = atof(t[i + 1].c_str()) / 1000;
+    } else if (t[i] == "bitmap" && i + 1 < t.size() && block == "map") {
+      world.bitmap = t[i + 1];
+    } else if (t[i] == "size" && i + 3 < t.size() && t[i + 1] == "["
+               && block == "map") {
+      world.size_x = atof(t[i + 2].c_str());
+      world.size_y = atof(t[i + 3].c_str());
+    } else if (t[i] == "pose" && i + 4 < t.size() && t[i + 1] == "["
+               && !have_pose && block != "map" && block != "window") {
+      // The first thing with a pose is the robot
+      world.start.px = atof(t[i + 2].c_str());
+      world.start.py = atof(t[i + 3].c_str());
+      world.start.pa = atof(t[i + 4].c_str()) * M_PI / 180;
+      have_pose = true;
+    }
+  }
+  if (world.bitmap.empty()) {
+    std::cerr << path << " has no map bitmap" << std::endl;
+    return false;
+  }
+
+  // The bitmap is relative to the world file
+  const char* slash = strrchr(path, '/');
+  if (slash != NULL && world.bitmap[0] != '/')
+    world.bitmap = std::string(path, slash + 1 - path) + world.bitmap;
+
+  if (!loadGridMap(world.map, world.bitmap.c_str(), world.size_x,
+                   world.size_y)) return false;
+  if (!loadDistMap(world.dist, world.bitmap.c_str(), world.size_x,
+                   world.size_y, &world.map)) return false;
+  initRayCaster(world.caster, world.map);
+  initSickGeometry(world.laser);
+  return true;
+} // End of loadSimWorld()
+
+/**
+ * initSim()
+ *
+ * Put a robot at the world's starting pose, with no noise and the devices
+ * of world41.cfg/world42.cfg: laser on, localize (fakelocalize) on.
+ *
+ **/
+
+inline void initSim(Sim& sim, const SimWorld& world, unsigned seed = 1)
+{
+  sim.world = &world;
+  sim.pose  = world.start;
+  sim.odom  = world.start;
+  sim.speed = sim.turnrate = 0;
+  sim.bumper[0] = sim.bumper[1] = sim.stall = false;
+  sim.time  = 0;
+  sim.steps = 0;
+  sim.laser = true;
+  sim.localize = true;
+  memset(&sim.noise, 0, sizeof(sim.noise));
+  sim.rng.seed(seed);
+  sim.scan.resize(world.laser.count);
+} // End of initSim()
+
+/**
+ * simCollides()
+ *
+ * Would the robot's body hit something at (x, y)?
+ *
+ **/
+
+inline bool simCollides(const SimWorld& world, double x, double y)
+{
+  return distAt(world.dist, x, y) < ROOMBA_RADIUS;
+} // End of simCollides()
+
+/**
+ * simBumper()
+ *
+ * Is bumper i (0 left, 1 right) touching anything?
+ *
+ **/
+
+inline bool simBumper(const SimWorld& world, Pose2d pose, int i)
+{
+  double side = (i == 0) ? 1 : -1;
+  double c = cos(pose.pa), s = sin(pose.pa);
+  double bx = SIM_BUMPER_X, by = side * SIM_BUMPER_Y;
+  double ba = side * SIM_BUMPER_A;
+
+  // The segment is centred on the bumper and square to the way it faces
+  double ux = -sin(ba), uy = cos(ba);
+  int n = (int)ceil(SIM_BUMPER_LEN / (world.map.scale / 2));
+  for (int k = 0; k <= n; k++) {
+    double t = SIM_BUMPER_LEN * ((double)k / n - 0.5);
+    double rx = bx + t * ux, ry = by + t * uy;
+    if (pointOccupied(world.map, pose.px + c * rx - s * ry,
+                      pose.py + s * rx + c * ry)) return true;
+  }
+  return false;
+} // End of simBumper()
+
+/**
+ * simStep()
+ *
+ * Move the robot on by one interval. The move is done in steps of no more
+ * than a map cell, so the robot can't jump through a thin wall, and stops
+ * at the last free one if it would hit something.
+ *
+ **/
+
+inline void simStep(Sim& sim)
+{
+  const SimWorld& world = *sim.world;
+  double dt = world.dt;
+  double dist = fabs(sim.speed) * dt;
+  int n = (int)ceil(dist / world.map.scale);
+  if (n < 1) n = 1;
+  double h = dt / n;
+  std::normal_distribution<double> gauss(0, 1);
+
+  sim.stall = false;
+  for (int k = 0; k < n; k++) {
+    double v = sim.speed, w = sim.turnrate;
+    double a = sim.pose.pa;
+    double nx, ny;
+    // Follow the arc exactly; it's a straight line if we aren't turning
+    if (fabs(w) > 1e-9) {
+      nx = sim.pose.px + v / w * (sin(a + w * h) - sin(a));
+      ny = sim.pose.py - v / w * (cos(a + w * h) - cos(a));
+    } else {
+      nx = sim.pose.px + v * h * cos(a);
+      ny = sim.pose.py + v * h * sin(a);
+    }
+    if (simCollides(world, nx, ny)
+        && distAt(world.dist, nx, ny) < distAt(world.dist, sim.pose.px,
+                                               sim.pose.py)) {
+      sim.stall = true;
+      break;
+    }
+
+    // The odometry sees the same move, give or take some noise
+    double trans = hypot(nx - sim.pose.px, ny - sim.pose.py);
+    double rot = w * h;
+    if (sim.noise.odom_trans > 0 || sim.noise.odom_rot > 0) {
+      trans += gauss(sim.rng) * sim.noise.odom_trans * trans;
+      rot   += gauss(sim.rng) * sim.noise.odom_rot * fabs(rot)
+             + gauss(sim.rng) * sim.noise.odom_rot * trans;
+    }
+    double heading = sim.odom.pa + rot / 2;
+    sim.odom.px += trans * cos(heading) * (v < 0 ? -1 : 1);
+    sim.odom.py += trans * sin(heading) * (v < 0 ? -1 : 1);
+    sim.odom.pa = normalizeAngle(sim.odom.pa + rot);
+
+    sim.pose.px = nx;
+    sim.pose.py = ny;
+    sim.pose.pa = normalizeAngle(a + w * h);
+  }
+
+  sim.bumper[0] = simBumper(world, sim.pose, 0);
+  sim.bumper[1] = simBumper(world, sim.pose, 1);
+  sim.time += dt;
+  sim.steps++;
+} // End of simStep()
+
+/**
+ * simSense()
+ *
+ * What the robot's devices would report now.
+ *
+ **/
+
+inline void simSense(Sim& sim, SensorFrame& f)
+{
+  const SimWorld& world = *sim.world;
+
+  f.seq   = sim.steps + 1;
+  f.stamp = sim.time;
+  f.odom  = sim.odom;
+  f.bumper[0] = sim.bumper[0];
+  f.bumper[1] = sim.bumper[1];
+  f.stall = sim.stall;
+
+  f.ranges_count = 0;
+  f.max_range = f.min_left = f.min_right = 0;
+  if (sim.laser) {
+    const ScanGeometry& geom = world.laser;
+    int n = geom.count < FRAME_MAX_BEAMS ? geom.count : FRAME_MAX_BEAMS;
+    std::normal_distribution<double> gauss(0, 1);
+
+    castScan(world.caster, geom, sim.pose, &sim.scan[0]);
+    f.max_range = geom.max_range;
+    for (int i = 0; i < n; i++) {
+      double r = sim.scan[i];
+      if (sim.noise.range > 0) r += gauss(sim.rng) * sim.noise.range;
+      if (r < 0) r = 0;
+      if (r > geom.max_range) r = geom.max_range;
+      f.ranges[i]   = r;
+      f.bearings[i] = geom.bearing[i];
+    }
+    f.ranges_count = n;
+    beamSides(f.ranges, f.bearings, n, f.max_range, &f.min_left,
+              &f.min_right);
+  }
+
+  f.hyp_count = 0;
+  memset(f.hyps, 0, sizeof(f.hyps));
+  if (sim.localize) {
+    f.hyps[0].mean.px = sim.pose.px;
+    f.hyps[0].mean.py = sim.pose.py;
+    f.hyps[0].mean.pa = sim.pose.pa;
+    f.hyps[0].alpha = 1;
+    f.hyp_count = 1;
+  }
+} // End of simSense()
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Telemetry decoder
+ *
+ ** Description ***************************************************************
+ *
+ *  Turns a binary telemetry log (see telemetry.h) back into something
+ *  readable:
+ *
+ *    ./telemetry-decode [-text] telemetry.tlog > run.csv
+ *
+ *  By default it writes CSV with a header line, one row per tick, for
+ *  loading into a spreadsheet or plotting. With -text it writes each tick
+ *  the way real-local used to print them.
+ */
+
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include "telemetry.h"
+
+/**
+ * Function headers
+ *
+ **/
+
+void printCsvHeader();
+void printCsv(const TelemetryRecord& r);
+void printText(const TelemetryRecord& r);
+
+/**
+ * main()
+ *
+ **/
+
+int main(int argc, char *argv[])
+{
+  bool text = false;
+  const char* path = NULL;
+  TelemetryHeader header;
+  TelemetryRecord rec;
+  long count = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-text") == 0) text = true;
+    else path = argv[i];
+  }
+  if (path == NULL) {
+    std::cerr << "Usage: " << argv[0] << " [-text] log.tlog" << std::endl;
+    return 1;
+  }
+
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    std::cerr << "Can't open " << path << std::endl;
+    return 1;
+  }
+  if (!readTelemetryHeader(fp, header)) {
+    std::cerr << path << " isn't a version " << TELEMETRY_VERSION
+              << " telemetry log" << std::endl;
+    fclose(fp);
+    return 1;
+  }
+
+  if (!text) printCsvHeader();
+  while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+    if (text) printText(rec);
+    else printCsv(rec);
+    count++;
+  }
+  fclose(fp);
+
+  std::cerr << path << ": " << count << " ticks from " << header.program
+            << std::endl;
+  return 0;
+} // end of main()
+
+/**
+ * printCsvHeader()
+ *
+ **/
+
+void printCsvHeader()
+{
+  printf("tick,frame,time,tick_period,data_age,loop_time,"
+         "odom_x,odom_y,odom_a,pose_x,pose_y,pose_a,targ_x,targ_y,"
+         "speed,turnrate,min_left,min_right,min_range,ranges,"
+         "bump_left,bump_right,stall,hyp_count,state");
+  for (int i = 0; i < TELEMETRY_HYPS; i++)
+    printf(",h%d_x,h%d_y,h%d_a,h%d_alpha", i, i, i, i);
+  printf("\n");
+} // End of printCsvHeader()
+
+/**
+ * printCsv()
+ *
+ **/
+
+void printCsv(const TelemetryRecord& r)
+{
+  printf("%llu,%llu,%.6f,%.6f,%.6f,%.6f,",
+         (unsigned long long)r.tick, (unsigned long long)r.frame, r.time,
+         r.tick_period, r.data_age, r.loop_time);
+  printf("%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%d,%d,%d,%d,%d,%d",
+         r.odom_x, r.odom_y, r.odom_a, r.pose_x, r.pose_y, r.pose_a,
+         r.targ_x, r.targ_y, r.speed, r.turnrate,
+         r.min_left, r.min_right, r.min_range, r.ranges_count,
+         (r.flags & TELEMETRY_BUMP_LEFT) != 0,
+         (r.flags & TELEMETRY_BUMP_RIGHT) != 0,
+         (r.flags & TELEMETRY_STALL) != 0, r.hyp_count, r.state);
+  for (int i = 0; i < TELEMETRY_HYPS; i++) {
+    printf(",%g,%g,%g,%g", r.hyps[i].x, r.hyps[i].y, r.hyps[i].a,
+           r.hyps[i].alpha);
+  }
+  printf("\n");
+} // End of printCsv()
+
+/**
+ * printText()
+ *
+ **/
+
+void printText(const TelemetryRecord& r)
+{
+  int shown = r.hyp_count < TELEMETRY_HYPS ? r.hyp_count : TELEMETRY_HYPS;
+
+  printf("Tick %llu at %.3fs (period %.1fms, data %.1fms old)\n",
+         (unsigned long long)r.tick, r.time, r.tick_period * 1000,
+         r.data_age * 1000);
+  printf("Left  bumper: %d\n", (r.flags & TELEMETRY_BUMP_LEFT) != 0);
+  printf("Right bumper: %d\n", (r.flags & TELEMETRY_BUMP_RIGHT) != 0);
+  printf("We are at\nX: %g\nY: %g\nA: %g\n", r.pose_x, r.pose_y, r.pose_a);
+  if (r.ranges_count > 0) {
+    printf("Closest thing on left: %g\n", r.min_left);
+    printf("Closest thing on right: %g\n", r.min_right);
+  }
+  printf("%d possible locations:\n", r.hyp_count);
+  for (int i = 0; i < shown; i++) {
+    printf("X: %g\tY: %g\tA: %g\tW: %g\n", r.hyps[i].x, r.hyps[i].y,
+           r.hyps[i].a, r.hyps[i].alpha);
+  }
+  printf("Speed: %g\nTurn rate: %g\nCounter: %d\n\n", r.speed, r.turnrate,
+         r.state);
+} // End of printText()
@@ -0,0 +1,295 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Telemetry log
+ *
+ ** Description ***************************************************************
+ *
+ *  A binary log with one fixed size record per control tick, in place of
+ *  printing everything to the terminal and log.txt with std::endl (which
+ *  flushes on every line and was slowing the loop down).
+ *
+ *  logTelemetry() just copies the record into a single-producer,
+ *  single-consumer ring buffer. A background thread drains the ring to the
+ *  file in large blocks. If the writer ever falls so far behind that the
+ *  ring is full, records are dropped and counted rather than making the
+ *  control loop wait.
+ *
+ *  A file is a TelemetryHeader followed by TelemetryRecords, in the byte
+ *  order of the machine that wrote it. telemetry-decode turns one into CSV
+ *  or text.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_HYPS    4      // How many hypotheses each record keeps
+#define TELEMETRY_RING    4096   // Records the ring holds; a power of 2
+#define TELEMETRY_BATCH   256    // Records the writer writes at a time
+
+// Bits in TelemetryRecord::flags
+#define TELEMETRY_BUMP_LEFT  1
+#define TELEMETRY_BUMP_RIGHT 2
+#define TELEMETRY_STALL      4
+
+/**
+ * The start of every telemetry file.
+ *
+ **/
+
+struct TelemetryHeader
+{
+  char     magic[4];        // "TLOG"
+  uint32_t version;
+  uint32_t record_size;     // sizeof(TelemetryRecord), as a sanity check
+  uint32_t hyps;            // TELEMETRY_HYPS
+  double   start;           // clientNow() when the log was opened
+  char     program[40];     // Which controller wrote it
+};
+
+static_assert(sizeof(TelemetryHeader) == 64,
+              "TelemetryHeader must be 64 bytes");
+
+struct TelemetryHypoth
+{
+  float x, y, a, alpha;
+};
+
+/**
+ * One tick. Times are in seconds; "time" is since the log was opened.
+ * Fields a controller doesn't have (the target, in real-local) are 0.
+ *
+ **/
+
+struct TelemetryRecord
+{
+  uint64_t tick;
+  uint64_t frame;           // SensorFrame::seq the tick acted on
+  double   time;
+  float    tick_period;     // Since the previous tick
+  float    data_age;        // How old the sensor data was
+  float    loop_time;       // Spent working out what to do
+
+  float    odom_x, odom_y, odom_a;
+  float    pose_x, pose_y, pose_a;      // Where the controller thinks it is
+  float    targ_x, targ_y;              // Where it is heading
+  float    speed, turnrate;             // What it told the robot
+
+  float    min_left, min_right;         // Laser summary
+  float    min_range;
+  uint16_t ranges_count;
+  uint8_t  flags;                       // TELEMETRY_BUMP_* and _STALL
+  uint8_t  hyp_count;                   // Hypotheses the localizer had
+  int32_t  state;                       // Controller specific
+  TelemetryHypoth hyps[TELEMETRY_HYPS]; // The first few of them
+};
+
+static_assert(sizeof(TelemetryRecord) % 8 == 0,
+              "TelemetryRecord must pack without padding between records");
+
+/**
+ * A single-producer, single-consumer queue. head is only written by the
+ * producer and tail only by the consumer, and they live on separate cache
+ * lines so the two threads don't fight over one.
+ *
+ **/
+
+template <class T>
+struct SpscRing
+{
+  alignas(64) std::atomic<uint64_t> head;   // Next slot to write
+  alignas(64) std::atomic<uint64_t> tail;   // Next slot to read
+  alignas(64) std::vector<T> items;
+  uint64_t mask;
+};
+
+template <class T>
+void initRing(SpscRing<T>& ring, int size)
+{
+  ring.items.resize(size);
+  ring.mask = size - 1;
+  ring.head.store(0);
+  ring.tail.store(0);
+} // End of initRing()
+
+/**
+ * ringPush()
+ *
+ * Returns false, without waiting, if the ring is full.
+ *
+ **/
+
+template <class T>
+bool ringPush(SpscRing<T>& ring, const T& item)
+{
+  uint64_t h = ring.head.load(std::memory_order_relaxed);
+  if (h - ring.tail.load(std::memory_order_acquire) > ring.mask) return false;
+  ring.items[h & ring.mask] = item;
+  ring.head.store(h + 1, std::memory_order_release);
+  return true;
+} // End of ringPush()
+
+/**
+ * ringPop()
+ *
+ * Take up to "max" items off the ring into "out". Returns how many.
+ *
+ **/
+
+template <class T>
+int ringPop(SpscRing<T>& ring, T* out, int max)
+{
+  uint64_t t = ring.tail.load(std::memory_order_relaxed);
+  uint64_t h = ring.head.load(std::memory_order_acquire);
+  int n = h - t < (uint64_t)max ? (int)(h - t) : max;
+
+  for (int i = 0; i < n; i++) out[i] = ring.items[(t + i) & ring.mask];
+  ring.tail.store(t + n, std::memory_order_release);
+  return n;
+} // End of ringPop()
+
+/**
+ * An open log.
+ *
+ **/
+
+struct Telemetry
+{
+  FILE*  fp;                  // NULL if logging is off
+  double start;
+  uint64_t written, dropped;
+  SpscRing<TelemetryRecord> ring;
+  std::atomic<bool> running;
+  std::thread       writer;
+};
+
+inline double telemetryNow()
+{
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * telemetryWriter()
+ *
+ * The background thread: write whatever is in the ring, nap when there
+ * is nothing, and empty the ring before stopping.
+ *
+ **/
+
+inline void telemetryWriter(Telemetry* tm)
+{
+  std::vector<TelemetryRecord> batch(TELEMETRY_BATCH);
+
+  while (true) {
+    bool stopping = !tm->running.load(std::memory_order_acquire);
+    int n = ringPop(tm->ring, &batch[0], TELEMETRY_BATCH);
+    if (n > 0) {
+      fwrite(&batch[0], sizeof(TelemetryRecord), n, tm->fp);
+      tm->written += n;
+    } else if (stopping) {
+      break;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+} // End of telemetryWriter()
+
+/**
+ * openTelemetry()
+ *
+ * Start logging to "path". If it can't be opened we say so and carry on
+ * without a log; logTelemetry() then does nothing.
+ *
+ **/
+
+inline bool openTelemetry(Telemetry& tm, const char* path,
+                          const char* program)
+{
+  TelemetryHeader header;
+
+  tm.written = tm.dropped = 0;
+  tm.start = telemetryNow();
+  tm.fp = fopen(path, "wb");
+  if (tm.fp == NULL) {
+    fprintf(stderr, "Can't open telemetry log %s\n", path);
+    return false;
+  }
+  // The writer does its own batching, so give stdio a big buffer too
+  setvbuf(tm.fp, NULL, _IOFBF, 1 << 16);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "TLOG", 4);
+  header.version     = TELEMETRY_VERSION;
+  header.record_size = sizeof(TelemetryRecord);
+  header.hyps        = TELEMETRY_HYPS;
+  header.start       = tm.start;
+  strncpy(header.program, program, sizeof(header.program) - 1);
+  fwrite(&header, sizeof(header), 1, tm.fp);
+
+  initRing(tm.ring, TELEMETRY_RING);
+  tm.running.store(true);
+  tm.writer = std::thread(telemetryWriter, &tm);
+  return true;
+} // End of openTelemetry()
+
+/**
+ * logTelemetry()
+ *
+ * Queue a record. Fills in the time; everything else is up to the caller.
+ *
+ **/
+
+inline void logTelemetry(Telemetry& tm, TelemetryRecord& rec)
+{
+  if (tm.fp == NULL) return;
+  rec.time = telemetryNow() - tm.start;
+  if (!ringPush(tm.ring, rec)) tm.dropped++;
+} // End of logTelemetry()
+
+/**
+ * closeTelemetry()
+ *
+ * Write out what's left and close the file.
+ *
+ **/
+
+inline void closeTelemetry(Telemetry& tm)
+{
+  if (tm.fp == NULL) return;
+  tm.running.store(false, std::memory_order_release);
+  tm.writer.join();
+  fclose(tm.fp);
+  tm.fp = NULL;
+  if (tm.dropped > 0) {
+    fprintf(stderr, "Telemetry: dropped %llu of %llu records\n",
+            (unsigned long long)tm.dropped,
+            (unsigned long long)(tm.written + tm.dropped));
+  }
+} // End of closeTelemetry()
+
+/**
+ * readTelemetryHeader()
+ *
+ * Check a log is one we can read. Used by telemetry-decode.
+ *
+ **/
+
+inline bool readTelemetryHeader(FILE* fp, TelemetryHeader& header)
+{
+  if (fread(&header, sizeof(header), 1, fp) != 1) return false;
+  return memcmp(header.magic, "TLOG", 4) == 0
+    && header.version == TELEMETRY_VERSION
+    && header.record_size == sizeof(TelemetryRecord)
+    && header.hyps == TELEMETRY_HYPS;
+} // End of readTelemetryHeader()
+
+#endif
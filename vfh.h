@@ -0,0 +1,301 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Vector field histogram
+ *
+ ** Description ***************************************************************
+ *
+ *  Steers round whatever the laser sees, towards a heading we'd like to
+ *  go in, with a speed and turn rate that change smoothly rather than
+ *  snapping between a few settings (VFH+, Ulrich and Borenstein).
+ *
+ *  Each tick every beam that ends close enough to matter goes into a polar
+ *  histogram of 5 degree sectors round the robot. A beam counts for more
+ *  the closer it ends, and is widened by the angle the robot's radius
+ *  (and a margin) takes up at that range, so that a gap the robot doesn't
+ *  fit through closes up. Each sector keeps the worst beam in it, rather
+ *  than adding them up, so it doesn't matter how many beams there are: the
+ *  raw scan and the points a LaserScan (scan.h) keeps give the same
+ *  histogram. That is smoothed over a few sectors either side, and then
+ *  each sector is blocked or free, with some hysteresis so that the gaps
+ *  don't flicker open and shut from one tick to the next.
+ *
+ *  The runs of free sectors are the valleys the robot could go down. A
+ *  narrow one is aimed down the middle; a wide one at the wanted heading
+ *  if that's in it, or else a little way in from whichever edge is
+ *  nearer. Of those, the one closest to the wanted heading, to straight
+ *  on and to the way we went last time wins. The turn rate is in
+ *  proportion to how far off that is, and the speed comes down the closer
+ *  things are ahead and the harder we're turning.
+ *
+ *  The laser only sees the front half of the robot, so only those sectors
+ *  are candidates. With nowhere to go it stops and turns on the spot, away
+ *  from the side with more in the way, and vfhStep() says so.
+ *
+ *  Working out each beam's weight and the sectors it covers is plain
+ *  arithmetic over arrays of floats, one beam at a time, with no branches;
+ *  only putting them into the sectors is done one by one. g++ vectorizes
+ *  it at -O3 with -fno-math-errno (for the square root), but not with the
+ *  -O2 the build script uses.
+ */
+
+#ifndef VFH_H
+#define VFH_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "planner.h"
+#include "scan.h"
+#include "sensorframe.h"
+
+#define VFH_SECTORS 72         // 5 degrees each, straight ahead in sector 0
+
+/**
+ * Settings, the histogram, and what was chosen last time.
+ *
+ **/
+
+struct Vfh
+{
+  double window;                // Beams further than this don't count
+  double radius;                // Of the robot, and a margin round it
+  int    smooth;                // Sectors either side to smooth over
+  double block, clear;          // Closer than block, a sector is blocked;
+                                // further than clear, free again
+  int    wide;                  // Sectors in a valley that is wide
+  double w_target, w_ahead, w_last;  // Weights for choosing a direction
+  double max_speed, min_speed, max_turnrate;
+  double turn_gain;             // Turn rate per radian off
+
+  std::vector<float> mag, lo, hi;    // Scratch: each beam's weight and span
+  float  raw[VFH_SECTORS];      // Worst beam in each sector
+  float  density[VFH_SECTORS];  // ...smoothed
+  bool   blocked[VFH_SECTORS];
+  double last;                  // Way we went last time, in the odometry
+  bool   have_last;
+
+  // From the last tick
+  double chosen;                // Relative to the robot, radians
+  int    valleys;
+  bool   stuck;                 // Nowhere to go: turned on the spot
+};
+
+/**
+ * initVfh()
+ *
+ **/
+
+inline void initVfh(Vfh& vfh)
+{
+  vfh.window = 2.0;
+  vfh.radius = ROOMBA_RADIUS + 0.1;
+  vfh.smooth = 2;
+  vfh.block = 0.6;
+  vfh.clear = 0.8;
+  vfh.wide = 16;
+  vfh.w_target = 5.0;
+  vfh.w_ahead = 2.0;
+  vfh.w_last = 2.0;
+  vfh.max_speed = 1.0;
+  vfh.min_speed = 0.1;
+  vfh.max_turnrate = 1.0;
+  vfh.turn_gain = 1.5;
+  std::fill(vfh.raw, vfh.raw + VFH_SECTORS, 0.0f);
+  std::fill(vfh.density, vfh.density + VFH_SECTORS, 0.0f);
+  std::fill(vfh.blocked, vfh.blocked + VFH_SECTORS, false);
+  vfh.last = 0;
+  vfh.have_last = false;
+  vfh.chosen = 0;
+  vfh.valleys = 0;
+  vfh.stuck = false;
+} // End of initVfh()
+
+/**
+ * vfhWeight()
+ *
+ * How much an obstacle d metres away counts: 1 right up against the
+ * robot, falling to 0 at the edge of the window.
+ *
+ **/
+
+inline double vfhWeight(const Vfh& vfh, double d)
+{
+  double f = std::min(1.0, d / vfh.window);
+  return 1 - f * f;
+} // End of vfhWeight()
+
+/**
+ * angleOff()
+ *
+ * How far apart two headings are, 0 to pi.
+ *
+ **/
+
+inline double angleOff(double a, double b)
+{
+  return fabs(atan2(sin(a - b), cos(a - b)));
+} // End of angleOff()
+
+/**
+ * asinApprox()
+ *
+ * asin(x) for x from 0 to 1, to within 0.0001 (Abramowitz and Stegun
+ * 4.4.45), in arithmetic and a square root, which vectorize where asinf()
+ * doesn't.
+ *
+ **/
+
+inline float asinApprox(float x)
+{
+  float p = 1.5707288f + x * (-0.2121144f + x * (0.0742610f - 0.0187293f * x));
+  return 1.5707963f - sqrtf(1 - x) * p;
+} // End of asinApprox()
+
+/**
+ * vfhHistogram()
+ *
+ * Fill the histogram from n beams, range and bearing, and decide which
+ * sectors are blocked.
+ *
+ **/
+
+inline void vfhHistogram(Vfh& vfh, const double* range, const double* bearing,
+                         int n)
+{
+  const float per = VFH_SECTORS / (2 * M_PI);
+  const float window = vfh.window, radius = vfh.radius;
+
+  // Each beam's weight, and the sectors (in fractional sector units, not
+  // yet wrapped) its obstacle covers once it's been widened
+  vfh.mag.resize(n);
+  vfh.lo.resize(n);
+  vfh.hi.resize(n);
+  float* mag = &vfh.mag[0];
+  float* lo = &vfh.lo[0];
+  float* hi = &vfh.hi[0];
+  // Written with selects rather than std::min() and std::max(), and
+  // dividing either way, so there are no branches in it.
+  for (int i = 0; i < n; i++) {
+    float r = range[i];
+    float d = r < 0.02f ? window : r;        // No reading: nothing there
+    float f = d / (d > window ? d : window);
+    float widen = asinApprox(radius / (d > radius ? d : radius));
+    float b = bearing[i] * per;
+    mag[i] = 1 - f * f;
+    lo[i] = b - widen * per;
+    hi[i] = b + widen * per;
+  }
+
+  std::fill(vfh.raw, vfh.raw + VFH_SECTORS, 0.0f);
+  for (int i = 0; i < n; i++) {
+    if (mag[i] <= 0) continue;
+    int k0 = (int)floorf(lo[i] + 0.5f), k1 = (int)floorf(hi[i] + 0.5f);
+    for (int k = k0; k <= k1; k++) {
+      float& s = vfh.raw[((k % VFH_SECTORS) + VFH_SECTORS) % VFH_SECTORS];
+      s = std::max(s, mag[i]);
+    }
+  }
+
+  // Smooth, nearer sectors counting for more
+  int l = vfh.smooth;
+  for (int k = 0; k < VFH_SECTORS; k++) {
+    float sum = 0;
+    for (int j = -l; j <= l; j++)
+      sum += (l + 1 - abs(j))
+             * vfh.raw[(k + j + VFH_SECTORS) % VFH_SECTORS];
+    vfh.density[k] = sum / ((l + 1) * (l + 1));
+  }
+
+  double high = vfhWeight(vfh, vfh.block), low = vfhWeight(vfh, vfh.clear);
+  for (int k = 0; k < VFH_SECTORS; k++) {
+    if (vfh.density[k] > high) vfh.blocked[k] = true;
+    else if (vfh.density[k] < low) vfh.blocked[k] = false;
+  }
+} // End of vfhHistogram()
+
+/**
+ * vfhStep()
+ *
+ * One tick: the speed and turn rate to get past whatever the laser sees,
+ * heading for "target" radians from straight ahead. Returns false if
+ * there's nowhere to go and it is turning on the spot instead. The beams
+ * come from the scan, if there is one, made from the frame.
+ *
+ **/
+
+inline bool vfhStep(Vfh& vfh, const SensorFrame& frame, double target,
+                    double* speed, double* turnrate,
+                    const LaserScan* scan = NULL)
+{
+  if (scan != NULL) vfhHistogram(vfh, scan->range, scan->bearing, scan->count);
+  else vfhHistogram(vfh, frame.ranges, frame.bearings, frame.ranges_count);
+
+  // The way we went last time, from where we're facing now
+  double last = vfh.have_last ? vfh.last - frame.odom.pa : 0;
+
+  // The sectors the laser can see, front half, right to left
+  const int half = VFH_SECTORS / 4;
+  double best = 1e9, best_cost = 1e9;
+  vfh.valleys = 0;
+  for (int k = -half; k <= half; ) {
+    if (vfh.blocked[(k + VFH_SECTORS) % VFH_SECTORS]) {
+      k++;
+      continue;
+    }
+    int first = k;
+    while (k <= half && !vfh.blocked[(k + VFH_SECTORS) % VFH_SECTORS]) k++;
+    int last_k = k - 1;
+    vfh.valleys++;
+
+    // Where to aim in this valley
+    double cand[3];
+    int nc = 0;
+    double right = first * (2 * M_PI / VFH_SECTORS);
+    double left = last_k * (2 * M_PI / VFH_SECTORS);
+    if (last_k - first + 1 < vfh.wide) {
+      cand[nc++] = (left + right) / 2;
+    } else {
+      double in = vfh.wide / 2 * (2 * M_PI / VFH_SECTORS);
+      cand[nc++] = right + in;
+      cand[nc++] = left - in;
+      if (target > right + in && target < left - in) cand[nc++] = target;
+    }
+    for (int c = 0; c < nc; c++) {
+      double cost = vfh.w_target * angleOff(cand[c], target)
+                    + vfh.w_ahead * fabs(cand[c])
+                    + vfh.w_last * angleOff(cand[c], last);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best = cand[c];
+      }
+    }
+  }
+
+  if (vfh.valleys == 0) {
+    // Turn away from the side with more in the way
+    double l = 0, r = 0;
+    for (int k = 1; k <= half; k++) {
+      l += vfh.density[k];
+      r += vfh.density[VFH_SECTORS - k];
+    }
+    vfh.stuck = true;
+    vfh.chosen = l > r ? -M_PI / 2 : M_PI / 2;
+    *speed = 0;
+    *turnrate = l > r ? -vfh.max_turnrate : vfh.max_turnrate;
+  } else {
+    vfh.stuck = false;
+    vfh.chosen = best;
+    // Slow down for what's ahead, and for turning hard. If straight on is
+    // blocked, turn into the valley before going anywhere.
+    double ahead = vfh.density[0];
+    double v = vfh.max_speed * (1 - ahead) * std::max(0.0, cos(best));
+    *speed = vfh.blocked[0] ? 0 : std::max(vfh.min_speed, v);
+    *turnrate = std::max(-vfh.max_turnrate,
+                         std::min(vfh.max_turnrate, vfh.turn_gain * best));
+  }
+  vfh.last = frame.odom.pa + vfh.chosen;
+  vfh.have_last = true;
+  return !vfh.stuck;
+} // End of vfhStep()
+
+#endif
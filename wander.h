@@ -0,0 +1,383 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Wander and localize
+ *
+ ** Description ***************************************************************
+ *
+ *  The decision making of real-local, taken out of its main() so that
+ *  other programs (the Monte Carlo runner, say) can run it against any
+ *  number of robots. Each call to wanderTick() is one time round the old
+ *  control loop.
+ *
+ *  The robot wanders, steering away from whichever side the laser says is
+ *  closer and backing off when it bumps into something, while it works
+ *  out where it is. Once the localizer is down to two hypotheses or fewer
+ *  it looks at the best one, and stops if that is more than 99% certain.
+ *
+ *  The localizer is either amcl, whose hypotheses come in the frame, or our
+ *  own filter in mcl.h, which is fed every new frame. Either way its
+ *  hypotheses are read once a tick into the tracker in hyptrack.h, which
+ *  knows the best of them and notices when we seem to have been kidnapped.
+ *
+ *  With a LaserScan (scan.h) set, each new scan is cleaned up and thinned
+ *  out once, and the filter, the scan matcher and the steering all use
+ *  that rather than the raw beams.
+ *
+ *  With a Vfh (vfh.h) set, it steers round what the laser sees with the
+ *  vector field histogram, keeping going straight on where it can, rather
+ *  than by which side has the nearest thing on it.
+ *
+ *  With an ActiveLocalizer (activeloc.h) set, the robot stops wandering
+ *  while there are hypotheses to choose between, and makes whichever moves
+ *  will best tell them apart.
+ *
+ *  With keep_going set it carries on wandering once it knows where it is,
+ *  and a PoseGuard (relocalize.h), if set, checks every scan against where
+ *  it thinks it is from then on. If it is picked up and put down somewhere
+ *  else, the guard finds it again; our own filter is started again there,
+ *  and amcl's poses are corrected.
+ *
+ *  With an OccMap (occmap.h) set, every scan after it is localized is
+ *  added to the map, and so to the distances the filter and the guard
+ *  look things up in, so they keep up with what has moved.
+ */
+
+#ifndef WANDER_H
+#define WANDER_H
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "activeloc.h"
+#include "hyptrack.h"
+#include "mcl.h"
+#include "occmap.h"
+#include "relocalize.h"
+#include "scan.h"
+#include "scanmatch.h"
+#include "sensorframe.h"
+#include "vfh.h"
+
+// Odometry noise for the filter when it's fed by the scan matcher, in
+// place of amcl's 0.2
+#define SCANMATCH_ODOM_ALPHA 0.05
+
+// What wanderTick() returns
+#define WANDER_RUNNING    0
+#define WANDER_LOCALIZED  1
+
+/**
+ * Everything the controller remembers between ticks.
+ *
+ **/
+
+struct Wander
+{
+  Mcl*  mcl;                     // Our own filter, or NULL to use amcl
+  ScanMatcher* matcher;          // Corrects the odometry it gets, if set
+  LaserScan* scan;               // The laser, preprocessed, if set
+  Vfh*  vfh;                     // Steers round things, if set
+  ActiveLocalizer* active;       // Chooses moves to localize, if set
+  PoseGuard* guard;              // Watches for kidnapping, if set
+  OccMap* mapper;                // Keeps the map up to date, if set
+  bool  keep_going;              // Carry on once localized
+  bool  verbose;                 // Print the hypotheses every tick
+  bool  quiet;                   // Don't print the best hypothesis either
+
+  std::vector<MclHypoth> hyps;   // From whichever localizer
+  HypTracker tracker;            // ...followed from tick to tick
+  int    counter, main_counter, bumped;
+  int    hc;                     // How many hypotheses there are
+  double speed, turnrate;
+  player_pose2d_t pose;          // Where we think we are
+  bool   localized;              // ...and we're sure of it
+
+  // Set on the ticks we look at the best hypothesis
+  bool   checked;
+  player_pose2d_t best_pose;
+  double best;
+};
+
+/**
+ * initWander()
+ *
+ **/
+
+inline void initWander(Wander& w, Mcl* mcl)
+{
+  w.mcl = mcl;
+  w.matcher = NULL;
+  w.scan = NULL;
+  w.vfh = NULL;
+  w.active = NULL;
+  w.guard = NULL;
+  w.mapper = NULL;
+  w.keep_going = false;
+  w.verbose = false;
+  w.quiet = false;
+  w.hyps.clear();
+  initHypTracker(w.tracker);
+  w.counter = w.main_counter = w.bumped = 0;
+  w.hc = 0;
+  w.speed = w.turnrate = 0;
+  memset(&w.pose, 0, sizeof(w.pose));
+  w.localized = false;
+  w.checked = false;
+  memset(&w.best_pose, 0, sizeof(w.best_pose));
+  w.best = 0;
+} // End of initWander()
+
+/**
+ * updateLocalizer()
+ *
+ * Feed the latest odometry and laser scan to our own particle filter. The
+ * odometry is the wheels' unless a corrected one is given, and the beams
+ * are those kept in the scan, if one is given, made from the frame.
+ *
+ **/
+
+inline void updateLocalizer(Mcl& mcl, const SensorFrame& frame,
+                            const Pose2d* odom = NULL,
+                            const LaserScan* scan = NULL)
+{
+  // No scan yet while the proxies are starting up
+  if (frame.ranges_count == 0) return;
+
+  if (scan != NULL) {
+    mclUpdate(mcl, odom != NULL ? *odom : frame.odom, scan->range,
+              scan->bearing, scan->count);
+  } else {
+    mclUpdate(mcl, odom != NULL ? *odom : frame.odom, frame.ranges,
+              frame.bearings, frame.ranges_count);
+  }
+} // End of updateLocalizer()
+
+/**
+ * useScanMatcher()
+ *
+ * Give our own filter odometry corrected by scan matching (scanmatch.h)
+ * instead of the wheels'. Since it is that much better, the filter can
+ * spread its particles less each time we move, and so settle sooner.
+ *
+ **/
+
+inline void useScanMatcher(Wander& w, ScanMatcher& sm)
+{
+  w.matcher = &sm;
+  if (w.mcl == NULL) return;
+  for (int k = 0; k < 4; k++) w.mcl->odom_alpha[k] = SCANMATCH_ODOM_ALPHA;
+} // End of useScanMatcher()
+
+/**
+ * wanderLocalize()
+ *
+ * Work out where we are from a frame that is "fresh" if we haven't seen
+ * it before.
+ *
+ **/
+
+inline void wanderLocalize(Wander& w, const SensorFrame& frame, bool fresh)
+{
+  // Read new information about position. The filter only wants to see
+  // each scan once.
+  if (fresh && w.scan != NULL) processScan(*w.scan, frame);
+  if (w.mcl != NULL) {
+    if (fresh && w.matcher != NULL) {
+      matchScan(*w.matcher, frame, w.scan);
+      updateLocalizer(*w.mcl, frame, &w.matcher->pose, w.scan);
+    } else if (fresh) {
+      updateLocalizer(*w.mcl, frame, NULL, w.scan);
+    }
+    mclHypotheses(*w.mcl, w.hyps);
+  } else {
+    // amcl's come in the frame, hyp_count of them
+    w.hyps.clear();
+    for (int i = 0; i < frame.hyp_count && i < FRAME_MAX_HYPS; i++) {
+      MclHypoth h;
+      h.mean.px = frame.hyps[i].mean.px;
+      h.mean.py = frame.hyps[i].mean.py;
+      h.mean.pa = frame.hyps[i].mean.pa;
+      h.cov[0]  = frame.hyps[i].cov[0];
+      h.cov[1]  = frame.hyps[i].cov[1];
+      h.cov[2]  = frame.hyps[i].cov[2];
+      h.alpha   = frame.hyps[i].alpha;
+      w.hyps.push_back(h);
+    }
+  }
+  w.hc = w.hyps.size();
+  trackHypotheses(w.tracker, w.hc ? &w.hyps[0] : NULL, w.hc, frame.stamp);
+
+  const TrackedHypoth* best = bestHypoth(w.tracker);
+  if (best != NULL) {
+    w.pose.px = best->mean.px;
+    w.pose.py = best->mean.py;
+    w.pose.pa = best->mean.pa;
+  }
+  if (w.verbose) printHypotheses(w.tracker);
+  if ((w.tracker.events & HYP_EVENT_KIDNAPPED) && !w.quiet) {
+    std::cout << "Kidnapped? Best hypothesis jumped to (" << w.pose.px
+              << ", " << w.pose.py << ")" << std::endl;
+  }
+
+  // Once we know where we are, make sure we stay knowing it
+  if (w.guard != NULL && w.localized && frame.ranges_count > 0) {
+    Pose2d pose = { w.pose.px, w.pose.py, w.pose.pa };
+    int state = guardPose(*w.guard, frame, pose);
+    if (state == GUARD_FOUND) {
+      if (w.mcl != NULL) {
+        mclInitPose(*w.mcl, w.guard->found, 0.2, 0.1);
+        clearCorrection(*w.guard);
+        pose = w.guard->found;
+      }
+      if (!w.quiet) {
+        std::cout << "Lost! Found again at (" << w.guard->found.px << ", "
+                  << w.guard->found.py << ") in "
+                  << w.guard->global.seconds * 1000 << "ms" << std::endl;
+      }
+    } else if (state == GUARD_LOST && w.mcl != NULL) {
+      // One scan at a time can't tell where we are, so let the filter
+      // work it out from scratch, the slow way
+      if (!w.quiet) std::cout << "Lost! Starting again" << std::endl;
+      mclInitGlobal(*w.mcl);
+      clearCorrection(*w.guard);
+      w.localized = false;
+    }
+    pose = correctPose(*w.guard, pose);
+    w.pose.px = pose.px;
+    w.pose.py = pose.py;
+    w.pose.pa = pose.pa;
+  }
+
+  // Only once we know where we are is it worth putting the scan on the map
+  if (w.mapper != NULL && w.localized && fresh) {
+    Pose2d pose = { w.pose.px, w.pose.py, w.pose.pa };
+    mapScan(*w.mapper, frame, pose);
+  }
+} // End of wanderLocalize()
+
+/**
+ * wanderSteer()
+ *
+ * Navigation adjustments using laser data: go forwards, away from
+ * whichever side is closer. Spikes in the scan don't count, if we have
+ * one. With the histogram, head the same way, but round whatever is
+ * ahead.
+ *
+ **/
+
+inline void wanderSteer(Wander& w, const SensorFrame& frame)
+{
+  double min_left  = w.scan != NULL ? w.scan->min_left : frame.min_left;
+  double min_right = w.scan != NULL ? w.scan->min_right : frame.min_right;
+
+  if (w.vfh != NULL) {
+    vfhStep(*w.vfh, frame, min_left < min_right ? -0.5 : 0.5, &w.speed,
+            &w.turnrate, w.scan);
+    return;
+  }
+
+  w.speed = 1.0;
+  if (min_left < 1.2) {
+    w.turnrate = -0.8;
+  } else if (min_right < 1.2) {
+    w.turnrate = 0.8;
+  } else {
+    if (min_left < min_right) w.turnrate = -0.4;
+    else w.turnrate = 0.4;
+  }
+} // End of wanderSteer()
+
+/**
+ * wanderDecide()
+ *
+ * Having localized, decide what to do. Sets w.speed and w.turnrate, and
+ * returns WANDER_LOCALIZED once we are sure where we are. With keep_going
+ * that's only the first time, and we carry on wandering.
+ *
+ **/
+
+inline int wanderDecide(Wander& w, const SensorFrame& frame)
+{
+  w.checked = false;
+
+  // If either bumper is pressed, stop. Otherwise just go forwards
+  if (w.bumped) {
+    if (w.counter < 50) {
+      w.speed = -0.5;
+      w.turnrate = -0.4;
+    } else {
+      w.counter = 0;
+      w.bumped = 0;
+      w.speed = 0.5;
+      w.turnrate = 0.0;
+    }
+    w.counter ++;
+  } else if(frame.bumper[0] || frame.bumper[1]){
+    w.speed= 0;
+    w.turnrate= 0;
+    w.bumped = 1;
+  // After 1000 iterations, and if hypoth count <= 2
+  // Record the current best hypothesis. Our own filter gets a say as
+  // soon as it has settled down to fewer than the maximum particles, and
+  // amcl does too if we're moving to localize rather than wandering.
+  } else if ((w.mcl != NULL ? (w.mcl->updates > 10
+                               && w.mcl->count < w.mcl->max_samples)
+                            : (w.active != NULL || w.main_counter > 1000))
+             && w.hc <= 2 && !w.localized) {
+    const TrackedHypoth* hypo = bestHypoth(w.tracker);
+    double best = hypo != NULL ? hypo->alpha : 0.0;
+    w.checked = true;
+    w.best_pose = w.pose;
+    w.best = best;
+    if (!w.quiet) {
+      std::cout << "Best hypothesis..." << std::endl;
+      std::cout << "X: " << w.pose.px  << std::endl;
+      std::cout << "Y: " << w.pose.py  << std::endl;
+      std::cout << "A: " << w.pose.pa  << std::endl;
+      std::cout << "W: " << best << std::endl;
+    }
+    // If the best hypothesis is 99% certain, we've done a successful run.
+    if (best > 0.99) {
+      if (!w.quiet) {
+        std::cout << "Success!" << std::endl;
+        std::cout << "I am " << best << " sure that I am at ";
+        std::cout << "(" << w.pose.px << ", " << w.pose.py << ")..."
+                  << std::endl;
+      }
+      w.localized = true;
+      w.speed = w.turnrate = 0;
+      if (w.keep_going) wanderSteer(w, frame);
+      return WANDER_LOCALIZED;
+    }
+    w.main_counter = 200;
+    // Not sure yet: if there are two, go and see which
+    if (w.active != NULL
+        && !activeStep(*w.active, w.hyps, frame, &w.speed, &w.turnrate))
+      wanderSteer(w, frame);
+  } else if (w.active != NULL
+             && activeStep(*w.active, w.hyps, frame, &w.speed, &w.turnrate)) {
+    // Moving to tell the hypotheses apart
+  } else {
+    wanderSteer(w, frame);
+  }
+
+  // Count how many times we do this
+  w.counter++;
+  w.main_counter++;
+  return WANDER_RUNNING;
+} // End of wanderDecide()
+
+/**
+ * wanderTick()
+ *
+ * One time round the control loop: both of the above.
+ *
+ **/
+
+inline int wanderTick(Wander& w, const SensorFrame& frame, bool fresh)
+{
+  wanderLocalize(w, frame, fresh);
+  return wanderDecide(w, frame);
+} // End of wanderTick()
+
+#endif
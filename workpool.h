@@ -0,0 +1,276 @@
+/*
+ *  CISC-3415 Robotics
+ *  Project 4 - Work stealing pool
+ *
+ ** Description ***************************************************************
+ *
+ *  Runs a batch of independent jobs, numbered 0 to n-1, on a few threads.
+ *  The jobs are dealt out in equal blocks, one queue per thread. Each
+ *  thread works back from the end of its own block, and when that is empty
+ *  it steals from the front of someone else's, so a thread that gets the
+ *  quick jobs helps out the one that got the slow ones. Nothing is added
+ *  once the batch starts, so when every queue is empty we're done.
+ *
+ *  A job is told which thread runs it, so that it can use scratch space
+ *  belonging to that thread, but what a job does should not depend on it.
+ *
+ *  runParallel() starts the threads for one batch and joins them after,
+ *  which is fine for a batch that takes a while but not for one that has
+ *  to be done every tick. A WorkPool keeps its threads waiting between
+ *  batches instead: runBatch() wakes them, runs the batch the same way,
+ *  and waits for every thread to finish with it before it returns.
+ */
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * One thread's queue of jobs.
+ *
+ **/
+
+struct WorkQueue
+{
+  std::mutex      lock;
+  std::deque<int> jobs;
+};
+
+/**
+ * What happened, for reporting.
+ *
+ **/
+
+struct PoolStats
+{
+  int threads;
+  int stolen;                  // Jobs run by a thread they weren't dealt to
+  std::vector<int> ran;        // How many jobs each thread ran
+};
+
+/**
+ * takeJob()
+ *
+ * The next job for thread "me": the last of its own, or else the first of
+ * anyone else's. -1 when there are none left.
+ *
+ **/
+
+inline int takeJob(std::vector<WorkQueue>& queues, int me, bool* stole)
+{
+  int n = queues.size();
+  int job = -1;
+
+  *stole = false;
+  {
+    std::lock_guard<std::mutex> hold(queues[me].lock);
+    if (!queues[me].jobs.empty()) {
+      job = queues[me].jobs.back();
+      queues[me].jobs.pop_back();
+      return job;
+    }
+  }
+  // Start with our neighbour so that the thieves spread out
+  for (int k = 1; k < n; k++) {
+    WorkQueue& q = queues[(me + k) % n];
+    std::lock_guard<std::mutex> hold(q.lock);
+    if (!q.jobs.empty()) {
+      job = q.jobs.front();
+      q.jobs.pop_front();
+      *stole = true;
+      return job;
+    }
+  }
+  return -1;
+} // End of takeJob()
+
+/**
+ * runParallel()
+ *
+ * Call fn(job, thread) for every job from 0 to n_jobs-1, on n_threads
+ * threads (the calling thread is one of them), and wait for them all.
+ *
+ **/
+
+template<class F>
+inline PoolStats runParallel(int n_jobs, int n_threads, F fn)
+{
+  PoolStats stats;
+  std::atomic<int> stolen(0);
+
+  if (n_threads < 1) n_threads = 1;
+  if (n_threads > n_jobs) n_threads = n_jobs > 0 ? n_jobs : 1;
+  std::vector<WorkQueue> queues(n_threads);
+  for (int t = 0; t < n_threads; t++) {
+    int from = (long long)n_jobs * t / n_threads;
+    int to   = (long long)n_jobs * (t + 1) / n_threads;
+    for (int j = from; j < to; j++) queues[t].jobs.push_back(j);
+  }
+
+  stats.threads = n_threads;
+  stats.ran.assign(n_threads, 0);
+  auto work = [&](int me) {
+    bool stole;
+    int job;
+    while ((job = takeJob(queues, me, &stole)) >= 0) {
+      fn(job, me);
+      stats.ran[me]++;
+      if (stole) stolen++;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < n_threads; t++) threads.push_back(std::thread(work, t));
+  work(0);
+  for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+
+  stats.stolen = stolen.load();
+  return stats;
+} // End of runParallel()
+
+/**
+ * A pool of threads that are kept for batch after batch.
+ *
+ **/
+
+struct WorkPool
+{
+  std::vector<std::thread> threads;     // All but the caller's
+  std::vector<WorkQueue> queues;        // One for each, the caller's first
+  std::function<void(int, int)> fn;     // The batch being run
+  std::mutex lock;
+  std::condition_variable start, done;
+  int batch;                            // Goes up by one for each batch
+  int running;                          // Threads not done with it yet
+  bool quit;
+  std::atomic<int> stolen;
+  std::vector<int> ran;
+};
+
+/**
+ * poolWork()
+ *
+ * Run jobs from the current batch as thread "me" until there are none.
+ *
+ **/
+
+inline void poolWork(WorkPool& pool, int me)
+{
+  bool stole;
+  int job;
+  while ((job = takeJob(pool.queues, me, &stole)) >= 0) {
+    pool.fn(job, me);
+    pool.ran[me]++;
+    if (stole) pool.stolen++;
+  }
+} // End of poolWork()
+
+/**
+ * poolThread()
+ *
+ * What each of the pool's threads does: wait for a batch, help with it,
+ * say so, and wait for the next, until the pool is stopped.
+ *
+ **/
+
+inline void poolThread(WorkPool& pool, int me)
+{
+  int seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> hold(pool.lock);
+      pool.start.wait(hold, [&] { return pool.quit || pool.batch != seen; });
+      if (pool.quit) return;
+      seen = pool.batch;
+    }
+    poolWork(pool, me);
+    std::lock_guard<std::mutex> hold(pool.lock);
+    if (--pool.running == 0) pool.done.notify_one();
+  }
+} // End of poolThread()
+
+/**
+ * startWorkPool()
+ *
+ * Start n_threads - 1 threads; the one that calls runBatch() is the other.
+ *
+ **/
+
+inline void startWorkPool(WorkPool& pool, int n_threads)
+{
+  if (n_threads < 1) n_threads = 1;
+  pool.queues = std::vector<WorkQueue>(n_threads);
+  pool.ran.assign(n_threads, 0);
+  pool.batch = pool.running = 0;
+  pool.quit = false;
+  for (int t = 1; t < n_threads; t++)
+    pool.threads.push_back(std::thread(poolThread, std::ref(pool), t));
+} // End of startWorkPool()
+
+/**
+ * runBatch()
+ *
+ * Call fn(job, thread) for every job from 0 to n_jobs-1 on the pool's
+ * threads, as runParallel() does, and wait for them all.
+ *
+ **/
+
+template<class F>
+inline PoolStats runBatch(WorkPool& pool, int n_jobs, F fn)
+{
+  int n_threads = pool.queues.size();
+  PoolStats stats;
+
+  // The threads are all waiting, so the queues are ours until we wake them
+  for (int t = 0; t < n_threads; t++) {
+    int from = (long long)n_jobs * t / n_threads;
+    int to   = (long long)n_jobs * (t + 1) / n_threads;
+    for (int j = from; j < to; j++) pool.queues[t].jobs.push_back(j);
+  }
+  pool.fn = fn;
+  pool.ran.assign(n_threads, 0);
+  pool.stolen = 0;
+  {
+    std::lock_guard<std::mutex> hold(pool.lock);
+    pool.running = pool.threads.size();
+    pool.batch++;
+  }
+  pool.start.notify_all();
+  poolWork(pool, 0);
+  {
+    std::unique_lock<std::mutex> hold(pool.lock);
+    pool.done.wait(hold, [&] { return pool.running == 0; });
+  }
+
+  stats.threads = n_threads;
+  stats.ran = pool.ran;
+  stats.stolen = pool.stolen.load();
+  return stats;
+} // End of runBatch()
+
+/**
+ * stopWorkPool()
+ *
+ * Tell the threads to finish and wait for them.
+ *
+ **/
+
+inline void stopWorkPool(WorkPool& pool)
+{
+  {
+    std::lock_guard<std::mutex> hold(pool.lock);
+    pool.quit = true;
+  }
+  pool.start.notify_all();
+  for (size_t t = 0; t < pool.threads.size(); t++) pool.threads[t].join();
+  pool.threads.clear();
+} // End of stopWorkPool()
+
+#endif